@@ -2,18 +2,6 @@
 
 LOCAL_PATH := $(call my-dir)
  
-include $(CLEAR_VARS)
-
-LOCAL_MODULE_TAGS := eng
-LOCAL_MODULE := libgstamcsink
-LOCAL_SRC_FILES := \
-    src/gst-amc-sink-plugin.c \
-    src/gst-amc.c \
-    src/gst-jni-utils.c \
-    src/gst-amc-sink.c \
-    src/gst-amc-video-decoder.c \
-    src/gst-amc-video-sink.c
-
 ifndef GSTREAMER_ROOT_ANDROID
 $(error GSTREAMER_ROOT_ANDROID is not defined!)
 endif
@@ -32,11 +20,69 @@ else
 $(error Target arch ABI not supported: $(TARGET_ARCH_ABI))
 endif
 
-LOCAL_C_INCLUDES := $(GSTREAMER_ROOT)/include/gstreamer-1.0 \
-                    $(GSTREAMER_ROOT)/include/glib-2.0 \
-                    $(GSTREAMER_ROOT)/include \
-                    $(GSTREAMER_ROOT)/include/libxml2 \
-                    $(GSTREAMER_ROOT)/lib/glib-2.0/include
+GSTREAMER_INCLUDES := $(GSTREAMER_ROOT)/include/gstreamer-1.0 \
+                      $(GSTREAMER_ROOT)/include/glib-2.0 \
+                      $(GSTREAMER_ROOT)/include \
+                      $(GSTREAMER_ROOT)/include/libxml2 \
+                      $(GSTREAMER_ROOT)/lib/gstreamer-1.0/include \
+                      $(GSTREAMER_ROOT)/lib/glib-2.0/include
+
+# Codec, JNI and surface handling shared by the elements and libamcdec,
+# linked once into whatever uses both
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libgstamccommon
+LOCAL_SRC_FILES := \
+    src/gst-amc.c \
+    src/gst-amc-codec-cache.c \
+    src/gst-amc-surface-texture.c \
+    src/gst-jni-utils.c
+
+LOCAL_C_INCLUDES := $(GSTREAMER_INCLUDES)
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)/src
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_CFLAGS += -mfpu=neon
+endif
+
+include $(BUILD_STATIC_LIBRARY)
+
+# Decoding without a pipeline, see src/amcdec.h. The decoder elements
+# move their codec data through it too
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libamcdec
+LOCAL_SRC_FILES := \
+    src/amcdec.c
+LOCAL_STATIC_LIBRARIES := libgstamccommon
+
+LOCAL_C_INCLUDES := $(GSTREAMER_INCLUDES)
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_CFLAGS += -mfpu=neon
+endif
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libgstamcsink
+LOCAL_SRC_FILES := \
+    src/gst-amc-sink-plugin.c \
+    src/gst-amc-copy.c \
+    src/gst-amc-gop-pool.c \
+    src/gst-amc-nal-filter.c \
+    src/gst-amc-shared-codec.c \
+    src/gst-amc-output-pool.c \
+    src/gst-amc-sink.c \
+    src/gst-amc-video-decoder.c \
+    src/gst-amc-video-sink.c
+LOCAL_STATIC_LIBRARIES := libamcdec
+
+LOCAL_C_INCLUDES := $(GSTREAMER_INCLUDES)
 LOCAL_CFLAGS += -DGST_PLUGIN_BUILD_STATIC
 
 ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
@@ -0,0 +1,49 @@
+/*
+ ============================================================================
+ Name        : amcdec-private.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __AMCDEC_PRIVATE_H__
+#define __AMCDEC_PRIVATE_H__
+
+#include "amcdec.h"
+#include "gst-amc.h"
+
+G_BEGIN_DECLS
+
+/* For the decoder elements, which create, configure, reset and free
+ * their codec themselves and move the data of the started codec through
+ * an AmcDec wrapping it. Access units may be split over several input
+ * buffers, so input is queued slot by slot */
+
+typedef struct _AmcDecInput AmcDecInput;
+
+/* An input buffer of the codec, filled and queued with
+ * amc_dec_queue_input() */
+struct _AmcDecInput
+{
+    gint index;
+    guint8 *data;
+    gsize size;
+};
+
+AmcDec * amc_dec_new_for_codec (GstAmcCodec *codec, gboolean surface_output,
+            GError **err);
+
+AmcDecResult amc_dec_dequeue_input (AmcDec *dec, AmcDecInput *input,
+            gint64 timeout_us, GError **err);
+AmcDecResult amc_dec_queue_input (AmcDec *dec, const AmcDecInput *input,
+            gsize size, gint64 pts_us, gint flags, GError **err);
+
+const GstAmcVideoOutputFormat * amc_dec_get_output_format (AmcDec *dec);
+
+G_END_DECLS
+
+#endif /* __AMCDEC_PRIVATE_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
@@ -0,0 +1,456 @@
+/*
+ ============================================================================
+ Name        : amcdec.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "amcdec-private.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+/* Queued access units remembered for their decode time, more than any
+ * codec holds on to */
+#define MAX_PENDING 32
+
+typedef struct _AmcDecPending AmcDecPending;
+
+struct _AmcDecPending
+{
+    gint64 pts_us;
+    /* Monotonic time of amc_dec_push(), 0 if the slot is free */
+    gint64 queued_time;
+};
+
+struct _AmcDec
+{
+    GstAmcCodec *codec;
+    GstAmcBuffer *input_buffers;
+    gsize n_input_buffers;
+
+    /* FALSE if the codec belongs to a decoder element */
+    gboolean owns_codec;
+    /* Output goes to a surface, the output buffers are never accessed */
+    gboolean surface_output;
+    /* The last frame carried the end of stream, report it next */
+    gboolean eos_pending;
+
+    GstAmcVideoOutputFormat output_format;
+
+    /* Ring of queued access units, no allocations per frame. Written
+     * by the pushing and read by the pulling thread, with pending_lock */
+    GMutex pending_lock;
+    AmcDecPending pending[MAX_PENDING];
+    guint next_pending;
+};
+
+/* Once per process, @vm may be NULL if the library is loaded by Java */
+gboolean
+amc_dec_init (JavaVM *vm, GError **err)
+{
+    if (!gst_init_check (NULL, NULL, err))
+        return FALSE;
+
+    if (vm)
+        gst_amc_jni_set_java_vm (vm);
+
+    if (!gst_amc_init ()) {
+        g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_INIT,
+                    "Failed to initialize Android MediaCodec support");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static AmcDec *
+amc_dec_alloc (GstAmcCodec *codec, gboolean owns_codec, gboolean surface_output)
+{
+    AmcDec *dec;
+
+    dec = g_slice_new0 (AmcDec);
+    g_mutex_init (&dec->pending_lock);
+    dec->codec = codec;
+    dec->owns_codec = owns_codec;
+    dec->surface_output = surface_output;
+
+    return dec;
+}
+
+static gboolean
+amc_dec_get_input_buffers (AmcDec *dec, GError **err)
+{
+    dec->input_buffers = gst_amc_codec_get_input_buffers (dec->codec,
+                &dec->n_input_buffers, err);
+
+    return dec->input_buffers != NULL;
+}
+
+/* Creates a decoder rendering to @surface, within the codec budget of
+ * the process like the decoder elements */
+AmcDec *
+amc_dec_new (const gchar *mime, gint width, gint height,
+            const guint8 *codec_data, gsize codec_data_size, jobject surface,
+            GError **err)
+{
+    GstAmcFormat *format;
+    GstAmcCodec *codec;
+    AmcDec *dec;
+
+    g_return_val_if_fail (mime != NULL, NULL);
+
+    codec = gst_amc_decoder_new_with_budget (mime, width, height,
+                GST_AMC_SESSION_PRIORITY_NORMAL, TRUE, NULL, NULL, err);
+    if (!codec)
+        return NULL;
+
+    dec = amc_dec_alloc (codec, TRUE, TRUE);
+    dec->output_format.width = width;
+    dec->output_format.height = height;
+
+    format = gst_amc_format_new_video (mime, width, height, err);
+    if (!format)
+        goto error;
+    if (codec_data && !gst_amc_format_set_buffer (format, "csd-0",
+                    (guint8 *) codec_data, codec_data_size, err)) {
+        gst_amc_format_free (format);
+        goto error;
+    }
+    if (!gst_amc_codec_configure (dec->codec, format, surface, 0, err)) {
+        gst_amc_format_free (format);
+        goto error;
+    }
+    gst_amc_format_free (format);
+
+    if (!gst_amc_codec_start (dec->codec, err))
+        goto error;
+
+    if (!amc_dec_get_input_buffers (dec, err))
+        goto error;
+
+    return dec;
+
+error:
+    amc_dec_free (dec);
+    return NULL;
+}
+
+/* Moves the data of @codec, configured and started by the caller, who
+ * keeps owning it and frees the decoder before stopping it */
+AmcDec *
+amc_dec_new_for_codec (GstAmcCodec *codec, gboolean surface_output,
+            GError **err)
+{
+    AmcDec *dec;
+
+    g_return_val_if_fail (codec != NULL, NULL);
+
+    dec = amc_dec_alloc (codec, FALSE, surface_output);
+    if (!amc_dec_get_input_buffers (dec, err)) {
+        amc_dec_free (dec);
+        return NULL;
+    }
+
+    return dec;
+}
+
+void
+amc_dec_free (AmcDec *dec)
+{
+    g_return_if_fail (dec != NULL);
+
+    if (dec->input_buffers)
+        gst_amc_codec_free_buffers (dec->input_buffers, dec->n_input_buffers);
+    if (dec->owns_codec) {
+        gst_amc_codec_stop (dec->codec, NULL);
+        gst_amc_codec_release (dec->codec, NULL);
+        gst_amc_codec_free (dec->codec);
+    }
+    g_mutex_clear (&dec->pending_lock);
+    g_slice_free (AmcDec, dec);
+}
+
+/* Waits up to @timeout_us for an input slot of the codec */
+AmcDecResult
+amc_dec_dequeue_input (AmcDec *dec, AmcDecInput *input, gint64 timeout_us,
+            GError **err)
+{
+    gint idx;
+
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (input != NULL, AMC_DEC_ERROR);
+
+    idx = gst_amc_codec_dequeue_input_buffer (dec->codec, timeout_us, err);
+    if (idx == INFO_TRY_AGAIN_LATER)
+        return AMC_DEC_TRY_AGAIN;
+    if (idx < 0)
+        return AMC_DEC_ERROR;
+
+    if ((gsize) idx >= dec->n_input_buffers) {
+        g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+                    "Invalid input buffer index %d of %" G_GSIZE_FORMAT,
+                    idx, dec->n_input_buffers);
+        return AMC_DEC_ERROR;
+    }
+
+    input->index = idx;
+    input->data = dec->input_buffers[idx].data;
+    input->size = dec->input_buffers[idx].size;
+
+    return AMC_DEC_OK;
+}
+
+/* Hands @input back to the codec with its first @size bytes filled */
+AmcDecResult
+amc_dec_queue_input (AmcDec *dec, const AmcDecInput *input, gsize size,
+            gint64 pts_us, gint flags, GError **err)
+{
+    GstAmcBufferInfo buffer_info;
+
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (input != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (size <= input->size, AMC_DEC_ERROR);
+
+    buffer_info.flags = flags;
+    buffer_info.offset = 0;
+    buffer_info.presentation_time_us = pts_us;
+    buffer_info.size = size;
+
+    return gst_amc_codec_queue_input_buffer (dec->codec, input->index,
+                &buffer_info, err) ? AMC_DEC_OK : AMC_DEC_ERROR;
+}
+
+static AmcDecResult
+amc_dec_queue (AmcDec *dec, const guint8 *data, gsize size, gint64 pts_us,
+            gint flags, gint64 timeout_us, GError **err)
+{
+    AmcDecInput input;
+    AmcDecResult ret;
+
+    ret = amc_dec_dequeue_input (dec, &input, timeout_us, err);
+    if (ret != AMC_DEC_OK)
+        return ret;
+
+    if (size > input.size) {
+        g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+                    "Access unit of %" G_GSIZE_FORMAT " bytes exceeds input "
+                    "buffer of %" G_GSIZE_FORMAT, size, input.size);
+        /* Hand the slot back empty */
+        amc_dec_queue_input (dec, &input, 0, pts_us, 0, NULL);
+        return AMC_DEC_ERROR;
+    }
+    if (size)
+        memcpy (input.data, data, size);
+
+    return amc_dec_queue_input (dec, &input, size, pts_us, flags, err);
+}
+
+/* Queues one access unit, waiting up to @timeout_us for an input slot */
+AmcDecResult
+amc_dec_push (AmcDec *dec, const guint8 *data, gsize size, gint64 pts_us,
+            gboolean keyframe, gint64 timeout_us, GError **err)
+{
+    AmcDecResult ret;
+    AmcDecPending *pending;
+
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+
+    ret = amc_dec_queue (dec, data, size, pts_us,
+                keyframe ? BUFFER_FLAG_SYNC_FRAME : 0, timeout_us, err);
+    if (ret != AMC_DEC_OK)
+        return ret;
+
+    g_mutex_lock (&dec->pending_lock);
+    pending = &dec->pending[dec->next_pending];
+    pending->pts_us = pts_us;
+    pending->queued_time = g_get_monotonic_time ();
+    dec->next_pending = (dec->next_pending + 1) % MAX_PENDING;
+    g_mutex_unlock (&dec->pending_lock);
+
+    return AMC_DEC_OK;
+}
+
+/* Makes the codec output everything queued, amc_dec_pull() returns
+ * AMC_DEC_EOS after the last frame */
+AmcDecResult
+amc_dec_push_eos (AmcDec *dec, gint64 timeout_us, GError **err)
+{
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+
+    return amc_dec_queue (dec, NULL, 0, 0, BUFFER_FLAG_END_OF_STREAM,
+                timeout_us, err);
+}
+
+static gint64
+amc_dec_take_decode_time (AmcDec *dec, gint64 pts_us)
+{
+    gint64 decode_time = -1;
+    guint i;
+
+    g_mutex_lock (&dec->pending_lock);
+    for (i = 0; i < MAX_PENDING; i++) {
+        AmcDecPending *pending = &dec->pending[i];
+
+        if (pending->queued_time && pending->pts_us == pts_us) {
+            decode_time = g_get_monotonic_time () - pending->queued_time;
+            pending->queued_time = 0;
+            break;
+        }
+    }
+    g_mutex_unlock (&dec->pending_lock);
+
+    return decode_time;
+}
+
+/* Waits up to @timeout_us for a decoded frame */
+AmcDecResult
+amc_dec_pull (AmcDec *dec, AmcDecFrame *frame, gint64 timeout_us, GError **err)
+{
+    GstAmcBufferInfo buffer_info;
+    GstAmcFormat *format;
+    gboolean ret;
+    gint idx;
+
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (frame != NULL, AMC_DEC_ERROR);
+
+    if (g_atomic_int_get (&dec->eos_pending)) {
+        g_atomic_int_set (&dec->eos_pending, FALSE);
+        return AMC_DEC_EOS;
+    }
+
+again:
+    idx = gst_amc_codec_dequeue_output_buffer (dec->codec, &buffer_info,
+                timeout_us, err);
+    switch (idx) {
+    case INFO_TRY_AGAIN_LATER:
+        return AMC_DEC_TRY_AGAIN;
+    case INFO_OUTPUT_BUFFERS_CHANGED:
+        if (!dec->surface_output)
+            return AMC_DEC_BUFFERS_CHANGED;
+        goto again;
+    case INFO_OUTPUT_FORMAT_CHANGED:
+        format = gst_amc_codec_get_output_format (dec->codec, err);
+        if (!format)
+            return AMC_DEC_ERROR;
+        if (gst_debug_category_get_threshold (GST_CAT_DEFAULT) >= GST_LEVEL_DEBUG) {
+            gchar *format_string;
+
+            format_string = gst_amc_format_to_string (format, NULL);
+            GST_DEBUG ("Output format changed: %s", format_string);
+            g_free (format_string);
+        }
+        ret = gst_amc_video_output_format_parse (&dec->output_format, format, err);
+        gst_amc_format_free (format);
+        return ret ? AMC_DEC_FORMAT_CHANGED : AMC_DEC_ERROR;
+    default:
+        if (idx < 0)
+            return AMC_DEC_ERROR;
+        break;
+    }
+
+    if (buffer_info.flags & BUFFER_FLAG_END_OF_STREAM) {
+        /* Some codecs put the last frame into the end of stream buffer */
+        if (buffer_info.size <= 0) {
+            if (!gst_amc_codec_release_output_buffer (dec->codec, idx,
+                            FALSE, 0, err))
+                return AMC_DEC_ERROR;
+            return AMC_DEC_EOS;
+        }
+        g_atomic_int_set (&dec->eos_pending, TRUE);
+    }
+
+    frame->index = idx;
+    frame->pts_us = buffer_info.presentation_time_us;
+    frame->offset = buffer_info.offset;
+    frame->size = buffer_info.size;
+    /* The decoder elements time their frames themselves */
+    frame->decode_time_us = dec->owns_codec ?
+        amc_dec_take_decode_time (dec, frame->pts_us) : -1;
+
+    return AMC_DEC_OK;
+}
+
+/* Shows @frame at @render_time_ns of CLOCK_MONOTONIC, as System.nanoTime()
+ * returns, or right away if not positive */
+AmcDecResult
+amc_dec_render (AmcDec *dec, const AmcDecFrame *frame, gint64 render_time_ns,
+            GError **err)
+{
+    gboolean ret;
+
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (frame != NULL, AMC_DEC_ERROR);
+
+    if (render_time_ns > 0)
+        ret = gst_amc_codec_render_output_buffer_at (dec->codec, frame->index,
+                    render_time_ns, err);
+    else
+        ret = gst_amc_codec_release_output_buffer (dec->codec, frame->index,
+                    TRUE, 0, err);
+
+    return ret ? AMC_DEC_OK : AMC_DEC_ERROR;
+}
+
+/* Drops @frame without showing it */
+AmcDecResult
+amc_dec_release (AmcDec *dec, const AmcDecFrame *frame, GError **err)
+{
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+    g_return_val_if_fail (frame != NULL, AMC_DEC_ERROR);
+
+    return gst_amc_codec_release_output_buffer (dec->codec, frame->index,
+                FALSE, 0, err) ? AMC_DEC_OK : AMC_DEC_ERROR;
+}
+
+/* Discards all queued input and pending output, frames pulled before
+ * must not be rendered or released anymore */
+AmcDecResult
+amc_dec_flush (AmcDec *dec, GError **err)
+{
+    g_return_val_if_fail (dec != NULL, AMC_DEC_ERROR);
+
+    g_mutex_lock (&dec->pending_lock);
+    memset (dec->pending, 0, sizeof (dec->pending));
+    dec->next_pending = 0;
+    g_mutex_unlock (&dec->pending_lock);
+    g_atomic_int_set (&dec->eos_pending, FALSE);
+
+    return gst_amc_codec_flush (dec->codec, err) ? AMC_DEC_OK : AMC_DEC_ERROR;
+}
+
+/* Last output format of the codec, for the decoder elements */
+const GstAmcVideoOutputFormat *
+amc_dec_get_output_format (AmcDec *dec)
+{
+    g_return_val_if_fail (dec != NULL, NULL);
+
+    return &dec->output_format;
+}
+
+/* Cropped size of the decoded frames */
+void
+amc_dec_get_output_size (AmcDec *dec, gint *width, gint *height)
+{
+    const GstAmcVideoOutputFormat *output;
+
+    g_return_if_fail (dec != NULL);
+
+    output = &dec->output_format;
+    if (output->crop_right > output->crop_left) {
+        *width = output->crop_right - output->crop_left + 1;
+        *height = output->crop_bottom - output->crop_top + 1;
+    } else {
+        *width = output->width;
+        *height = output->height;
+    }
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,85 @@
+/*
+ ============================================================================
+ Name        : amcdec.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __AMCDEC_H__
+#define __AMCDEC_H__
+
+#include <jni.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Decodes straight to a Surface without a GStreamer pipeline: access
+ * units are pushed, decoded frames pulled and rendered at a time of the
+ * caller's choice. Pushing and pulling may happen on different threads,
+ * other calls on one decoder must not run concurrently with them.
+ *
+ * The decoder elements move their data through this API too, on top of
+ * it they match output to GstVideoCodecFrames, see amcdec-private.h */
+
+typedef struct _AmcDec AmcDec;
+typedef struct _AmcDecFrame AmcDecFrame;
+
+typedef enum
+{
+    AMC_DEC_OK,
+    /* Nothing could be done within the timeout */
+    AMC_DEC_TRY_AGAIN,
+    /* The output size changed, see amc_dec_get_output_size() */
+    AMC_DEC_FORMAT_CHANGED,
+    /* The codec output buffers were replaced, only reported to the
+     * decoder elements copying output out */
+    AMC_DEC_BUFFERS_CHANGED,
+    /* All input up to amc_dec_push_eos() was output */
+    AMC_DEC_EOS,
+    AMC_DEC_ERROR
+} AmcDecResult;
+
+struct _AmcDecFrame
+{
+    /* Codec output buffer, to be rendered or released exactly once */
+    gint index;
+    gint64 pts_us;
+    /* Decoded bytes in the codec output buffer, frames of size 0 were
+     * dropped by the codec and are released, not rendered */
+    gint offset;
+    gint size;
+    /* From amc_dec_push() to output, -1 if unknown */
+    gint64 decode_time_us;
+};
+
+gboolean amc_dec_init (JavaVM *vm, GError **err);
+
+AmcDec * amc_dec_new (const gchar *mime, gint width, gint height,
+            const guint8 *codec_data, gsize codec_data_size, jobject surface,
+            GError **err);
+void amc_dec_free (AmcDec *dec);
+
+AmcDecResult amc_dec_push (AmcDec *dec, const guint8 *data, gsize size,
+            gint64 pts_us, gboolean keyframe, gint64 timeout_us, GError **err);
+AmcDecResult amc_dec_push_eos (AmcDec *dec, gint64 timeout_us, GError **err);
+AmcDecResult amc_dec_pull (AmcDec *dec, AmcDecFrame *frame, gint64 timeout_us,
+            GError **err);
+
+AmcDecResult amc_dec_render (AmcDec *dec, const AmcDecFrame *frame,
+            gint64 render_time_ns, GError **err);
+AmcDecResult amc_dec_release (AmcDec *dec, const AmcDecFrame *frame,
+            GError **err);
+
+AmcDecResult amc_dec_flush (AmcDec *dec, GError **err);
+
+void amc_dec_get_output_size (AmcDec *dec, gint *width, gint *height);
+
+G_END_DECLS
+
+#endif /* __AMCDEC_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
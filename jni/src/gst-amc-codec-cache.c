@@ -0,0 +1,242 @@
+/*
+ ============================================================================
+ Name        : gst-amc-codec-cache.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "gst-amc-codec-cache.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+/* The supported types of the usable decoders with their profile levels,
+ * in native byte order and 32-bit words so the profile levels can be used
+ * in place from the mapped file:
+ *
+ *   magic, format version, key size, key (NUL-terminated),
+ *   then per type until the end:
+ *   MIME size, MIME (NUL-terminated), n, n profile and level pairs
+ *
+ * Strings are padded to a multiple of 4 bytes */
+
+#define CACHE_MAGIC 0x43434d41
+#define CACHE_FORMAT_VERSION 1
+
+#define PAD4(n) (((n) + 3) & ~(gsize) 3)
+
+struct _GstAmcCodecCache
+{
+    /* Built after enumerating, NULL if mapped */
+    GByteArray *data;
+    GMappedFile *file;
+    /* Up to the first type */
+    guint header_size;
+};
+
+static void
+append_uint32 (GByteArray *data, guint32 value)
+{
+    g_byte_array_append (data, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+append_string (GByteArray *data, const gchar *string)
+{
+    static const guint8 zeros[4];
+    gsize size = strlen (string) + 1;
+
+    append_uint32 (data, PAD4 (size));
+    g_byte_array_append (data, (const guint8 *) string, size);
+    g_byte_array_append (data, zeros, PAD4 (size) - size);
+}
+
+static gboolean
+read_uint32 (const guint8 **data, const guint8 *end, guint32 *value)
+{
+    if (end - *data < (gssize) sizeof (guint32))
+        return FALSE;
+
+    memcpy (value, *data, sizeof (guint32));
+    *data += sizeof (guint32);
+
+    return TRUE;
+}
+
+static const gchar *
+read_string (const guint8 **data, const guint8 *end)
+{
+    const gchar *string;
+    guint32 size;
+
+    if (!read_uint32 (data, end, &size) || !size || size % 4 ||
+                end - *data < (gssize) size)
+        return NULL;
+
+    string = (const gchar *) *data;
+    if (!memchr (string, '\0', size))
+        return NULL;
+    *data += size;
+
+    return string;
+}
+
+/* Calls @func for every type, if @func isn't NULL. Returns FALSE if the
+ * data is malformed or not for @key */
+static gboolean
+gst_amc_codec_cache_parse (const guint8 *data, gsize size, const gchar *key,
+            GstCaps *caps, GstAmcCodecForeachFunc func)
+{
+    const guint8 *end = data + size;
+    const gchar *cache_key;
+    guint32 magic, version;
+
+    if (!read_uint32 (&data, end, &magic) || magic != CACHE_MAGIC ||
+                !read_uint32 (&data, end, &version) ||
+                version != CACHE_FORMAT_VERSION)
+        return FALSE;
+
+    cache_key = read_string (&data, end);
+    if (!cache_key || (key && strcmp (cache_key, key) != 0))
+        return FALSE;
+
+    while (data < end) {
+        GstAmcCodecProfileLevel *profile_levels;
+        const gchar *mime;
+        guint32 n_profile_levels;
+
+        mime = read_string (&data, end);
+        if (!mime || !read_uint32 (&data, end, &n_profile_levels) ||
+                    n_profile_levels > (end - data) / sizeof (GstAmcCodecProfileLevel))
+            return FALSE;
+
+        profile_levels = (GstAmcCodecProfileLevel *) data;
+        data += n_profile_levels * sizeof (GstAmcCodecProfileLevel);
+
+        if (func)
+            func (caps, mime, profile_levels, n_profile_levels);
+    }
+
+    return TRUE;
+}
+
+/* Starts an empty cache to add the enumerated types to */
+GstAmcCodecCache *
+gst_amc_codec_cache_new (const gchar *key)
+{
+    GstAmcCodecCache *cache = g_slice_new0 (GstAmcCodecCache);
+
+    cache->data = g_byte_array_new ();
+    append_uint32 (cache->data, CACHE_MAGIC);
+    append_uint32 (cache->data, CACHE_FORMAT_VERSION);
+    append_string (cache->data, key ? key : "");
+    cache->header_size = cache->data->len;
+
+    return cache;
+}
+
+/* Maps the cache at @path, NULL if missing, malformed or written for
+ * another @key */
+GstAmcCodecCache *
+gst_amc_codec_cache_load (const gchar *path, const gchar *key)
+{
+    GstAmcCodecCache *cache;
+    GMappedFile *file;
+    GError *err = NULL;
+
+    file = g_mapped_file_new (path, FALSE, &err);
+    if (!file) {
+        GST_DEBUG ("No codec cache: %s", err->message);
+        g_clear_error (&err);
+        return NULL;
+    }
+
+    if (!gst_amc_codec_cache_parse ((const guint8 *) g_mapped_file_get_contents (file),
+                    g_mapped_file_get_length (file), key, NULL, NULL)) {
+        GST_INFO ("Codec cache %s is stale or invalid", path);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    cache = g_slice_new0 (GstAmcCodecCache);
+    cache->file = file;
+
+    return cache;
+}
+
+void
+gst_amc_codec_cache_free (GstAmcCodecCache *cache)
+{
+    if (cache->data)
+        g_byte_array_unref (cache->data);
+    if (cache->file)
+        g_mapped_file_unref (cache->file);
+    g_slice_free (GstAmcCodecCache, cache);
+}
+
+void
+gst_amc_codec_cache_add_type (GstAmcCodecCache *cache, const gchar *mime,
+            const GstAmcCodecProfileLevel *profile_levels,
+            gsize n_profile_levels)
+{
+    g_return_if_fail (cache->data != NULL);
+
+    append_string (cache->data, mime);
+    append_uint32 (cache->data, n_profile_levels);
+    g_byte_array_append (cache->data, (const guint8 *) profile_levels,
+                n_profile_levels * sizeof (GstAmcCodecProfileLevel));
+}
+
+/* Adds the types of @other, built with gst_amc_codec_cache_new() too */
+void
+gst_amc_codec_cache_append (GstAmcCodecCache *cache, GstAmcCodecCache *other)
+{
+    g_return_if_fail (cache->data != NULL);
+    g_return_if_fail (other->data != NULL);
+
+    g_byte_array_append (cache->data, other->data->data + other->header_size,
+                other->data->len - other->header_size);
+}
+
+/* Replaces the file at @path atomically */
+gboolean
+gst_amc_codec_cache_save (GstAmcCodecCache *cache, const gchar *path,
+            GError **err)
+{
+    gchar *dir;
+
+    g_return_val_if_fail (cache->data != NULL, FALSE);
+
+    dir = g_path_get_dirname (path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    return g_file_set_contents (path, (const gchar *) cache->data->data,
+                cache->data->len, err);
+}
+
+void
+gst_amc_codec_cache_foreach (GstAmcCodecCache *cache, GstCaps *caps,
+            GstAmcCodecForeachFunc func)
+{
+    const guint8 *data;
+    gsize size;
+
+    if (cache->file) {
+        data = (const guint8 *) g_mapped_file_get_contents (cache->file);
+        size = g_mapped_file_get_length (cache->file);
+    } else {
+        data = cache->data->data;
+        size = cache->data->len;
+    }
+
+    gst_amc_codec_cache_parse (data, size, NULL, caps, func);
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
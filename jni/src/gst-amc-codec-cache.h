@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : gst-amc-codec-cache.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_CODEC_CACHE_H__
+#define __GST_AMC_CODEC_CACHE_H__
+
+#include <gst/gst.h>
+
+#include "gst-amc.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstAmcCodecCache GstAmcCodecCache;
+
+GstAmcCodecCache * gst_amc_codec_cache_new (const gchar *key);
+GstAmcCodecCache * gst_amc_codec_cache_load (const gchar *path,
+            const gchar *key);
+void gst_amc_codec_cache_free (GstAmcCodecCache *cache);
+
+void gst_amc_codec_cache_add_type (GstAmcCodecCache *cache, const gchar *mime,
+            const GstAmcCodecProfileLevel *profile_levels,
+            gsize n_profile_levels);
+void gst_amc_codec_cache_append (GstAmcCodecCache *cache,
+            GstAmcCodecCache *other);
+gboolean gst_amc_codec_cache_save (GstAmcCodecCache *cache, const gchar *path,
+            GError **err);
+
+void gst_amc_codec_cache_foreach (GstAmcCodecCache *cache, GstCaps *caps,
+            GstAmcCodecForeachFunc func);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_CODEC_CACHE_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,240 @@
+/*
+ ============================================================================
+ Name        : gst-amc-copy.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include <string.h>
+
+#if defined (__ARM_NEON__) || defined (__aarch64__)
+#include <arm_neon.h>
+#endif
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "gst-amc-copy.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+/* Codec input buffers are often ION or dmabuf memory mapped uncached or
+ * write-combined, where full-line streaming stores beat a generic copy
+ * by far. Which kernel wins is measured once on such a buffer */
+
+#define BURST_SIZE 64
+
+#define CALIBRATE_MIN_SIZE (16 * 1024)
+#define CALIBRATE_MAX_SIZE (512 * 1024)
+#define CALIBRATE_ROUNDS 8
+
+typedef void (*GstAmcCopyFunc) (guint8 *dest, const guint8 *src, gsize size);
+typedef struct _GstAmcCopyKernel GstAmcCopyKernel;
+
+struct _GstAmcCopyKernel
+{
+    const gchar *name;
+    GstAmcCopyFunc func;
+};
+
+extern void *orc_memcpy (void *dest, const void *src, size_t n);
+
+static void
+copy_orc (guint8 *dest, const guint8 *src, gsize size)
+{
+    orc_memcpy (dest, src, size);
+}
+
+/* Defines a kernel copying 64-byte bursts to aligned addresses with
+ * @burst, the unaligned head and the tail with memcpy */
+#define DEFINE_BURST_COPY(name, burst, fence) \
+static void \
+name (guint8 *dest, const guint8 *src, gsize size) \
+{ \
+    gsize head = MIN ((gsize) (-(guintptr) dest & (BURST_SIZE - 1)), size); \
+\
+    memcpy (dest, src, head); \
+    dest += head; \
+    src += head; \
+    size -= head; \
+    for (; size >= BURST_SIZE; size -= BURST_SIZE) { \
+        burst (dest, src); \
+        dest += BURST_SIZE; \
+        src += BURST_SIZE; \
+    } \
+    fence; \
+    memcpy (dest, src, size); \
+}
+
+#if defined (__ARM_NEON__) || defined (__aarch64__)
+static inline void
+burst_neon (guint8 *dest, const guint8 *src)
+{
+    uint8x16_t a = vld1q_u8 (src);
+    uint8x16_t b = vld1q_u8 (src + 16);
+    uint8x16_t c = vld1q_u8 (src + 32);
+    uint8x16_t d = vld1q_u8 (src + 48);
+
+    vst1q_u8 (dest, a);
+    vst1q_u8 (dest + 16, b);
+    vst1q_u8 (dest + 32, c);
+    vst1q_u8 (dest + 48, d);
+}
+
+DEFINE_BURST_COPY (copy_neon_burst, burst_neon, (void) 0)
+#endif
+
+#if defined (__aarch64__)
+/* Non-temporal pairs, not allocating in the cache */
+static inline void
+burst_neon_stnp (guint8 *dest, const guint8 *src)
+{
+    __asm__ volatile (
+                "ldp q0, q1, [%1]\n\t"
+                "ldp q2, q3, [%1, #32]\n\t"
+                "stnp q0, q1, [%0]\n\t"
+                "stnp q2, q3, [%0, #32]\n\t"
+                : : "r" (dest), "r" (src)
+                : "v0", "v1", "v2", "v3", "memory");
+}
+
+DEFINE_BURST_COPY (copy_neon_stnp, burst_neon_stnp, (void) 0)
+#endif
+
+#if defined (__SSE2__)
+static inline void
+burst_sse2_stream (guint8 *dest, const guint8 *src)
+{
+    __m128i a = _mm_loadu_si128 ((const __m128i *) src);
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (src + 16));
+    __m128i c = _mm_loadu_si128 ((const __m128i *) (src + 32));
+    __m128i d = _mm_loadu_si128 ((const __m128i *) (src + 48));
+
+    _mm_stream_si128 ((__m128i *) dest, a);
+    _mm_stream_si128 ((__m128i *) (dest + 16), b);
+    _mm_stream_si128 ((__m128i *) (dest + 32), c);
+    _mm_stream_si128 ((__m128i *) (dest + 48), d);
+}
+
+/* Streaming stores are weakly ordered, fenced before the codec sees them */
+DEFINE_BURST_COPY (copy_sse2_stream, burst_sse2_stream, _mm_sfence ())
+#endif
+
+/* The first one is used until calibrated */
+static const GstAmcCopyKernel kernels[] = {
+    { "orc", copy_orc },
+#if defined (__ARM_NEON__) || defined (__aarch64__)
+    { "neon-burst64", copy_neon_burst },
+#endif
+#if defined (__aarch64__)
+    { "neon-stnp", copy_neon_stnp },
+#endif
+#if defined (__SSE2__)
+    { "sse2-stream", copy_sse2_stream },
+#endif
+};
+
+G_LOCK_DEFINE_STATIC (calibrate);
+static gint calibrated;
+/* Accessed atomically */
+static const GstAmcCopyKernel *kernel = &kernels[0];
+/* In MB/s, protected by the calibrate lock */
+static gdouble kernel_bandwidth;
+
+/* Copies to codec input memory with the kernel found fastest */
+void
+gst_amc_copy (guint8 *dest, const guint8 *src, gsize size)
+{
+    const GstAmcCopyKernel *k = g_atomic_pointer_get (&kernel);
+
+    k->func (dest, src, size);
+}
+
+/* Returns the bandwidth of copying @size bytes to @dest in MB/s */
+static gdouble
+measure_kernel (const GstAmcCopyKernel *k, guint8 *dest, const guint8 *src,
+            gsize size)
+{
+    gint64 start, elapsed;
+    guint i;
+
+    /* Warm up */
+    k->func (dest, src, size);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < CALIBRATE_ROUNDS; i++)
+        k->func (dest, src, size);
+    elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+    return (gdouble) size * CALIBRATE_ROUNDS / elapsed;
+}
+
+/* Picks the copy kernel with the highest bandwidth into @dest, a codec
+ * input buffer owned by the caller, once per process. Buffers too small
+ * to measure are skipped */
+void
+gst_amc_copy_calibrate (guint8 *dest, gsize size)
+{
+    const GstAmcCopyKernel *best = &kernels[0];
+    gdouble best_bandwidth = 0;
+    guint8 *src;
+    guint i;
+
+    if (g_atomic_int_get (&calibrated))
+        return;
+
+    size = MIN (size, CALIBRATE_MAX_SIZE);
+    if (size < CALIBRATE_MIN_SIZE)
+        return;
+
+    G_LOCK (calibrate);
+    if (calibrated) {
+        G_UNLOCK (calibrate);
+        return;
+    }
+
+    src = g_malloc (size);
+    memset (src, 0x5a, size);
+
+    for (i = 0; i < G_N_ELEMENTS (kernels); i++) {
+        gdouble bandwidth = measure_kernel (&kernels[i], dest, src, size);
+
+        GST_DEBUG ("Copy kernel %s: %.0f MB/s", kernels[i].name, bandwidth);
+        if (bandwidth > best_bandwidth) {
+            best = &kernels[i];
+            best_bandwidth = bandwidth;
+        }
+    }
+
+    g_free (src);
+
+    GST_INFO ("Using copy kernel %s for codec input, %.0f MB/s", best->name,
+                best_bandwidth);
+    kernel_bandwidth = best_bandwidth;
+    g_atomic_pointer_set (&kernel, best);
+    g_atomic_int_set (&calibrated, TRUE);
+    G_UNLOCK (calibrate);
+}
+
+/* Returns the name of the kernel in use, and its measured @bandwidth in
+ * MB/s or 0 if not calibrated yet */
+const gchar *
+gst_amc_copy_get_kernel (gdouble *bandwidth)
+{
+    const gchar *name;
+
+    G_LOCK (calibrate);
+    name = kernel->name;
+    if (bandwidth)
+        *bandwidth = kernel_bandwidth;
+    G_UNLOCK (calibrate);
+
+    return name;
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
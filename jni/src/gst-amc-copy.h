@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : gst-amc-copy.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_COPY_H__
+#define __GST_AMC_COPY_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+void gst_amc_copy (guint8 *dest, const guint8 *src, gsize size);
+
+void gst_amc_copy_calibrate (guint8 *dest, gsize size);
+const gchar * gst_amc_copy_get_kernel (gdouble *bandwidth);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_COPY_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
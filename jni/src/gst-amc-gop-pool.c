@@ -0,0 +1,648 @@
+/*
+ ============================================================================
+ Name        : gst-amc-gop-pool.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "gst-amc-gop-pool.h"
+#include "gst-amc-copy.h"
+#include "gst-jni-utils.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+/* Output is polled this often while no input can be queued */
+#define DEQUEUE_TIMEOUT_US 10000
+/* A codec without progress for this many polls is considered stuck */
+#define MAX_IDLE_POLLS 500
+
+typedef struct _GstAmcGopWorker GstAmcGopWorker;
+
+struct _GstAmcGopWorker
+{
+    GstAmcGopPool *pool;
+    guint id;
+
+    GstAmcCodec *codec;
+    /* FALSE for the codec borrowed from the caller */
+    gboolean owns_codec;
+    GstAmcBuffer *input_buffers;
+    gsize n_input_buffers;
+    GstAmcBuffer *output_buffers;
+    gsize n_output_buffers;
+    GstAmcVideoLayout layout;
+    gboolean has_layout;
+
+    GThread *thread;
+    /* GOPs dispatched to this codec */
+    GAsyncQueue *queue;
+};
+
+struct _GstAmcGopPool
+{
+    GstAmcGopWorker *workers;
+    guint n_workers;
+    guint next_worker;
+
+    GMutex lock;
+    GCond cond;
+    /* GOPs in dispatch order, protected by the lock */
+    GQueue pending;
+    gint flushing;
+};
+
+/* Makes a worker thread quit */
+static GstAmcGop quit_gop;
+
+GstAmcGop *
+gst_amc_gop_new (void)
+{
+    GstAmcGop *gop = g_slice_new0 (GstAmcGop);
+
+    gop->input = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+    gop->output = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+
+    return gop;
+}
+
+void
+gst_amc_gop_free (GstAmcGop *gop)
+{
+    g_return_if_fail (gop != NULL);
+
+    g_ptr_array_unref (gop->input);
+    g_ptr_array_unref (gop->output);
+    g_clear_error (&gop->error);
+    g_slice_free (GstAmcGop, gop);
+}
+
+static gboolean
+gst_amc_gop_worker_get_output_buffers (GstAmcGopWorker *worker, GError **err)
+{
+    if (worker->output_buffers)
+        gst_amc_codec_free_buffers (worker->output_buffers, worker->n_output_buffers);
+    worker->output_buffers = gst_amc_codec_get_output_buffers (worker->codec,
+                &worker->n_output_buffers, err);
+
+    return worker->output_buffers != NULL;
+}
+
+static gboolean
+gst_amc_gop_worker_update_layout (GstAmcGopWorker *worker, GError **err)
+{
+    GstAmcFormat *format;
+
+    format = gst_amc_codec_get_output_format (worker->codec, err);
+    if (!format)
+        return FALSE;
+
+    worker->has_layout = gst_amc_video_layout_from_format (&worker->layout,
+                format, err);
+    gst_amc_format_free (format);
+
+    return worker->has_layout;
+}
+
+/* Returns TRUE if access unit @index of @gop, or EOS after the last
+ * one, can be queued */
+static gboolean
+gst_amc_gop_worker_has_input (GstAmcGopWorker *worker, GstAmcGop *gop,
+            guint index)
+{
+    gboolean ret;
+
+    g_mutex_lock (&worker->pool->lock);
+    ret = index < gop->input->len || (index == gop->input->len && !gop->open);
+    g_mutex_unlock (&worker->pool->lock);
+
+    return ret;
+}
+
+/* Queues access unit @index of @gop, or EOS after the last one */
+static gboolean
+gst_amc_gop_worker_queue (GstAmcGopWorker *worker, GstAmcGop *gop,
+            gint idx, guint index, GError **err)
+{
+    GstAmcBufferInfo buffer_info;
+    GstAmcBuffer *buf;
+    GstBuffer *buffer = NULL;
+    GstMapInfo minfo;
+
+    if (idx >= worker->n_input_buffers) {
+        g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+                    "Invalid input buffer index %d of %" G_GSIZE_FORMAT,
+                    idx, worker->n_input_buffers);
+        return FALSE;
+    }
+
+    memset (&buffer_info, 0, sizeof (buffer_info));
+
+    /* Open GOPs grow meanwhile */
+    g_mutex_lock (&worker->pool->lock);
+    if (index < gop->input->len)
+        buffer = gst_buffer_ref (g_ptr_array_index (gop->input, index));
+    g_mutex_unlock (&worker->pool->lock);
+
+    if (!buffer) {
+        buffer_info.flags = BUFFER_FLAG_END_OF_STREAM;
+        return gst_amc_codec_queue_input_buffer (worker->codec, idx, &buffer_info, err);
+    }
+
+    buf = &worker->input_buffers[idx];
+
+    gst_buffer_map (buffer, &minfo, GST_MAP_READ);
+    if (minfo.size > buf->size) {
+        g_set_error (err, GST_STREAM_ERROR, GST_STREAM_ERROR_DECODE,
+                    "Access unit of %" G_GSIZE_FORMAT " bytes exceeds the "
+                    "%" G_GSIZE_FORMAT " bytes codec input buffer",
+                    minfo.size, buf->size);
+        gst_buffer_unmap (buffer, &minfo);
+        gst_buffer_unref (buffer);
+        return FALSE;
+    }
+    gst_amc_copy (buf->data, minfo.data, minfo.size);
+    buffer_info.size = minfo.size;
+    gst_buffer_unmap (buffer, &minfo);
+
+    buffer_info.presentation_time_us =
+        gst_util_uint64_scale (GST_BUFFER_PTS (buffer), 1, GST_USECOND);
+    if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        buffer_info.flags |= BUFFER_FLAG_SYNC_FRAME;
+    gst_buffer_unref (buffer);
+
+    return gst_amc_codec_queue_input_buffer (worker->codec, idx, &buffer_info, err);
+}
+
+/* Adds @outbuf to the frames of @gop not popped yet, keeping them in
+ * presentation order. Called with the pool lock held */
+static void
+gst_amc_gop_add_output (GstAmcGop *gop, GstBuffer *outbuf)
+{
+    guint i = gop->output->len;
+
+    while (i > 0 && GST_BUFFER_PTS (g_ptr_array_index (gop->output, i - 1)) >
+                GST_BUFFER_PTS (outbuf))
+        i--;
+    g_ptr_array_insert (gop->output, i, outbuf);
+}
+
+/* Copies output buffer @idx into @gop and releases it. Waits while the
+ * GOP holds GST_AMC_GOP_MAX_BUFFERED frames, until they are popped */
+static gboolean
+gst_amc_gop_worker_output (GstAmcGopWorker *worker, GstAmcGop *gop,
+            gint idx, const GstAmcBufferInfo *buffer_info, GError **err)
+{
+    GstAmcGopPool *pool = worker->pool;
+    GstVideoFrame vframe;
+    GstBuffer *outbuf;
+    GstAmcBuffer *buf;
+    gboolean copied;
+
+    if (buffer_info->size <= 0)
+        goto release;
+
+    if (!worker->has_layout && !gst_amc_gop_worker_update_layout (worker, err))
+        return FALSE;
+
+    g_mutex_lock (&pool->lock);
+    while (gop->output->len >= GST_AMC_GOP_MAX_BUFFERED && !pool->flushing)
+        g_cond_wait (&pool->cond, &pool->lock);
+    g_mutex_unlock (&pool->lock);
+    if (g_atomic_int_get (&pool->flushing))
+        goto release;
+
+    outbuf = gst_buffer_new_allocate (NULL, worker->layout.info.size, NULL);
+    gst_video_frame_map (&vframe, &worker->layout.info, outbuf, GST_MAP_WRITE);
+    if (worker->layout.use_image) {
+        copied = gst_amc_codec_copy_output_image (worker->codec, idx,
+                    &worker->layout, &vframe, err);
+    } else {
+        if (idx >= worker->n_output_buffers &&
+                    !gst_amc_gop_worker_get_output_buffers (worker, err)) {
+            gst_video_frame_unmap (&vframe);
+            gst_buffer_unref (outbuf);
+            return FALSE;
+        }
+        if (idx >= worker->n_output_buffers) {
+            g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+                        "Invalid output buffer index %d of %" G_GSIZE_FORMAT,
+                        idx, worker->n_output_buffers);
+            gst_video_frame_unmap (&vframe);
+            gst_buffer_unref (outbuf);
+            return FALSE;
+        }
+        buf = &worker->output_buffers[idx];
+        copied = gst_amc_video_layout_copy (&worker->layout,
+                    buf->data + buffer_info->offset, buffer_info->size, &vframe);
+    }
+    gst_video_frame_unmap (&vframe);
+
+    if (copied) {
+        GST_BUFFER_PTS (outbuf) = gst_util_uint64_scale (
+                    buffer_info->presentation_time_us, GST_USECOND, 1);
+        g_mutex_lock (&pool->lock);
+        gst_amc_gop_add_output (gop, outbuf);
+        gop->layout = worker->layout;
+        g_cond_broadcast (&pool->cond);
+        g_mutex_unlock (&pool->lock);
+    } else {
+        GST_WARNING ("Codec %u: dropping frame %" G_GINT64_FORMAT "%s%s",
+                    worker->id, buffer_info->presentation_time_us,
+                    *err ? ": " : "", *err ? (*err)->message : "");
+        g_clear_error (err);
+        gst_buffer_unref (outbuf);
+    }
+
+release:
+    return gst_amc_codec_release_output_buffer (worker->codec, idx, FALSE, 0, err);
+}
+
+static gboolean
+is_transient_error (GError **err)
+{
+    if (!g_error_matches (*err, GST_AMC_CODEC_ERROR, GST_AMC_CODEC_ERROR_TRANSIENT))
+        return FALSE;
+
+    g_clear_error (err);
+    return TRUE;
+}
+
+/* Decodes @gop from its sync frame to the end of stream. Returns
+ * early without error when the pool is flushing */
+static gboolean
+gst_amc_gop_worker_decode (GstAmcGopWorker *worker, GstAmcGop *gop, GError **err)
+{
+    GstAmcGopPool *pool = worker->pool;
+    GstAmcBufferInfo buffer_info;
+    guint n_queued = 0, n_idle = 0;
+    gint idx;
+
+    GST_LOG ("Codec %u: decoding GOP%s", worker->id, gop->open ? ", open" : "");
+
+    while (!g_atomic_int_get (&pool->flushing)) {
+        gboolean progress = FALSE, has_input;
+
+        has_input = gst_amc_gop_worker_has_input (worker, gop, n_queued);
+        if (has_input) {
+            idx = gst_amc_codec_dequeue_input_buffer (worker->codec, 0, err);
+            if (idx >= 0) {
+                if (!gst_amc_gop_worker_queue (worker, gop, idx, n_queued, err))
+                    return FALSE;
+                n_queued++;
+                progress = TRUE;
+            } else if (idx == G_MININT && !is_transient_error (err)) {
+                return FALSE;
+            }
+        }
+
+        idx = gst_amc_codec_dequeue_output_buffer (worker->codec, &buffer_info,
+                    progress ? 0 : DEQUEUE_TIMEOUT_US, err);
+        if (idx >= 0) {
+            if (!gst_amc_gop_worker_output (worker, gop, idx, &buffer_info, err))
+                return FALSE;
+            if (buffer_info.flags & BUFFER_FLAG_END_OF_STREAM)
+                return TRUE;
+            progress = TRUE;
+        } else if (idx == INFO_OUTPUT_FORMAT_CHANGED) {
+            if (!gst_amc_gop_worker_update_layout (worker, err))
+                return FALSE;
+            progress = TRUE;
+        } else if (idx == INFO_OUTPUT_BUFFERS_CHANGED) {
+            if (!gst_amc_gop_worker_get_output_buffers (worker, err))
+                return FALSE;
+            progress = TRUE;
+        } else if (idx == G_MININT && !is_transient_error (err)) {
+            return FALSE;
+        }
+
+        /* An open GOP may just wait for its next access unit */
+        if (progress || !has_input) {
+            n_idle = 0;
+        } else if (++n_idle > MAX_IDLE_POLLS) {
+            g_set_error (err, GST_STREAM_ERROR, GST_STREAM_ERROR_DECODE,
+                        "Codec %u stopped making progress", worker->id);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gpointer
+gst_amc_gop_worker_thread (GstAmcGopWorker *worker)
+{
+    GstAmcGopPool *pool = worker->pool;
+    GstAmcGop *gop;
+
+    while ((gop = g_async_queue_pop (worker->queue)) != &quit_gop) {
+        GError *err = NULL;
+
+        if (!gst_amc_gop_worker_decode (worker, gop, &err))
+            gop->error = err;
+
+        /* GOPs are closed, the next one needs no state from this one */
+        err = NULL;
+        if (!gst_amc_codec_flush (worker->codec, &err)) {
+            if (!gop->error)
+                gop->error = err;
+            else
+                g_clear_error (&err);
+        }
+
+        g_mutex_lock (&pool->lock);
+        gop->done = TRUE;
+        g_cond_broadcast (&pool->cond);
+        g_mutex_unlock (&pool->lock);
+    }
+
+    return NULL;
+}
+
+static void
+gst_amc_gop_worker_clear (GstAmcGopWorker *worker)
+{
+    if (worker->thread) {
+        g_async_queue_push (worker->queue, &quit_gop);
+        g_thread_join (worker->thread);
+    }
+    worker->thread = NULL;
+
+    if (worker->queue)
+        g_async_queue_unref (worker->queue);
+    worker->queue = NULL;
+
+    if (worker->input_buffers)
+        gst_amc_codec_free_buffers (worker->input_buffers, worker->n_input_buffers);
+    worker->input_buffers = NULL;
+    if (worker->output_buffers)
+        gst_amc_codec_free_buffers (worker->output_buffers, worker->n_output_buffers);
+    worker->output_buffers = NULL;
+
+    /* The borrowed codec is stopped by its owner */
+    if (worker->codec && worker->owns_codec) {
+        gst_amc_codec_stop (worker->codec, NULL);
+        gst_amc_codec_release (worker->codec, NULL);
+        gst_amc_codec_free (worker->codec);
+    }
+    worker->codec = NULL;
+}
+
+static gboolean
+gst_amc_gop_worker_init (GstAmcGopPool *pool, GstAmcGopWorker *worker,
+            guint id, GstAmcCodec *codec, const gchar *mime,
+            GstAmcFormat *format, GError **err)
+{
+    worker->pool = pool;
+    worker->id = id;
+
+    if (codec) {
+        worker->codec = codec;
+    } else {
+        gint width = 0, height = 0;
+
+        gst_amc_format_get_int (format, "width", &width, NULL);
+        gst_amc_format_get_int (format, "height", &height, NULL);
+
+        /* Extra instances are a luxury, they never take a session away
+         * from other decoders nor fall back to software */
+        worker->codec = gst_amc_decoder_new_with_budget (mime, width, height,
+                    GST_AMC_SESSION_PRIORITY_LOW, FALSE, NULL, NULL, err);
+        if (!worker->codec)
+            return FALSE;
+        worker->owns_codec = TRUE;
+    }
+
+    /* Decoding to output buffers, a surface can't be shared */
+    if (!gst_amc_codec_configure (worker->codec, format, NULL, 0, err) ||
+                !gst_amc_codec_start (worker->codec, err))
+        goto error;
+
+    worker->input_buffers = gst_amc_codec_get_input_buffers (worker->codec,
+                &worker->n_input_buffers, err);
+    if (!worker->input_buffers)
+        goto error;
+    if (!gst_amc_gop_worker_get_output_buffers (worker, err))
+        goto error;
+
+    worker->queue = g_async_queue_new ();
+    worker->thread = g_thread_try_new ("amcgop",
+                (GThreadFunc) gst_amc_gop_worker_thread, worker, err);
+    if (!worker->thread)
+        goto error;
+
+    return TRUE;
+
+error:
+    gst_amc_gop_worker_clear (worker);
+    return FALSE;
+}
+
+/* Decodes on up to @max_codecs instances, @codec being the first one.
+ * Fewer are used if the device runs out of codec sessions */
+GstAmcGopPool *
+gst_amc_gop_pool_new (GstAmcCodec *codec, const gchar *mime,
+            GstAmcFormat *format, guint max_codecs, GError **err)
+{
+    GstAmcGopPool *pool;
+    guint i;
+
+    g_return_val_if_fail (codec != NULL, NULL);
+    g_return_val_if_fail (max_codecs > 0, NULL);
+
+    pool = g_slice_new0 (GstAmcGopPool);
+    g_mutex_init (&pool->lock);
+    g_cond_init (&pool->cond);
+    g_queue_init (&pool->pending);
+    pool->workers = g_new0 (GstAmcGopWorker, max_codecs);
+
+    for (i = 0; i < max_codecs; i++) {
+        GError *local_err = NULL;
+
+        if (!gst_amc_gop_worker_init (pool, &pool->workers[i], i,
+                        i ? NULL : codec, mime, format, &local_err)) {
+            if (i == 0) {
+                g_propagate_error (err, local_err);
+                gst_amc_gop_pool_free (pool);
+                return NULL;
+            }
+
+            GST_INFO ("Using %u of %u codecs: %s", i, max_codecs,
+                        local_err->message);
+            g_clear_error (&local_err);
+            break;
+        }
+        pool->n_workers++;
+    }
+
+    return pool;
+}
+
+void
+gst_amc_gop_pool_free (GstAmcGopPool *pool)
+{
+    guint i;
+
+    g_return_if_fail (pool != NULL);
+
+    gst_amc_gop_pool_set_flushing (pool, TRUE);
+    for (i = 0; i < pool->n_workers; i++)
+        gst_amc_gop_worker_clear (&pool->workers[i]);
+    g_free (pool->workers);
+
+    g_mutex_clear (&pool->lock);
+    g_cond_clear (&pool->cond);
+    g_slice_free (GstAmcGopPool, pool);
+}
+
+guint
+gst_amc_gop_pool_get_n_codecs (GstAmcGopPool *pool)
+{
+    return pool->n_workers;
+}
+
+guint
+gst_amc_gop_pool_get_n_pending (GstAmcGopPool *pool)
+{
+    guint n_pending;
+
+    g_mutex_lock (&pool->lock);
+    n_pending = g_queue_get_length (&pool->pending);
+    g_mutex_unlock (&pool->lock);
+
+    return n_pending;
+}
+
+/* Takes ownership of @gop and dispatches it round-robin */
+void
+gst_amc_gop_pool_push (GstAmcGopPool *pool, GstAmcGop *gop)
+{
+    GstAmcGopWorker *worker;
+
+    g_mutex_lock (&pool->lock);
+    g_queue_push_tail (&pool->pending, gop);
+    worker = &pool->workers[pool->next_worker];
+    pool->next_worker = (pool->next_worker + 1) % pool->n_workers;
+    g_mutex_unlock (&pool->lock);
+
+    g_async_queue_push (worker->queue, gop);
+}
+
+/* Appends access unit @input to the open @gop pushed already, taking
+ * ownership of it */
+void
+gst_amc_gop_pool_append (GstAmcGopPool *pool, GstAmcGop *gop, GstBuffer *input)
+{
+    g_return_if_fail (gop->open);
+
+    g_mutex_lock (&pool->lock);
+    g_ptr_array_add (gop->input, input);
+    g_mutex_unlock (&pool->lock);
+}
+
+/* Ends the open @gop, its decoding completes once the codec is drained */
+void
+gst_amc_gop_pool_close (GstAmcGopPool *pool, GstAmcGop *gop)
+{
+    g_mutex_lock (&pool->lock);
+    gop->open = FALSE;
+    g_mutex_unlock (&pool->lock);
+}
+
+/* Waits for the oldest GOP to be decoded, NULL if there is none or
+ * the pool is flushing. Only for GOPs decoding to at most
+ * GST_AMC_GOP_MAX_BUFFERED frames, use gst_amc_gop_pool_pop_frame()
+ * otherwise */
+GstAmcGop *
+gst_amc_gop_pool_pop (GstAmcGopPool *pool)
+{
+    GstAmcGop *gop;
+
+    g_mutex_lock (&pool->lock);
+    while ((gop = g_queue_peek_head (&pool->pending)) && !gop->done &&
+                !pool->flushing)
+        g_cond_wait (&pool->cond, &pool->lock);
+    if (gop && !pool->flushing)
+        g_queue_pop_head (&pool->pending);
+    else
+        gop = NULL;
+    g_mutex_unlock (&pool->lock);
+
+    return gop;
+}
+
+/* Takes the next frame of the oldest GOP as soon as it is decoded,
+ * codecs output in presentation order. Returns GST_FLOW_OK with @buffer
+ * set to NULL once that GOP is complete, GST_FLOW_EOS if no GOP is
+ * pending, GST_FLOW_FLUSHING while flushing and GST_FLOW_ERROR with @err
+ * set if the GOP failed after its last frame. Unless @wait, returns
+ * GST_FLOW_CUSTOM_SUCCESS if the next frame isn't decoded yet */
+GstFlowReturn
+gst_amc_gop_pool_pop_frame (GstAmcGopPool *pool, gboolean wait,
+            GstBuffer **buffer, GstAmcVideoLayout *layout, GError **err)
+{
+    GstAmcGop *gop, *finished = NULL;
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    *buffer = NULL;
+
+    g_mutex_lock (&pool->lock);
+    while ((gop = g_queue_peek_head (&pool->pending)) && !gop->output->len &&
+                !gop->done && !pool->flushing && wait)
+        g_cond_wait (&pool->cond, &pool->lock);
+
+    if (pool->flushing) {
+        ret = GST_FLOW_FLUSHING;
+    } else if (gop && !gop->output->len && !gop->done) {
+        ret = GST_FLOW_CUSTOM_SUCCESS;
+    } else if (!gop) {
+        ret = GST_FLOW_EOS;
+    } else if (gop->output->len) {
+        *buffer = gst_buffer_ref (g_ptr_array_index (gop->output, 0));
+        g_ptr_array_remove_index (gop->output, 0);
+        if (layout)
+            *layout = gop->layout;
+        /* Its codec may wait for room */
+        g_cond_broadcast (&pool->cond);
+    } else {
+        finished = g_queue_pop_head (&pool->pending);
+        if (finished->error) {
+            g_propagate_error (err, finished->error);
+            finished->error = NULL;
+            ret = GST_FLOW_ERROR;
+        }
+    }
+    g_mutex_unlock (&pool->lock);
+
+    if (finished)
+        gst_amc_gop_free (finished);
+
+    return ret;
+}
+
+/* While flushing, GOPs are aborted and discarded */
+void
+gst_amc_gop_pool_set_flushing (GstAmcGopPool *pool, gboolean flushing)
+{
+    GstAmcGop *gop;
+
+    g_mutex_lock (&pool->lock);
+    g_atomic_int_set (&pool->flushing, flushing);
+    g_cond_broadcast (&pool->cond);
+
+    while (flushing && (gop = g_queue_peek_head (&pool->pending))) {
+        while (!gop->done)
+            g_cond_wait (&pool->cond, &pool->lock);
+        g_queue_pop_head (&pool->pending);
+        gst_amc_gop_free (gop);
+    }
+    g_mutex_unlock (&pool->lock);
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,66 @@
+/*
+ ============================================================================
+ Name        : gst-amc-gop-pool.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_GOP_POOL_H__
+#define __GST_AMC_GOP_POOL_H__
+
+#include <gst/gst.h>
+
+#include "gst-amc.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstAmcGop GstAmcGop;
+typedef struct _GstAmcGopPool GstAmcGopPool;
+
+/* Decoded frames a GOP holds before its codec waits for them to be popped */
+#define GST_AMC_GOP_MAX_BUFFERED 8
+
+/* A closed GOP, decoded independently of the others */
+struct _GstAmcGop
+{
+    /* Access units in decoding order, the first one is a sync frame */
+    GPtrArray *input;
+    /* Decoded frames not popped yet, in presentation order */
+    GPtrArray *output;
+    GstAmcVideoLayout layout;
+    GError *error;
+    /* TRUE if access units are still appended once pushed, see
+     * gst_amc_gop_pool_append() */
+    gboolean open;
+
+    /* < private > */
+    gboolean done;
+};
+
+GstAmcGop * gst_amc_gop_new (void);
+void gst_amc_gop_free (GstAmcGop *gop);
+
+GstAmcGopPool * gst_amc_gop_pool_new (GstAmcCodec *codec, const gchar *mime,
+            GstAmcFormat *format, guint max_codecs, GError **err);
+void gst_amc_gop_pool_free (GstAmcGopPool *pool);
+
+guint gst_amc_gop_pool_get_n_codecs (GstAmcGopPool *pool);
+guint gst_amc_gop_pool_get_n_pending (GstAmcGopPool *pool);
+
+void gst_amc_gop_pool_push (GstAmcGopPool *pool, GstAmcGop *gop);
+void gst_amc_gop_pool_append (GstAmcGopPool *pool, GstAmcGop *gop, GstBuffer *input);
+void gst_amc_gop_pool_close (GstAmcGopPool *pool, GstAmcGop *gop);
+GstAmcGop * gst_amc_gop_pool_pop (GstAmcGopPool *pool);
+GstFlowReturn gst_amc_gop_pool_pop_frame (GstAmcGopPool *pool, gboolean wait,
+            GstBuffer **buffer, GstAmcVideoLayout *layout, GError **err);
+void gst_amc_gop_pool_set_flushing (GstAmcGopPool *pool, gboolean flushing);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_GOP_POOL_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
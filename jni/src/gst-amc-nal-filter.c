@@ -0,0 +1,355 @@
+/*
+ ============================================================================
+ Name        : gst-amc-nal-filter.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "gst-amc-nal-filter.h"
+#include "gst-amc-copy.h"
+
+#define H264_NAL_SEI 6
+#define H264_NAL_AUD 9
+#define H264_NAL_FILLER 12
+
+#define H265_NAL_AUD 35
+#define H265_NAL_FILLER 38
+#define H265_NAL_PREFIX_SEI 39
+#define H265_NAL_SUFFIX_SEI 40
+
+#define KEEP_SEI_SIZE ((GST_AMC_NAL_FILTER_MAX_SEI_TYPE + 1) / 8)
+
+typedef struct _GstAmcNalSpan GstAmcNalSpan;
+typedef struct _RbspReader RbspReader;
+
+/* Bytes of the input passed on to the codec */
+struct _GstAmcNalSpan
+{
+    gsize offset;
+    gsize size;
+};
+
+struct _GstAmcNalFilter
+{
+    gboolean hevc;
+    GstAmcNalFilterFlags flags;
+    /* Bitmap of the SEI payload types kept */
+    guint8 keep_sei[KEEP_SEI_SIZE];
+
+    /* Spans of the last scanned access unit, reused */
+    GArray *spans;
+};
+
+struct _RbspReader
+{
+    const guint8 *data;
+    const guint8 *end;
+    guint n_zeros;
+};
+
+GType
+gst_amc_nal_filter_flags_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GFlagsValue values[] = {
+        {GST_AMC_NAL_FILTER_AUD, "Access unit delimiters", "aud"},
+        {GST_AMC_NAL_FILTER_FILLER, "Filler data", "filler"},
+        {GST_AMC_NAL_FILTER_SEI, "SEI without kept payload types", "sei"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_flags_register_static ("GstAmcNalFilterFlags", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+/* Returns NULL if @mime isn't H.264 or H.265 */
+GstAmcNalFilter *
+gst_amc_nal_filter_new (const gchar *mime)
+{
+    GstAmcNalFilter *filter;
+    gboolean hevc;
+
+    if (strcmp (mime, "video/hevc") == 0)
+        hevc = TRUE;
+    else if (strcmp (mime, "video/avc") == 0)
+        hevc = FALSE;
+    else
+        return NULL;
+
+    filter = g_slice_new0 (GstAmcNalFilter);
+    filter->hevc = hevc;
+    filter->spans = g_array_new (FALSE, FALSE, sizeof (GstAmcNalSpan));
+
+    return filter;
+}
+
+void
+gst_amc_nal_filter_free (GstAmcNalFilter *filter)
+{
+    g_array_free (filter->spans, TRUE);
+    g_slice_free (GstAmcNalFilter, filter);
+}
+
+void
+gst_amc_nal_filter_set_flags (GstAmcNalFilter *filter,
+            GstAmcNalFilterFlags flags)
+{
+    filter->flags = flags;
+}
+
+/* @keep_sei is a bitmap of (GST_AMC_NAL_FILTER_MAX_SEI_TYPE + 1) bits */
+void
+gst_amc_nal_filter_set_keep_sei (GstAmcNalFilter *filter,
+            const guint8 *keep_sei)
+{
+    memcpy (filter->keep_sei, keep_sei, KEEP_SEI_SIZE);
+}
+
+/* Returns the first 00 00 01 in [@data, @end), or @end. Words without a
+ * zero byte are skipped at once, as most of a slice is */
+static const guint8 *
+find_start_code (const guint8 *data, const guint8 *end)
+{
+    while (end - data >= 3) {
+        const guint8 *stop;
+
+        if (end - data >= 8) {
+            guint64 word;
+
+            memcpy (&word, data, 8);
+            if (!((word - G_GUINT64_CONSTANT (0x0101010101010101)) & ~word &
+                            G_GUINT64_CONSTANT (0x8080808080808080))) {
+                data += 8;
+                continue;
+            }
+        }
+
+        for (stop = MIN (data + 8, end - 2); data < stop; data++) {
+            if (data[0] == 0 && data[1] == 0 && data[2] == 1)
+                return data;
+        }
+    }
+
+    return end;
+}
+
+static gboolean
+rbsp_reader_get (RbspReader *reader, guint8 *byte)
+{
+    if (reader->data < reader->end && reader->n_zeros >= 2 &&
+                *reader->data == 0x03) {
+        /* Emulation prevention byte */
+        reader->data++;
+        reader->n_zeros = 0;
+    }
+    if (reader->data >= reader->end)
+        return FALSE;
+
+    *byte = *reader->data++;
+    reader->n_zeros = *byte ? 0 : reader->n_zeros + 1;
+
+    return TRUE;
+}
+
+static gboolean
+rbsp_reader_get_value (RbspReader *reader, guint *value)
+{
+    guint8 byte;
+
+    *value = 0;
+    do {
+        if (!rbsp_reader_get (reader, &byte))
+            return FALSE;
+        *value += byte;
+    } while (byte == 0xff);
+
+    return TRUE;
+}
+
+/* Returns TRUE if the SEI payload @data holds a message of a kept type,
+ * or can't be parsed */
+static gboolean
+gst_amc_nal_filter_keep_sei (GstAmcNalFilter *filter, const guint8 *data,
+            const guint8 *end)
+{
+    RbspReader reader = { data, end, 0 };
+    guint type, size;
+
+    /* Up to the rbsp_trailing_bits */
+    while (reader.end - reader.data > 1 || (reader.data < reader.end &&
+                    *reader.data != 0x80)) {
+        if (!rbsp_reader_get_value (&reader, &type) ||
+                    !rbsp_reader_get_value (&reader, &size))
+            return TRUE;
+
+        if (type <= GST_AMC_NAL_FILTER_MAX_SEI_TYPE &&
+                    filter->keep_sei[type / 8] & (1 << (type % 8)))
+            return TRUE;
+
+        while (size--) {
+            guint8 byte;
+
+            if (!rbsp_reader_get (&reader, &byte))
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Returns TRUE if the NAL unit in [@data, @end), start code excluded,
+ * is passed on to the codec */
+static gboolean
+gst_amc_nal_filter_keep_nal (GstAmcNalFilter *filter, const guint8 *data,
+            const guint8 *end)
+{
+    guint header_size = filter->hevc ? 2 : 1;
+    guint type;
+
+    if (end - data < (gssize) header_size)
+        return TRUE;
+
+    type = filter->hevc ? (data[0] >> 1) & 0x3f : data[0] & 0x1f;
+    if (filter->hevc) {
+        switch (type) {
+        case H265_NAL_AUD:
+            return !(filter->flags & GST_AMC_NAL_FILTER_AUD);
+        case H265_NAL_FILLER:
+            return !(filter->flags & GST_AMC_NAL_FILTER_FILLER);
+        case H265_NAL_PREFIX_SEI:
+        case H265_NAL_SUFFIX_SEI:
+            break;
+        default:
+            return TRUE;
+        }
+    } else {
+        switch (type) {
+        case H264_NAL_AUD:
+            return !(filter->flags & GST_AMC_NAL_FILTER_AUD);
+        case H264_NAL_FILLER:
+            return !(filter->flags & GST_AMC_NAL_FILTER_FILLER);
+        case H264_NAL_SEI:
+            break;
+        default:
+            return TRUE;
+        }
+    }
+
+    if (!(filter->flags & GST_AMC_NAL_FILTER_SEI))
+        return TRUE;
+
+    /* Without trailing_zero_8bits */
+    while (end > data + header_size && end[-1] == 0)
+        end--;
+
+    return gst_amc_nal_filter_keep_sei (filter, data + header_size, end);
+}
+
+/* Returns where the NAL unit with start code @sc begins, taking in a
+ * leading zero byte of a 4-byte start code */
+static const guint8 *
+nal_start (const guint8 *sc, const guint8 *min)
+{
+    return sc > min && sc[-1] == 0 ? sc - 1 : sc;
+}
+
+static void
+gst_amc_nal_filter_keep_span (GstAmcNalFilter *filter, gsize offset,
+            gsize size)
+{
+    GstAmcNalSpan span = { offset, size };
+
+    if (filter->spans->len) {
+        GstAmcNalSpan *last = &g_array_index (filter->spans, GstAmcNalSpan,
+                    filter->spans->len - 1);
+
+        if (last->offset + last->size == offset) {
+            last->size += size;
+            return;
+        }
+    }
+
+    g_array_append_val (filter->spans, span);
+}
+
+/* Finds the parts of the byte-stream access unit @data to pass on to the
+ * codec, and returns their size. If nothing would be left, everything is
+ * kept. gst_amc_nal_filter_copy() then copies them out */
+gsize
+gst_amc_nal_filter_scan (GstAmcNalFilter *filter, const guint8 *data,
+            gsize size)
+{
+    const guint8 *end = data + size;
+    const guint8 *sc, *start;
+    gsize kept = 0;
+    guint i;
+
+    g_array_set_size (filter->spans, 0);
+
+    sc = find_start_code (data, end);
+    start = sc < end ? nal_start (sc, data) : end;
+    /* Leading bytes, e.g. of a slice continued from the last buffer */
+    if (start > data)
+        gst_amc_nal_filter_keep_span (filter, 0, start - data);
+
+    while (sc < end) {
+        const guint8 *next_sc, *next;
+
+        next_sc = find_start_code (sc + 3, end);
+        next = next_sc < end ? nal_start (next_sc, sc + 3) : end;
+
+        if (gst_amc_nal_filter_keep_nal (filter, sc + 3, next))
+            gst_amc_nal_filter_keep_span (filter, start - data, next - start);
+
+        sc = next_sc;
+        start = next;
+    }
+
+    for (i = 0; i < filter->spans->len; i++)
+        kept += g_array_index (filter->spans, GstAmcNalSpan, i).size;
+
+    if (!kept) {
+        g_array_set_size (filter->spans, 0);
+        gst_amc_nal_filter_keep_span (filter, 0, size);
+        kept = size;
+    }
+
+    return kept;
+}
+
+/* Copies @size bytes from @offset of the filtered access unit last
+ * scanned from @data */
+void
+gst_amc_nal_filter_copy (GstAmcNalFilter *filter, const guint8 *data,
+            gsize offset, guint8 *dest, gsize size)
+{
+    guint i;
+
+    for (i = 0; i < filter->spans->len && size; i++) {
+        GstAmcNalSpan *span = &g_array_index (filter->spans, GstAmcNalSpan, i);
+        gsize n;
+
+        if (offset >= span->size) {
+            offset -= span->size;
+            continue;
+        }
+
+        n = MIN (span->size - offset, size);
+        gst_amc_copy (dest, data + span->offset + offset, n);
+        dest += n;
+        size -= n;
+        offset = 0;
+    }
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,56 @@
+/*
+ ============================================================================
+ Name        : gst-amc-nal-filter.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_NAL_FILTER_H__
+#define __GST_AMC_NAL_FILTER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_AMC_NAL_FILTER_FLAGS \
+    (gst_amc_nal_filter_flags_get_type())
+
+/* SEI payload types up to this one can be kept */
+#define GST_AMC_NAL_FILTER_MAX_SEI_TYPE 255
+
+typedef struct _GstAmcNalFilter GstAmcNalFilter;
+
+/* NAL units stripped from H.264 and H.265 byte-stream input */
+typedef enum
+{
+    GST_AMC_NAL_FILTER_NONE = 0,
+    GST_AMC_NAL_FILTER_AUD = (1 << 0),
+    GST_AMC_NAL_FILTER_FILLER = (1 << 1),
+    /* Unless one of the messages is of a kept payload type */
+    GST_AMC_NAL_FILTER_SEI = (1 << 2)
+} GstAmcNalFilterFlags;
+
+GType gst_amc_nal_filter_flags_get_type (void);
+
+GstAmcNalFilter * gst_amc_nal_filter_new (const gchar *mime);
+void gst_amc_nal_filter_free (GstAmcNalFilter *filter);
+
+void gst_amc_nal_filter_set_flags (GstAmcNalFilter *filter,
+            GstAmcNalFilterFlags flags);
+void gst_amc_nal_filter_set_keep_sei (GstAmcNalFilter *filter,
+            const guint8 *keep_sei);
+
+gsize gst_amc_nal_filter_scan (GstAmcNalFilter *filter, const guint8 *data,
+            gsize size);
+void gst_amc_nal_filter_copy (GstAmcNalFilter *filter, const guint8 *data,
+            gsize offset, guint8 *dest, gsize size);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_NAL_FILTER_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
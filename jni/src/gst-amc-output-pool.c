@@ -0,0 +1,213 @@
+/*
+ ============================================================================
+ Name        : gst-amc-output-pool.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include "gst-amc-output-pool.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+GType
+gst_amc_output_meta_api_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const gchar *tags[] = { NULL };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = gst_meta_api_type_register ("GstAmcOutputMetaAPI", tags);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+static gboolean
+gst_amc_output_meta_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
+{
+    GstAmcOutputMeta *output_meta = (GstAmcOutputMeta *) meta;
+
+    output_meta->dec = NULL;
+    output_meta->frame.index = -1;
+    output_meta->generation = 0;
+
+    return TRUE;
+}
+
+/* Not copied with the buffer, only one buffer may release the index */
+const GstMetaInfo *
+gst_amc_output_meta_get_info (void)
+{
+    static const GstMetaInfo *info = NULL;
+
+    if (g_once_init_enter (&info)) {
+        const GstMetaInfo *tmp = gst_meta_register (GST_AMC_OUTPUT_META_API_TYPE,
+                    "GstAmcOutputMeta", sizeof (GstAmcOutputMeta),
+                    gst_amc_output_meta_init, NULL, NULL);
+        g_once_init_leave (&info, tmp);
+    }
+
+    return info;
+}
+
+G_DEFINE_TYPE (GstAmcOutputPool, gst_amc_output_pool, GST_TYPE_BUFFER_POOL);
+
+/* Releases the frame of @meta unless the codec was flushed or replaced
+ * meanwhile, in which case its index may have been handed out again */
+static gboolean
+gst_amc_output_pool_release_meta (GstAmcOutputPool * pool,
+            GstAmcOutputMeta * meta, gboolean render, gint64 delay, GError ** err)
+{
+    gboolean ret = TRUE;
+
+    g_mutex_lock (&pool->lock);
+    if (meta->dec && meta->generation == pool->generation) {
+        /* Both clocks are CLOCK_MONOTONIC, see amc_dec_render() */
+        if (render)
+            ret = amc_dec_render (meta->dec, &meta->frame, delay > 0 ?
+                        g_get_monotonic_time () * 1000 + delay : 0,
+                        err) == AMC_DEC_OK;
+        else
+            ret = amc_dec_release (meta->dec, &meta->frame, err) == AMC_DEC_OK;
+    }
+    meta->dec = NULL;
+    g_mutex_unlock (&pool->lock);
+
+    return ret;
+}
+
+static GstFlowReturn
+gst_amc_output_pool_alloc_buffer (GstBufferPool * pool, GstBuffer ** buffer,
+            GstBufferPoolAcquireParams * params)
+{
+    GstMeta *meta;
+
+    *buffer = gst_buffer_new ();
+    meta = gst_buffer_add_meta (*buffer, GST_AMC_OUTPUT_META_INFO, NULL);
+    /* Stays with the buffer when it is recycled */
+    GST_META_FLAG_SET (meta, GST_META_FLAG_POOLED);
+
+    return GST_FLOW_OK;
+}
+
+/* Output dropped without being rendered goes back to the codec */
+static void
+gst_amc_output_pool_reset_buffer (GstBufferPool * pool, GstBuffer * buffer)
+{
+    GstAmcOutputMeta *meta = gst_buffer_get_amc_output_meta (buffer);
+    GError *err = NULL;
+
+    if (meta && !gst_amc_output_pool_release_meta (GST_AMC_OUTPUT_POOL (pool),
+                    meta, FALSE, 0, &err)) {
+        GST_ERROR_OBJECT (pool, "Release output buffer fail: %s", err->message);
+        g_clear_error (&err);
+    }
+
+    GST_BUFFER_POOL_CLASS (gst_amc_output_pool_parent_class)->reset_buffer (pool, buffer);
+}
+
+static void
+gst_amc_output_pool_finalize (GObject * obj)
+{
+    GstAmcOutputPool *pool = GST_AMC_OUTPUT_POOL (obj);
+
+    g_mutex_clear (&pool->lock);
+
+    G_OBJECT_CLASS (gst_amc_output_pool_parent_class)->finalize (obj);
+}
+
+static void
+gst_amc_output_pool_class_init (GstAmcOutputPoolClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+    GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+    gobject_class->finalize = gst_amc_output_pool_finalize;
+
+    pool_class->alloc_buffer = gst_amc_output_pool_alloc_buffer;
+    pool_class->reset_buffer = gst_amc_output_pool_reset_buffer;
+}
+
+static void
+gst_amc_output_pool_init (GstAmcOutputPool * pool)
+{
+    g_mutex_init (&pool->lock);
+}
+
+/* @min_buffers are allocated up front, the pool grows to the number of
+ * output buffers of the codec as needed */
+GstBufferPool *
+gst_amc_output_pool_new (guint min_buffers)
+{
+    GstBufferPool *pool;
+    GstStructure *config;
+
+    pool = g_object_new (GST_TYPE_AMC_OUTPUT_POOL, NULL);
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, NULL, 0, min_buffers, 0);
+    if (!gst_buffer_pool_set_config (pool, config))
+        GST_WARNING_OBJECT (pool, "Failed to configure output pool");
+
+    return pool;
+}
+
+/* Wraps @frame pulled from @dec, the pool must be active */
+GstBuffer *
+gst_amc_output_pool_acquire (GstAmcOutputPool * pool, AmcDec * dec,
+            const AmcDecFrame * frame)
+{
+    GstAmcOutputMeta *meta;
+    GstBuffer *buffer;
+
+    g_return_val_if_fail (GST_IS_AMC_OUTPUT_POOL (pool), NULL);
+
+    if (gst_buffer_pool_acquire_buffer (GST_BUFFER_POOL (pool), &buffer,
+                    NULL) != GST_FLOW_OK)
+        return NULL;
+
+    meta = gst_buffer_get_amc_output_meta (buffer);
+    g_mutex_lock (&pool->lock);
+    meta->dec = dec;
+    meta->frame = *frame;
+    meta->generation = pool->generation;
+    g_mutex_unlock (&pool->lock);
+
+    return buffer;
+}
+
+/* Must be called before the codec is flushed, stopped or freed. Frames
+ * handed out so far are never released from then on */
+void
+gst_amc_output_pool_invalidate (GstAmcOutputPool * pool)
+{
+    g_return_if_fail (GST_IS_AMC_OUTPUT_POOL (pool));
+
+    g_mutex_lock (&pool->lock);
+    pool->generation++;
+    g_mutex_unlock (&pool->lock);
+}
+
+/* Releases the output buffer wrapped by @buffer, rendering it at @delay
+ * if @render. Does nothing for buffers not from an output pool or
+ * released already */
+gboolean
+gst_amc_output_buffer_release (GstBuffer * buffer, gboolean render,
+            gint64 delay, GError ** err)
+{
+    GstAmcOutputMeta *meta = gst_buffer_get_amc_output_meta (buffer);
+    GstBufferPool *pool = buffer->pool;
+
+    if (!meta || !pool || !GST_IS_AMC_OUTPUT_POOL (pool))
+        return TRUE;
+
+    return gst_amc_output_pool_release_meta (GST_AMC_OUTPUT_POOL (pool), meta,
+                render, delay, err);
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
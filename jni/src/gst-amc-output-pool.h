@@ -0,0 +1,78 @@
+/*
+ ============================================================================
+ Name        : gst-amc-output-pool.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_OUTPUT_POOL_H__
+#define __GST_AMC_OUTPUT_POOL_H__
+
+#include <gst/gst.h>
+
+#include "amcdec.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_AMC_OUTPUT_POOL (gst_amc_output_pool_get_type ())
+#define GST_AMC_OUTPUT_POOL(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_AMC_OUTPUT_POOL, GstAmcOutputPool))
+#define GST_IS_AMC_OUTPUT_POOL(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_AMC_OUTPUT_POOL))
+
+#define GST_AMC_OUTPUT_META_API_TYPE (gst_amc_output_meta_api_get_type ())
+#define GST_AMC_OUTPUT_META_INFO (gst_amc_output_meta_get_info ())
+#define gst_buffer_get_amc_output_meta(b) \
+    ((GstAmcOutputMeta *) gst_buffer_get_meta ((b), GST_AMC_OUTPUT_META_API_TYPE))
+
+typedef struct _GstAmcOutputMeta GstAmcOutputMeta;
+typedef struct _GstAmcOutputPool GstAmcOutputPool;
+typedef struct _GstAmcOutputPoolClass GstAmcOutputPoolClass;
+
+/* A codec output buffer rendered to the surface the codec was
+ * configured with, carried by video/x-amc-direct buffers */
+struct _GstAmcOutputMeta
+{
+    GstMeta meta;
+
+    /* NULL once released */
+    AmcDec *dec;
+    AmcDecFrame frame;
+    /* Generation of the pool the index is valid in */
+    guint generation;
+};
+
+/* Recycles buffers with a GstAmcOutputMeta, so handing output buffers
+ * to amcsink allocates nothing in steady state */
+struct _GstAmcOutputPool
+{
+    GstBufferPool parent_instance;
+
+    /* < private > */
+    GMutex lock;
+    guint generation;
+};
+
+struct _GstAmcOutputPoolClass
+{
+    GstBufferPoolClass parent_class;
+};
+
+GType gst_amc_output_meta_api_get_type (void);
+const GstMetaInfo * gst_amc_output_meta_get_info (void);
+
+GType gst_amc_output_pool_get_type (void);
+
+GstBufferPool * gst_amc_output_pool_new (guint min_buffers);
+GstBuffer * gst_amc_output_pool_acquire (GstAmcOutputPool *pool, AmcDec *dec, const AmcDecFrame *frame);
+void gst_amc_output_pool_invalidate (GstAmcOutputPool *pool);
+
+gboolean gst_amc_output_buffer_release (GstBuffer *buffer, gboolean render, gint64 delay, GError **err);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_OUTPUT_POOL_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,269 @@
+/*
+ ============================================================================
+ Name        : gst-amc-shared-codec.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include "gst-amc-shared-codec.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+/* A codec session time-shared by all streams of a MIME type. Streams
+ * take turns decoding closed GOPs on it, each one followed by a flush,
+ * so they never see each other's reference frames. Turns are granted
+ * in the order they were asked for */
+struct _GstAmcSharedCodec
+{
+    gint ref_count;
+    gchar *mime;
+
+    GMutex lock;
+    GCond cond;
+    /* TRUE while a stream has its turn, with the lock */
+    gboolean busy;
+    /* Streams waiting for their turn, with the lock */
+    GQueue waiters;
+
+    /* Owned by the stream having its turn */
+    GstAmcCodec *codec;
+    /* A single worker configured for @config */
+    GstAmcGopPool *pool;
+    gchar *config;
+};
+
+typedef struct
+{
+    gboolean granted;
+} GstAmcSharedCodecWaiter;
+
+G_LOCK_DEFINE_STATIC (sessions);
+static GHashTable *sessions;
+
+/* Returns the session for @mime, creating its codec on first use */
+GstAmcSharedCodec *
+gst_amc_shared_codec_get (const gchar *mime, GError **err)
+{
+    GstAmcSharedCodec *shared;
+
+    g_return_val_if_fail (mime != NULL, NULL);
+
+    G_LOCK (sessions);
+    if (!sessions)
+        sessions = g_hash_table_new (g_str_hash, g_str_equal);
+
+    shared = g_hash_table_lookup (sessions, mime);
+    if (!shared) {
+        GstAmcCodec *codec;
+
+        /* Counted against the budget like any other decoder */
+        codec = gst_amc_decoder_new_with_budget (mime, 0, 0,
+                    GST_AMC_SESSION_PRIORITY_NORMAL, TRUE, NULL, NULL, err);
+        if (!codec) {
+            G_UNLOCK (sessions);
+            return NULL;
+        }
+
+        shared = g_slice_new0 (GstAmcSharedCodec);
+        shared->mime = g_strdup (mime);
+        shared->codec = codec;
+        g_mutex_init (&shared->lock);
+        g_cond_init (&shared->cond);
+        g_queue_init (&shared->waiters);
+        g_hash_table_insert (sessions, shared->mime, shared);
+        GST_INFO ("Created shared %s session", mime);
+    }
+    shared->ref_count++;
+    G_UNLOCK (sessions);
+
+    return shared;
+}
+
+static void
+gst_amc_shared_codec_stop (GstAmcSharedCodec *shared)
+{
+    GError *err = NULL;
+
+    if (!shared->pool)
+        return;
+
+    /* The pool borrows the codec, stopping it is up to us */
+    gst_amc_gop_pool_free (shared->pool);
+    shared->pool = NULL;
+    g_free (shared->config);
+    shared->config = NULL;
+
+    if (!gst_amc_codec_stop (shared->codec, &err)) {
+        GST_WARNING ("Failed to stop shared %s codec: %s", shared->mime,
+                    err->message);
+        g_clear_error (&err);
+    }
+}
+
+void
+gst_amc_shared_codec_unref (GstAmcSharedCodec *shared)
+{
+    GError *err = NULL;
+
+    g_return_if_fail (shared != NULL);
+
+    G_LOCK (sessions);
+    if (--shared->ref_count > 0) {
+        G_UNLOCK (sessions);
+        return;
+    }
+    g_hash_table_remove (sessions, shared->mime);
+    G_UNLOCK (sessions);
+
+    GST_INFO ("Releasing shared %s session", shared->mime);
+    gst_amc_shared_codec_stop (shared);
+    gst_amc_codec_release (shared->codec, &err);
+    if (err) {
+        GST_WARNING ("Failed to release shared %s codec: %s", shared->mime,
+                    err->message);
+        g_clear_error (&err);
+    }
+    gst_amc_codec_free (shared->codec);
+
+    g_mutex_clear (&shared->lock);
+    g_cond_clear (&shared->cond);
+    g_free (shared->mime);
+    g_slice_free (GstAmcSharedCodec, shared);
+}
+
+/* Waits for the turn of the calling stream, which ends with
+ * gst_amc_shared_codec_release(). Returns FALSE without a turn once
+ * @flushing is set, followed by gst_amc_shared_codec_wakeup() */
+gboolean
+gst_amc_shared_codec_acquire (GstAmcSharedCodec *shared, const gint *flushing)
+{
+    GstAmcSharedCodecWaiter waiter = { FALSE };
+
+    g_return_val_if_fail (shared != NULL, FALSE);
+
+    g_mutex_lock (&shared->lock);
+    if (!shared->busy) {
+        shared->busy = TRUE;
+        g_mutex_unlock (&shared->lock);
+        return TRUE;
+    }
+
+    g_queue_push_tail (&shared->waiters, &waiter);
+    while (!waiter.granted && !g_atomic_int_get (flushing))
+        g_cond_wait (&shared->cond, &shared->lock);
+    if (!waiter.granted)
+        g_queue_remove (&shared->waiters, &waiter);
+    g_mutex_unlock (&shared->lock);
+
+    return waiter.granted;
+}
+
+/* Ends the turn of the calling stream, handing the codec over to the
+ * next one waiting. A codec that @failed is stopped first, the next
+ * stream doesn't trust it and starts over */
+void
+gst_amc_shared_codec_release (GstAmcSharedCodec *shared, gboolean failed)
+{
+    GstAmcSharedCodecWaiter *waiter;
+
+    g_return_if_fail (shared != NULL);
+
+    if (failed)
+        gst_amc_shared_codec_stop (shared);
+
+    g_mutex_lock (&shared->lock);
+    waiter = g_queue_pop_head (&shared->waiters);
+    if (waiter)
+        waiter->granted = TRUE;
+    else
+        shared->busy = FALSE;
+    g_cond_broadcast (&shared->cond);
+    g_mutex_unlock (&shared->lock);
+}
+
+/* Makes the streams waiting for their turn check their flushing flag */
+void
+gst_amc_shared_codec_wakeup (GstAmcSharedCodec *shared)
+{
+    g_return_if_fail (shared != NULL);
+
+    g_mutex_lock (&shared->lock);
+    g_cond_broadcast (&shared->cond);
+    g_mutex_unlock (&shared->lock);
+}
+
+/* Returns the pool to decode on during the turn of the calling stream.
+ * The codec is reconfigured with @format first if the last GOP was
+ * decoded for another @config, i.e. another resolution or codec data,
+ * in which case @switch_time is set to the time that took. The pool is
+ * never flushing, GOPs pushed come back once decoded */
+GstAmcGopPool *
+gst_amc_shared_codec_configure (GstAmcSharedCodec *shared, const gchar *config,
+            GstAmcFormat *format, GstClockTime *switch_time, GError **err)
+{
+    gint64 start;
+
+    g_return_val_if_fail (shared != NULL, NULL);
+    g_return_val_if_fail (config != NULL, NULL);
+
+    *switch_time = GST_CLOCK_TIME_NONE;
+
+    if (g_strcmp0 (config, shared->config) == 0)
+        return shared->pool;
+
+    start = g_get_monotonic_time ();
+    gst_amc_shared_codec_stop (shared);
+    shared->pool = gst_amc_gop_pool_new (shared->codec, shared->mime,
+                format, 1, err);
+    if (!shared->pool)
+        return NULL;
+    shared->config = g_strdup (config);
+
+    *switch_time = (g_get_monotonic_time () - start) * GST_USECOND;
+    GST_DEBUG ("Switched shared %s codec to %s in %" GST_TIME_FORMAT,
+                shared->mime, config, GST_TIME_ARGS (*switch_time));
+
+    return shared->pool;
+}
+
+/* Decodes @gop in a turn of its own, see gst_amc_shared_codec_acquire()
+ * and gst_amc_shared_codec_configure(). Decoding errors are returned in
+ * the GOP. FALSE means the codec couldn't be configured, or without @err
+ * set, that @flushing was set while waiting */
+gboolean
+gst_amc_shared_codec_decode (GstAmcSharedCodec *shared, const gint *flushing,
+            const gchar *config, GstAmcFormat *format, GstAmcGop *gop,
+            GstClockTime *switch_time, GError **err)
+{
+    GstAmcGopPool *pool;
+    GstAmcGop *done;
+
+    g_return_val_if_fail (shared != NULL, FALSE);
+    g_return_val_if_fail (gop != NULL, FALSE);
+
+    *switch_time = GST_CLOCK_TIME_NONE;
+
+    if (!gst_amc_shared_codec_acquire (shared, flushing))
+        return FALSE;
+
+    pool = gst_amc_shared_codec_configure (shared, config, format, switch_time, err);
+    if (!pool) {
+        gst_amc_shared_codec_release (shared, FALSE);
+        return FALSE;
+    }
+
+    gst_amc_gop_pool_push (pool, gop);
+    done = gst_amc_gop_pool_pop (pool);
+    g_assert (done == gop);
+
+    gst_amc_shared_codec_release (shared, gop->error != NULL);
+
+    return TRUE;
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : gst-amc-shared-codec.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_SHARED_CODEC_H__
+#define __GST_AMC_SHARED_CODEC_H__
+
+#include <gst/gst.h>
+
+#include "gst-amc.h"
+#include "gst-amc-gop-pool.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstAmcSharedCodec GstAmcSharedCodec;
+
+GstAmcSharedCodec * gst_amc_shared_codec_get (const gchar *mime, GError **err);
+void gst_amc_shared_codec_unref (GstAmcSharedCodec *shared);
+
+gboolean gst_amc_shared_codec_acquire (GstAmcSharedCodec *shared,
+            const gint *flushing);
+GstAmcGopPool * gst_amc_shared_codec_configure (GstAmcSharedCodec *shared,
+            const gchar *config, GstAmcFormat *format, GstClockTime *switch_time,
+            GError **err);
+void gst_amc_shared_codec_release (GstAmcSharedCodec *shared, gboolean failed);
+void gst_amc_shared_codec_wakeup (GstAmcSharedCodec *shared);
+
+gboolean gst_amc_shared_codec_decode (GstAmcSharedCodec *shared,
+            const gint *flushing, const gchar *config, GstAmcFormat *format,
+            GstAmcGop *gop, GstClockTime *switch_time, GError **err);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_SHARED_CODEC_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -12,7 +12,7 @@
 #include "gst-amc.h"
 
 #define PACKAGE "gstamcsink"
-#define VERSION "0.0.1"
+#define VERSION GST_AMC_VERSION
 
 static gboolean plugin_init (GstPlugin *);
 
@@ -38,6 +38,10 @@ plugin_init (GstPlugin *plugin)
                     GST_RANK_NONE, GST_TYPE_AMC_VIDEO_SINK))
       return FALSE;
 
+    if (!gst_element_register (plugin, "amcvideodecoder",
+                    GST_RANK_NONE, GST_TYPE_AMC_VIDEO_DECODER))
+      return FALSE;
+
     return TRUE;
 }
 
@@ -14,6 +14,7 @@
 #include <gst/gst.h>
 
 #include "gst-amc-video-sink.h"
+#include "gst-amc-video-decoder.h"
 
 #endif /* __GST_AMC_SINK_PLUGIN_H__ */
 
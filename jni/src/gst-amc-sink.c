@@ -9,12 +9,37 @@
  */
 
 #include "gst-amc-sink.h"
+#include "gst-amc-output-pool.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_amc_sink_debug);
 #define GST_CAT_DEFAULT gst_amc_sink_debug
 
+enum
+{
+    PROP_ZERO,
+    PROP_RENDER_AHEAD,
+    PROP_CATCH_UP_OFFSET,
+    N_PROPERTIES
+};
+
+#define DEFAULT_RENDER_AHEAD (40 * GST_MSECOND)
+
+#define GST_AMC_SINK_GET_PRIVATE(obj) (gst_amc_sink_get_instance_private(obj))
+
+typedef struct _GstAmcSinkPrivate GstAmcSinkPrivate;
+
+struct _GstAmcSinkPrivate
+{
+    /* Both protected by the object lock */
+    GstClockTime render_ahead;
+    /* Extra render-ahead requested by the decoder to catch up
+     * with the live edge */
+    GstClockTime catch_up_offset;
+};
+
 static gboolean gst_amc_sink_start (GstBaseSink *base_sink);
 static gboolean gst_amc_sink_stop (GstBaseSink *base_sink);
+static gboolean gst_amc_sink_event (GstBaseSink *base_sink, GstEvent *event);
 static void gst_amc_sink_get_times (GstBaseSink * base_sink, GstBuffer * buf,
             GstClockTime * start, GstClockTime * end);
 static GstFlowReturn gst_amc_sink_render (GstBaseSink *base_sink,
@@ -27,9 +52,8 @@ GST_STATIC_PAD_TEMPLATE (
             GST_PAD_ALWAYS,
             GST_STATIC_CAPS ("video/x-amc-direct"));
 
-#define PTS_DELTA (40 * GST_MSECOND)
 #define gst_amc_sink_parent_class parent_class
-G_DEFINE_TYPE (GstAmcSink, gst_amc_sink, GST_TYPE_BASE_SINK);
+G_DEFINE_TYPE_WITH_PRIVATE (GstAmcSink, gst_amc_sink, GST_TYPE_BASE_SINK);
 
 static void
 gst_amc_sink_dispose (GObject *obj)
@@ -55,6 +79,49 @@ gst_amc_sink_constructed (GObject *obj)
     G_OBJECT_CLASS (parent_class)->constructed (obj);
 }
 
+static void
+gst_amc_sink_set_property (GObject *obj, guint prop_id,
+            const GValue *value, GParamSpec *pspec)
+{
+    GstAmcSink *self = GST_AMC_SINK (obj);
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (self);
+
+    switch (prop_id) {
+    case PROP_RENDER_AHEAD:
+        GST_OBJECT_LOCK (self);
+        priv->render_ahead = g_value_get_uint64 (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_amc_sink_get_property (GObject *obj, guint prop_id,
+            GValue *value, GParamSpec *pspec)
+{
+    GstAmcSink *self = GST_AMC_SINK (obj);
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (self);
+
+    switch (prop_id) {
+    case PROP_RENDER_AHEAD:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, priv->render_ahead);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_CATCH_UP_OFFSET:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, priv->catch_up_offset);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+        break;
+    }
+}
+
 static void
 gst_amc_sink_class_init (GstAmcSinkClass *klass)
 {
@@ -66,9 +133,26 @@ gst_amc_sink_class_init (GstAmcSinkClass *klass)
     obj_class->constructed = gst_amc_sink_constructed;
     obj_class->dispose = gst_amc_sink_dispose;
     obj_class->finalize = gst_amc_sink_finalize;
+    obj_class->set_property = gst_amc_sink_set_property;
+    obj_class->get_property = gst_amc_sink_get_property;
+
+    g_object_class_install_property (obj_class, PROP_RENDER_AHEAD,
+            g_param_spec_uint64 ("render-ahead", "Render ahead",
+                "How long before their timestamp frames are handed to the codec "
+                "for rendering (in nanoseconds)",
+                0, G_MAXUINT64, DEFAULT_RENDER_AHEAD,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (obj_class, PROP_CATCH_UP_OFFSET,
+            g_param_spec_uint64 ("catch-up-offset", "Catch-up offset",
+                "How much earlier than their timestamp frames are shown to "
+                "catch up with the live edge (in nanoseconds)",
+                0, G_MAXUINT64, 0,
+                G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
     base_sink_class->start = GST_DEBUG_FUNCPTR (gst_amc_sink_start);
     base_sink_class->stop = GST_DEBUG_FUNCPTR (gst_amc_sink_stop);
+    base_sink_class->event = GST_DEBUG_FUNCPTR (gst_amc_sink_event);
     base_sink_class->get_times = GST_DEBUG_FUNCPTR (gst_amc_sink_get_times);
     base_sink_class->render = GST_DEBUG_FUNCPTR (gst_amc_sink_render);
     base_sink_class->preroll = GST_DEBUG_FUNCPTR (gst_amc_sink_render);
@@ -86,6 +170,9 @@ gst_amc_sink_class_init (GstAmcSinkClass *klass)
 static void
 gst_amc_sink_init (GstAmcSink *self)
 {
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (self);
+
+    priv->render_ahead = DEFAULT_RENDER_AHEAD;
     gst_base_sink_set_max_lateness (GST_BASE_SINK (self), 80 * GST_MSECOND);
     gst_base_sink_set_qos_enabled (GST_BASE_SINK (self), TRUE);
 }
@@ -99,15 +186,56 @@ gst_amc_sink_start (GstBaseSink *base_sink)
 static gboolean
 gst_amc_sink_stop (GstBaseSink *base_sink)
 {
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (GST_AMC_SINK (base_sink));
+
+    GST_OBJECT_LOCK (base_sink);
+    priv->catch_up_offset = 0;
+    GST_OBJECT_UNLOCK (base_sink);
+
     return TRUE;
 }
 
+static gboolean
+gst_amc_sink_event (GstBaseSink *base_sink, GstEvent *event)
+{
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (GST_AMC_SINK (base_sink));
+
+    /* Sent out of band by amcvideodecoder's catch-up controller */
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_DOWNSTREAM_OOB &&
+                gst_event_has_name (event, "amc-catch-up")) {
+        const GstStructure *s = gst_event_get_structure (event);
+        guint64 offset;
+
+        if (gst_structure_get_uint64 (s, "offset", &offset)) {
+            GST_DEBUG_OBJECT (base_sink, "Catch-up offset %" GST_TIME_FORMAT,
+                        GST_TIME_ARGS (offset));
+            GST_OBJECT_LOCK (base_sink);
+            priv->catch_up_offset = offset;
+            GST_OBJECT_UNLOCK (base_sink);
+        }
+        gst_event_unref (event);
+        return TRUE;
+    }
+
+    return GST_BASE_SINK_CLASS (parent_class)->event (base_sink, event);
+}
+
 static void
 gst_amc_sink_get_times (GstBaseSink * base_sink, GstBuffer * buf,
             GstClockTime * start, GstClockTime * end)
 {
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (GST_AMC_SINK (base_sink));
+    GstClockTime ahead;
+
+    GST_OBJECT_LOCK (base_sink);
+    ahead = priv->render_ahead + priv->catch_up_offset;
+    GST_OBJECT_UNLOCK (base_sink);
+
     if (GST_BUFFER_TIMESTAMP_IS_VALID (buf)) {
-        *start = GST_BUFFER_TIMESTAMP (buf) - PTS_DELTA;
+        if (GST_BUFFER_TIMESTAMP (buf) > ahead)
+            *start = GST_BUFFER_TIMESTAMP (buf) - ahead;
+        else
+            *start = 0;
         if (GST_BUFFER_DURATION_IS_VALID (buf))
             *end = *start + GST_BUFFER_DURATION (buf);
         else
@@ -120,26 +248,19 @@ gst_amc_sink_render (GstBaseSink *base_sink,
             GstBuffer *buffer)
 {
     GstAmcSink *self = GST_AMC_SINK (base_sink);
-    GstAmcSinkBufferData *buffer_data;
+    GstAmcSinkPrivate *priv = GST_AMC_SINK_GET_PRIVATE (self);
+    GstClockTime render_ahead;
     GError *error = NULL;
-    GstMapInfo map_info;
-
-    if (!gst_buffer_map (buffer, &map_info, GST_MAP_READ))
-      return GST_FLOW_ERROR;
-
-    buffer_data = (GstAmcSinkBufferData *) map_info.data;
-    if (buffer_data->codec) {
-        if (gst_amc_codec_release_output_buffer (buffer_data->codec,
-                        buffer_data->index, TRUE, PTS_DELTA, &error)) {
-            buffer_data->codec = NULL;
-        } else {
-            GST_ERROR_OBJECT (self, "Release output buffer fail: %s",
-                        error->message);
-            g_error_free (error);
-        }
-    }
 
-    gst_buffer_unmap (buffer, &map_info);
+    GST_OBJECT_LOCK (self);
+    render_ahead = priv->render_ahead;
+    GST_OBJECT_UNLOCK (self);
+
+    if (!gst_amc_output_buffer_release (buffer, TRUE, render_ahead, &error)) {
+        GST_ERROR_OBJECT (self, "Release output buffer fail: %s",
+                    error->message);
+        g_error_free (error);
+    }
 
     return GST_FLOW_OK;
 }
@@ -27,7 +27,6 @@ G_BEGIN_DECLS
 
 typedef struct _GstAmcSink GstAmcSink;
 typedef struct _GstAmcSinkClass GstAmcSinkClass;
-typedef struct _GstAmcSinkBufferData GstAmcSinkBufferData;
 
 struct _GstAmcSink
 {
@@ -39,12 +38,6 @@ struct _GstAmcSinkClass
     GstBaseSinkClass parent_class;
 };
 
-struct _GstAmcSinkBufferData
-{
-    GstAmcCodec *codec;
-    gint index;
-};
-
 GType gst_amc_sink_get_type (void);
 
 G_END_DECLS
@@ -0,0 +1,381 @@
+/*
+ ============================================================================
+ Name        : gst-amc-surface-texture.c
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#include "gst-amc-surface-texture.h"
+#include "gst-jni-utils.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_amc_debug);
+#define GST_CAT_DEFAULT gst_amc_debug
+
+static struct
+{
+    jclass klass;
+    jmethodID constructor;
+    jmethodID update_tex_image;
+    jmethodID get_transform_matrix;
+    jmethodID get_timestamp;
+    jmethodID set_on_frame_available_listener;
+    jmethodID release;
+} surface_texture;
+
+/* Shipped with the application, see src/cc/hev/gst/amc/ */
+#define FRAME_LISTENER_CLASS "cc/hev/gst/amc/GstAmcOnFrameAvailableListener"
+
+static struct
+{
+    jclass klass;
+    jmethodID constructor;
+    jmethodID set_context;
+} frame_listener;
+
+static struct
+{
+    jclass klass;
+    jmethodID constructor;
+    jmethodID release;
+} surface;
+
+GstAmcSurfaceTexture *
+gst_amc_surface_texture_new (guint texture_id, GError **err)
+{
+    GstAmcSurfaceTexture *texture;
+    JNIEnv *env;
+
+    env = gst_amc_jni_get_env ();
+
+    texture = g_slice_new0 (GstAmcSurfaceTexture);
+
+    texture->texture = gst_amc_jni_new_object (env, err, TRUE,
+                surface_texture.klass, surface_texture.constructor,
+                (jint) texture_id);
+    if (!texture->texture)
+        goto error;
+
+    texture->surface = gst_amc_jni_new_object (env, err, TRUE,
+                surface.klass, surface.constructor, texture->texture);
+    if (!texture->surface)
+        goto error;
+
+    return texture;
+
+error:
+    gst_amc_surface_texture_free (texture);
+    return NULL;
+}
+
+void
+gst_amc_surface_texture_free (GstAmcSurfaceTexture *texture)
+{
+    JNIEnv *env;
+    GError *err = NULL;
+
+    g_return_if_fail (texture != NULL);
+
+    env = gst_amc_jni_get_env ();
+
+    if (texture->listener) {
+        /* Waits for a callback in progress, the method is synchronized */
+        if (!gst_amc_jni_call_void_method (env, &err, texture->listener,
+                        frame_listener.set_context, (jlong) 0)) {
+            GST_WARNING ("Failed to clear listener context: %s", err->message);
+            g_clear_error (&err);
+        }
+        if (!gst_amc_jni_call_void_method (env, &err, texture->texture,
+                        surface_texture.set_on_frame_available_listener, NULL)) {
+            GST_WARNING ("Failed to unset frame listener: %s", err->message);
+            g_clear_error (&err);
+        }
+        gst_amc_jni_object_unref (env, texture->listener);
+    }
+
+    if (texture->surface) {
+        if (!gst_amc_jni_call_void_method (env, &err, texture->surface,
+                        surface.release)) {
+            GST_WARNING ("Failed to release surface: %s", err->message);
+            g_clear_error (&err);
+        }
+        gst_amc_jni_object_unref (env, texture->surface);
+    }
+
+    if (texture->texture) {
+        if (!gst_amc_jni_call_void_method (env, &err, texture->texture,
+                        surface_texture.release)) {
+            GST_WARNING ("Failed to release surface texture: %s", err->message);
+            g_clear_error (&err);
+        }
+        gst_amc_jni_object_unref (env, texture->texture);
+    }
+
+    g_slice_free (GstAmcSurfaceTexture, texture);
+}
+
+jobject
+gst_amc_surface_texture_get_surface (GstAmcSurfaceTexture *texture)
+{
+    g_return_val_if_fail (texture != NULL, NULL);
+
+    return texture->surface;
+}
+
+/* Must be called from the thread the GL context is current in */
+gboolean
+gst_amc_surface_texture_update_tex_image (GstAmcSurfaceTexture *texture,
+            GError **err)
+{
+    JNIEnv *env;
+
+    g_return_val_if_fail (texture != NULL, FALSE);
+
+    env = gst_amc_jni_get_env ();
+
+    return gst_amc_jni_call_void_method (env, err, texture->texture,
+                surface_texture.update_tex_image);
+}
+
+gboolean
+gst_amc_surface_texture_get_transform_matrix (GstAmcSurfaceTexture *texture,
+            gfloat *matrix, GError **err)
+{
+    JNIEnv *env;
+    jfloatArray array;
+    gboolean ret = FALSE;
+
+    g_return_val_if_fail (texture != NULL, FALSE);
+    g_return_val_if_fail (matrix != NULL, FALSE);
+
+    env = gst_amc_jni_get_env ();
+
+    array = (*env)->NewFloatArray (env, 16);
+    if (!array) {
+        gst_amc_jni_set_error (env, err, GST_LIBRARY_ERROR,
+                    GST_LIBRARY_ERROR_FAILED, "Failed to create float array");
+        return FALSE;
+    }
+
+    if (!gst_amc_jni_call_void_method (env, err, texture->texture,
+                    surface_texture.get_transform_matrix, array))
+        goto done;
+
+    (*env)->GetFloatArrayRegion (env, array, 0, 16, (jfloat *) matrix);
+    if ((*env)->ExceptionCheck (env)) {
+        gst_amc_jni_set_error (env, err, GST_LIBRARY_ERROR,
+                    GST_LIBRARY_ERROR_FAILED, "Failed to get transform matrix");
+        goto done;
+    }
+
+    ret = TRUE;
+
+done:
+    gst_amc_jni_object_local_unref (env, array);
+
+    return ret;
+}
+
+gboolean
+gst_amc_surface_texture_get_timestamp (GstAmcSurfaceTexture *texture,
+            gint64 *timestamp, GError **err)
+{
+    JNIEnv *env;
+
+    g_return_val_if_fail (texture != NULL, FALSE);
+    g_return_val_if_fail (timestamp != NULL, FALSE);
+
+    env = gst_amc_jni_get_env ();
+
+    return gst_amc_jni_call_long_method (env, err, texture->texture,
+                surface_texture.get_timestamp, timestamp);
+}
+
+gboolean
+gst_amc_surface_texture_has_frame_listener (void)
+{
+    return frame_listener.klass != NULL;
+}
+
+gboolean
+gst_amc_surface_texture_set_on_frame_available_callback (GstAmcSurfaceTexture *texture,
+            GstAmcSurfaceTextureOnFrameAvailableCallback callback, gpointer user_data,
+            GError **err)
+{
+    JNIEnv *env;
+
+    g_return_val_if_fail (texture != NULL, FALSE);
+    g_return_val_if_fail (texture->listener == NULL, FALSE);
+
+    if (!frame_listener.klass) {
+        g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_INIT,
+                    "%s is not part of the application", FRAME_LISTENER_CLASS);
+        return FALSE;
+    }
+
+    env = gst_amc_jni_get_env ();
+
+    texture->callback = callback;
+    texture->user_data = user_data;
+
+    texture->listener = gst_amc_jni_new_object (env, err, TRUE,
+                frame_listener.klass, frame_listener.constructor);
+    if (!texture->listener)
+        return FALSE;
+
+    if (!gst_amc_jni_call_void_method (env, err, texture->listener,
+                    frame_listener.set_context, (jlong) (gintptr) texture))
+        goto error;
+
+    if (!gst_amc_jni_call_void_method (env, err, texture->texture,
+                    surface_texture.set_on_frame_available_listener,
+                    texture->listener))
+        goto error;
+
+    return TRUE;
+
+error:
+    gst_amc_jni_object_unref (env, texture->listener);
+    texture->listener = NULL;
+    return FALSE;
+}
+
+static void JNICALL
+on_frame_available (JNIEnv *env, jobject thiz, jlong context,
+            jobject surface_texture)
+{
+    GstAmcSurfaceTexture *texture = (GstAmcSurfaceTexture *) (gintptr) context;
+
+    /* Cleared before the texture is freed */
+    if (texture && texture->callback)
+        texture->callback (texture, texture->user_data);
+}
+
+static gboolean
+frame_listener_static_init (JNIEnv *env)
+{
+    static const JNINativeMethod methods[] = {
+        { "native_onFrameAvailable", "(JLandroid/graphics/SurfaceTexture;)V",
+            (void *) on_frame_available },
+    };
+    GError *err = NULL;
+
+    frame_listener.klass = gst_amc_jni_get_application_class (env, &err,
+                FRAME_LISTENER_CLASS);
+    if (!frame_listener.klass)
+        goto error;
+
+    frame_listener.constructor =
+        gst_amc_jni_get_method_id (env, &err, frame_listener.klass,
+                    "<init>", "()V");
+    if (!frame_listener.constructor)
+        goto error;
+
+    frame_listener.set_context =
+        gst_amc_jni_get_method_id (env, &err, frame_listener.klass,
+                    "setContext", "(J)V");
+    if (!frame_listener.set_context)
+        goto error;
+
+    if ((*env)->RegisterNatives (env, frame_listener.klass, methods,
+                    G_N_ELEMENTS (methods)) != JNI_OK) {
+        (*env)->ExceptionClear (env);
+        g_set_error (&err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_INIT,
+                    "Failed to register native methods");
+        goto error;
+    }
+
+    return TRUE;
+
+error:
+    GST_WARNING ("Frame listener not available, no GL output: %s",
+                err ? err->message : "unknown error");
+    g_clear_error (&err);
+    if (frame_listener.klass)
+        gst_amc_jni_object_unref (env, frame_listener.klass);
+    frame_listener.klass = NULL;
+    return FALSE;
+}
+
+gboolean
+gst_amc_surface_texture_static_init (void)
+{
+    JNIEnv *env;
+    GError *err = NULL;
+
+    env = gst_amc_jni_get_env ();
+
+    surface_texture.klass =
+        gst_amc_jni_get_class (env, &err, "android/graphics/SurfaceTexture");
+    if (!surface_texture.klass)
+        goto error;
+
+    surface_texture.constructor =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "<init>", "(I)V");
+    if (!surface_texture.constructor)
+        goto error;
+
+    surface_texture.update_tex_image =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "updateTexImage", "()V");
+    if (!surface_texture.update_tex_image)
+        goto error;
+
+    surface_texture.get_transform_matrix =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "getTransformMatrix", "([F)V");
+    if (!surface_texture.get_transform_matrix)
+        goto error;
+
+    surface_texture.get_timestamp =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "getTimestamp", "()J");
+    if (!surface_texture.get_timestamp)
+        goto error;
+
+    surface_texture.set_on_frame_available_listener =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "setOnFrameAvailableListener",
+                    "(Landroid/graphics/SurfaceTexture$OnFrameAvailableListener;)V");
+    if (!surface_texture.set_on_frame_available_listener)
+        goto error;
+
+    surface_texture.release =
+        gst_amc_jni_get_method_id (env, &err, surface_texture.klass,
+                    "release", "()V");
+    if (!surface_texture.release)
+        goto error;
+
+    surface.klass = gst_amc_jni_get_class (env, &err, "android/view/Surface");
+    if (!surface.klass)
+        goto error;
+
+    surface.constructor =
+        gst_amc_jni_get_method_id (env, &err, surface.klass,
+                    "<init>", "(Landroid/graphics/SurfaceTexture;)V");
+    if (!surface.constructor)
+        goto error;
+
+    surface.release =
+        gst_amc_jni_get_method_id (env, &err, surface.klass,
+                    "release", "()V");
+    if (!surface.release)
+        goto error;
+
+    /* Optional, only GL output depends on it */
+    frame_listener_static_init (env);
+
+    return TRUE;
+
+error:
+    GST_ERROR ("Failed to initialize surface texture: %s",
+                err ? err->message : "unknown error");
+    g_clear_error (&err);
+    return FALSE;
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
@@ -0,0 +1,56 @@
+/*
+ ============================================================================
+ Name        : gst-amc-surface-texture.h
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+#ifndef __GST_AMC_SURFACE_TEXTURE_H__
+#define __GST_AMC_SURFACE_TEXTURE_H__
+
+#include <jni.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstAmcSurfaceTexture GstAmcSurfaceTexture;
+
+/* Called from an arbitrary Java thread whenever a new image was queued */
+typedef void (*GstAmcSurfaceTextureOnFrameAvailableCallback) (GstAmcSurfaceTexture *texture,
+            gpointer user_data);
+
+struct _GstAmcSurfaceTexture
+{
+    /* < private > */
+    jobject texture; /* global reference */
+    jobject surface; /* global reference */
+    jobject listener; /* global reference */
+    GstAmcSurfaceTextureOnFrameAvailableCallback callback;
+    gpointer user_data;
+};
+
+GstAmcSurfaceTexture * gst_amc_surface_texture_new (guint texture_id, GError **err);
+void gst_amc_surface_texture_free (GstAmcSurfaceTexture *texture);
+
+jobject gst_amc_surface_texture_get_surface (GstAmcSurfaceTexture *texture);
+
+gboolean gst_amc_surface_texture_update_tex_image (GstAmcSurfaceTexture *texture, GError **err);
+gboolean gst_amc_surface_texture_get_transform_matrix (GstAmcSurfaceTexture *texture, gfloat *matrix, GError **err);
+gboolean gst_amc_surface_texture_get_timestamp (GstAmcSurfaceTexture *texture, gint64 *timestamp, GError **err);
+
+gboolean gst_amc_surface_texture_has_frame_listener (void);
+gboolean gst_amc_surface_texture_set_on_frame_available_callback (GstAmcSurfaceTexture *texture,
+            GstAmcSurfaceTextureOnFrameAvailableCallback callback, gpointer user_data,
+            GError **err);
+
+gboolean gst_amc_surface_texture_static_init (void);
+
+G_END_DECLS
+
+#endif /* __GST_AMC_SURFACE_TEXTURE_H__ */
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */
+
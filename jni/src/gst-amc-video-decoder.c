@@ -9,11 +9,21 @@
  */
 
 #include <string.h>
+#include <gst/base/gstadapter.h>
 #include <gst/video/videooverlay.h>
+#include <gst/gl/gl.h>
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/codecparsers/gsth265parser.h>
 
 #include "gst-amc-video-decoder.h"
-#include "gst-amc.h"
+#include "amcdec-private.h"
+#include "gst-amc-copy.h"
+#include "gst-amc-gop-pool.h"
+#include "gst-amc-nal-filter.h"
+#include "gst-amc-output-pool.h"
+#include "gst-amc-shared-codec.h"
 #include "gst-amc-sink.h"
+#include "gst-amc-surface-texture.h"
 #include "gst-jni-utils.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_amc_video_decoder_debug);
@@ -32,9 +42,113 @@ GST_DEBUG_CATEGORY_STATIC (gst_amc_video_decoder_debug);
 enum
 {
     PROP_ZERO,
+    PROP_OUTPUT_MODE,
+    PROP_MAX_RECOVERIES_PER_MINUTE,
+    PROP_WAIT_FOR_KEYFRAME,
+    PROP_WATCHDOG,
+    PROP_MAX_FRAMES_IN_FLIGHT,
+    PROP_LEAKY,
+    PROP_TARGET_LATENCY,
+    PROP_MAX_RENDER_AHEAD,
+    PROP_JUMP_THRESHOLD,
+    PROP_PARALLEL_GOPS,
+    PROP_THUMBNAIL_INTERVAL,
+    PROP_TIME_SHARE,
+    PROP_FOCUS,
+    PROP_ROTATE_METHOD,
+    PROP_SCALING_MODE,
+    PROP_PRIORITY,
+    PROP_FORMAT_OVERRIDES,
+    PROP_FORMAT_PRESETS,
+    PROP_HEADROOM_THRESHOLD,
+    PROP_STRIP_NAL,
+    PROP_KEEP_SEI,
+    PROP_LIVE_LATENCY,
+    PROP_CATCH_UP_STATE,
+    PROP_STATS,
     N_PROPERTIES
 };
 
+#define DEFAULT_OUTPUT_MODE GST_AMC_VIDEO_DECODER_OUTPUT_MODE_AUTO
+#define DEFAULT_MAX_RECOVERIES_PER_MINUTE 3
+#define DEFAULT_WAIT_FOR_KEYFRAME FALSE
+#define DEFAULT_WATCHDOG TRUE
+#define DEFAULT_MAX_FRAMES_IN_FLIGHT 0
+#define DEFAULT_LEAKY GST_AMC_VIDEO_DECODER_LEAKY_NONE
+#define DEFAULT_TARGET_LATENCY 0
+#define DEFAULT_MAX_RENDER_AHEAD (100 * GST_MSECOND)
+#define DEFAULT_JUMP_THRESHOLD GST_SECOND
+#define DEFAULT_PARALLEL_GOPS 1
+#define MAX_PARALLEL_GOPS 16
+#define DEFAULT_THUMBNAIL_INTERVAL 0
+#define DEFAULT_TIME_SHARE FALSE
+#define DEFAULT_FOCUS FALSE
+#define DEFAULT_ROTATE_METHOD GST_VIDEO_ORIENTATION_AUTO
+#define DEFAULT_SCALING_MODE GST_AMC_VIDEO_DECODER_SCALING_MODE_FIT
+#define DEFAULT_PRIORITY GST_AMC_VIDEO_DECODER_PRIORITY_DEFAULT
+#define DEFAULT_HEADROOM_THRESHOLD 0.2
+#define DEFAULT_STRIP_NAL GST_AMC_NAL_FILTER_NONE
+
+/* Render-ahead changes smaller than this aren't sent to the sink */
+#define CATCH_UP_OFFSET_STEP (5 * GST_MSECOND)
+#define CATCH_UP_REPORT_INTERVAL G_TIME_SPAN_SECOND
+
+/* Window over which the decoder load is measured and reported */
+#define LOAD_REPORT_INTERVAL G_TIME_SPAN_SECOND
+
+/* SEI payload types kept by default: user data (captions, HDR10+),
+ * recovery points and HDR metadata */
+static const guint default_keep_sei[] = { 4, 5, 6, 137, 144, 147 };
+
+/* Window over which the bytes saved by stripping NAL units are measured */
+#define STRIP_REPORT_INTERVAL G_TIME_SPAN_SECOND
+
+/* Output buffer wrappers allocated up front, more as the codec needs */
+#define OUTPUT_POOL_MIN_BUFFERS 8
+
+/* Window over which the time-shared refresh rate is measured */
+#define TIME_SHARE_REPORT_INTERVAL G_TIME_SPAN_SECOND
+
+/* The watchdog fires after this many frame durations on top of the
+ * reorder depth without output, but never before WATCHDOG_MIN_STALL */
+#define WATCHDOG_STALL_FRAMES 8
+#define WATCHDOG_MIN_STALL GST_SECOND
+
+/* Minimum interval between keyframe requests sent upstream */
+#define KEYFRAME_REQUEST_INTERVAL G_TIME_SPAN_SECOND
+
+/* Back-off before retrying a call that failed with a transient error,
+ * after failing for TRANSIENT_ERROR_MAX_DURATION the codec is reset */
+#define TRANSIENT_ERROR_RETRY_DELAY (10 * G_TIME_SPAN_MILLISECOND)
+#define TRANSIENT_ERROR_MAX_DURATION (500 * G_TIME_SPAN_MILLISECOND)
+
+typedef enum
+{
+    DROP_REASON_LATE,
+    DROP_REASON_NON_REFERENCE,
+    DROP_REASON_GOP_TAIL,
+    DROP_REASON_DISCONT,
+    DROP_REASON_RESET,
+    DROP_REASON_CATCH_UP,
+    DROP_REASON_THUMBNAIL,
+    DROP_REASON_BACKGROUND,
+    DROP_REASON_TIME_SHARE,
+    N_DROP_REASONS
+} DropReason;
+
+/* Field names in the stats structure */
+static const gchar *drop_reason_names[N_DROP_REASONS] = {
+    "dropped-late",
+    "dropped-non-reference",
+    "dropped-gop-tail",
+    "dropped-discont",
+    "dropped-reset",
+    "dropped-catch-up",
+    "dropped-thumbnail",
+    "dropped-background",
+    "dropped-time-share"
+};
+
 typedef struct _BufferIdentification BufferIdentification;
 typedef struct _GstAmcVideoDecoderPrivate GstAmcVideoDecoderPrivate;
 
@@ -43,13 +157,25 @@ typedef struct _GstAmcVideoDecoderPrivate GstAmcVideoDecoderPrivate;
 struct _BufferIdentification
 {
     guint64 timestamp;
+    /* Monotonic time the frame was queued to the codec */
+    gint64 queued_time;
 };
 
+/* Window surface changes the streaming thread still has to apply */
+typedef enum
+{
+    SURFACE_CHANGE_NONE,
+    /* The codec has to pick up the new surface */
+    SURFACE_CHANGE_PENDING,
+    /* The codec already renders to the new surface */
+    SURFACE_CHANGE_SWITCHED
+} SurfaceChange;
+
 struct _GstAmcVideoDecoderPrivate
 {
     GstAmcCodec *codec;
-    GstAmcBuffer *input_buffers;
-    gsize n_input_buffers;
+    /* Data flow of the started codec, NULL while it is stopped */
+    AmcDec *dec;
 
     GstVideoCodecState *input_state;
     gboolean input_state_changed;
@@ -75,18 +201,267 @@ struct _GstAmcVideoDecoderPrivate
 
     GstFlowReturn downstream_flow_ret;
 
+    /* Window surface set by the application, protected by the object lock */
     jobject surface;
+    /* Monotonic time the surface was set, protected by the object lock */
+    gint64 surface_set_time;
+    /* SurfaceChange for the streaming thread, accessed atomically */
+    guint surface_change;
+    /* Serializes setOutputSurface() from the application thread with the
+     * codec being configured, stopped or freed. Held only for codec calls,
+     * never while waiting for data flow */
+    GMutex window_lock;
+    /* TRUE while the codec renders to a window surface, with window_lock */
+    gboolean window_codec;
+    /* Rendered to while the window is gone on API 23+, with window_lock */
+    GstAmcSurfaceTexture *placeholder;
+    /* TRUE if the codec was stopped for a lost window or released for a
+     * preempting decoder, accessed atomically */
+    gint codec_stopped;
+    /* TRUE while the codec is configured and may be released for a
+     * preempting decoder, with window_lock */
+    gboolean codec_held;
 
     gint width;
     gint height;
+    gint fps_n;
+    gint fps_d;
+
+    /* Latency tracking */
+    GstH264NalParser *h264_parser;
+    GstH265Parser *h265_parser;
+    gint reorder_depth;
+    GstClockTime decode_time;
+    GstClockTime latency;
+    /* Since when, and the highest, estimate below the reported latency */
+    gint64 latency_lower_since;
+    GstClockTime latency_lower_max;
+
+    GstAmcVideoDecoderOutputMode output_mode;
+    /* TRUE if decoding into our own SurfaceTexture */
+    gboolean gl_output;
+    /* TRUE if copying frames out of the codec output buffers */
+    gboolean raw_output;
+    GstAmcBuffer *output_buffers;
+    gsize n_output_buffers;
+    GstAmcVideoLayout layout;
+    /* Last output format reported by the codec, if has_output_format */
+    GstAmcVideoOutputFormat output_format;
+    gboolean has_output_format;
+
+    GstGLDisplay *gl_display;
+    GstGLContext *gl_context;
+    GstGLContext *other_gl_context;
+    GstAmcSurfaceTexture *surface_texture;
+    guint gl_texture;
+    GError *gl_error;
+    /* Every latched image is drawn into its own texture from the pool,
+     * the next updateTexImage() would overwrite frames still queued */
+    GstBufferPool *gl_pool;
+    GstGLShader *gl_shader;
+    GstGLFramebuffer *gl_fbo;
+    /* Images queued by the codec and not latched yet, with gl_frame_lock */
+    GMutex gl_frame_lock;
+    GCond gl_frame_cond;
+    guint gl_frames_available;
+
+    /* Error recovery */
+    guint max_recoveries_per_minute;
+    /* Monotonic times of the recoveries within the last minute */
+    GArray *recovery_times;
+    /* TRUE if the codec must be reset before queueing more input */
+    gboolean pending_reset;
+    /* TRUE if input is dropped until the next sync frame */
+    gboolean needs_keyframe;
+    /* Monotonic time of the last keyframe request, 0 if none */
+    gint64 keyframe_request_time;
+    /* Why frames are dropped while waiting for a keyframe */
+    DropReason keyframe_wait_reason;
+    gboolean wait_for_keyframe;
+    /* Monotonic time of the error being recovered from, 0 if none */
+    gint64 recovery_start;
+    /* TRUE if the pending reset only needs to flush the codec */
+    gboolean reset_flush_only;
+    /* Monotonic time of a surface switch done by reconfiguring, 0 if none */
+    gint64 surface_switch_start;
+    /* TRUE if the codec was configured to render to a surface */
+    gboolean surface_configured;
+    /* TRUE while the window surface is gone, input is dropped meanwhile */
+    gboolean parked;
+
+    /* Stuck codec watchdog */
+    gboolean watchdog;
+    /* Monotonic time the codec last made progress */
+    gint64 last_progress_time;
+    /* TRUE if the watchdog flushed the codec and no output followed */
+    gboolean watchdog_flushed;
+
+    /* Frames queued to the codec but not output yet */
+    guint max_frames_in_flight;
+    GstAmcVideoDecoderLeaky leaky;
+    /* Signalled when the codec outputs a buffer */
+    GMutex in_flight_lock;
+    GCond in_flight_cond;
+
+    /* Subframe (alignment=nal) input */
+    gboolean partial_frames;
+    /* Slices of the current access unit without partial frame support */
+    GstAdapter *au_adapter;
+
+    /* Live-edge catch-up controller */
+    GstClockTime target_latency;
+    GstClockTime max_render_ahead;
+    GstClockTime jump_threshold;
+    /* Render-ahead last requested from the sink */
+    GstClockTime catch_up_offset;
+    gint64 catch_up_report_time;
+    /* Both protected by the object lock */
+    GstClockTime live_latency;
+    GstAmcVideoDecoderCatchUpState catch_up_state;
+
+    /* Wraps output buffers rendered by amcsink, always active */
+    GstBufferPool *output_pool;
+
+    /* Parallel GOP decoding, raw output only */
+    guint parallel_gops;
+    GstAmcGopPool *gop_pool;
+    /* GOP collecting input until the next sync frame */
+    GstAmcGop *gop;
+
+    /* Keyframe-only thumbnail extraction */
+    GstClockTime thumbnail_interval;
+    /* Earliest PTS of the next thumbnail, NONE for the next keyframe */
+    GstClockTime next_thumbnail;
+
+    /* Keyframe-only decoding on a codec session shared with the other
+     * time-sharing decoders of the MIME type, raw output only */
+    gboolean time_share;
+    GstAmcSharedCodec *shared_codec;
+    GstAmcFormat *shared_format;
+    /* Identifies the codec configuration among the sharing streams */
+    gchar *shared_config;
+    /* Full-rate decoding on the shared codec, with the object lock */
+    gboolean focus;
+    /* Open GOP of a focused stream, which has its turn on the shared
+     * codec until the GOP is closed at the next keyframe */
+    GstAmcGop *shared_gop;
+    GstAmcGopPool *shared_pool;
+    /* Interrupts waiting for a turn on the shared codec, accessed
+     * atomically */
+    gint shared_flushing;
+    gint64 refresh_window_start;
+    guint n_window_refreshes;
+
+    /* Set by the codec budget when a decoder of higher priority needs
+     * our hardware session, accessed atomically and cleared with
+     * window_lock held */
+    gint preempted;
+    /* Bumped with window_lock held whenever a codec is given up, so a
+     * late release thread leaves the next one alone, read atomically */
+    gint codec_generation;
+
+    /* Rendering to the window surface, both protected by the object lock */
+    GstVideoOrientationMethod rotate_method;
+    GstAmcVideoDecoderScalingMode scaling_mode;
+    /* Clockwise rotation from the image-orientation tag */
+    gint tag_rotation;
+    /* Rotation the codec was configured with */
+    gint rotation;
+
+    /* Codec clocking hints, the priority is protected by the object lock */
+    GstAmcVideoDecoderPriority priority;
+    /* Operating rate last passed to the codec, 0 if none */
+    gdouble operating_rate;
+
+    /* Decoder load, headroom below the threshold is signalled */
+    gdouble headroom_threshold;
+    gint64 load_window_start;
+    /* Time spent waiting for input slots in the window while the srcpad
+     * loop waited for output too, in microseconds */
+    gint64 load_starved;
+    /* Time the codec took to deliver the outputs of the window it had the
+     * input for, in microseconds, and their number */
+    gint64 load_busy;
+    guint load_outputs;
+    /* Monotonic time the srcpad loop started waiting for the next output,
+     * 0 while it is not waiting */
+    gint64 output_wait_start;
+    gboolean overloaded;
+
+    /* NAL units stripped from H.264 and H.265 input while copying it to
+     * the codec, both protected by the object lock */
+    GstAmcNalFilterFlags strip_nal;
+    guint8 keep_sei[(GST_AMC_NAL_FILTER_MAX_SEI_TYPE + 1) / 8];
+    /* Created for the MIME type once stripping is enabled */
+    GstAmcNalFilter *nal_filter;
+    gint64 strip_window_start;
+    guint64 strip_window_bytes;
+
+    /* Extra format keys, both protected by the object lock */
+    GstStructure *format_overrides;
+    gchar *format_presets;
+
+    /* Statistics, protected by the object lock */
+    guint n_recoveries;
+    GstClockTime time_to_recover;
+    guint n_stalls;
+    guint64 n_dropped[N_DROP_REASONS];
+    guint n_parallel_codecs;
+    guint n_surface_switches;
+    GstClockTime surface_switch_time;
+    gboolean software_codec;
+    guint n_preemptions;
+    guint n_time_share_switches;
+    GstClockTime time_share_switch_time;
+    gdouble refresh_rate;
+    gdouble decode_load;
+    gdouble input_starvation;
+    gdouble headroom;
+    guint64 n_stripped_bytes;
+    gdouble strip_rate;
+};
+
+typedef struct _GstAmcVideoDecoderGLFrame GstAmcVideoDecoderGLFrame;
+
+struct _GstAmcVideoDecoderGLFrame
+{
+    GstAmcVideoDecoder *self;
+    gint64 timestamp;
+    gint64 latched;
+    gfloat matrix[16];
+    GstBuffer *outbuf;
+    gboolean updated;
 };
 
+/* Every format a device codec may take, for the template until the codec
+ * cache is written. Narrowed down to those of the device's codecs on the
+ * pad, see gst_amc_video_decoder_get_device_caps() */
+static GstStaticPadTemplate gst_amc_video_decoder_sink_template =
+GST_STATIC_PAD_TEMPLATE (
+            "sink",
+            GST_PAD_SINK,
+            GST_PAD_ALWAYS,
+            GST_STATIC_CAPS ("video/x-h264, parsed = (boolean) true, "
+                    "stream-format = (string) byte-stream; "
+                "video/x-h265, parsed = (boolean) true, "
+                    "stream-format = (string) byte-stream; "
+                "video/mpeg, mpegversion = (int) { 1, 2, 4 }, "
+                    "systemstream = (boolean) false, parsed = (boolean) true; "
+                "video/x-divx, divxversion = (int) [ 3, 5 ], "
+                    "parsed = (boolean) true; "
+                "video/x-h263, variant = (string) itu, parsed = (boolean) true; "
+                "video/x-vp8; "
+                "video/x-vp9"));
+
 static GstStaticPadTemplate gst_amc_video_decoder_src_template =
 GST_STATIC_PAD_TEMPLATE (
             "src",
             GST_PAD_SRC,
             GST_PAD_ALWAYS,
-            GST_STATIC_CAPS ("video/x-amc-direct"));
+            GST_STATIC_CAPS ("video/x-amc-direct; "
+                GST_VIDEO_CAPS_MAKE_WITH_FEATURES (GST_CAPS_FEATURE_MEMORY_GL_MEMORY,
+                    "RGBA") ", texture-target = (string) 2D; "
+                GST_VIDEO_CAPS_MAKE ("{ I420, NV12 }")));
 
 static void gst_amc_video_decoder_video_overlay_init (gpointer iface, gpointer iface_data);
 
@@ -97,8 +472,6 @@ G_DEFINE_TYPE_WITH_CODE (GstAmcVideoDecoder, gst_amc_video_decoder,
                 gst_amc_video_decoder_video_overlay_init);
             G_ADD_PRIVATE (GstAmcVideoDecoder));
 
-extern void *orc_memcpy (void *dest, const void *src, size_t n);
-
 static GstStateChangeReturn
 gst_amc_video_decoder_change_state (GstElement * element, GstStateChange transition);
 
@@ -111,6 +484,130 @@ static gboolean gst_amc_video_decoder_flush (GstVideoDecoder * decoder);
 static GstFlowReturn gst_amc_video_decoder_handle_frame (GstVideoDecoder * decoder, GstVideoCodecFrame * frame);
 static GstFlowReturn gst_amc_video_decoder_finish (GstVideoDecoder * decoder);
 static GstFlowReturn gst_amc_video_decoder_drain (GstAmcVideoDecoder * self);
+static void gst_amc_video_decoder_set_property (GObject * object, guint prop_id,
+            const GValue * value, GParamSpec * pspec);
+static void gst_amc_video_decoder_get_property (GObject * object, guint prop_id,
+            GValue * value, GParamSpec * pspec);
+static void gst_amc_video_decoder_set_context (GstElement * element, GstContext * context);
+static gboolean gst_amc_video_decoder_src_query (GstVideoDecoder * decoder, GstQuery * query);
+static gboolean gst_amc_video_decoder_sink_event (GstVideoDecoder * decoder, GstEvent * event);
+static void gst_amc_video_decoder_update_rotation (GstAmcVideoDecoder * self);
+static void gst_amc_video_decoder_update_scaling_mode (GstAmcVideoDecoder * self);
+static void gst_amc_video_decoder_update_priority (GstAmcVideoDecoder * self);
+static GstAmcSessionPriority priority_to_session_priority (GstAmcVideoDecoderPriority priority);
+static void gst_amc_video_decoder_update_operating_rate (GstAmcVideoDecoder * self);
+static GstStructure * gst_amc_video_decoder_get_stats (GstAmcVideoDecoder * self);
+
+GType
+gst_amc_video_decoder_output_mode_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GEnumValue values[] = {
+        {GST_AMC_VIDEO_DECODER_OUTPUT_MODE_AUTO,
+            "Use GL output if downstream supports it and no window is set, "
+            "raw output if downstream supports neither GL nor amcsink", "auto"},
+        {GST_AMC_VIDEO_DECODER_OUTPUT_MODE_DIRECT,
+            "Render directly to the window surface", "direct"},
+        {GST_AMC_VIDEO_DECODER_OUTPUT_MODE_GL,
+            "Output RGBA GL textures", "gl"},
+        {GST_AMC_VIDEO_DECODER_OUTPUT_MODE_RAW,
+            "Output I420 or NV12 frames in system memory", "raw"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_enum_register_static ("GstAmcVideoDecoderOutputMode", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+GType
+gst_amc_video_decoder_leaky_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GEnumValue values[] = {
+        {GST_AMC_VIDEO_DECODER_LEAKY_NONE,
+            "Block upstream until the codec catches up", "none"},
+        {GST_AMC_VIDEO_DECODER_LEAKY_GOP,
+            "Drop non-reference frames, then the rest of the GOP", "gop"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_enum_register_static ("GstAmcVideoDecoderLeaky", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+GType
+gst_amc_video_decoder_catch_up_state_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GEnumValue values[] = {
+        {GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_IDLE,
+            "At or below the target latency", "idle"},
+        {GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_RENDER_AHEAD,
+            "Rendering early", "render-ahead"},
+        {GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_SKIP,
+            "Skipping non-reference frames", "skip"},
+        {GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_JUMP,
+            "Jumping to the next keyframe", "jump"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_enum_register_static ("GstAmcVideoDecoderCatchUpState", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+GType
+gst_amc_video_decoder_scaling_mode_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GEnumValue values[] = {
+        {GST_AMC_VIDEO_DECODER_SCALING_MODE_FIT,
+            "Scale to fit the surface", "fit"},
+        {GST_AMC_VIDEO_DECODER_SCALING_MODE_CROP,
+            "Scale to fill the surface, cropping the edges", "crop"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_enum_register_static ("GstAmcVideoDecoderScalingMode", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
+
+GType
+gst_amc_video_decoder_priority_get_type (void)
+{
+    static volatile gsize type = 0;
+    static const GEnumValue values[] = {
+        {GST_AMC_VIDEO_DECODER_PRIORITY_DEFAULT,
+            "Codec default", "default"},
+        {GST_AMC_VIDEO_DECODER_PRIORITY_REALTIME,
+            "Realtime, e.g. foreground playback", "realtime"},
+        {GST_AMC_VIDEO_DECODER_PRIORITY_BEST_EFFORT,
+            "Best effort, e.g. background processing", "best-effort"},
+        {0, NULL, NULL}
+    };
+
+    if (g_once_init_enter (&type)) {
+        GType tmp = g_enum_register_static ("GstAmcVideoDecoderPriority", values);
+        g_once_init_leave (&type, tmp);
+    }
+
+    return (GType) type;
+}
 
 static BufferIdentification *
 buffer_identification_new (GstClockTime timestamp)
@@ -118,6 +615,7 @@ buffer_identification_new (GstClockTime timestamp)
     BufferIdentification *id = g_slice_new (BufferIdentification);
 
     id->timestamp = timestamp;
+    id->queued_time = g_get_monotonic_time ();
 
     return id;
 }
@@ -137,14 +635,267 @@ gst_amc_video_decoder_finalize (GObject * object)
   g_mutex_clear (&priv->drain_lock);
   g_cond_clear (&priv->drain_cond);
 
+  gst_buffer_pool_set_active (priv->output_pool, FALSE);
+  gst_object_unref (priv->output_pool);
+  g_mutex_clear (&priv->in_flight_lock);
+  g_cond_clear (&priv->in_flight_cond);
+  g_mutex_clear (&priv->gl_frame_lock);
+  g_cond_clear (&priv->gl_frame_cond);
+  g_mutex_clear (&priv->window_lock);
+
   if (priv->surface) {
         JNIEnv *env = gst_amc_jni_get_env ();
         gst_amc_jni_object_unref (env, priv->surface);
   }
+  if (priv->placeholder)
+      gst_amc_surface_texture_free (priv->placeholder);
+
+  if (priv->h264_parser)
+      gst_h264_nal_parser_free (priv->h264_parser);
+  if (priv->h265_parser)
+      gst_h265_parser_free (priv->h265_parser);
+  if (priv->nal_filter)
+      gst_amc_nal_filter_free (priv->nal_filter);
+
+  if (priv->other_gl_context)
+      gst_object_unref (priv->other_gl_context);
+  if (priv->gl_display)
+      gst_object_unref (priv->gl_display);
+
+  g_array_free (priv->recovery_times, TRUE);
+  if (priv->format_overrides)
+      gst_structure_free (priv->format_overrides);
+  g_free (priv->format_presets);
+  g_object_unref (priv->au_adapter);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+static void
+gst_amc_video_decoder_set_property (GObject * object, guint prop_id,
+            const GValue * value, GParamSpec * pspec)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (object);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    switch (prop_id) {
+    case PROP_OUTPUT_MODE:
+        priv->output_mode = g_value_get_enum (value);
+        break;
+    case PROP_MAX_RECOVERIES_PER_MINUTE:
+        priv->max_recoveries_per_minute = g_value_get_uint (value);
+        break;
+    case PROP_WAIT_FOR_KEYFRAME:
+        priv->wait_for_keyframe = g_value_get_boolean (value);
+        break;
+    case PROP_WATCHDOG:
+        priv->watchdog = g_value_get_boolean (value);
+        break;
+    case PROP_MAX_FRAMES_IN_FLIGHT:
+        priv->max_frames_in_flight = g_value_get_uint (value);
+        break;
+    case PROP_LEAKY:
+        priv->leaky = g_value_get_enum (value);
+        break;
+    case PROP_TARGET_LATENCY:
+        priv->target_latency = g_value_get_uint64 (value);
+        break;
+    case PROP_MAX_RENDER_AHEAD:
+        priv->max_render_ahead = g_value_get_uint64 (value);
+        break;
+    case PROP_JUMP_THRESHOLD:
+        priv->jump_threshold = g_value_get_uint64 (value);
+        break;
+    case PROP_PARALLEL_GOPS:
+        priv->parallel_gops = g_value_get_uint (value);
+        break;
+    case PROP_THUMBNAIL_INTERVAL:
+        priv->thumbnail_interval = g_value_get_uint64 (value);
+        break;
+    case PROP_TIME_SHARE:
+        priv->time_share = g_value_get_boolean (value);
+        break;
+    case PROP_FOCUS:
+        GST_OBJECT_LOCK (self);
+        priv->focus = g_value_get_boolean (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_ROTATE_METHOD:
+        GST_OBJECT_LOCK (self);
+        priv->rotate_method = g_value_get_enum (value);
+        GST_OBJECT_UNLOCK (self);
+        gst_amc_video_decoder_update_rotation (self);
+        break;
+    case PROP_SCALING_MODE:
+        GST_OBJECT_LOCK (self);
+        priv->scaling_mode = g_value_get_enum (value);
+        GST_OBJECT_UNLOCK (self);
+        gst_amc_video_decoder_update_scaling_mode (self);
+        break;
+    case PROP_PRIORITY:
+        GST_OBJECT_LOCK (self);
+        priv->priority = g_value_get_enum (value);
+        GST_OBJECT_UNLOCK (self);
+        gst_amc_video_decoder_update_priority (self);
+        break;
+    case PROP_FORMAT_OVERRIDES:
+        GST_OBJECT_LOCK (self);
+        if (priv->format_overrides)
+            gst_structure_free (priv->format_overrides);
+        priv->format_overrides = g_value_dup_boxed (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_FORMAT_PRESETS:
+        GST_OBJECT_LOCK (self);
+        g_free (priv->format_presets);
+        priv->format_presets = g_value_dup_string (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_HEADROOM_THRESHOLD:
+        priv->headroom_threshold = g_value_get_double (value);
+        break;
+    case PROP_STRIP_NAL:
+        GST_OBJECT_LOCK (self);
+        priv->strip_nal = g_value_get_flags (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_KEEP_SEI:
+    {
+        guint i, type;
+
+        GST_OBJECT_LOCK (self);
+        memset (priv->keep_sei, 0, sizeof (priv->keep_sei));
+        for (i = 0; i < gst_value_array_get_size (value); i++) {
+            type = g_value_get_uint (gst_value_array_get_value (value, i));
+            priv->keep_sei[type / 8] |= 1 << (type % 8);
+        }
+        GST_OBJECT_UNLOCK (self);
+        break;
+    }
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_amc_video_decoder_get_property (GObject * object, guint prop_id,
+            GValue * value, GParamSpec * pspec)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (object);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    switch (prop_id) {
+    case PROP_OUTPUT_MODE:
+        g_value_set_enum (value, priv->output_mode);
+        break;
+    case PROP_MAX_RECOVERIES_PER_MINUTE:
+        g_value_set_uint (value, priv->max_recoveries_per_minute);
+        break;
+    case PROP_WAIT_FOR_KEYFRAME:
+        g_value_set_boolean (value, priv->wait_for_keyframe);
+        break;
+    case PROP_WATCHDOG:
+        g_value_set_boolean (value, priv->watchdog);
+        break;
+    case PROP_MAX_FRAMES_IN_FLIGHT:
+        g_value_set_uint (value, priv->max_frames_in_flight);
+        break;
+    case PROP_LEAKY:
+        g_value_set_enum (value, priv->leaky);
+        break;
+    case PROP_TARGET_LATENCY:
+        g_value_set_uint64 (value, priv->target_latency);
+        break;
+    case PROP_MAX_RENDER_AHEAD:
+        g_value_set_uint64 (value, priv->max_render_ahead);
+        break;
+    case PROP_JUMP_THRESHOLD:
+        g_value_set_uint64 (value, priv->jump_threshold);
+        break;
+    case PROP_PARALLEL_GOPS:
+        g_value_set_uint (value, priv->parallel_gops);
+        break;
+    case PROP_THUMBNAIL_INTERVAL:
+        g_value_set_uint64 (value, priv->thumbnail_interval);
+        break;
+    case PROP_TIME_SHARE:
+        g_value_set_boolean (value, priv->time_share);
+        break;
+    case PROP_FOCUS:
+        GST_OBJECT_LOCK (self);
+        g_value_set_boolean (value, priv->focus);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_ROTATE_METHOD:
+        GST_OBJECT_LOCK (self);
+        g_value_set_enum (value, priv->rotate_method);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_SCALING_MODE:
+        GST_OBJECT_LOCK (self);
+        g_value_set_enum (value, priv->scaling_mode);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_PRIORITY:
+        GST_OBJECT_LOCK (self);
+        g_value_set_enum (value, priv->priority);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_FORMAT_OVERRIDES:
+        GST_OBJECT_LOCK (self);
+        g_value_set_boxed (value, priv->format_overrides);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_FORMAT_PRESETS:
+        GST_OBJECT_LOCK (self);
+        g_value_set_string (value, priv->format_presets);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_HEADROOM_THRESHOLD:
+        g_value_set_double (value, priv->headroom_threshold);
+        break;
+    case PROP_STRIP_NAL:
+        GST_OBJECT_LOCK (self);
+        g_value_set_flags (value, priv->strip_nal);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_KEEP_SEI:
+    {
+        GValue type = G_VALUE_INIT;
+        guint i;
+
+        g_value_init (&type, G_TYPE_UINT);
+        GST_OBJECT_LOCK (self);
+        for (i = 0; i <= GST_AMC_NAL_FILTER_MAX_SEI_TYPE; i++) {
+            if (!(priv->keep_sei[i / 8] & (1 << (i % 8))))
+                continue;
+            g_value_set_uint (&type, i);
+            gst_value_array_append_value (value, &type);
+        }
+        GST_OBJECT_UNLOCK (self);
+        g_value_unset (&type);
+        break;
+    }
+    case PROP_LIVE_LATENCY:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, priv->live_latency);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_CATCH_UP_STATE:
+        GST_OBJECT_LOCK (self);
+        g_value_set_enum (value, priv->catch_up_state);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed (value, gst_amc_video_decoder_get_stats (self));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
 static const gchar *
 caps_to_mime (GstCaps *caps)
 {
@@ -179,6 +930,214 @@ caps_to_mime (GstCaps *caps)
     return "video/avc";
 }
 
+/* Frames a codec may hold back for reordering when the bitstream
+ * doesn't tell us */
+static gint
+mime_to_default_reorder_depth (const gchar *mime)
+{
+    if (strcmp (mime, "video/mpeg2") == 0 ||
+        strcmp (mime, "video/mp4v-es") == 0)
+        return 1;
+
+    return 0;
+}
+
+static gint
+h264_level_to_max_dpb_mbs (guint8 level_idc)
+{
+    static const struct
+    {
+        guint8 level;
+        gint max_dpb_mbs;
+    } h264_level_mapping_table[] = {
+        {9, 396}, {10, 396}, {11, 900}, {12, 2376}, {13, 2376},
+        {20, 2376}, {21, 4752}, {22, 8100}, {30, 8100}, {31, 18000},
+        {32, 20480}, {40, 32768}, {41, 32768}, {42, 34816},
+        {50, 110400}, {51, 184320}, {52, 184320}
+    };
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (h264_level_mapping_table); i++) {
+        if (h264_level_mapping_table[i].level == level_idc)
+            return h264_level_mapping_table[i].max_dpb_mbs;
+    }
+
+    return 696320;
+}
+
+static gint
+h264_sps_to_reorder_depth (GstH264SPS *sps)
+{
+    gint mbs, max_dpb_frames;
+
+    if (sps->vui_parameters_present_flag &&
+        sps->vui_parameters.bitstream_restriction_flag) {
+        if (sps->vui_parameters.num_reorder_frames <=
+            sps->vui_parameters.max_dec_frame_buffering)
+            return sps->vui_parameters.num_reorder_frames;
+        return sps->vui_parameters.max_dec_frame_buffering;
+    }
+
+    /* Baseline has no B-frames, everything else may use the whole DPB */
+    if (sps->profile_idc == 66)
+        return 0;
+
+    mbs = (sps->pic_width_in_mbs_minus1 + 1) *
+        (sps->pic_height_in_map_units_minus1 + 1) *
+        (2 - sps->frame_mbs_only_flag);
+    max_dpb_frames = h264_level_to_max_dpb_mbs (sps->level_idc) / MAX (mbs, 1);
+
+    return CLAMP (max_dpb_frames, 1, 16);
+}
+
+static gint
+h264_parse_reorder_depth (GstH264NalParser *parser, const guint8 *data, gsize size)
+{
+    GstH264ParserResult res;
+    GstH264NalUnit nalu;
+    gint depth = -1;
+
+    res = gst_h264_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H264_PARSER_OK || res == GST_H264_PARSER_NO_NAL_END) {
+        if (nalu.type == GST_H264_NAL_SPS) {
+            GstH264SPS sps;
+
+            if (gst_h264_parser_parse_sps (parser, &nalu, &sps) == GST_H264_PARSER_OK) {
+                depth = h264_sps_to_reorder_depth (&sps);
+                gst_h264_sps_clear (&sps);
+            }
+            break;
+        }
+        if (nalu.type == GST_H264_NAL_SLICE || nalu.type == GST_H264_NAL_SLICE_IDR)
+            break;
+        if (res == GST_H264_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h264_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return depth;
+}
+
+static gint
+h265_parse_reorder_depth (GstH265Parser *parser, const guint8 *data, gsize size)
+{
+    GstH265ParserResult res;
+    GstH265NalUnit nalu;
+    gint depth = -1;
+
+    res = gst_h265_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H265_PARSER_OK || res == GST_H265_PARSER_NO_NAL_END) {
+        if (nalu.type == GST_H265_NAL_VPS) {
+            GstH265VPS vps;
+
+            gst_h265_parser_parse_vps (parser, &nalu, &vps);
+        } else if (nalu.type == GST_H265_NAL_SPS) {
+            GstH265SPS sps;
+
+            if (gst_h265_parser_parse_sps (parser, &nalu, &sps, FALSE) ==
+                GST_H265_PARSER_OK)
+                depth = sps.max_num_reorder_pics[sps.max_sub_layers_minus1];
+            break;
+        } else if (nalu.type <= GST_H265_NAL_SLICE_CRA_NUT) {
+            break;
+        }
+        if (res == GST_H265_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h265_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return depth;
+}
+
+static gboolean
+h264_is_non_reference (GstH264NalParser *parser, const guint8 *data, gsize size)
+{
+    GstH264ParserResult res;
+    GstH264NalUnit nalu;
+
+    res = gst_h264_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H264_PARSER_OK || res == GST_H264_PARSER_NO_NAL_END) {
+        if (nalu.type >= GST_H264_NAL_SLICE && nalu.type <= GST_H264_NAL_SLICE_IDR)
+            return nalu.ref_idc == 0;
+        if (res == GST_H264_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h264_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return FALSE;
+}
+
+static gboolean
+h265_is_non_reference (GstH265Parser *parser, const guint8 *data, gsize size)
+{
+    GstH265ParserResult res;
+    GstH265NalUnit nalu;
+
+    res = gst_h265_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H265_PARSER_OK || res == GST_H265_PARSER_NO_NAL_END) {
+        /* TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and RSV_VCL_N1x */
+        if (nalu.type <= GST_H265_NAL_SLICE_CRA_NUT)
+            return nalu.type <= GST_H265_NAL_RSV_VCL_N14 && nalu.type % 2 == 0;
+        if (res == GST_H265_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h265_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return FALSE;
+}
+
+/* IDR access units reference nothing decoded before them */
+static gboolean
+h264_is_idr (GstH264NalParser *parser, const guint8 *data, gsize size)
+{
+    GstH264ParserResult res;
+    GstH264NalUnit nalu;
+
+    res = gst_h264_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H264_PARSER_OK || res == GST_H264_PARSER_NO_NAL_END) {
+        if (nalu.type >= GST_H264_NAL_SLICE && nalu.type <= GST_H264_NAL_SLICE_IDR)
+            return nalu.type == GST_H264_NAL_SLICE_IDR;
+        if (res == GST_H264_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h264_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return FALSE;
+}
+
+/* Unlike CRA, IDR and BLA pictures have no leading pictures referencing
+ * the previous GOP */
+static gboolean
+h265_is_idr (GstH265Parser *parser, const guint8 *data, gsize size)
+{
+    GstH265ParserResult res;
+    GstH265NalUnit nalu;
+
+    res = gst_h265_parser_identify_nalu (parser, data, 0, size, &nalu);
+    while (res == GST_H265_PARSER_OK || res == GST_H265_PARSER_NO_NAL_END) {
+        if (nalu.type <= GST_H265_NAL_SLICE_CRA_NUT)
+            return nalu.type >= GST_H265_NAL_SLICE_BLA_W_LP &&
+                nalu.type <= GST_H265_NAL_SLICE_IDR_N_LP;
+        if (res == GST_H265_PARSER_NO_NAL_END)
+            break;
+
+        res = gst_h265_parser_identify_nalu (parser, data,
+                    nalu.offset + nalu.size, size, &nalu);
+    }
+
+    return FALSE;
+}
+
 const gchar *
 mpeg4_profile_to_string (gint profile)
 {
@@ -297,6 +1256,23 @@ hevc_profile_to_string (gint profile)
     return NULL;
 }
 
+/* Accept whole access units, or single slices queued as subframes */
+static void
+set_alignment_list (GstStructure *s)
+{
+    GValue list = G_VALUE_INIT;
+    GValue value = G_VALUE_INIT;
+
+    gst_value_list_init (&list, 2);
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, "au");
+    gst_value_list_append_value (&list, &value);
+    g_value_set_static_string (&value, "nal");
+    gst_value_list_append_value (&list, &value);
+    g_value_unset (&value);
+    gst_structure_take_value (s, "alignment", &list);
+}
+
 static void
 codec_info_to_caps (GstCaps *caps, const gchar *mime,
             GstAmcCodecProfileLevel *profile_levels, gsize n_profile_levels)
@@ -396,8 +1372,8 @@ codec_info_to_caps (GstCaps *caps, const gchar *mime,
                     "framerate", GST_TYPE_FRACTION_RANGE,
                     0, 1, G_MAXINT, 1,
                     "parsed", G_TYPE_BOOLEAN, TRUE,
-                    "stream-format", G_TYPE_STRING, "byte-stream",
-                    "alignment", G_TYPE_STRING, "au", NULL);
+                    "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+        set_alignment_list (tmp);
 
         if (n_profile_levels) {
             for (j = n_profile_levels - 1; j >= 0; j--) {
@@ -442,8 +1418,8 @@ codec_info_to_caps (GstCaps *caps, const gchar *mime,
                     "framerate", GST_TYPE_FRACTION_RANGE,
                     0, 1, G_MAXINT, 1,
                     "parsed", G_TYPE_BOOLEAN, TRUE,
-                    "stream-format", G_TYPE_STRING, "byte-stream",
-                    "alignment", G_TYPE_STRING, "au", NULL);
+                    "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+        set_alignment_list (tmp);
 
         if (n_profile_levels) {
             for (j = n_profile_levels - 1; j >= 0; j--) {
@@ -499,6 +1475,37 @@ codec_info_to_caps (GstCaps *caps, const gchar *mime,
     }
 }
 
+static gpointer
+gst_amc_video_decoder_list_codecs (gpointer data)
+{
+    return gst_amc_codeclist_to_caps (codec_info_to_caps);
+}
+
+/* Input caps of the device's codecs. Listing them starts in the background
+ * when the class is initialized, the first caller waits for it to finish */
+static GstCaps *
+gst_amc_video_decoder_get_device_caps (void)
+{
+    static GOnce once = G_ONCE_INIT;
+
+    return g_once (&once, gst_amc_video_decoder_list_codecs, NULL);
+}
+
+static gpointer
+gst_amc_video_decoder_prefetch_device_caps (gpointer data)
+{
+    gst_amc_video_decoder_get_device_caps ();
+
+    return NULL;
+}
+
+static GstCaps *
+gst_amc_video_decoder_getcaps (GstVideoDecoder * decoder, GstCaps * filter)
+{
+    return gst_video_decoder_proxy_getcaps (decoder,
+                gst_amc_video_decoder_get_device_caps (), filter);
+}
+
 static void
 gst_amc_video_decoder_class_init (GstAmcVideoDecoderClass * klass)
 {
@@ -507,13 +1514,184 @@ gst_amc_video_decoder_class_init (GstAmcVideoDecoderClass * klass)
     GstVideoDecoderClass *videodec_class = GST_VIDEO_DECODER_CLASS (klass);
     GstPadTemplate *templ;
     GstCaps *caps;
+    GThread *thread;
 
     parent_class = g_type_class_peek_parent (klass);
 
     gobject_class->finalize = gst_amc_video_decoder_finalize;
+    gobject_class->set_property = gst_amc_video_decoder_set_property;
+    gobject_class->get_property = gst_amc_video_decoder_get_property;
+
+    g_object_class_install_property (gobject_class, PROP_OUTPUT_MODE,
+            g_param_spec_enum ("output-mode", "Output mode",
+                "Where decoded frames are rendered to",
+                GST_TYPE_AMC_VIDEO_DECODER_OUTPUT_MODE, DEFAULT_OUTPUT_MODE,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_MAX_RECOVERIES_PER_MINUTE,
+            g_param_spec_uint ("max-recoveries-per-minute", "Max recoveries per minute",
+                "Maximum number of in-place codec resets after recoverable "
+                "codec errors within a minute before failing (0 = never reset)",
+                0, G_MAXUINT, DEFAULT_MAX_RECOVERIES_PER_MINUTE,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_WAIT_FOR_KEYFRAME,
+            g_param_spec_boolean ("wait-for-keyframe", "Wait for keyframe",
+                "Drop frames after a discontinuity or corrupted input until "
+                "the next keyframe, requesting one from upstream",
+                DEFAULT_WAIT_FOR_KEYFRAME,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_WATCHDOG,
+            g_param_spec_boolean ("watchdog", "Watchdog",
+                "Flush or reset the codec when it stops producing output "
+                "while input is pending",
+                DEFAULT_WATCHDOG,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_MAX_FRAMES_IN_FLIGHT,
+            g_param_spec_uint ("max-frames-in-flight", "Max frames in flight",
+                "Maximum number of frames queued to the codec but not output "
+                "yet, at least the reorder depth + 1 (0 = unlimited)",
+                0, G_MAXUINT, DEFAULT_MAX_FRAMES_IN_FLIGHT,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_LEAKY,
+            g_param_spec_enum ("leaky", "Leaky",
+                "What to do with input when max-frames-in-flight is reached",
+                GST_TYPE_AMC_VIDEO_DECODER_LEAKY, DEFAULT_LEAKY,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_TARGET_LATENCY,
+            g_param_spec_uint64 ("target-latency", "Target latency",
+                "Latency to the live edge the catch-up controller aims for "
+                "(in nanoseconds, 0 = disabled)",
+                0, G_MAXUINT64, DEFAULT_TARGET_LATENCY,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_MAX_RENDER_AHEAD,
+            g_param_spec_uint64 ("max-render-ahead", "Max render ahead",
+                "Excess latency absorbed by rendering early in amcsink before "
+                "non-reference frames are skipped (in nanoseconds)",
+                0, G_MAXUINT64, DEFAULT_MAX_RENDER_AHEAD,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_JUMP_THRESHOLD,
+            g_param_spec_uint64 ("jump-threshold", "Jump threshold",
+                "Excess latency above which decoding jumps to the next "
+                "keyframe (in nanoseconds)",
+                0, G_MAXUINT64, DEFAULT_JUMP_THRESHOLD,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_PARALLEL_GOPS,
+            g_param_spec_uint ("parallel-gops", "Parallel GOPs",
+                "Number of codec instances decoding closed GOPs in parallel "
+                "with raw output, for offline processing (1 = disabled)",
+                1, MAX_PARALLEL_GOPS, DEFAULT_PARALLEL_GOPS,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_THUMBNAIL_INTERVAL,
+            g_param_spec_uint64 ("thumbnail-interval", "Thumbnail interval",
+                "Decode only the first keyframe every this many nanoseconds "
+                "of PTS to raw output, one at a time (0 = decode all frames)",
+                0, G_MAXUINT64, DEFAULT_THUMBNAIL_INTERVAL,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_TIME_SHARE,
+            g_param_spec_boolean ("time-share", "Time share",
+                "Decode only keyframes to raw output, on a codec session "
+                "shared with the other time-sharing decoders (takes effect "
+                "when the decoder is opened)",
+                DEFAULT_TIME_SHARE,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_FOCUS,
+            g_param_spec_boolean ("focus", "Focus",
+                "With time-share, decode all frames on the shared codec, "
+                "the other streams refresh their keyframes in between the "
+                "GOPs of this one (takes effect at the next keyframe)",
+                DEFAULT_FOCUS,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_ROTATE_METHOD,
+            g_param_spec_enum ("rotate-method", "Rotate method",
+                "Rotation applied when rendering to the window surface, auto "
+                "follows the image-orientation tag (flips are not supported)",
+                GST_TYPE_VIDEO_ORIENTATION_METHOD, DEFAULT_ROTATE_METHOD,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_SCALING_MODE,
+            g_param_spec_enum ("scaling-mode", "Scaling mode",
+                "How frames are scaled to the window surface",
+                GST_TYPE_AMC_VIDEO_DECODER_SCALING_MODE, DEFAULT_SCALING_MODE,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_PRIORITY,
+            g_param_spec_enum ("priority", "Priority",
+                "Scheduling priority of the codec relative to other codecs",
+                GST_TYPE_AMC_VIDEO_DECODER_PRIORITY, DEFAULT_PRIORITY,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_FORMAT_OVERRIDES,
+            g_param_spec_boxed ("format-overrides", "Format overrides",
+                "Typed MediaFormat keys set before configuring the codec, "
+                "taking precedence over format-presets",
+                GST_TYPE_STRUCTURE,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_FORMAT_PRESETS,
+            g_param_spec_string ("format-presets", "Format presets",
+                "File of MediaFormat key presets, one structure per line "
+                "named after a MIME type or codec name",
+                NULL,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_HEADROOM_THRESHOLD,
+            g_param_spec_double ("headroom-threshold", "Headroom threshold",
+                "Decode headroom below which overload is signalled with "
+                "amc-decoder-load messages and upstream events (0 = never)",
+                0.0, 1.0, DEFAULT_HEADROOM_THRESHOLD,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_STRIP_NAL,
+            g_param_spec_flags ("strip-nal", "Strip NAL units",
+                "NAL units of H.264 and H.265 input not passed on to the codec, "
+                "also with parallel-gops and time-share",
+                GST_TYPE_AMC_NAL_FILTER_FLAGS, DEFAULT_STRIP_NAL,
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_KEEP_SEI,
+            gst_param_spec_array ("keep-sei", "Keep SEI",
+                "SEI payload types kept with strip-nal=sei, an SEI NAL unit "
+                "holding any of them is passed on whole "
+                "(default: < 4, 5, 6, 137, 144, 147 >)",
+                g_param_spec_uint ("sei-type", "SEI type", "SEI payload type",
+                    0, GST_AMC_NAL_FILTER_MAX_SEI_TYPE, 0,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS),
+                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_LIVE_LATENCY,
+            g_param_spec_uint64 ("live-latency", "Live latency",
+                "Measured latency to the live edge (in nanoseconds)",
+                0, G_MAXUINT64, 0,
+                G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_CATCH_UP_STATE,
+            g_param_spec_enum ("catch-up-state", "Catch-up state",
+                "Current action of the catch-up controller",
+                GST_TYPE_AMC_VIDEO_DECODER_CATCH_UP_STATE,
+                GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_IDLE,
+                G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, PROP_STATS,
+            g_param_spec_boxed ("stats", "Statistics",
+                "Decoder statistics", GST_TYPE_STRUCTURE,
+                G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
     element_class->change_state =
         GST_DEBUG_FUNCPTR (gst_amc_video_decoder_change_state);
+    element_class->set_context =
+        GST_DEBUG_FUNCPTR (gst_amc_video_decoder_set_context);
 
     videodec_class->start = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_start);
     videodec_class->stop = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_stop);
@@ -523,10 +1701,17 @@ gst_amc_video_decoder_class_init (GstAmcVideoDecoderClass * klass)
     videodec_class->set_format = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_set_format);
     videodec_class->handle_frame = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_handle_frame);
     videodec_class->finish = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_finish);
-
-    caps = gst_amc_codeclist_to_caps (codec_info_to_caps);
-    templ = gst_pad_template_new ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, caps);
-    gst_caps_unref (caps);
+    videodec_class->src_query = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_src_query);
+    videodec_class->sink_event = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_sink_event);
+    videodec_class->getcaps = GST_DEBUG_FUNCPTR (gst_amc_video_decoder_getcaps);
+
+    /* Autoplugging goes by the template, so it lists the device's codecs
+     * whenever the codec cache has them already */
+    caps = gst_amc_codeclist_to_caps_from_cache (codec_info_to_caps);
+    if (caps)
+        templ = gst_pad_template_new ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, caps);
+    else
+        templ = gst_static_pad_template_get (&gst_amc_video_decoder_sink_template);
     gst_element_class_add_pad_template (element_class, templ);
 
     gst_element_class_add_pad_template (element_class,
@@ -538,544 +1723,3592 @@ gst_amc_video_decoder_class_init (GstAmcVideoDecoderClass * klass)
             "Heiher <r@hev.cc>");
 
     GST_DEBUG_CATEGORY_INIT (GST_CAT_DEFAULT, "amcvideodecoder", 0, "AmcVideoDecoder");
+
+    /* Registering the element doesn't wait for the codec list */
+    if (caps) {
+        gst_caps_unref (caps);
+    } else {
+        thread = g_thread_try_new ("amccodecs",
+                    gst_amc_video_decoder_prefetch_device_caps, NULL, NULL);
+        if (thread)
+            g_thread_unref (thread);
+    }
 }
 
+/* Called once frames reach the new surface, from any thread */
 static void
-gst_amc_video_decoder_video_overlay_set_window_handle (GstVideoOverlay * overlay,
-            guintptr handle)
+gst_amc_video_decoder_post_surface_switch (GstAmcVideoDecoder * self,
+            const gchar * method, gint64 start)
 {
-    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (overlay);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    JNIEnv *env = gst_amc_jni_get_env ();
-    jobject surface = (jobject) handle;
-
-    if (priv->surface)
-        gst_amc_jni_object_unref (env, priv->surface);
-
-    if (surface)
-        priv->surface = gst_amc_jni_object_ref (env, surface);
+    GstClockTime switch_time;
+    guint n_switches;
+
+    switch_time = (g_get_monotonic_time () - start) * GST_USECOND;
+
+    GST_OBJECT_LOCK (self);
+    n_switches = ++priv->n_surface_switches;
+    priv->surface_switch_time = switch_time;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_INFO_OBJECT (self, "Switched output surface (%s) in %" GST_TIME_FORMAT,
+                method, GST_TIME_ARGS (switch_time));
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self),
+                    gst_structure_new ("amc-surface-switch",
+                        "method", G_TYPE_STRING, method,
+                        "surface-switches", G_TYPE_UINT, n_switches,
+                        "switch-time", G_TYPE_UINT64, switch_time,
+                        NULL)));
 }
 
+/* Called with the stream lock held once the window surface is destroyed,
+ * e.g. as the application goes to the background. The codec was moved off
+ * the window by set_window_handle() already, see release_window() */
 static void
-gst_amc_video_decoder_video_overlay_init (gpointer iface, gpointer iface_data)
+gst_amc_video_decoder_park (GstAmcVideoDecoder * self)
 {
-    GstVideoOverlayInterface *overlay = (GstVideoOverlayInterface*) iface;
-    overlay->set_window_handle = gst_amc_video_decoder_video_overlay_set_window_handle;
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (priv->parked)
+        return;
+
+    GST_INFO_OBJECT (self, "Output surface lost, dropping video until a new "
+                "one is set");
+    priv->parked = TRUE;
+    priv->surface_switch_start = 0;
+
+    /* Discard what a codec kept configured still holds */
+    if (!g_atomic_int_get (&priv->codec_stopped) && !priv->pending_reset) {
+        priv->pending_reset = TRUE;
+        priv->reset_flush_only = TRUE;
+    }
 }
 
+/* Moves the codec off the window surface before set_window_handle(NULL)
+ * returns and the application destroys the surface, with window_lock
+ * held. Since API 23 the codec renders to a placeholder surface meanwhile
+ * and stays configured. Otherwise it is stopped under the streaming
+ * thread, which backs off once it notices, and configured again for the
+ * next surface */
 static void
-gst_amc_video_decoder_init (GstAmcVideoDecoder * self)
+gst_amc_video_decoder_release_window (GstAmcVideoDecoder * self)
 {
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    gst_video_decoder_set_packetized (GST_VIDEO_DECODER (self), TRUE);
-    gst_video_decoder_set_needs_format (GST_VIDEO_DECODER (self), TRUE);
+    GError *err = NULL;
 
-    priv->mime = caps_to_mime (NULL);
-    g_mutex_init (&priv->drain_lock);
-    g_cond_init (&priv->drain_cond);
+    if (!priv->window_codec)
+        return;
+
+    if (gst_amc_get_sdk_int () >= 23) {
+        if (!priv->placeholder)
+            priv->placeholder = gst_amc_surface_texture_new (0, &err);
+        if (priv->placeholder && gst_amc_codec_set_output_surface (priv->codec,
+                        gst_amc_surface_texture_get_surface (priv->placeholder), &err))
+            return;
+        GST_WARNING_OBJECT (self, "Failed to set placeholder surface, stopping "
+                    "codec: %s", err->message);
+        g_clear_error (&err);
+    }
+
+    /* Output held downstream can't be rendered anymore */
+    gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+    g_atomic_int_set (&priv->codec_stopped, TRUE);
+    if (!gst_amc_codec_stop (priv->codec, &err)) {
+        GST_WARNING_OBJECT (self, "Failed to stop codec: %s", err->message);
+        g_clear_error (&err);
+    }
+    priv->window_codec = FALSE;
 }
 
-static gboolean
-gst_amc_video_decoder_open (GstVideoDecoder * decoder)
+/* Applies a window surface change the application made, with the stream
+ * lock held */
+static void
+gst_amc_video_decoder_apply_surface_change (GstAmcVideoDecoder * self)
 {
-    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstAmcVideoDecoderClass *klass = GST_AMC_VIDEO_DECODER_GET_CLASS (self);
-    GError *err = NULL;
+    SurfaceChange change;
+    gboolean has_surface;
+    gint64 start;
 
-    GST_DEBUG_OBJECT (self, "Opening decoder");
+    change = g_atomic_int_and (&priv->surface_change, SURFACE_CHANGE_NONE);
+    if (change == SURFACE_CHANGE_NONE)
+        return;
 
-    priv->codec = gst_amc_decoder_new_from_type (priv->mime, &err);
-    if (!priv->codec) {
-        GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-        return FALSE;
+    /* Only a running codec rendering to the window has to be switched */
+    if (!priv->started || priv->gl_output || priv->raw_output)
+        return;
+
+    GST_OBJECT_LOCK (self);
+    has_surface = priv->surface != NULL;
+    start = priv->surface_set_time;
+    GST_OBJECT_UNLOCK (self);
+
+    if (!has_surface) {
+        gst_amc_video_decoder_park (self);
+        return;
     }
-    priv->started = FALSE;
-    priv->flushing = TRUE;
 
-    GST_DEBUG_OBJECT (self, "Opened decoder");
+    if (priv->parked) {
+        GST_INFO_OBJECT (self, "Got a new surface, resuming at the next keyframe");
+        priv->parked = FALSE;
+        priv->needs_keyframe = TRUE;
+        priv->keyframe_wait_reason = DROP_REASON_BACKGROUND;
+        priv->keyframe_request_time = 0;
+    }
 
-    return TRUE;
+    /* Done by set_window_handle() already, or a full reset is pending
+     * anyway and picks up the new surface */
+    if (change == SURFACE_CHANGE_SWITCHED ||
+                (priv->pending_reset && !priv->reset_flush_only))
+        return;
+
+    /* Stop and configure the same codec instance again with the new
+     * surface, decoding resumes at the next sync frame */
+    GST_DEBUG_OBJECT (self, "Reconfiguring codec for the new surface");
+    priv->pending_reset = TRUE;
+    priv->reset_flush_only = FALSE;
+    priv->surface_switch_start = start;
 }
 
-static gboolean
-gst_amc_video_decoder_close (GstVideoDecoder * decoder)
+/* Called from the application thread, which must not wait for the
+ * streaming thread, that may be blocked downstream for a long time */
+static void
+gst_amc_video_decoder_video_overlay_set_window_handle (GstVideoOverlay * overlay,
+            guintptr handle)
 {
-    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (overlay);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    JNIEnv *env = gst_amc_jni_get_env ();
+    jobject surface = (jobject) handle;
+    jobject old_surface;
+    gboolean switched = FALSE;
+    gint64 start;
+    GError *err = NULL;
 
-    GST_DEBUG_OBJECT (self, "Closing decoder");
+    start = g_get_monotonic_time ();
 
-    if (priv->codec) {
-        GError *err = NULL;
+    GST_OBJECT_LOCK (self);
+    old_surface = priv->surface;
+    priv->surface = surface ? gst_amc_jni_object_ref (env, surface) : NULL;
+    priv->surface_set_time = start;
+    GST_OBJECT_UNLOCK (self);
 
-        gst_amc_codec_release (priv->codec, &err);
-        if (err)
-          GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+    /* The surface is destroyed once this returns */
+    if (!surface) {
+        g_mutex_lock (&priv->window_lock);
+        gst_amc_video_decoder_release_window (self);
+        g_mutex_unlock (&priv->window_lock);
+    }
 
-        gst_amc_codec_free (priv->codec);
+    /* Since API 23 the surface can be swapped under a running codec,
+     * without losing any reference frames */
+    if (surface && gst_amc_get_sdk_int () >= 23) {
+        g_mutex_lock (&priv->window_lock);
+        if (priv->window_codec) {
+            switched = gst_amc_codec_set_output_surface (priv->codec, surface, &err);
+            if (!switched) {
+                GST_WARNING_OBJECT (self, "Failed to set output surface, "
+                            "reconfiguring codec: %s", err->message);
+                g_clear_error (&err);
+            }
+        }
+        g_mutex_unlock (&priv->window_lock);
     }
-    priv->codec = NULL;
 
-    priv->started = FALSE;
-    priv->flushing = TRUE;
+    if (switched)
+        gst_amc_video_decoder_post_surface_switch (self, "set-output-surface", start);
 
-    GST_DEBUG_OBJECT (self, "Closed decoder");
+    g_atomic_int_set (&priv->surface_change,
+                switched ? SURFACE_CHANGE_SWITCHED : SURFACE_CHANGE_PENDING);
 
-    return TRUE;
+    if (old_surface)
+        gst_amc_jni_object_unref (env, old_surface);
 }
 
-static GstStateChangeReturn
-gst_amc_video_decoder_change_state (GstElement * element, GstStateChange transition)
+static void
+gst_amc_video_decoder_video_overlay_init (gpointer iface, gpointer iface_data)
+{
+    GstVideoOverlayInterface *overlay = (GstVideoOverlayInterface*) iface;
+    overlay->set_window_handle = gst_amc_video_decoder_video_overlay_set_window_handle;
+}
+
+static void
+gst_amc_video_decoder_set_context (GstElement * element, GstContext * context)
 {
     GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (element);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
-    GError *err = NULL;
-
-    switch (transition) {
-    case GST_STATE_CHANGE_NULL_TO_READY:
-        break;
-    case GST_STATE_CHANGE_READY_TO_PAUSED:
-        priv->downstream_flow_ret = GST_FLOW_OK;
-        priv->draining = FALSE;
-        priv->started = FALSE;
-        break;
-    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
-        break;
-    case GST_STATE_CHANGE_PAUSED_TO_READY:
-        priv->flushing = TRUE;
-        gst_amc_codec_flush (priv->codec, &err);
-        if (err)
-        GST_ELEMENT_WARNING_FROM_ERROR (self, err);
-        g_mutex_lock (&priv->drain_lock);
-        priv->draining = FALSE;
-        g_cond_broadcast (&priv->drain_cond);
-        g_mutex_unlock (&priv->drain_lock);
-        break;
-    default:
-        break;
-    }
 
-    if (ret == GST_STATE_CHANGE_FAILURE)
-      return ret;
+    gst_gl_handle_set_context (element, context, &priv->gl_display,
+                &priv->other_gl_context);
 
-    ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+    GST_ELEMENT_CLASS (parent_class)->set_context (element, context);
+}
 
-    if (ret == GST_STATE_CHANGE_FAILURE)
-      return ret;
+static gboolean
+gst_amc_video_decoder_src_query (GstVideoDecoder * decoder, GstQuery * query)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
 
-    switch (transition) {
-    case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
-        break;
-    case GST_STATE_CHANGE_PAUSED_TO_READY:
-        priv->downstream_flow_ret = GST_FLOW_FLUSHING;
-        priv->started = FALSE;
-        break;
-    case GST_STATE_CHANGE_READY_TO_NULL:
+    switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONTEXT:
+        if (gst_gl_handle_context_query (GST_ELEMENT (decoder), query,
+                        priv->gl_display, priv->gl_context, priv->other_gl_context))
+            return TRUE;
         break;
     default:
         break;
     }
 
-    return ret;
+    return GST_VIDEO_DECODER_CLASS (parent_class)->src_query (decoder, query);
 }
 
-#define MAX_FRAME_DIST_TIME  (5 * GST_SECOND)
-#define MAX_FRAME_DIST_FRAMES (100)
+/* Clockwise rotation in degrees to configure the codec with */
+static gint
+gst_amc_video_decoder_get_rotation (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstVideoOrientationMethod method;
+
+    GST_OBJECT_LOCK (self);
+    method = priv->rotate_method;
+    GST_OBJECT_UNLOCK (self);
+
+    switch (method) {
+    case GST_VIDEO_ORIENTATION_90R:
+        return 90;
+    case GST_VIDEO_ORIENTATION_180:
+        return 180;
+    case GST_VIDEO_ORIENTATION_90L:
+        return 270;
+    case GST_VIDEO_ORIENTATION_AUTO:
+        return priv->tag_rotation;
+    default:
+        return 0;
+    }
+}
 
-static GstVideoCodecFrame *
-_find_nearest_frame (GstAmcVideoDecoder * self, GstClockTime reference_timestamp)
+/* The rotation is a configure-time key, a running codec rendering to the
+ * window is reconfigured to apply a new one */
+static void
+gst_amc_video_decoder_update_rotation (GstAmcVideoDecoder * self)
 {
-    GList *l, *best_l = NULL;
-    GList *finish_frames = NULL;
-    GstVideoCodecFrame *best = NULL;
-    guint64 best_timestamp = 0;
-    guint64 best_diff = G_MAXUINT64;
-    BufferIdentification *best_id = NULL;
-    GList *frames;
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gint rotation;
 
-    frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (self));
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    rotation = gst_amc_video_decoder_get_rotation (self);
+    if (priv->started && priv->surface_configured && !priv->gl_output &&
+                rotation != priv->rotation) {
+        GST_DEBUG_OBJECT (self, "Rotation changed to %d, reconfiguring codec",
+                    rotation);
+        priv->pending_reset = TRUE;
+        priv->reset_flush_only = FALSE;
+    }
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+}
 
-    for (l = frames; l; l = l->next) {
-        GstVideoCodecFrame *tmp = l->data;
-        BufferIdentification *id = gst_video_codec_frame_get_user_data (tmp);
-        guint64 timestamp, diff;
+/* Must be called with the stream lock held */
+static void
+gst_amc_video_decoder_apply_scaling_mode (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderScalingMode mode;
+    GError *err = NULL;
 
-        /* This happens for frames that were just added but
-         * which were not passed to the component yet. Ignore
-         * them here!
-         */
-        if (!id)
-            continue;
+    GST_OBJECT_LOCK (self);
+    mode = priv->scaling_mode;
+    GST_OBJECT_UNLOCK (self);
 
-        timestamp = id->timestamp;
+    if (!gst_amc_codec_set_video_scaling_mode (priv->codec, mode, &err)) {
+        GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+        g_clear_error (&err);
+    }
+}
 
-        if (timestamp > reference_timestamp)
-            diff = timestamp - reference_timestamp;
-        else
-            diff = reference_timestamp - timestamp;
+static void
+gst_amc_video_decoder_update_scaling_mode (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
 
-        if (best == NULL || diff < best_diff) {
-            best = tmp;
-            best_timestamp = timestamp;
-            best_diff = diff;
-            best_l = l;
-            best_id = id;
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    if (priv->started && priv->surface_configured && !priv->gl_output)
+        gst_amc_video_decoder_apply_scaling_mode (self);
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+}
 
-            /* For frames without timestamp we simply take the first frame */
-            if ((reference_timestamp == 0 && timestamp == 0) || diff == 0)
-                break;
-        }
-    }
+/* Rate the codec has to decode at: the framerate times the playback
+ * rate, or 0 if the framerate is unknown */
+static gdouble
+gst_amc_video_decoder_get_operating_rate (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gdouble rate = GST_VIDEO_DECODER (self)->input_segment.rate;
 
-    if (best_id) {
-        for (l = frames; l && l != best_l; l = l->next) {
-            GstVideoCodecFrame *tmp = l->data;
-            BufferIdentification *id = gst_video_codec_frame_get_user_data (tmp);
-            guint64 diff_time, diff_frames;
+    if (priv->fps_n <= 0 || priv->fps_d <= 0)
+        return 0;
 
-            if (id->timestamp > best_timestamp)
-                break;
+    return (gdouble) priv->fps_n / priv->fps_d * ABS (rate);
+}
 
-            if (id->timestamp == 0 || best_timestamp == 0)
-                diff_time = 0;
-            else
-                diff_time = best_timestamp - id->timestamp;
-            diff_frames = best->system_frame_number - tmp->system_frame_number;
+/* Tells a running codec about a new framerate or playback rate */
+static void
+gst_amc_video_decoder_update_operating_rate (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gdouble operating_rate;
+    GError *err = NULL;
 
-            if (diff_time > MAX_FRAME_DIST_TIME || diff_frames > MAX_FRAME_DIST_FRAMES) {
-                finish_frames =
-                    g_list_prepend (finish_frames, gst_video_codec_frame_ref (tmp));
-            }
-        }
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    operating_rate = gst_amc_video_decoder_get_operating_rate (self);
+    if (!priv->started || !priv->codec || gst_amc_get_sdk_int () < 23 ||
+                operating_rate == 0 || operating_rate == priv->operating_rate)
+        goto done;
+
+    GST_DEBUG_OBJECT (self, "Operating rate changed to %f", operating_rate);
+    if (!gst_amc_codec_set_parameter_float (priv->codec, "operating-rate",
+                    operating_rate, &err)) {
+        GST_WARNING_OBJECT (self, "Failed to set operating rate: %s", err->message);
+        g_clear_error (&err);
+        goto done;
     }
+    priv->operating_rate = operating_rate;
 
-    if (finish_frames) {
-        g_warning ("%s: Too old frames, bug in decoder -- please file a bug",
-            GST_ELEMENT_NAME (self));
-        for (l = finish_frames; l; l = l->next)
-            gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), l->data);
-    }
+done:
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+}
 
-    if (best)
-        gst_video_codec_frame_ref (best);
+static void
+gst_amc_video_decoder_update_priority (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderPriority priority;
+    GError *err = NULL;
 
-    g_list_foreach (frames, (GFunc) gst_video_codec_frame_unref, NULL);
-    g_list_free (frames);
+    GST_OBJECT_LOCK (self);
+    priority = priv->priority;
+    GST_OBJECT_UNLOCK (self);
 
-    return best;
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    if (priv->codec)
+        gst_amc_codec_set_session_priority (priv->codec,
+                    priority_to_session_priority (priority));
+    if (priv->started && priv->codec && gst_amc_get_sdk_int () >= 23 &&
+                priority != GST_AMC_VIDEO_DECODER_PRIORITY_DEFAULT &&
+                !gst_amc_codec_set_parameter_int (priv->codec, "priority",
+                    priority, &err)) {
+        GST_WARNING_OBJECT (self, "Failed to set priority: %s", err->message);
+        g_clear_error (&err);
+    }
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
 }
 
 static gboolean
-gst_amc_video_decoder_set_src_caps (GstAmcVideoDecoder * self)
+gst_amc_video_decoder_sink_event (GstVideoDecoder * decoder, GstEvent * event)
 {
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstVideoCodecState *state;
+    GstTagList *tags;
+    gchar *orientation;
     gboolean ret;
 
-    state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (self),
-                GST_VIDEO_FORMAT_ENCODED, priv->width, priv->height,
-                priv->input_state);
-    if (state->caps)
-        gst_caps_unref (state->caps);
-    state->caps = gst_static_pad_template_get_caps (&gst_amc_video_decoder_src_template);
-    ret = gst_video_decoder_negotiate (GST_VIDEO_DECODER (self));
-    gst_video_codec_state_unref (state);
+    switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_TAG:
+        gst_event_parse_tag (event, &tags);
+        if (!gst_tag_list_get_string (tags, GST_TAG_IMAGE_ORIENTATION, &orientation))
+            break;
 
-    return ret;
+        GST_DEBUG_OBJECT (self, "Got image-orientation tag %s", orientation);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+        if (g_str_equal (orientation, "rotate-0"))
+            priv->tag_rotation = 0;
+        else if (g_str_equal (orientation, "rotate-90"))
+            priv->tag_rotation = 90;
+        else if (g_str_equal (orientation, "rotate-180"))
+            priv->tag_rotation = 180;
+        else if (g_str_equal (orientation, "rotate-270"))
+            priv->tag_rotation = 270;
+        else
+            GST_WARNING_OBJECT (self, "Unsupported image-orientation %s", orientation);
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        g_free (orientation);
+
+        gst_amc_video_decoder_update_rotation (self);
+        break;
+    case GST_EVENT_FLUSH_START:
+        /* Stops waiting for a turn on the shared codec, reset in flush() */
+        if (priv->shared_codec) {
+            g_atomic_int_set (&priv->shared_flushing, TRUE);
+            gst_amc_shared_codec_wakeup (priv->shared_codec);
+        }
+        break;
+    case GST_EVENT_SEGMENT:
+        /* Picks up the playback rate of the stored segment */
+        ret = GST_VIDEO_DECODER_CLASS (parent_class)->sink_event (decoder, event);
+        gst_amc_video_decoder_update_operating_rate (self);
+        return ret;
+    default:
+        break;
+    }
+
+    return GST_VIDEO_DECODER_CLASS (parent_class)->sink_event (decoder, event);
 }
 
 static void
-gst_amc_video_decoder_free_buffer (gpointer data)
+gst_amc_video_decoder_init (GstAmcVideoDecoder * self)
 {
-    GstAmcSinkBufferData *buffer_data = data;
-    GError *error = NULL;
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    guint i;
 
-    if (buffer_data->codec) {
-        if (!gst_amc_codec_release_output_buffer (buffer_data->codec, buffer_data->index,
-                        FALSE, 0, &error)) {
-            GST_ERROR ("Release output buffer fail: %s", error->message);
-            g_error_free (error);
-        }
-    }
+    gst_video_decoder_set_packetized (GST_VIDEO_DECODER (self), TRUE);
+    gst_video_decoder_set_needs_format (GST_VIDEO_DECODER (self), TRUE);
 
-    g_slice_free (GstAmcSinkBufferData, buffer_data);
+    priv->mime = caps_to_mime (NULL);
+    priv->output_pool = gst_amc_output_pool_new (OUTPUT_POOL_MIN_BUFFERS);
+    if (!gst_buffer_pool_set_active (priv->output_pool, TRUE))
+        GST_WARNING_OBJECT (self, "Failed to activate output pool");
+    priv->output_mode = DEFAULT_OUTPUT_MODE;
+    priv->max_recoveries_per_minute = DEFAULT_MAX_RECOVERIES_PER_MINUTE;
+    priv->wait_for_keyframe = DEFAULT_WAIT_FOR_KEYFRAME;
+    priv->watchdog = DEFAULT_WATCHDOG;
+    priv->max_frames_in_flight = DEFAULT_MAX_FRAMES_IN_FLIGHT;
+    priv->leaky = DEFAULT_LEAKY;
+    priv->target_latency = DEFAULT_TARGET_LATENCY;
+    priv->max_render_ahead = DEFAULT_MAX_RENDER_AHEAD;
+    priv->jump_threshold = DEFAULT_JUMP_THRESHOLD;
+    priv->parallel_gops = DEFAULT_PARALLEL_GOPS;
+    priv->thumbnail_interval = DEFAULT_THUMBNAIL_INTERVAL;
+    priv->time_share = DEFAULT_TIME_SHARE;
+    priv->focus = DEFAULT_FOCUS;
+    priv->rotate_method = DEFAULT_ROTATE_METHOD;
+    priv->scaling_mode = DEFAULT_SCALING_MODE;
+    priv->priority = DEFAULT_PRIORITY;
+    priv->headroom_threshold = DEFAULT_HEADROOM_THRESHOLD;
+    priv->strip_nal = DEFAULT_STRIP_NAL;
+    for (i = 0; i < G_N_ELEMENTS (default_keep_sei); i++)
+        priv->keep_sei[default_keep_sei[i] / 8] |= 1 << (default_keep_sei[i] % 8);
+    gst_video_info_init (&priv->layout.info);
+    g_mutex_init (&priv->in_flight_lock);
+    g_cond_init (&priv->in_flight_cond);
+    g_mutex_init (&priv->gl_frame_lock);
+    g_cond_init (&priv->gl_frame_cond);
+    g_mutex_init (&priv->window_lock);
+    priv->au_adapter = gst_adapter_new ();
+    priv->recovery_times = g_array_new (FALSE, FALSE, sizeof (gint64));
+    g_mutex_init (&priv->drain_lock);
+    g_cond_init (&priv->drain_cond);
 }
 
-static GstBuffer *
-gst_amc_video_decoder_new_buffer (GstAmcVideoDecoder * self, gint idx)
+static gboolean
+gst_amc_video_decoder_wants_gl_output (GstAmcVideoDecoder * self)
 {
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstMapInfo minfo;
-    GstBuffer *outbuf;
-    GstAmcSinkBufferData *buffer_data;
-    const gsize buffer_data_size = sizeof (GstAmcSinkBufferData);
+    GstCaps *gl_caps, *peer_caps;
+    gboolean ret;
 
-    buffer_data = g_slice_new (GstAmcSinkBufferData);
-    if (!buffer_data)
-        return NULL;
+    switch (priv->output_mode) {
+    case GST_AMC_VIDEO_DECODER_OUTPUT_MODE_DIRECT:
+        return FALSE;
+    case GST_AMC_VIDEO_DECODER_OUTPUT_MODE_GL:
+        return TRUE;
+    default:
+        break;
+    }
+
+    /* A window handle set by the application always wins */
+    GST_OBJECT_LOCK (self);
+    ret = priv->surface != NULL;
+    GST_OBJECT_UNLOCK (self);
+    if (ret)
+        return FALSE;
 
-    buffer_data->codec = priv->codec;
-    buffer_data->index = idx;
+    if (!gst_amc_surface_texture_has_frame_listener ())
+        return FALSE;
 
-    outbuf = gst_buffer_new_wrapped_full (0, buffer_data, buffer_data_size, 0,
-                buffer_data_size, buffer_data, gst_amc_video_decoder_free_buffer);
-    if (!outbuf)
-        g_slice_free (GstAmcSinkBufferData, buffer_data);
+    gl_caps = gst_caps_from_string (GST_VIDEO_CAPS_MAKE_WITH_FEATURES (
+                    GST_CAPS_FEATURE_MEMORY_GL_MEMORY, "RGBA"));
+    peer_caps = gst_pad_peer_query_caps (GST_VIDEO_DECODER_SRC_PAD (self), gl_caps);
+    ret = peer_caps && !gst_caps_is_empty (peer_caps);
+    if (peer_caps)
+        gst_caps_unref (peer_caps);
+    gst_caps_unref (gl_caps);
 
-    return outbuf;
+    return ret;
 }
 
-static void
-gst_amc_video_decoder_loop (GstAmcVideoDecoder * self)
+static gboolean
+gst_amc_video_decoder_wants_raw_output (GstAmcVideoDecoder * self)
 {
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstFlowReturn flow_ret = GST_FLOW_OK;
-    gboolean release_buffer = TRUE;
-    GstAmcBufferInfo buffer_info;
-    GstVideoCodecFrame *frame;
-    GError *err = NULL;
-    GstBuffer *outbuf;
-    gboolean is_eos;
-    gint idx;
-
-    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    GstCaps *direct_caps, *peer_caps;
+    gboolean ret;
+
+    switch (priv->output_mode) {
+    case GST_AMC_VIDEO_DECODER_OUTPUT_MODE_RAW:
+        return TRUE;
+    case GST_AMC_VIDEO_DECODER_OUTPUT_MODE_AUTO:
+        break;
+    default:
+        return FALSE;
+    }
+
+    GST_OBJECT_LOCK (self);
+    ret = priv->surface != NULL;
+    GST_OBJECT_UNLOCK (self);
+    if (ret)
+        return FALSE;
+
+    /* Copying is the last resort, when downstream isn't amcsink */
+    direct_caps = gst_caps_new_empty_simple ("video/x-amc-direct");
+    peer_caps = gst_pad_peer_query_caps (GST_VIDEO_DECODER_SRC_PAD (self), direct_caps);
+    ret = !peer_caps || gst_caps_is_empty (peer_caps);
+    if (peer_caps)
+        gst_caps_unref (peer_caps);
+    gst_caps_unref (direct_caps);
+
+    return ret;
+}
+
+static const gchar gl_vertex_shader[] =
+    "uniform mat4 u_transformation;\n"
+    "attribute vec4 a_position;\n"
+    "attribute vec2 a_texcoord;\n"
+    "varying vec2 v_texcoord;\n"
+    "void main ()\n"
+    "{\n"
+    "    gl_Position = a_position;\n"
+    "    v_texcoord = (u_transformation * vec4 (a_texcoord, 0.0, 1.0)).xy;\n"
+    "}\n";
+
+static const gchar gl_fragment_shader[] =
+    "#extension GL_OES_EGL_image_external : require\n"
+    "precision mediump float;\n"
+    "varying vec2 v_texcoord;\n"
+    "uniform samplerExternalOES tex;\n"
+    "void main ()\n"
+    "{\n"
+    "    gl_FragColor = texture2D (tex, v_texcoord);\n"
+    "}\n";
+
+static void
+gst_amc_video_decoder_on_frame_available (GstAmcSurfaceTexture * texture,
+            GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    g_mutex_lock (&priv->gl_frame_lock);
+    priv->gl_frames_available++;
+    g_cond_broadcast (&priv->gl_frame_cond);
+    g_mutex_unlock (&priv->gl_frame_lock);
+}
+
+static void
+_gl_create_surface_texture (GstGLContext * context, GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    const GstGLFuncs *gl = context->gl_vtable;
+
+    priv->gl_shader = gst_gl_shader_new_link_with_stages (context, &priv->gl_error,
+                gst_glsl_stage_new_with_string (context, GL_VERTEX_SHADER,
+                    GST_GLSL_VERSION_100, GST_GLSL_PROFILE_ES, gl_vertex_shader),
+                gst_glsl_stage_new_with_string (context, GL_FRAGMENT_SHADER,
+                    GST_GLSL_VERSION_100, GST_GLSL_PROFILE_ES, gl_fragment_shader),
+                NULL);
+    if (!priv->gl_shader)
+        return;
+
+    gl->GenTextures (1, &priv->gl_texture);
+    priv->surface_texture = gst_amc_surface_texture_new (priv->gl_texture,
+                &priv->gl_error);
+    if (priv->surface_texture &&
+                !gst_amc_surface_texture_set_on_frame_available_callback (
+                    priv->surface_texture,
+                    (GstAmcSurfaceTextureOnFrameAvailableCallback)
+                    gst_amc_video_decoder_on_frame_available, self, &priv->gl_error)) {
+        gst_amc_surface_texture_free (priv->surface_texture);
+        priv->surface_texture = NULL;
+    }
+    if (!priv->surface_texture) {
+        gl->DeleteTextures (1, &priv->gl_texture);
+        priv->gl_texture = 0;
+        gst_object_unref (priv->gl_shader);
+        priv->gl_shader = NULL;
+    }
+}
+
+static void
+_gl_destroy_surface_texture (GstGLContext * context, GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    const GstGLFuncs *gl = context->gl_vtable;
+
+    if (priv->surface_texture)
+        gst_amc_surface_texture_free (priv->surface_texture);
+    priv->surface_texture = NULL;
+
+    if (priv->gl_texture)
+        gl->DeleteTextures (1, &priv->gl_texture);
+    priv->gl_texture = 0;
+
+    if (priv->gl_shader)
+        gst_object_unref (priv->gl_shader);
+    priv->gl_shader = NULL;
+    if (priv->gl_fbo)
+        gst_object_unref (priv->gl_fbo);
+    priv->gl_fbo = NULL;
+}
+
+static gboolean
+gst_amc_video_decoder_ensure_gl (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (priv->surface_texture)
+        return TRUE;
+
+    if (!gst_gl_ensure_element_data (self, &priv->gl_display,
+                    &priv->other_gl_context)) {
+        g_set_error (err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NOT_FOUND,
+                    "Failed to get GL display");
+        return FALSE;
+    }
+
+    if (!priv->gl_context)
+        gst_gl_query_local_gl_context (GST_ELEMENT (self), GST_PAD_SRC,
+                    &priv->gl_context);
+
+    if (!priv->gl_context) {
+        GST_OBJECT_LOCK (priv->gl_display);
+        do {
+            if (priv->gl_context)
+                gst_object_unref (priv->gl_context);
+            priv->gl_context =
+                gst_gl_display_get_gl_context_for_thread (priv->gl_display, NULL);
+            if (!priv->gl_context &&
+                !gst_gl_display_create_context (priv->gl_display,
+                        priv->other_gl_context, &priv->gl_context, err)) {
+                GST_OBJECT_UNLOCK (priv->gl_display);
+                return FALSE;
+            }
+        } while (!gst_gl_display_add_context (priv->gl_display, priv->gl_context));
+        GST_OBJECT_UNLOCK (priv->gl_display);
+    }
+
+    if (!gst_gl_context_check_feature (priv->gl_context,
+                    "GL_OES_EGL_image_external")) {
+        g_set_error (err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_SETTINGS,
+                    "GL context does not support external-oes textures");
+        return FALSE;
+    }
+
+    priv->gl_frames_available = 0;
+    gst_gl_context_thread_add (priv->gl_context,
+                (GstGLContextThreadFunc) _gl_create_surface_texture, self);
+    if (!priv->surface_texture) {
+        g_propagate_error (err, priv->gl_error);
+        priv->gl_error = NULL;
+        return FALSE;
+    }
+
+    GST_DEBUG_OBJECT (self, "Decoding into surface texture %u", priv->gl_texture);
+
+    return TRUE;
+}
+
+static void
+gst_amc_video_decoder_free_gl (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (priv->gl_pool) {
+        gst_buffer_pool_set_active (priv->gl_pool, FALSE);
+        gst_object_unref (priv->gl_pool);
+    }
+    priv->gl_pool = NULL;
+
+    if (priv->gl_context) {
+        gst_gl_context_thread_add (priv->gl_context,
+                    (GstGLContextThreadFunc) _gl_destroy_surface_texture, self);
+        gst_object_unref (priv->gl_context);
+    }
+    priv->gl_context = NULL;
+
+    priv->gl_output = FALSE;
+}
+
+static GstAmcSessionPriority
+priority_to_session_priority (GstAmcVideoDecoderPriority priority)
+{
+    switch (priority) {
+    case GST_AMC_VIDEO_DECODER_PRIORITY_REALTIME:
+        return GST_AMC_SESSION_PRIORITY_HIGH;
+    case GST_AMC_VIDEO_DECODER_PRIORITY_BEST_EFFORT:
+        return GST_AMC_SESSION_PRIORITY_LOW;
+    default:
+        return GST_AMC_SESSION_PRIORITY_NORMAL;
+    }
+}
+
+/* The codec generation a preemption was for */
+typedef struct
+{
+    GstAmcVideoDecoder *self;
+    gint codec_generation;
+} GstAmcVideoDecoderPreemption;
+
+/* Releases the codec of a preempted session on a thread of its own, so
+ * the session goes even while no data flows, e.g. in PAUSED. The
+ * streaming thread backs off as for a lost window and creates another
+ * codec at the next frame. Nothing is done if the streaming thread gave
+ * up the preempted codec meanwhile */
+static gpointer
+gst_amc_video_decoder_release_preempted (GstAmcVideoDecoderPreemption * preemption)
+{
+    GstAmcVideoDecoder *self = preemption->self;
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GError *err = NULL;
+
+    g_mutex_lock (&priv->window_lock);
+    if (priv->codec_held && g_atomic_int_get (&priv->preempted) &&
+                g_atomic_int_get (&priv->codec_generation) ==
+                preemption->codec_generation) {
+        GST_DEBUG_OBJECT (self, "Releasing preempted codec");
+
+        /* Output held downstream can't be rendered anymore */
+        gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+        g_atomic_int_set (&priv->codec_stopped, TRUE);
+        if (!gst_amc_codec_stop (priv->codec, &err)) {
+            GST_WARNING_OBJECT (self, "Failed to stop codec: %s", err->message);
+            g_clear_error (&err);
+        }
+        if (!gst_amc_codec_release (priv->codec, &err)) {
+            GST_WARNING_OBJECT (self, "Failed to release codec: %s", err->message);
+            g_clear_error (&err);
+        }
+        gst_amc_codec_release_session (priv->codec);
+        priv->window_codec = FALSE;
+        priv->codec_held = FALSE;
+    }
+    g_mutex_unlock (&priv->window_lock);
+
+    gst_object_unref (self);
+    g_slice_free (GstAmcVideoDecoderPreemption, preemption);
+
+    return NULL;
+}
+
+/* Called from the thread of the preempting decoder with the budget lock
+ * held. A configured codec is released right away, otherwise it is
+ * replaced at the next frame */
+static void
+gst_amc_video_decoder_preempt (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderPreemption *preemption;
+    GThread *thread;
+    GError *err = NULL;
+
+    GST_INFO_OBJECT (self, "Hardware session preempted");
+    g_atomic_int_set (&priv->preempted, TRUE);
+
+    /* Not window_lock, its holders may wait for the budget lock */
+    preemption = g_slice_new (GstAmcVideoDecoderPreemption);
+    preemption->self = gst_object_ref (self);
+    preemption->codec_generation = g_atomic_int_get (&priv->codec_generation);
+
+    thread = g_thread_try_new ("amcpreempt",
+                (GThreadFunc) gst_amc_video_decoder_release_preempted,
+                preemption, &err);
+    if (thread) {
+        g_thread_unref (thread);
+    } else {
+        GST_WARNING_OBJECT (self, "Failed to release codec, waiting for the "
+                    "next frame: %s", err->message);
+        g_clear_error (&err);
+        gst_object_unref (self);
+        g_slice_free (GstAmcVideoDecoderPreemption, preemption);
+    }
+}
+
+/* Before the codec is freed or restarted. Output held downstream refers
+ * to the decoder and is never released from then on */
+static void
+gst_amc_video_decoder_free_dec (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (!priv->dec)
+        return;
+
+    gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+    amc_dec_free (priv->dec);
+    priv->dec = NULL;
+}
+
+static gboolean
+gst_amc_video_decoder_flush_codec (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (priv->dec)
+        return amc_dec_flush (priv->dec, err) == AMC_DEC_OK;
+
+    return gst_amc_codec_flush (priv->codec, err);
+}
+
+/* Called before the codec is freed. Forgets its preemption, so a
+ * release thread still to run for it leaves the next codec alone */
+static void
+gst_amc_video_decoder_clear_preempted (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    g_mutex_lock (&priv->window_lock);
+    g_atomic_int_set (&priv->preempted, FALSE);
+    g_atomic_int_inc (&priv->codec_generation);
+    g_mutex_unlock (&priv->window_lock);
+}
+
+/* Called before the codec is stopped or freed, so neither the
+ * application thread switches its surface nor a preempting decoder
+ * releases it meanwhile */
+static void
+gst_amc_video_decoder_detach_window (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    g_mutex_lock (&priv->window_lock);
+    priv->window_codec = FALSE;
+    priv->codec_held = FALSE;
+    g_mutex_unlock (&priv->window_lock);
+}
+
+/* Creates a codec within the process-wide budget, with the priority
+ * property deciding who is preempted, or a software one if no hardware
+ * session is left */
+static GstAmcCodec *
+gst_amc_video_decoder_create_codec (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderPriority priority;
+    GstAmcCodec *codec;
+
+    GST_OBJECT_LOCK (self);
+    priority = priv->priority;
+    GST_OBJECT_UNLOCK (self);
+
+    codec = gst_amc_decoder_new_with_budget (priv->mime, priv->width,
+                priv->height, priority_to_session_priority (priority), TRUE,
+                (GstAmcSessionPreemptFunc) gst_amc_video_decoder_preempt, self, err);
+    if (!codec)
+        return NULL;
+
+    if (gst_amc_codec_is_software (codec))
+        GST_INFO_OBJECT (self, "Decoding in software");
+    GST_OBJECT_LOCK (self);
+    priv->software_codec = gst_amc_codec_is_software (codec);
+    GST_OBJECT_UNLOCK (self);
+
+    return codec;
+}
+
+static gboolean
+gst_amc_video_decoder_open (GstVideoDecoder * decoder)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderClass *klass = GST_AMC_VIDEO_DECODER_GET_CLASS (self);
+
+    GST_DEBUG_OBJECT (self, "Opening decoder");
+
+    /* The codec is only created in set_format(), once the resolution
+     * class it is budgeted by is known */
+    priv->started = FALSE;
+    priv->flushing = TRUE;
+
+    GST_DEBUG_OBJECT (self, "Opened decoder");
+
+    return TRUE;
+}
+
+static gboolean
+gst_amc_video_decoder_close (GstVideoDecoder * decoder)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    GST_DEBUG_OBJECT (self, "Closing decoder");
+
+    if (priv->codec) {
+        GError *err = NULL;
+
+        gst_amc_video_decoder_detach_window (self);
+        gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+        gst_amc_video_decoder_free_dec (self);
+        gst_amc_codec_release (priv->codec, &err);
+        if (err)
+          GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+
+        gst_amc_video_decoder_clear_preempted (self);
+        gst_amc_codec_free (priv->codec);
+    }
+    priv->codec = NULL;
+
+    /* The codec is released, the surface it rendered to can go */
+    gst_amc_video_decoder_free_gl (self);
+
+    priv->started = FALSE;
+    priv->flushing = TRUE;
+
+    GST_DEBUG_OBJECT (self, "Closed decoder");
+
+    return TRUE;
+}
+
+static GstStateChangeReturn
+gst_amc_video_decoder_change_state (GstElement * element, GstStateChange transition)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (element);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
+    GError *err = NULL;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_NULL_TO_READY:
+        break;
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+        priv->downstream_flow_ret = GST_FLOW_OK;
+        priv->draining = FALSE;
+        priv->started = FALSE;
+        break;
+    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
+        break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+        priv->flushing = TRUE;
+        /* Stops waiting for a turn on the shared codec */
+        if (priv->shared_codec) {
+            g_atomic_int_set (&priv->shared_flushing, TRUE);
+            gst_amc_shared_codec_wakeup (priv->shared_codec);
+        }
+        /* The pool flushes the codecs it decodes on */
+        if (priv->gop_pool)
+            gst_amc_gop_pool_set_flushing (priv->gop_pool, TRUE);
+        else if (priv->codec) {
+            gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+            gst_amc_video_decoder_flush_codec (self, &err);
+        }
+        if (err)
+        GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+        g_mutex_lock (&priv->drain_lock);
+        priv->draining = FALSE;
+        g_cond_broadcast (&priv->drain_cond);
+        g_mutex_unlock (&priv->drain_lock);
+        break;
+    default:
+        break;
+    }
+
+    if (ret == GST_STATE_CHANGE_FAILURE)
+      return ret;
+
+    ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+    if (ret == GST_STATE_CHANGE_FAILURE)
+      return ret;
+
+    switch (transition) {
+    case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
+        break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+        priv->downstream_flow_ret = GST_FLOW_FLUSHING;
+        priv->started = FALSE;
+        break;
+    case GST_STATE_CHANGE_READY_TO_NULL:
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+#define MAX_FRAME_DIST_TIME  (5 * GST_SECOND)
+#define MAX_FRAME_DIST_FRAMES (100)
+
+static GstVideoCodecFrame *
+_find_nearest_frame (GstAmcVideoDecoder * self, GstClockTime reference_timestamp)
+{
+    GList *l, *best_l = NULL;
+    GList *finish_frames = NULL;
+    GstVideoCodecFrame *best = NULL;
+    guint64 best_timestamp = 0;
+    guint64 best_diff = G_MAXUINT64;
+    BufferIdentification *best_id = NULL;
+    GList *frames;
+
+    frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (self));
+
+    for (l = frames; l; l = l->next) {
+        GstVideoCodecFrame *tmp = l->data;
+        BufferIdentification *id = gst_video_codec_frame_get_user_data (tmp);
+        guint64 timestamp, diff;
+
+        /* This happens for frames that were just added but
+         * which were not passed to the component yet. Ignore
+         * them here!
+         */
+        if (!id)
+            continue;
+
+        timestamp = id->timestamp;
+
+        if (timestamp > reference_timestamp)
+            diff = timestamp - reference_timestamp;
+        else
+            diff = reference_timestamp - timestamp;
+
+        if (best == NULL || diff < best_diff) {
+            best = tmp;
+            best_timestamp = timestamp;
+            best_diff = diff;
+            best_l = l;
+            best_id = id;
+
+            /* For frames without timestamp we simply take the first frame */
+            if ((reference_timestamp == 0 && timestamp == 0) || diff == 0)
+                break;
+        }
+    }
+
+    if (best_id) {
+        for (l = frames; l && l != best_l; l = l->next) {
+            GstVideoCodecFrame *tmp = l->data;
+            BufferIdentification *id = gst_video_codec_frame_get_user_data (tmp);
+            guint64 diff_time, diff_frames;
+
+            if (id->timestamp > best_timestamp)
+                break;
+
+            if (id->timestamp == 0 || best_timestamp == 0)
+                diff_time = 0;
+            else
+                diff_time = best_timestamp - id->timestamp;
+            diff_frames = best->system_frame_number - tmp->system_frame_number;
+
+            if (diff_time > MAX_FRAME_DIST_TIME || diff_frames > MAX_FRAME_DIST_FRAMES) {
+                finish_frames =
+                    g_list_prepend (finish_frames, gst_video_codec_frame_ref (tmp));
+            }
+        }
+    }
+
+    if (finish_frames) {
+        g_warning ("%s: Too old frames, bug in decoder -- please file a bug",
+            GST_ELEMENT_NAME (self));
+        for (l = finish_frames; l; l = l->next)
+            gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), l->data);
+    }
+
+    if (best)
+        gst_video_codec_frame_ref (best);
+
+    g_list_foreach (frames, (GFunc) gst_video_codec_frame_unref, NULL);
+    g_list_free (frames);
+
+    return best;
+}
+
+static void
+gst_amc_video_decoder_parse_reorder_depth (GstAmcVideoDecoder * self,
+            const guint8 * data, gsize size)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gint depth = -1;
+
+    if (strcmp (priv->mime, "video/avc") == 0) {
+        if (!priv->h264_parser)
+            priv->h264_parser = gst_h264_nal_parser_new ();
+        depth = h264_parse_reorder_depth (priv->h264_parser, data, size);
+    } else if (strcmp (priv->mime, "video/hevc") == 0) {
+        if (!priv->h265_parser)
+            priv->h265_parser = gst_h265_parser_new ();
+        depth = h265_parse_reorder_depth (priv->h265_parser, data, size);
+    }
+
+    if (depth >= 0 && depth != priv->reorder_depth) {
+        GST_DEBUG_OBJECT (self, "Reorder depth changed: %d -> %d",
+                    priv->reorder_depth, depth);
+        priv->reorder_depth = depth;
+    }
+}
+
+/* Returns 0 if the framerate is unknown */
+static GstClockTime
+gst_amc_video_decoder_get_frame_duration (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (!priv->input_state || priv->input_state->info.fps_n <= 0)
+        return 0;
+
+    return gst_util_uint64_scale (GST_SECOND, priv->input_state->info.fps_d,
+                priv->input_state->info.fps_n);
+}
+
+/* Returns TRUE if GOPs of the MIME type can be told closed from the
+ * bitstream, see gst_amc_video_decoder_is_closed_gop_start() */
+static gboolean
+mime_has_closed_gops (const gchar * mime)
+{
+    return strcmp (mime, "video/avc") == 0 || strcmp (mime, "video/hevc") == 0 ||
+        strcmp (mime, "video/x-vnd.on2.vp8") == 0 ||
+        strcmp (mime, "video/x-vnd.on2.vp9") == 0;
+}
+
+/* Returns TRUE if the sync frame @data starts a GOP no later frame
+ * references across, FALSE if unknown. VP8 and VP9 keyframes reset all
+ * reference slots */
+static gboolean
+gst_amc_video_decoder_is_closed_gop_start (GstAmcVideoDecoder * self,
+            const guint8 * data, gsize size)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (strcmp (priv->mime, "video/avc") == 0) {
+        if (!priv->h264_parser)
+            priv->h264_parser = gst_h264_nal_parser_new ();
+        return h264_is_idr (priv->h264_parser, data, size);
+    } else if (strcmp (priv->mime, "video/hevc") == 0) {
+        if (!priv->h265_parser)
+            priv->h265_parser = gst_h265_parser_new ();
+        return h265_is_idr (priv->h265_parser, data, size);
+    }
+
+    return mime_has_closed_gops (priv->mime);
+}
+
+/* Returns TRUE if no other frame references this one, FALSE if unknown */
+static gboolean
+gst_amc_video_decoder_is_non_reference (GstAmcVideoDecoder * self,
+            const guint8 * data, gsize size)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (strcmp (priv->mime, "video/avc") == 0) {
+        if (!priv->h264_parser)
+            priv->h264_parser = gst_h264_nal_parser_new ();
+        return h264_is_non_reference (priv->h264_parser, data, size);
+    } else if (strcmp (priv->mime, "video/hevc") == 0) {
+        if (!priv->h265_parser)
+            priv->h265_parser = gst_h265_parser_new ();
+        return h265_is_non_reference (priv->h265_parser, data, size);
+    }
+
+    return FALSE;
+}
+
+/* Scans @data for NAL units to strip with the stream lock held. Returns
+ * TRUE if the @size bytes left are to be copied with
+ * gst_amc_nal_filter_copy(), FALSE if @data is copied as is */
+static gboolean
+gst_amc_video_decoder_strip_nal (GstAmcVideoDecoder * self,
+            const guint8 * data, gsize data_size, gsize * size)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcNalFilterFlags strip;
+
+    *size = data_size;
+
+    GST_OBJECT_LOCK (self);
+    strip = priv->strip_nal;
+    if (strip && !priv->nal_filter)
+        priv->nal_filter = gst_amc_nal_filter_new (priv->mime);
+    if (strip && priv->nal_filter) {
+        gst_amc_nal_filter_set_flags (priv->nal_filter, strip);
+        gst_amc_nal_filter_set_keep_sei (priv->nal_filter, priv->keep_sei);
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    if (!strip || !priv->nal_filter)
+        return FALSE;
+
+    *size = gst_amc_nal_filter_scan (priv->nal_filter, data, data_size);
+    GST_LOG_OBJECT (self, "Stripped %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+                " bytes", data_size - *size, data_size);
+
+    return *size < data_size;
+}
+
+/* Accounts for @stripped bytes of input not copied to the codec, with the
+ * stream lock held. The rate is measured every STRIP_REPORT_INTERVAL */
+static void
+gst_amc_video_decoder_update_strip_rate (GstAmcVideoDecoder * self,
+            gsize stripped)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gint64 now, window;
+
+    now = g_get_monotonic_time ();
+    if (!priv->strip_window_start)
+        priv->strip_window_start = now;
+    priv->strip_window_bytes += stripped;
+
+    window = now - priv->strip_window_start;
+    if (!stripped && window < STRIP_REPORT_INTERVAL)
+        return;
+
+    GST_OBJECT_LOCK (self);
+    priv->n_stripped_bytes += stripped;
+    if (window >= STRIP_REPORT_INTERVAL) {
+        priv->strip_rate = (gdouble) priv->strip_window_bytes *
+            G_TIME_SPAN_SECOND / window;
+        priv->strip_window_start = now;
+        priv->strip_window_bytes = 0;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+/* Replaces @input by a copy without the NAL units to strip, for GOPs
+ * the pool and the shared codec copy as they are. With the stream lock
+ * held */
+static GstBuffer *
+gst_amc_video_decoder_strip_input (GstAmcVideoDecoder * self, GstBuffer * input)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstMapInfo minfo, sminfo;
+    GstBuffer *stripped;
+    gsize size;
+
+    gst_buffer_map (input, &minfo, GST_MAP_READ);
+    if (!gst_amc_video_decoder_strip_nal (self, minfo.data, minfo.size, &size)) {
+        gst_buffer_unmap (input, &minfo);
+        gst_amc_video_decoder_update_strip_rate (self, 0);
+        return input;
+    }
+
+    stripped = gst_buffer_new_allocate (NULL, size, NULL);
+    gst_buffer_map (stripped, &sminfo, GST_MAP_WRITE);
+    gst_amc_nal_filter_copy (priv->nal_filter, minfo.data, 0, sminfo.data, size);
+    gst_buffer_unmap (stripped, &sminfo);
+    gst_buffer_copy_into (stripped, input, GST_BUFFER_COPY_FLAGS |
+                GST_BUFFER_COPY_TIMESTAMPS | GST_BUFFER_COPY_META, 0, -1);
+    gst_amc_video_decoder_update_strip_rate (self, minfo.size - size);
+    gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
+
+    return stripped;
+}
+
+/* Changes smaller than this are ignored when the frame rate is unknown */
+#define LATENCY_UPDATE_MIN_THRESHOLD (10 * GST_MSECOND)
+/* How long the estimate must stay lower before the latency is lowered */
+#define LATENCY_DECREASE_DELAY (2 * G_TIME_SPAN_SECOND)
+
+/* Must be called with the stream lock held. Each update makes the sinks
+ * re-query the latency, so it only moves by at least a frame: upward at
+ * once, downward after the estimate stayed lower for LATENCY_DECREASE_DELAY */
+static void
+gst_amc_video_decoder_update_latency (GstAmcVideoDecoder * self,
+            BufferIdentification * id)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstClockTime decode_time, frame_duration, latency, threshold;
+    gint64 now;
+
+    decode_time = (g_get_monotonic_time () - id->queued_time) * GST_USECOND;
+    if (GST_CLOCK_TIME_IS_VALID (priv->decode_time))
+        priv->decode_time = (priv->decode_time * 7 + decode_time) / 8;
+    else
+        priv->decode_time = decode_time;
+
+    frame_duration = gst_amc_video_decoder_get_frame_duration (self);
+    latency = priv->reorder_depth * frame_duration + priv->decode_time;
+    threshold = MAX (frame_duration, LATENCY_UPDATE_MIN_THRESHOLD);
+
+    if (GST_CLOCK_TIME_IS_VALID (priv->latency)) {
+        if (latency + threshold <= priv->latency) {
+            now = g_get_monotonic_time ();
+            if (!priv->latency_lower_since) {
+                priv->latency_lower_since = now;
+                priv->latency_lower_max = latency;
+            }
+            priv->latency_lower_max = MAX (priv->latency_lower_max, latency);
+            if (now - priv->latency_lower_since < LATENCY_DECREASE_DELAY)
+                return;
+            /* Lowered no further than the estimate went within the delay */
+            latency = priv->latency_lower_max;
+        } else if (latency < priv->latency + threshold) {
+            priv->latency_lower_since = 0;
+            return;
+        }
+    }
+    priv->latency_lower_since = 0;
+
+    GST_DEBUG_OBJECT (self, "Latency changed to %" GST_TIME_FORMAT
+                " (reorder depth %d, decode time %" GST_TIME_FORMAT ")",
+                GST_TIME_ARGS (latency), priv->reorder_depth,
+                GST_TIME_ARGS (priv->decode_time));
+    priv->latency = latency;
+    /* Posts a latency message so the pipeline picks it up */
+    gst_video_decoder_set_latency (GST_VIDEO_DECODER (self), latency, latency);
+}
+
+/* Called from the srcpad loop for every output frame with the stream lock
+ * held. The decode load is the average time the codec took to deliver an
+ * output once asked for it, while it held more input than that output
+ * needs, relative to the frame interval at the current playback rate. Time
+ * the loop spends pushing downstream, e.g. synchronized to the clock, and
+ * time the codec waits for input don't count. Input starvation is the share
+ * of the window spent waiting for an input slot while the loop waited for
+ * output, i.e. both were held up by the codec. Headroom is what is left by
+ * the larger of both */
+static void
+gst_amc_video_decoder_update_load (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gdouble rate = GST_VIDEO_DECODER (self)->input_segment.rate;
+    gdouble decode_load = 0, input_starvation, headroom, proportion;
+    GstClockTime frame_interval;
+    gboolean overloaded;
+    gint64 now, window;
+    GstStructure *s;
+
+    now = g_get_monotonic_time ();
+    if (!priv->load_window_start) {
+        priv->load_window_start = now;
+        priv->load_starved = 0;
+        priv->load_busy = 0;
+        priv->load_outputs = 0;
+        return;
+    }
+
+    window = now - priv->load_window_start;
+    if (window < LOAD_REPORT_INTERVAL)
+        return;
+
+    frame_interval = gst_amc_video_decoder_get_frame_duration (self) / MAX (ABS (rate), 0.01);
+    /* A codec never short of input to output from keeps up with it */
+    if (frame_interval && priv->load_outputs)
+        decode_load = (gdouble) priv->load_busy * GST_USECOND /
+            priv->load_outputs / frame_interval;
+    input_starvation = (gdouble) MIN (priv->load_starved, window) / window;
+    headroom = 1.0 - MAX (decode_load, input_starvation);
+
+    priv->load_window_start = now;
+    priv->load_starved = 0;
+    priv->load_busy = 0;
+    priv->load_outputs = 0;
+
+    GST_OBJECT_LOCK (self);
+    priv->decode_load = decode_load;
+    priv->input_starvation = input_starvation;
+    priv->headroom = headroom;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_LOG_OBJECT (self, "Decode load %.2f, input starvation %.2f, headroom %.2f",
+                decode_load, input_starvation, headroom);
+
+    overloaded = headroom < priv->headroom_threshold;
+    if (!overloaded && !priv->overloaded)
+        return;
+
+    if (overloaded != priv->overloaded)
+        GST_INFO_OBJECT (self, "Decoder %s, headroom %.2f",
+                    overloaded ? "overloaded" : "keeping up again", headroom);
+    priv->overloaded = overloaded;
+
+    s = gst_structure_new ("amc-decoder-load",
+                "overloaded", G_TYPE_BOOLEAN, overloaded,
+                "headroom", G_TYPE_DOUBLE, headroom,
+                "decode-load", G_TYPE_DOUBLE, decode_load,
+                "input-starvation", G_TYPE_DOUBLE, input_starvation,
+                NULL);
+
+    /* Lets an adaptive source step down before the sink starts dropping,
+     * the QoS event being understood by upstream elements in general. Its
+     * proportion is the load relative to the highest one sustained without
+     * signalling, so above 1.0 while overloaded */
+    if (overloaded) {
+        proportion = (1.0 - headroom) / MAX (1.0 - priv->headroom_threshold, 0.01);
+        gst_pad_push_event (GST_VIDEO_DECODER_SINK_PAD (self),
+                    gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM,
+                        gst_structure_copy (s)));
+        gst_pad_push_event (GST_VIDEO_DECODER_SINK_PAD (self),
+                    gst_event_new_qos (GST_QOS_TYPE_OVERFLOW, proportion, 0,
+                        GST_CLOCK_TIME_NONE));
+    }
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self), s));
+}
+
+static GstStructure *
+gst_amc_video_decoder_get_stats (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstStructure *stats;
+    const gchar *copy_kernel;
+    gdouble copy_bandwidth;
+    gint i;
+
+    copy_kernel = gst_amc_copy_get_kernel (&copy_bandwidth);
+
+    GST_OBJECT_LOCK (self);
+    stats = gst_structure_new ("application/x-amc-video-decoder-stats",
+                "recoveries", G_TYPE_UINT, priv->n_recoveries,
+                "time-to-recover", G_TYPE_UINT64, priv->time_to_recover,
+                "stalls", G_TYPE_UINT, priv->n_stalls,
+                "parallel-codecs", G_TYPE_UINT, priv->n_parallel_codecs,
+                "surface-switches", G_TYPE_UINT, priv->n_surface_switches,
+                "surface-switch-time", G_TYPE_UINT64, priv->surface_switch_time,
+                "software-codec", G_TYPE_BOOLEAN, priv->software_codec,
+                "preemptions", G_TYPE_UINT, priv->n_preemptions,
+                "time-share-switches", G_TYPE_UINT, priv->n_time_share_switches,
+                "time-share-switch-time", G_TYPE_UINT64, priv->time_share_switch_time,
+                "refresh-rate", G_TYPE_DOUBLE, priv->refresh_rate,
+                "decode-load", G_TYPE_DOUBLE, priv->decode_load,
+                "input-starvation", G_TYPE_DOUBLE, priv->input_starvation,
+                "headroom", G_TYPE_DOUBLE, priv->headroom,
+                "stripped-bytes", G_TYPE_UINT64, priv->n_stripped_bytes,
+                "strip-rate", G_TYPE_DOUBLE, priv->strip_rate,
+                "copy-kernel", G_TYPE_STRING, copy_kernel,
+                "copy-bandwidth", G_TYPE_DOUBLE, copy_bandwidth,
+                NULL);
+    for (i = 0; i < N_DROP_REASONS; i++)
+        gst_structure_set (stats, drop_reason_names[i], G_TYPE_UINT64,
+                    priv->n_dropped[i], NULL);
+    GST_OBJECT_UNLOCK (self);
+
+    return stats;
+}
+
+/* Drops @frame, which must not have been queued to the codec */
+static GstFlowReturn
+gst_amc_video_decoder_drop_frame (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, DropReason reason)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    GST_DEBUG_OBJECT (self, "Dropping frame %" GST_TIME_FORMAT " (%s)",
+                GST_TIME_ARGS (frame->pts), drop_reason_names[reason]);
+
+    GST_OBJECT_LOCK (self);
+    priv->n_dropped[reason]++;
+    GST_OBJECT_UNLOCK (self);
+
+    return gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), frame);
+}
+
+/* Decides whether @frame is dropped while waiting for a keyframe,
+ * asking upstream for one at most every KEYFRAME_REQUEST_INTERVAL.
+ * Must be called with the stream lock held */
+static gboolean
+gst_amc_video_decoder_skip_to_keyframe (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstBuffer *buffer = frame->input_buffer;
+    gint64 now;
+
+    if (priv->wait_for_keyframe && !priv->needs_keyframe &&
+                (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_CORRUPTED) ||
+                 (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DISCONT) &&
+                  !GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame)))) {
+        GST_INFO_OBJECT (self, "%s input, waiting for keyframe",
+                    GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_CORRUPTED) ?
+                    "Corrupted" : "Discontinuous");
+        priv->needs_keyframe = TRUE;
+        priv->keyframe_wait_reason = DROP_REASON_DISCONT;
+    }
+
+    if (!priv->needs_keyframe)
+        return FALSE;
+
+    if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame) &&
+                !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_CORRUPTED)) {
+        GST_DEBUG_OBJECT (self, "Got keyframe, resuming");
+        priv->needs_keyframe = FALSE;
+        priv->keyframe_request_time = 0;
+        return FALSE;
+    }
+
+    /* A GOP tail was dropped to catch up with the codec, asking upstream
+     * for an early keyframe would only add to its load */
+    if (priv->keyframe_wait_reason == DROP_REASON_GOP_TAIL)
+        return TRUE;
+
+    now = g_get_monotonic_time ();
+    if (!priv->keyframe_request_time ||
+                now - priv->keyframe_request_time >= KEYFRAME_REQUEST_INTERVAL) {
+        GST_DEBUG_OBJECT (self, "Requesting keyframe from upstream");
+        gst_video_decoder_request_sync_point (GST_VIDEO_DECODER (self), frame, 0);
+        priv->keyframe_request_time = now;
+    }
+
+    return TRUE;
+}
+
+/* Returns the number of frames queued to the codec that the base class
+ * still waits for. Frames the codec never outputs, like hidden or
+ * corrupted ones, are finished by _find_nearest_frame() once later ones
+ * come out, so unlike counting queued and dequeued buffers this doesn't
+ * drift. If more than @allowance are pending, @since is set to the time
+ * the first frame beyond it was queued, the codec should have produced
+ * output from then on. Must be called with the stream lock held */
+static guint
+gst_amc_video_decoder_get_pending_frames (GstAmcVideoDecoder * self,
+            guint allowance, gint64 * since)
+{
+    GList *frames, *l;
+    guint n_pending = 0;
+
+    if (since)
+        *since = 0;
+
+    /* Frames are kept in the order they were handled, and so queued */
+    frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (self));
+    for (l = frames; l; l = l->next) {
+        BufferIdentification *id = gst_video_codec_frame_get_user_data (l->data);
+
+        if (!id)
+            continue;
+        if (n_pending++ == allowance && since)
+            *since = id->queued_time;
+    }
+    g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+
+    return n_pending;
+}
+
+/* Returns the number of frames in flight if max-frames-in-flight are,
+ * otherwise 0. The limit never goes below what the codec must hold back
+ * for reordering, it wouldn't output anything before getting more input.
+ * Must be called with the stream lock held */
+static guint
+gst_amc_video_decoder_get_frames_in_flight (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    guint limit, n_pending;
+
+    if (!priv->max_frames_in_flight)
+        return 0;
+
+    limit = MAX (priv->max_frames_in_flight, (guint) priv->reorder_depth + 1);
+    n_pending = gst_amc_video_decoder_get_pending_frames (self, 0, NULL);
+
+    return n_pending >= limit ? n_pending : 0;
+}
+
+/* Blocks until the codec has less than max-frames-in-flight frames
+ * pending. Returns FALSE if interrupted by flushing, a pending reset or
+ * a downstream error. Must be called with the stream lock held */
+static gboolean
+gst_amc_video_decoder_wait_in_flight (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    guint n_pending;
+
+    while ((n_pending = gst_amc_video_decoder_get_frames_in_flight (self))) {
+        gint64 end_time;
+
+        if (priv->flushing || priv->pending_reset ||
+                    priv->downstream_flow_ret != GST_FLOW_OK)
+            return FALSE;
+
+        GST_LOG_OBJECT (self, "Waiting for %u frames in flight", n_pending);
+
+        /* Re-check regularly, the codec may be reset meanwhile */
+        end_time = g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND;
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        g_mutex_lock (&priv->in_flight_lock);
+        g_cond_wait_until (&priv->in_flight_cond, &priv->in_flight_lock, end_time);
+        g_mutex_unlock (&priv->in_flight_lock);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+    }
+
+    return TRUE;
+}
+
+static void
+gst_amc_video_decoder_post_catch_up (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstStructure *s;
+
+    GST_OBJECT_LOCK (self);
+    s = gst_structure_new ("amc-catch-up",
+                "live-latency", G_TYPE_UINT64, priv->live_latency,
+                "target-latency", G_TYPE_UINT64, priv->target_latency,
+                "render-ahead", G_TYPE_UINT64, priv->catch_up_offset,
+                "state", GST_TYPE_AMC_VIDEO_DECODER_CATCH_UP_STATE, priv->catch_up_state,
+                "dropped", G_TYPE_UINT64, priv->n_dropped[DROP_REASON_CATCH_UP],
+                NULL);
+    GST_OBJECT_UNLOCK (self);
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self), s));
+}
+
+/* Live-edge catch-up controller, run for every input frame with the
+ * stream lock held. The live latency is how long ago the newest frame was
+ * at the live edge, in running time, plus the decoder latency. The excess
+ * over target-latency is first absorbed by rendering early in amcsink,
+ * then by skipping non-reference frames and finally by jumping to the
+ * next keyframe. Returns TRUE if @frame should be dropped */
+static gboolean
+gst_amc_video_decoder_catch_up (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, const guint8 * data, gsize size)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER (self);
+    GstAmcVideoDecoderCatchUpState state;
+    GstClockTime running_time, now, lag, live_latency, excess, offset;
+    GstClock *clock;
+    gint64 report_time;
+    gboolean drop = FALSE;
+
+    GST_OBJECT_LOCK (self);
+    if (GST_STATE (self) != GST_STATE_PLAYING || !(clock = GST_ELEMENT_CLOCK (self))) {
+        GST_OBJECT_UNLOCK (self);
+        return FALSE;
+    }
+    gst_object_ref (clock);
+    now = gst_clock_get_time (clock) - GST_ELEMENT_CAST (self)->base_time;
+    GST_OBJECT_UNLOCK (self);
+    gst_object_unref (clock);
+
+    running_time = gst_segment_to_running_time (&decoder->input_segment,
+                GST_FORMAT_TIME, frame->pts);
+    if (!GST_CLOCK_TIME_IS_VALID (running_time))
+        return FALSE;
+
+    lag = now > running_time ? now - running_time : 0;
+    if (GST_CLOCK_TIME_IS_VALID (priv->latency))
+        lag += priv->latency;
+
+    GST_OBJECT_LOCK (self);
+    if (priv->live_latency)
+        priv->live_latency = (priv->live_latency * 3 + lag) / 4;
+    else
+        priv->live_latency = lag;
+    live_latency = priv->live_latency;
+    GST_OBJECT_UNLOCK (self);
+
+    excess = live_latency > priv->target_latency ?
+        live_latency - priv->target_latency : 0;
+    offset = MIN (excess, priv->max_render_ahead);
+
+    if (excess > priv->jump_threshold)
+        state = GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_JUMP;
+    else if (excess > priv->max_render_ahead)
+        state = GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_SKIP;
+    else if (excess > 0)
+        state = GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_RENDER_AHEAD;
+    else
+        state = GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_IDLE;
+
+    if ((offset > priv->catch_up_offset ? offset - priv->catch_up_offset :
+                priv->catch_up_offset - offset) >= CATCH_UP_OFFSET_STEP ||
+                (offset == 0 && priv->catch_up_offset != 0)) {
+        GST_DEBUG_OBJECT (self, "Render-ahead %" GST_TIME_FORMAT " for live latency %"
+                    GST_TIME_FORMAT, GST_TIME_ARGS (offset), GST_TIME_ARGS (live_latency));
+        priv->catch_up_offset = offset;
+        gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self),
+                    gst_event_new_custom (GST_EVENT_CUSTOM_DOWNSTREAM_OOB,
+                        gst_structure_new ("amc-catch-up",
+                            "offset", G_TYPE_UINT64, offset, NULL)));
+    }
+
+    if (state == GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_JUMP &&
+                !GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame)) {
+        if (!priv->needs_keyframe)
+            GST_INFO_OBJECT (self, "Live latency %" GST_TIME_FORMAT
+                        ", jumping to next keyframe", GST_TIME_ARGS (live_latency));
+        priv->needs_keyframe = TRUE;
+        priv->keyframe_wait_reason = DROP_REASON_CATCH_UP;
+        drop = TRUE;
+    } else if (state == GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_SKIP &&
+                gst_amc_video_decoder_is_non_reference (self, data, size)) {
+        drop = TRUE;
+    }
+
+    GST_OBJECT_LOCK (self);
+    priv->catch_up_state = state;
+    GST_OBJECT_UNLOCK (self);
+
+    report_time = g_get_monotonic_time ();
+    if (report_time - priv->catch_up_report_time >= CATCH_UP_REPORT_INTERVAL) {
+        priv->catch_up_report_time = report_time;
+        gst_amc_video_decoder_post_catch_up (self);
+    }
+
+    return drop;
+}
+
+/* Returns TRUE if the call that failed with the transient error @err is
+ * to be retried, @start holding the time of the first failure in a row.
+ * Otherwise @err is made recoverable for the reset that follows */
+static gboolean
+gst_amc_video_decoder_retry_transient (GstAmcVideoDecoder * self, GError * err,
+            gint64 * start)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    if (!*start)
+        *start = now;
+    if (now - *start < TRANSIENT_ERROR_MAX_DURATION)
+        return TRUE;
+
+    GST_WARNING_OBJECT (self, "Transient failures for %" G_GINT64_FORMAT
+                " ms, escalating: %s", (now - *start) / G_TIME_SPAN_MILLISECOND,
+                err->message);
+    *start = 0;
+    err->code = GST_AMC_CODEC_ERROR_RECOVERABLE;
+
+    return FALSE;
+}
+
+/* Marks the codec for an in-place reset if @err is a recoverable
+ * codec error and the recovery budget allows it.
+ * Must be called with the stream lock held */
+static gboolean
+gst_amc_video_decoder_schedule_reset (GstAmcVideoDecoder * self, GError * err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gint64 now = g_get_monotonic_time ();
+    guint expired = 0;
+
+    /* Failing because the window is gone, not a codec error */
+    if (g_atomic_int_get (&priv->codec_stopped))
+        return TRUE;
+
+    if (!g_error_matches (err, GST_AMC_CODEC_ERROR, GST_AMC_CODEC_ERROR_RECOVERABLE))
+        return FALSE;
+
+    if (priv->pending_reset) {
+        /* Escalate a pending watchdog flush */
+        priv->reset_flush_only = FALSE;
+        return TRUE;
+    }
+
+    while (expired < priv->recovery_times->len &&
+                now - g_array_index (priv->recovery_times, gint64, expired) >
+                60 * G_TIME_SPAN_SECOND)
+        expired++;
+    g_array_remove_range (priv->recovery_times, 0, expired);
+
+    if (priv->recovery_times->len >= priv->max_recoveries_per_minute) {
+        GST_WARNING_OBJECT (self, "Not recovering, %u recoveries in the last minute",
+                    priv->recovery_times->len);
+        return FALSE;
+    }
+    g_array_append_val (priv->recovery_times, now);
+
+    GST_WARNING_OBJECT (self, "Recoverable codec error, resetting codec: %s",
+                err->message);
+    priv->pending_reset = TRUE;
+    priv->reset_flush_only = FALSE;
+    if (!priv->recovery_start)
+        priv->recovery_start = now;
+
+    return TRUE;
+}
+
+/* Called with the stream lock held when the first frame after a reset
+ * is output */
+static void
+gst_amc_video_decoder_post_recovery (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstClockTime time_to_recover;
+    guint n_recoveries;
+
+    time_to_recover = (g_get_monotonic_time () - priv->recovery_start) * GST_USECOND;
+    priv->recovery_start = 0;
+
+    GST_OBJECT_LOCK (self);
+    n_recoveries = ++priv->n_recoveries;
+    priv->time_to_recover = time_to_recover;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_INFO_OBJECT (self, "Recovered from codec error in %" GST_TIME_FORMAT,
+                GST_TIME_ARGS (time_to_recover));
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self),
+                    gst_structure_new ("amc-recovery",
+                        "recoveries", G_TYPE_UINT, n_recoveries,
+                        "time-to-recover", G_TYPE_UINT64, time_to_recover,
+                        NULL)));
+}
+
+/* Restarts the watchdog bookkeeping for a new or flushed codec */
+static void
+gst_amc_video_decoder_reset_watchdog (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    priv->last_progress_time = g_get_monotonic_time ();
+}
+
+/* Called from the srcpad loop with the stream lock held when no output
+ * buffer was available. Schedules a flush, or a reset if flushing didn't
+ * help, once the codec held on to more input than it needs for reordering
+ * for too long */
+static gboolean
+gst_amc_video_decoder_check_stall (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstClockTime frame_duration, threshold, stall;
+    gboolean flush_only;
+    guint n_stalls, n_pending;
+    gint64 since;
+
+    if (!priv->watchdog || priv->pending_reset)
+        return FALSE;
+
+    /* Up to the reorder depth may wait for more input during idle gaps */
+    n_pending = gst_amc_video_decoder_get_pending_frames (self,
+                priv->reorder_depth + 1, &since);
+    if (!since)
+        return FALSE;
+
+    frame_duration = gst_amc_video_decoder_get_frame_duration (self);
+    threshold = MAX (WATCHDOG_MIN_STALL,
+                (priv->reorder_depth + WATCHDOG_STALL_FRAMES) * frame_duration);
+    since = MAX (since, priv->last_progress_time);
+    stall = (g_get_monotonic_time () - since) * GST_USECOND;
+    if (stall < threshold)
+        return FALSE;
+
+    flush_only = !priv->watchdog_flushed;
+    GST_WARNING_OBJECT (self, "No output for %" GST_TIME_FORMAT " with %u"
+                " frames pending, %s codec", GST_TIME_ARGS (stall),
+                n_pending, flush_only ? "flushing" : "resetting");
+
+    priv->pending_reset = TRUE;
+    priv->reset_flush_only = flush_only;
+    priv->watchdog_flushed = TRUE;
+
+    GST_OBJECT_LOCK (self);
+    n_stalls = ++priv->n_stalls;
+    GST_OBJECT_UNLOCK (self);
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self),
+                    gst_structure_new ("amc-watchdog",
+                        "action", G_TYPE_STRING, flush_only ? "flush" : "reset",
+                        "stall-duration", G_TYPE_UINT64, stall,
+                        "pending-frames", G_TYPE_UINT64, (guint64) n_pending,
+                        "stalls", G_TYPE_UINT, n_stalls,
+                        NULL)));
+
+    return TRUE;
+}
+
+static gboolean
+gst_amc_video_decoder_set_src_caps (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstVideoCodecState *state;
+    gint width = priv->width, height = priv->height;
+    gboolean ret;
+
+    /* The visible rectangle once the codec told us */
+    if (priv->has_output_format) {
+        width = priv->output_format.crop_right - priv->output_format.crop_left + 1;
+        height = priv->output_format.crop_bottom - priv->output_format.crop_top + 1;
+    }
+
+    if (priv->gl_output) {
+        state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (self),
+                    GST_VIDEO_FORMAT_RGBA, width, height, priv->input_state);
+        if (state->caps)
+            gst_caps_unref (state->caps);
+        state->caps = gst_video_info_to_caps (&state->info);
+        gst_caps_set_features (state->caps, 0,
+                    gst_caps_features_new (GST_CAPS_FEATURE_MEMORY_GL_MEMORY, NULL));
+        gst_caps_set_simple (state->caps, "texture-target", G_TYPE_STRING,
+                    gst_gl_texture_target_to_string (GST_GL_TEXTURE_TARGET_2D),
+                    NULL);
+
+        /* Allocated again at the new size with the next frame */
+        if (priv->gl_pool) {
+            gst_buffer_pool_set_active (priv->gl_pool, FALSE);
+            gst_object_unref (priv->gl_pool);
+            priv->gl_pool = NULL;
+        }
+    } else if (priv->raw_output) {
+        state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (self),
+                    GST_VIDEO_INFO_FORMAT (&priv->layout.info),
+                    GST_VIDEO_INFO_WIDTH (&priv->layout.info),
+                    GST_VIDEO_INFO_HEIGHT (&priv->layout.info),
+                    priv->input_state);
+    } else {
+        state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (self),
+                    GST_VIDEO_FORMAT_ENCODED, width, height, priv->input_state);
+        if (state->caps)
+            gst_caps_unref (state->caps);
+        state->caps = gst_caps_new_empty_simple ("video/x-amc-direct");
+    }
+    ret = gst_video_decoder_negotiate (GST_VIDEO_DECODER (self));
+    gst_video_codec_state_unref (state);
+
+    return ret;
+}
+
+/* Output @out for amcsink to render, released unrendered if dropped
+ * on the way */
+static GstBuffer *
+gst_amc_video_decoder_new_buffer (GstAmcVideoDecoder * self, const AmcDecFrame * out)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    return gst_amc_output_pool_acquire (GST_AMC_OUTPUT_POOL (priv->output_pool),
+                priv->dec, out);
+}
+
+static gboolean
+gst_amc_video_decoder_get_output_buffers (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (priv->output_buffers)
+        gst_amc_codec_free_buffers (priv->output_buffers, priv->n_output_buffers);
+    priv->output_buffers = gst_amc_codec_get_output_buffers (priv->codec,
+                &priv->n_output_buffers, err);
+
+    return priv->output_buffers != NULL;
+}
+
+/* Copies @out into system memory and finishes @frame with it. The
+ * codec buffer is released by the caller */
+static GstFlowReturn
+gst_amc_video_decoder_finish_raw_frame (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, const AmcDecFrame * out)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER (self);
+    gint idx = out->index;
+    GstVideoCodecState *state;
+    GstVideoFrame vframe;
+    GstBuffer *outbuf;
+    GError *err = NULL;
+    gboolean copied = FALSE;
+
+    /* Vendor formats are copied through getOutputImage() instead */
+    if (!priv->layout.use_image && idx >= priv->n_output_buffers &&
+                !gst_amc_video_decoder_get_output_buffers (self, &err) && err)
+        GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+    if (!priv->layout.use_image && idx >= priv->n_output_buffers) {
+        GST_ERROR_OBJECT (self, "Invalid output buffer index %d of %zu",
+                    idx, priv->n_output_buffers);
+        return frame ? gst_video_decoder_drop_frame (decoder, frame) : GST_FLOW_OK;
+    }
+
+    if (frame) {
+        GstFlowReturn flow_ret = gst_video_decoder_allocate_output_frame (decoder, frame);
+
+        if (flow_ret != GST_FLOW_OK) {
+            gst_video_decoder_release_frame (decoder, frame);
+            return flow_ret;
+        }
+        outbuf = frame->output_buffer;
+    } else {
+        outbuf = gst_video_decoder_allocate_output_buffer (decoder);
+        if (!outbuf)
+            return GST_FLOW_ERROR;
+    }
+
+    state = gst_video_decoder_get_output_state (decoder);
+    if (state && gst_video_frame_map (&vframe, &state->info, outbuf, GST_MAP_WRITE)) {
+        if (priv->layout.use_image) {
+            copied = gst_amc_codec_copy_output_image (priv->codec, idx,
+                        &priv->layout, &vframe, &err);
+            if (!copied) {
+                GST_WARNING_OBJECT (self, "%s", err->message);
+                g_clear_error (&err);
+            }
+        } else {
+            copied = gst_amc_video_layout_copy (&priv->layout,
+                        priv->output_buffers[idx].data + out->offset,
+                        out->size, &vframe);
+        }
+        gst_video_frame_unmap (&vframe);
+    }
+    if (state)
+        gst_video_codec_state_unref (state);
+
+    if (!copied) {
+        GST_WARNING_OBJECT (self, "Failed to copy output buffer %d", idx);
+        if (frame)
+            return gst_video_decoder_drop_frame (decoder, frame);
+        gst_buffer_unref (outbuf);
+        return GST_FLOW_OK;
+    }
+
+    if (frame)
+        return gst_video_decoder_finish_frame (decoder, frame);
+
+    GST_BUFFER_PTS (outbuf) =
+        gst_util_uint64_scale (out->pts_us, GST_USECOND, 1);
+    return gst_pad_push (GST_VIDEO_DECODER_SRC_PAD (self), outbuf);
+}
+
+#ifndef GL_TEXTURE_EXTERNAL_OES
+#define GL_TEXTURE_EXTERNAL_OES (0x8D65)
+#endif
+
+/* Frames rendered by the codec take a moment to reach the SurfaceTexture */
+#define GL_FRAME_WAIT_TIMEOUT (100 * G_TIME_SPAN_MILLISECOND)
+
+/* Takes one image queued on the SurfaceTexture, FALSE if none showed up
+ * in time. Called without the stream lock held */
+static gboolean
+gst_amc_video_decoder_wait_gl_frame (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gint64 end_time = g_get_monotonic_time () + GL_FRAME_WAIT_TIMEOUT;
+    gboolean ret;
+
+    g_mutex_lock (&priv->gl_frame_lock);
+    while (!priv->gl_frames_available && !priv->flushing) {
+        if (!g_cond_wait_until (&priv->gl_frame_cond, &priv->gl_frame_lock, end_time))
+            break;
+    }
+    ret = priv->gl_frames_available > 0;
+    if (ret)
+        priv->gl_frames_available--;
+    g_mutex_unlock (&priv->gl_frame_lock);
+
+    return ret;
+}
+
+static void
+_gl_latch_frame (GstGLContext * context, GstAmcVideoDecoderGLFrame * frame)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (frame->self);
+    static const gfloat yflip_matrix[16] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, -1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 1.0f
+    };
+    gfloat matrix[16];
+    GError *err = NULL;
+
+    if (!gst_amc_surface_texture_update_tex_image (priv->surface_texture, &err))
+        goto error;
+    if (!gst_amc_surface_texture_get_timestamp (priv->surface_texture,
+                    &frame->latched, &err))
+        goto error;
+    if (!gst_amc_surface_texture_get_transform_matrix (priv->surface_texture,
+                    matrix, &err))
+        goto error;
+
+    /* SurfaceTexture matrices have their origin at the bottom left */
+    gst_gl_multiply_matrix4 (yflip_matrix, matrix, frame->matrix);
+    gst_gl_multiply_matrix4 (frame->matrix, yflip_matrix, frame->matrix);
+
+    frame->updated = TRUE;
+    return;
+
+error:
+    GST_ERROR_OBJECT (frame->self, "Failed to update texture image: %s",
+                err->message);
+    g_clear_error (&err);
+}
+
+static gboolean
+_gl_draw_frame_quad (GstAmcVideoDecoderGLFrame * frame)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (frame->self);
+    const GstGLFuncs *gl = priv->gl_context->gl_vtable;
+    static const GLfloat vertices[] = {
+        -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
+        1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+        -1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+        1.0f, 1.0f, 0.0f, 1.0f, 1.0f
+    };
+    GLint position, texcoord;
+
+    gst_gl_shader_use (priv->gl_shader);
+    gl->ActiveTexture (GL_TEXTURE0);
+    gl->BindTexture (GL_TEXTURE_EXTERNAL_OES, priv->gl_texture);
+    gst_gl_shader_set_uniform_1i (priv->gl_shader, "tex", 0);
+    gst_gl_shader_set_uniform_matrix_4fv (priv->gl_shader, "u_transformation",
+                1, FALSE, frame->matrix);
+
+    position = gst_gl_shader_get_attribute_location (priv->gl_shader, "a_position");
+    texcoord = gst_gl_shader_get_attribute_location (priv->gl_shader, "a_texcoord");
+    gl->BindBuffer (GL_ARRAY_BUFFER, 0);
+    gl->VertexAttribPointer (position, 3, GL_FLOAT, GL_FALSE,
+                5 * sizeof (GLfloat), vertices);
+    gl->VertexAttribPointer (texcoord, 2, GL_FLOAT, GL_FALSE,
+                5 * sizeof (GLfloat), vertices + 3);
+    gl->EnableVertexAttribArray (position);
+    gl->EnableVertexAttribArray (texcoord);
+
+    gl->DrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+
+    gl->DisableVertexAttribArray (position);
+    gl->DisableVertexAttribArray (texcoord);
+    gl->BindTexture (GL_TEXTURE_EXTERNAL_OES, 0);
+    gst_gl_context_clear_shader (priv->gl_context);
+
+    return TRUE;
+}
+
+static void
+_gl_draw_frame (GstGLContext * context, GstAmcVideoDecoderGLFrame * frame)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (frame->self);
+    GstGLMemory *mem = (GstGLMemory *) gst_buffer_peek_memory (frame->outbuf, 0);
+    GstGLSyncMeta *sync_meta;
+    guint width, height;
+
+    width = gst_gl_memory_get_texture_width (mem);
+    height = gst_gl_memory_get_texture_height (mem);
+    if (priv->gl_fbo) {
+        guint fbo_width, fbo_height;
+
+        gst_gl_framebuffer_get_effective_dimensions (priv->gl_fbo,
+                    &fbo_width, &fbo_height);
+        if (fbo_width != width || fbo_height != height) {
+            gst_object_unref (priv->gl_fbo);
+            priv->gl_fbo = NULL;
+        }
+    }
+    if (!priv->gl_fbo)
+        priv->gl_fbo = gst_gl_framebuffer_new_with_default_depth (context,
+                    width, height);
+
+    frame->updated = gst_gl_framebuffer_draw_to_texture (priv->gl_fbo, mem,
+                (GstGLFramebufferFunc) _gl_draw_frame_quad, frame);
+
+    sync_meta = gst_buffer_get_gl_sync_meta (frame->outbuf);
+    if (sync_meta)
+        gst_gl_sync_meta_set_sync_point (sync_meta, context);
+}
+
+static gboolean
+gst_amc_video_decoder_ensure_gl_pool (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstVideoCodecState *state;
+    GstBufferPool *pool;
+    GstStructure *config;
+    gboolean ret;
+
+    if (priv->gl_pool)
+        return TRUE;
+
+    state = gst_video_decoder_get_output_state (GST_VIDEO_DECODER (self));
+    if (!state)
+        return FALSE;
+
+    pool = gst_gl_buffer_pool_new (priv->gl_context);
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, state->caps,
+                GST_VIDEO_INFO_SIZE (&state->info), 0, 0);
+    gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+    gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_GL_SYNC_META);
+    ret = gst_buffer_pool_set_config (pool, config) &&
+        gst_buffer_pool_set_active (pool, TRUE);
+    gst_video_codec_state_unref (state);
+
+    if (!ret) {
+        GST_ERROR_OBJECT (self, "Failed to set up GL buffer pool");
+        gst_object_unref (pool);
+        return FALSE;
+    }
+    priv->gl_pool = pool;
+
+    return TRUE;
+}
+
+/* Latches the image the codec rendered for @pts and draws it into a
+ * texture of its own. Called with the stream lock held */
+static GstBuffer *
+gst_amc_video_decoder_new_gl_buffer (GstAmcVideoDecoder * self, GstClockTime pts)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcVideoDecoderGLFrame frame;
+    gboolean available;
+
+    frame.self = self;
+    frame.timestamp = pts;
+    frame.latched = -1;
+    frame.outbuf = NULL;
+
+    /* Images are latched in queue order, skipping those of frames that
+     * timed out before */
+    while (frame.latched < frame.timestamp) {
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        available = gst_amc_video_decoder_wait_gl_frame (self);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+        if (priv->flushing)
+            return NULL;
+        if (!available) {
+            GST_WARNING_OBJECT (self, "Timed out waiting for frame %"
+                        G_GINT64_FORMAT ", latched %" G_GINT64_FORMAT,
+                        frame.timestamp, frame.latched);
+            if (frame.latched < 0)
+                return NULL;
+            break;
+        }
+
+        frame.updated = FALSE;
+        gst_gl_context_thread_add (priv->gl_context,
+                    (GstGLContextThreadFunc) _gl_latch_frame, &frame);
+        if (!frame.updated)
+            return NULL;
+    }
+
+    if (!gst_amc_video_decoder_ensure_gl_pool (self))
+        return NULL;
+    if (gst_buffer_pool_acquire_buffer (priv->gl_pool, &frame.outbuf,
+                    NULL) != GST_FLOW_OK)
+        return NULL;
+
+    frame.updated = FALSE;
+    gst_gl_context_thread_add (priv->gl_context,
+                (GstGLContextThreadFunc) _gl_draw_frame, &frame);
+    if (!frame.updated) {
+        GST_ERROR_OBJECT (self, "Failed to draw frame %" G_GINT64_FORMAT,
+                    frame.timestamp);
+        gst_buffer_unref (frame.outbuf);
+        return NULL;
+    }
+
+    return frame.outbuf;
+}
+
+static void
+gst_amc_video_decoder_loop (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstFlowReturn flow_ret = GST_FLOW_OK;
+    gboolean release_buffer = TRUE;
+    GstVideoCodecFrame *frame;
+    gint64 transient_start = 0, wait_start;
+    gboolean backlog;
+    GError *err = NULL;
+    GstBuffer *outbuf;
+    gboolean is_eos;
+    AmcDecResult res;
+    AmcDecFrame out;
+
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+
+    /* Only a codec holding more input than the next output needs keeps
+     * the loop waiting on its own account */
+    wait_start = g_get_monotonic_time ();
+    backlog = gst_amc_video_decoder_get_pending_frames (self, 0, NULL) >
+        priv->reorder_depth + 1;
+
+retry:
+    GST_DEBUG_OBJECT (self, "Waiting for available output buffer");
+    priv->output_wait_start = wait_start;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    /* Wait at most 100ms here, some codecs don't fail dequeueing if
+    * the codec is flushing, causing deadlocks during shutdown */
+    res = amc_dec_pull (priv->dec, &out, 100000, &err);
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    priv->output_wait_start = 0;
+
+    if (res != AMC_DEC_OK && res != AMC_DEC_EOS) {
+        if (priv->flushing) {
+            g_clear_error (&err);
+            goto flushing;
+        }
+
+        /* Restarted once the codec is configured for a new window */
+        if (g_atomic_int_get (&priv->codec_stopped))
+            goto recover;
+
+        switch (res) {
+        case AMC_DEC_BUFFERS_CHANGED:
+            GST_DEBUG_OBJECT (self, "Output buffers have changed");
+
+            /* Only reported for output copied out */
+            if (!gst_amc_video_decoder_get_output_buffers (self, &err))
+                goto format_error;
+            break;
+        case AMC_DEC_FORMAT_CHANGED:
+        {
+            const GstAmcVideoOutputFormat *output_format;
+
+            GST_DEBUG_OBJECT (self, "Output format has changed");
+
+            output_format = amc_dec_get_output_format (priv->dec);
+            if (priv->has_output_format &&
+                        gst_amc_video_output_format_is_equal (output_format,
+                            &priv->output_format)) {
+                GST_DEBUG_OBJECT (self, "Output format unchanged, not renegotiating");
+                goto retry;
+            }
+
+            if (priv->raw_output &&
+                        !gst_amc_video_layout_from_output_format (&priv->layout,
+                            output_format, &err))
+                goto format_error;
+
+            priv->output_format = *output_format;
+            priv->has_output_format = TRUE;
+
+            if (!gst_amc_video_decoder_set_src_caps (self))
+                goto format_error;
+
+            goto retry;
+            break;
+        }
+        case AMC_DEC_TRY_AGAIN:
+            GST_DEBUG_OBJECT (self, "Dequeueing output buffer timed out");
+            if (gst_amc_video_decoder_check_stall (self))
+                goto recover;
+            goto retry;
+            break;
+        case AMC_DEC_ERROR:
+            if (g_error_matches (err, GST_AMC_CODEC_ERROR,
+                            GST_AMC_CODEC_ERROR_TRANSIENT) &&
+                        gst_amc_video_decoder_retry_transient (self, err,
+                            &transient_start)) {
+                GST_DEBUG_OBJECT (self, "Transient failure dequeueing output buffer: %s",
+                            err->message);
+                g_clear_error (&err);
+                GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+                g_usleep (TRANSIENT_ERROR_RETRY_DELAY);
+                GST_VIDEO_DECODER_STREAM_LOCK (self);
+                goto retry;
+            }
+            if (gst_amc_video_decoder_schedule_reset (self, err))
+                goto recover;
+            GST_ERROR_OBJECT (self, "Failure dequeueing output buffer");
+            goto dequeue_error;
+            break;
+        default:
+            g_assert_not_reached ();
+            break;
+        }
+
+        goto retry;
+    }
+
+    is_eos = res == AMC_DEC_EOS;
+    if (is_eos) {
+        GST_DEBUG_OBJECT (self, "Got end of stream");
+        /* Nothing to output or release */
+        out.size = 0;
+        release_buffer = FALSE;
+    } else {
+        GST_DEBUG_OBJECT (self, "Got output buffer at index %d: size %d time %"
+                    G_GINT64_FORMAT, out.index, out.size, out.pts_us);
+    }
+    transient_start = 0;
+
+    priv->last_progress_time = g_get_monotonic_time ();
+    priv->watchdog_flushed = FALSE;
+    if (backlog) {
+        priv->load_busy += priv->last_progress_time - wait_start;
+        priv->load_outputs++;
+    }
+
+    g_mutex_lock (&priv->in_flight_lock);
+    g_cond_broadcast (&priv->in_flight_cond);
+    g_mutex_unlock (&priv->in_flight_lock);
+
+    frame = is_eos ? NULL : _find_nearest_frame (self,
+                gst_util_uint64_scale (out.pts_us, GST_USECOND, 1));
+    if (frame)
+        gst_amc_video_decoder_update_latency (self,
+                    gst_video_codec_frame_get_user_data (frame));
+    if (priv->headroom_threshold > 0)
+        gst_amc_video_decoder_update_load (self);
+
+    if (frame && (gst_video_decoder_get_max_decode_time (GST_VIDEO_DECODER (self), frame)) < 0) {
+        flow_ret = gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_LATE);
+    } else if (out.size > 0 && priv->gl_output) {
+        /* Render into the SurfaceTexture, the GL thread latches it */
+        if (amc_dec_render (priv->dec, &out, 0, &err) != AMC_DEC_OK) {
+            if (priv->flushing) {
+                g_clear_error (&err);
+                goto flushing;
+            }
+            goto failed_release;
+        }
+        release_buffer = FALSE;
+
+        outbuf = gst_amc_video_decoder_new_gl_buffer (self,
+                    gst_util_uint64_scale (out.pts_us, GST_USECOND, 1));
+        if (!outbuf) {
+            if (frame)
+                flow_ret = gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), frame);
+        } else if (frame) {
+            frame->output_buffer = outbuf;
+            flow_ret = gst_video_decoder_finish_frame (GST_VIDEO_DECODER (self), frame);
+        } else {
+            GST_BUFFER_PTS (outbuf) =
+                gst_util_uint64_scale (out.pts_us, GST_USECOND, 1);
+            flow_ret = gst_pad_push (GST_VIDEO_DECODER_SRC_PAD (self), outbuf);
+        }
+    } else if (out.size > 0 && priv->raw_output) {
+        /* Copied out, the codec buffer is released below */
+        flow_ret = gst_amc_video_decoder_finish_raw_frame (self, frame, &out);
+    } else if (out.size > 0) {
+        if (!(outbuf = gst_amc_video_decoder_new_buffer (self, &out))) {
+            if (amc_dec_release (priv->dec, &out, &err) != AMC_DEC_OK)
+                GST_ERROR_OBJECT (self, "Failed to release output buffer index %d",
+                            out.index);
+            if (err && !priv->flushing)
+                GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+            g_clear_error (&err);
+            goto flow_error;
+        }
+
+        if (frame) {
+            frame->output_buffer = outbuf;
+            gst_video_decoder_finish_frame (GST_VIDEO_DECODER (self), frame);
+        } else {
+            GST_BUFFER_PTS (outbuf) =
+                gst_util_uint64_scale (out.pts_us, GST_USECOND, 1);
+            flow_ret = gst_pad_push (GST_VIDEO_DECODER_SRC_PAD (self), outbuf);
+        }
+        release_buffer = FALSE;
+    } else if (frame != NULL) {
+        flow_ret = gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), frame);
+    }
+
+    if (release_buffer) {
+        if (amc_dec_release (priv->dec, &out, &err) != AMC_DEC_OK) {
+            if (priv->flushing) {
+                g_clear_error (&err);
+                goto flushing;
+            }
+            goto failed_release;
+        }
+    }
+
+    if (is_eos || flow_ret == GST_FLOW_EOS) {
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        g_mutex_lock (&priv->drain_lock);
+        if (priv->draining) {
+            GST_DEBUG_OBJECT (self, "Drained");
+            priv->draining = FALSE;
+            g_cond_broadcast (&priv->drain_cond);
+        } else if (flow_ret == GST_FLOW_OK) {
+            GST_DEBUG_OBJECT (self, "Component signalled EOS");
+            flow_ret = GST_FLOW_EOS;
+        }
+        g_mutex_unlock (&priv->drain_lock);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+    } else {
+        GST_DEBUG_OBJECT (self, "Finished frame: %s", gst_flow_get_name (flow_ret));
+    }
+
+    priv->downstream_flow_ret = flow_ret;
+
+    if (flow_ret != GST_FLOW_OK)
+      goto flow_error;
+
+    if (priv->recovery_start && out.size > 0 && !priv->pending_reset)
+        gst_amc_video_decoder_post_recovery (self);
+
+    if (priv->surface_switch_start && out.size > 0 && !priv->pending_reset) {
+        gst_amc_video_decoder_post_surface_switch (self, "reconfigure",
+                    priv->surface_switch_start);
+        priv->surface_switch_start = 0;
+    }
 
-retry:
-    GST_DEBUG_OBJECT (self, "Waiting for available output buffer");
     GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    /* Wait at most 100ms here, some codecs don't fail dequeueing if
-    * the codec is flushing, causing deadlocks during shutdown */
-    idx = gst_amc_codec_dequeue_output_buffer (priv->codec, &buffer_info, 100000, &err);
-    GST_VIDEO_DECODER_STREAM_LOCK (self);
 
-    if (idx < 0) {
-        if (priv->flushing) {
-            g_clear_error (&err);
-            goto flushing;
+    return;
+
+dequeue_error:
+    GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    priv->downstream_flow_ret = GST_FLOW_ERROR;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    return;
+
+format_error:
+    if (err)
+      GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+    else
+      GST_ELEMENT_ERROR (self, LIBRARY, FAILED, (NULL), ("Failed to handle format"));
+    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    priv->downstream_flow_ret = GST_FLOW_ERROR;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    return;
+failed_release:
+    if (gst_amc_video_decoder_schedule_reset (self, err))
+        goto recover;
+    GST_VIDEO_DECODER_ERROR_FROM_ERROR (self, err);
+    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    priv->downstream_flow_ret = GST_FLOW_ERROR;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    return;
+flushing:
+    GST_DEBUG_OBJECT (self, "Flushing -- stopping task");
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    priv->downstream_flow_ret = GST_FLOW_FLUSHING;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    return;
+recover:
+    /* The streaming thread resets the codec with the next input */
+    GST_DEBUG_OBJECT (self, "Codec needs reset -- stopping task");
+    g_clear_error (&err);
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    /* Nothing will come out of this codec anymore */
+    g_mutex_lock (&priv->drain_lock);
+    if (priv->draining) {
+        priv->draining = FALSE;
+        g_cond_broadcast (&priv->drain_cond);
+    }
+    g_mutex_unlock (&priv->drain_lock);
+    return;
+flow_error:
+    if (flow_ret == GST_FLOW_EOS) {
+        GST_DEBUG_OBJECT (self, "EOS");
+        gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self),
+        gst_event_new_eos ());
+        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    } else if (flow_ret < GST_FLOW_EOS) {
+        GST_ELEMENT_ERROR (self, STREAM, FAILED,
+        ("Internal data stream error."), ("stream stopped, reason %s",
+        gst_flow_get_name (flow_ret)));
+        gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self),
+        gst_event_new_eos ());
+        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    } else if (flow_ret == GST_FLOW_FLUSHING) {
+        GST_DEBUG_OBJECT (self, "Flushing -- stopping task");
+        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    }
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    return;
+}
+
+static gboolean
+gst_amc_video_decoder_start (GstVideoDecoder * decoder)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    priv->last_upstream_ts = 0;
+    priv->drained = TRUE;
+    priv->downstream_flow_ret = GST_FLOW_OK;
+    priv->started = FALSE;
+    priv->flushing = TRUE;
+    priv->has_output_format = FALSE;
+    priv->reorder_depth = mime_to_default_reorder_depth (priv->mime);
+    priv->decode_time = GST_CLOCK_TIME_NONE;
+    priv->latency = GST_CLOCK_TIME_NONE;
+    priv->latency_lower_since = 0;
+    priv->pending_reset = FALSE;
+    priv->needs_keyframe = FALSE;
+    priv->keyframe_request_time = 0;
+    priv->recovery_start = 0;
+    priv->reset_flush_only = FALSE;
+    priv->surface_switch_start = 0;
+    priv->parked = FALSE;
+    g_atomic_int_set (&priv->codec_stopped, FALSE);
+    priv->watchdog_flushed = FALSE;
+    priv->catch_up_offset = 0;
+    priv->catch_up_report_time = 0;
+    priv->load_window_start = 0;
+    priv->overloaded = FALSE;
+    priv->strip_window_start = 0;
+    priv->strip_window_bytes = 0;
+    priv->refresh_window_start = 0;
+    priv->n_window_refreshes = 0;
+    GST_OBJECT_LOCK (self);
+    priv->live_latency = 0;
+    priv->catch_up_state = GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_IDLE;
+    GST_OBJECT_UNLOCK (self);
+    g_array_set_size (priv->recovery_times, 0);
+    gst_video_info_init (&priv->layout.info);
+    priv->next_thumbnail = GST_CLOCK_TIME_NONE;
+
+    return TRUE;
+}
+
+static gboolean
+gst_amc_video_decoder_stop (GstVideoDecoder * decoder)
+{
+    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GError *err = NULL;
+
+    GST_DEBUG_OBJECT (self, "Stopping decoder");
+    priv->flushing = TRUE;
+    if (priv->gop_pool)
+        gst_amc_gop_pool_free (priv->gop_pool);
+    priv->gop_pool = NULL;
+    if (priv->gop)
+        gst_amc_gop_free (priv->gop);
+    priv->gop = NULL;
+    GST_OBJECT_LOCK (self);
+    priv->n_parallel_codecs = 0;
+    GST_OBJECT_UNLOCK (self);
+    if (priv->shared_codec) {
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+        gst_amc_video_decoder_end_shared_gop (self, TRUE);
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        gst_amc_shared_codec_unref (priv->shared_codec);
+        priv->shared_codec = NULL;
+        priv->started = FALSE;
+    }
+    g_atomic_int_set (&priv->shared_flushing, FALSE);
+    if (priv->shared_format)
+        gst_amc_format_free (priv->shared_format);
+    priv->shared_format = NULL;
+    g_free (priv->shared_config);
+    priv->shared_config = NULL;
+    if (priv->started) {
+        gst_amc_video_decoder_detach_window (self);
+        gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+        if (!g_atomic_int_get (&priv->codec_stopped)) {
+            gst_amc_video_decoder_flush_codec (self, &err);
+            if (err)
+              GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+            gst_amc_codec_stop (priv->codec, &err);
+            if (err)
+              GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+        }
+        priv->started = FALSE;
+        if (priv->output_buffers)
+          gst_amc_codec_free_buffers (priv->output_buffers, priv->n_output_buffers);
+        priv->output_buffers = NULL;
+        priv->n_output_buffers = 0;
+    }
+    gst_pad_stop_task (GST_VIDEO_DECODER_SRC_PAD (decoder));
+    /* Not before the srcpad loop is done pulling from it */
+    gst_amc_video_decoder_free_dec (self);
+
+    priv->downstream_flow_ret = GST_FLOW_FLUSHING;
+    priv->drained = TRUE;
+    g_mutex_lock (&priv->drain_lock);
+    priv->draining = FALSE;
+    g_cond_broadcast (&priv->drain_cond);
+    g_mutex_unlock (&priv->drain_lock);
+    g_free (priv->codec_data);
+    priv->codec_data_size = 0;
+    gst_adapter_clear (priv->au_adapter);
+    if (priv->input_state)
+      gst_video_codec_state_unref (priv->input_state);
+    priv->input_state = NULL;
+    GST_DEBUG_OBJECT (self, "Stopped decoder");
+
+    return TRUE;
+}
+
+/* Sets the typed fields of @overrides on @format, logging every key */
+static void
+gst_amc_video_decoder_apply_format_overrides (GstAmcVideoDecoder * self,
+            GstAmcFormat * format, const GstStructure * overrides,
+            const gchar * origin)
+{
+    GError *err = NULL;
+    gint i, n;
+
+    n = gst_structure_n_fields (overrides);
+    for (i = 0; i < n; i++) {
+        const gchar *key = gst_structure_nth_field_name (overrides, i);
+        const GValue *value = gst_structure_get_value (overrides, key);
+        gchar *value_string;
+
+        switch (G_VALUE_TYPE (value)) {
+        case G_TYPE_INT:
+            gst_amc_format_set_int (format, key, g_value_get_int (value), &err);
+            break;
+        case G_TYPE_BOOLEAN:
+            gst_amc_format_set_int (format, key, g_value_get_boolean (value), &err);
+            break;
+        case G_TYPE_FLOAT:
+            gst_amc_format_set_float (format, key, g_value_get_float (value), &err);
+            break;
+        case G_TYPE_DOUBLE:
+            gst_amc_format_set_float (format, key, g_value_get_double (value), &err);
+            break;
+        case G_TYPE_STRING:
+            gst_amc_format_set_string (format, key, g_value_get_string (value), &err);
+            break;
+        default:
+            GST_WARNING_OBJECT (self, "Ignoring format key %s of unsupported type %s "
+                        "from %s", key, G_VALUE_TYPE_NAME (value), origin);
+            continue;
+        }
+
+        if (err) {
+            GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+            continue;
+        }
+
+        value_string = gst_value_serialize (value);
+        GST_INFO_OBJECT (self, "Set format key %s=%s from %s", key,
+                    GST_STR_NULL (value_string), origin);
+        g_free (value_string);
+    }
+}
+
+/* Applies the presets for our MIME type, then those for the codec name
+ * on top. The file is read on every configure so it can be tuned on the
+ * device without restarting the application */
+static void
+gst_amc_video_decoder_apply_format_presets (GstAmcVideoDecoder * self,
+            GstAmcFormat * format, const gchar * filename)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GPtrArray *presets;
+    gchar *contents, **lines, *codec_name;
+    const gchar *names[2];
+    GError *err = NULL;
+    guint i, j;
+
+    if (!g_file_get_contents (filename, &contents, NULL, &err)) {
+        GST_WARNING_OBJECT (self, "Failed to read format presets: %s", err->message);
+        g_clear_error (&err);
+        return;
+    }
+
+    presets = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_structure_free);
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        gchar *line = g_strstrip (lines[i]);
+        GstStructure *preset;
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        preset = gst_structure_from_string (line, NULL);
+        if (!preset) {
+            GST_WARNING_OBJECT (self, "Invalid format preset at %s:%u", filename, i + 1);
+            continue;
+        }
+        g_ptr_array_add (presets, preset);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    /* Time-sharing decoders have no codec of their own */
+    codec_name = priv->codec ? gst_amc_codec_get_name (priv->codec, &err) : NULL;
+    if (err) {
+        GST_DEBUG_OBJECT (self, "No codec name: %s", err->message);
+        g_clear_error (&err);
+    }
+
+    names[0] = priv->mime;
+    names[1] = codec_name;
+    for (i = 0; i < G_N_ELEMENTS (names); i++) {
+        if (!names[i])
+            continue;
+        for (j = 0; j < presets->len; j++) {
+            GstStructure *preset = g_ptr_array_index (presets, j);
+
+            if (gst_structure_has_name (preset, names[i]))
+                gst_amc_video_decoder_apply_format_overrides (self, format,
+                            preset, filename);
+        }
+    }
+
+    g_free (codec_name);
+    g_ptr_array_unref (presets);
+}
+
+/* Builds the codec format for the current stream parameters */
+static GstAmcFormat *
+gst_amc_video_decoder_create_format (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcFormat *format;
+    GstStructure *overrides;
+    gchar *format_string, *presets;
+    GError *local_err = NULL;
+
+    format = gst_amc_format_new_video (priv->mime, priv->width, priv->height, err);
+    if (!format)
+        return NULL;
+
+    /* FIXME: This buffer needs to be valid until the codec is stopped again */
+    if (priv->codec_data) {
+        gst_amc_format_set_buffer (format, "csd-0", priv->codec_data,
+            priv->codec_data_size, &local_err);
+        if (local_err)
+          GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+    }
+
+    /* Lets the vendor clock the hardware for the actual decoding rate */
+    if (priv->fps_n > 0 && priv->fps_d > 0) {
+        if (priv->fps_n % priv->fps_d == 0)
+            gst_amc_format_set_int (format, "frame-rate", priv->fps_n / priv->fps_d,
+                        &local_err);
+        else
+            gst_amc_format_set_float (format, "frame-rate",
+                        (gfloat) priv->fps_n / priv->fps_d, &local_err);
+        if (local_err)
+          GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+    }
+
+    priv->operating_rate = 0;
+    if (gst_amc_get_sdk_int () >= 23) {
+        GstAmcVideoDecoderPriority priority;
+
+        priv->operating_rate = gst_amc_video_decoder_get_operating_rate (self);
+        if (priv->operating_rate > 0) {
+            gst_amc_format_set_float (format, "operating-rate",
+                        priv->operating_rate, &local_err);
+            if (local_err)
+              GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
         }
 
-        switch (idx) {
-        case INFO_OUTPUT_BUFFERS_CHANGED:
-            GST_DEBUG_OBJECT (self, "Output buffers have changed");
+        GST_OBJECT_LOCK (self);
+        priority = priv->priority;
+        GST_OBJECT_UNLOCK (self);
+        if (priority != GST_AMC_VIDEO_DECODER_PRIORITY_DEFAULT) {
+            gst_amc_format_set_int (format, "priority", priority, &local_err);
+            if (local_err)
+              GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+        }
+    }
 
-            /* If the decoder is configured with a surface, get_output_buffers returns null */
-            break;
-        case INFO_OUTPUT_FORMAT_CHANGED:
-        {
-            GstAmcFormat *format;
-            gchar *format_string;
+    /* Rotated by the display pipeline when rendering to the window */
+    priv->rotation = 0;
+    if (!priv->gl_output && !priv->raw_output) {
+        priv->rotation = gst_amc_video_decoder_get_rotation (self);
+        if (priv->rotation) {
+            gst_amc_format_set_int (format, "rotation-degrees", priv->rotation,
+                        &local_err);
+            if (local_err)
+              GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+        }
+    }
 
-            GST_DEBUG_OBJECT (self, "Output format has changed");
+    /* Planar or semi-planar YUV in the output buffers */
+    if (priv->raw_output && gst_amc_get_sdk_int () >= 21) {
+        gst_amc_format_set_int (format, "color-format", COLOR_FormatYUV420Flexible,
+                    &local_err);
+        if (local_err)
+          GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+    }
 
-            format = gst_amc_codec_get_output_format (priv->codec, &err);
-            if (!format)
-              goto format_error;
+    /* Vendor tuning, applied last so it can replace any key above */
+    GST_OBJECT_LOCK (self);
+    presets = g_strdup (priv->format_presets);
+    overrides = priv->format_overrides ? gst_structure_copy (priv->format_overrides) : NULL;
+    GST_OBJECT_UNLOCK (self);
+    if (presets) {
+        gst_amc_video_decoder_apply_format_presets (self, format, presets);
+        g_free (presets);
+    }
+    if (overrides) {
+        gst_amc_video_decoder_apply_format_overrides (self, format, overrides,
+                    "format-overrides");
+        gst_structure_free (overrides);
+    }
 
-            format_string = gst_amc_format_to_string (format, &err);
-            if (!format) {
-                gst_amc_format_free (format);
-                goto format_error;
-            }
-            GST_DEBUG_OBJECT (self, "Got new output format: %s", format_string);
-            g_free (format_string);
-            gst_amc_format_free (format);
+    format_string = gst_amc_format_to_string (format, &local_err);
+    if (local_err)
+      GST_ELEMENT_WARNING_FROM_ERROR (self, local_err);
+    GST_DEBUG_OBJECT (self, "Configuring codec with format: %s", GST_STR_NULL (format_string));
+    g_free (format_string);
 
-            if (!gst_amc_video_decoder_set_src_caps (self))
-                goto format_error;
+    return format;
+}
 
-            goto retry;
-            break;
-        }
-        case INFO_TRY_AGAIN_LATER:
-            GST_DEBUG_OBJECT (self, "Dequeueing output buffer timed out");
-            goto retry;
-            break;
-        case G_MININT:
-            GST_ERROR_OBJECT (self, "Failure dequeueing output buffer");
-            goto dequeue_error;
-            break;
-        default:
-            g_assert_not_reached ();
-            break;
-        }
+/* Replaces the hardware codec by the software decoder for the stream,
+ * with the stream lock held and the codec not started */
+static gboolean
+gst_amc_video_decoder_use_software_codec (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GError *local_err = NULL;
+
+    gst_amc_video_decoder_detach_window (self);
+    gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+    gst_amc_video_decoder_free_dec (self);
+    gst_amc_codec_release (priv->codec, &local_err);
+    g_clear_error (&local_err);
+    gst_amc_video_decoder_clear_preempted (self);
+    gst_amc_codec_free (priv->codec);
+
+    priv->codec = gst_amc_decoder_new_software (priv->mime, err);
+    if (!priv->codec)
+        return FALSE;
 
-        goto retry;
+    GST_INFO_OBJECT (self, "Decoding in software");
+    GST_OBJECT_LOCK (self);
+    priv->software_codec = TRUE;
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+/* Configures and starts the codec for the current stream parameters */
+static gboolean
+gst_amc_video_decoder_configure_codec_once (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    JNIEnv *env = gst_amc_jni_get_env ();
+    GstAmcFormat *format;
+    jobject surface, window = NULL;
+    gboolean configured;
+
+    format = gst_amc_video_decoder_create_format (self, err);
+    if (!format)
+        return FALSE;
+
+    GST_OBJECT_LOCK (self);
+    if (!priv->gl_output && !priv->raw_output && priv->surface)
+        window = gst_amc_jni_object_ref (env, priv->surface);
+    GST_OBJECT_UNLOCK (self);
+
+    if (priv->gl_output)
+        surface = gst_amc_surface_texture_get_surface (priv->surface_texture);
+    else
+        surface = window;
+
+    /* A surface set meanwhile is switched to once the codec is configured */
+    g_mutex_lock (&priv->window_lock);
+    configured = gst_amc_codec_configure (priv->codec, format, surface, 0, err);
+    priv->window_codec = configured && window;
+    priv->codec_held = configured;
+    if (configured)
+        g_atomic_int_set (&priv->codec_stopped, FALSE);
+    g_mutex_unlock (&priv->window_lock);
+    if (window)
+        gst_amc_jni_object_unref (env, window);
+    if (!configured) {
+        gst_amc_format_free (format);
+        return FALSE;
     }
+    priv->surface_configured = surface != NULL;
+    if (surface && !priv->gl_output)
+        gst_amc_video_decoder_apply_scaling_mode (self);
 
-    GST_DEBUG_OBJECT (self, "Got output buffer at index %d: size %d time %" G_GINT64_FORMAT
-                " flags 0x%08x", idx, buffer_info.size, buffer_info.presentation_time_us,
-                buffer_info.flags);
+    gst_amc_format_free (format);
 
-    frame = _find_nearest_frame (self,
-                gst_util_uint64_scale (buffer_info.presentation_time_us, GST_USECOND, 1));
+    if (!gst_amc_codec_start (priv->codec, err))
+        return FALSE;
 
-    is_eos = !!(buffer_info.flags & BUFFER_FLAG_END_OF_STREAM);
+    /* The input buffers of a restarted codec are new */
+    gst_amc_video_decoder_free_dec (self);
+    priv->dec = amc_dec_new_for_codec (priv->codec, !priv->raw_output, err);
+    if (!priv->dec)
+        return FALSE;
 
-    if (frame && (gst_video_decoder_get_max_decode_time (GST_VIDEO_DECODER (self), frame)) < 0) {
-        flow_ret = gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), frame);
-    } else if (buffer_info.size > 0) {
-        if (!(outbuf = gst_amc_video_decoder_new_buffer (self, idx))) {
-            if (!gst_amc_codec_release_output_buffer (priv->codec, idx, FALSE, 0, &err))
-                GST_ERROR_OBJECT (self, "Failed to release output buffer index %d", idx);
-            if (err && !priv->flushing)
-                GST_ELEMENT_WARNING_FROM_ERROR (self, err);
-            g_clear_error (&err);
-            goto flow_error;
+    if (priv->raw_output && !gst_amc_video_decoder_get_output_buffers (self, err))
+        return FALSE;
+
+    gst_amc_video_decoder_reset_watchdog (self);
+
+    return TRUE;
+}
+
+/* Configures and starts the codec for the current stream parameters,
+ * recounting its session for the current resolution. A hardware codec
+ * the budget or the device has no resources for, or that was preempted
+ * meanwhile, is replaced by the software decoder */
+static gboolean
+gst_amc_video_decoder_configure_codec (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GError *local_err = NULL;
+
+    if (gst_amc_codec_update_session (priv->codec, priv->width, priv->height,
+                    &local_err) &&
+                gst_amc_video_decoder_configure_codec_once (self, &local_err))
+        return TRUE;
+
+    if (gst_amc_codec_is_software (priv->codec) ||
+                !(g_atomic_int_get (&priv->preempted) ||
+                    g_error_matches (local_err, GST_RESOURCE_ERROR,
+                        GST_RESOURCE_ERROR_BUSY) ||
+                    g_error_matches (local_err, GST_AMC_CODEC_ERROR,
+                        GST_AMC_CODEC_ERROR_INSUFFICIENT_RESOURCE))) {
+        g_propagate_error (err, local_err);
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT (self, "No hardware resources for %dx%d: %s", priv->width,
+                priv->height, local_err->message);
+    g_clear_error (&local_err);
+
+    if (!gst_amc_video_decoder_use_software_codec (self, err))
+        return FALSE;
+
+    return gst_amc_video_decoder_configure_codec_once (self, err);
+}
+
+/* Sets up parallel GOP decoding on the opened codec and as many
+ * further instances as the device allows, up to parallel-gops */
+static gboolean
+gst_amc_video_decoder_start_gop_pool (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstAmcFormat *format;
+    guint n_codecs;
+
+    format = gst_amc_video_decoder_create_format (self, err);
+    if (!format)
+        return FALSE;
+
+    priv->gop_pool = gst_amc_gop_pool_new (priv->codec, priv->mime, format,
+                priv->parallel_gops, err);
+    gst_amc_format_free (format);
+    if (!priv->gop_pool)
+        return FALSE;
+
+    n_codecs = gst_amc_gop_pool_get_n_codecs (priv->gop_pool);
+    GST_INFO_OBJECT (self, "Decoding GOPs on %u of %u codecs", n_codecs,
+                priv->parallel_gops);
+    GST_OBJECT_LOCK (self);
+    priv->n_parallel_codecs = n_codecs;
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+/* Finishes the frames of the oldest GOP of @pool as they are decoded,
+ * until it is complete or, unless @wait, until the next frame isn't
+ * decoded yet. GOPs are closed, so merging them in dispatch order keeps
+ * presentation order. Must be called with the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_finish_gop (GstAmcVideoDecoder * self,
+            GstAmcGopPool * pool, gboolean wait)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstFlowReturn flow_ret = GST_FLOW_OK;
+    GstAmcVideoLayout layout;
+    GError *err = NULL;
+
+    while (flow_ret == GST_FLOW_OK) {
+        GstVideoCodecFrame *frame;
+        GstBuffer *outbuf;
+        GstFlowReturn ret;
+
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        ret = gst_amc_gop_pool_pop_frame (pool, wait, &outbuf, &layout, &err);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+        if (ret == GST_FLOW_ERROR) {
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return GST_FLOW_ERROR;
+        }
+        if (ret == GST_FLOW_EOS || ret == GST_FLOW_CUSTOM_SUCCESS ||
+                    (ret == GST_FLOW_OK && !outbuf))
+            break;
+        if (ret != GST_FLOW_OK)
+            return ret;
+
+        if (!gst_video_info_is_equal (&layout.info, &priv->layout.info)) {
+            priv->layout = layout;
+            if (!gst_amc_video_decoder_set_src_caps (self)) {
+                gst_buffer_unref (outbuf);
+                return GST_FLOW_NOT_NEGOTIATED;
+            }
         }
 
+        frame = _find_nearest_frame (self, GST_BUFFER_PTS (outbuf));
         if (frame) {
             frame->output_buffer = outbuf;
-            gst_video_decoder_finish_frame (GST_VIDEO_DECODER (self), frame);
+            flow_ret = gst_video_decoder_finish_frame (GST_VIDEO_DECODER (self), frame);
         } else {
-            GST_BUFFER_PTS (outbuf) =
-                gst_util_uint64_scale (buffer_info.presentation_time_us, GST_USECOND, 1);
             flow_ret = gst_pad_push (GST_VIDEO_DECODER_SRC_PAD (self), outbuf);
         }
-        release_buffer = FALSE;
-    } else if (frame != NULL) {
-        flow_ret = gst_video_decoder_drop_frame (GST_VIDEO_DECODER (self), frame);
     }
 
-    if (release_buffer) {
-        if (!gst_amc_codec_release_output_buffer (priv->codec, idx, FALSE, 0, &err)) {
-            if (priv->flushing) {
-                g_clear_error (&err);
-                goto flushing;
-            }
-            goto failed_release;
+    priv->downstream_flow_ret = flow_ret;
+
+    return flow_ret;
+}
+
+/* Hands the collected GOP to the next codec, keeping at most one GOP
+ * per codec in flight. Must be called with the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_dispatch_gop (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstFlowReturn flow_ret = GST_FLOW_OK;
+
+    if (!priv->gop)
+        return GST_FLOW_OK;
+
+    while (flow_ret == GST_FLOW_OK &&
+                gst_amc_gop_pool_get_n_pending (priv->gop_pool) >=
+                gst_amc_gop_pool_get_n_codecs (priv->gop_pool))
+        flow_ret = gst_amc_video_decoder_finish_gop (self, priv->gop_pool, TRUE);
+
+    if (flow_ret == GST_FLOW_OK)
+        gst_amc_gop_pool_push (priv->gop_pool, priv->gop);
+    else
+        gst_amc_gop_free (priv->gop);
+    priv->gop = NULL;
+
+    return flow_ret;
+}
+
+/* Collects access units into GOPs split at sync frames that nothing
+ * after references across, open GOPs stay in one piece */
+static GstFlowReturn
+gst_amc_video_decoder_handle_gop_frame (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, GstBuffer * input)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gboolean sync = GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame);
+    gboolean split = FALSE;
+    GstClockTime timestamp;
+    GstFlowReturn flow_ret;
+
+    if (sync && priv->gop) {
+        GstMapInfo minfo;
+
+        gst_buffer_map (input, &minfo, GST_MAP_READ);
+        split = gst_amc_video_decoder_is_closed_gop_start (self, minfo.data,
+                    minfo.size);
+        gst_buffer_unmap (input, &minfo);
+    } else if (sync) {
+        split = TRUE;
+    }
+
+    if (split) {
+        flow_ret = gst_amc_video_decoder_dispatch_gop (self);
+        if (flow_ret != GST_FLOW_OK) {
+            gst_buffer_unref (input);
+            gst_video_codec_frame_unref (frame);
+            return flow_ret;
         }
+        priv->gop = gst_amc_gop_new ();
+    } else if (!priv->gop) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_DISCONT);
     }
 
-    if (is_eos || flow_ret == GST_FLOW_EOS) {
-        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-        g_mutex_lock (&priv->drain_lock);
-        if (priv->draining) {
-            GST_DEBUG_OBJECT (self, "Drained");
-            priv->draining = FALSE;
-            g_cond_broadcast (&priv->drain_cond);
-        } else if (flow_ret == GST_FLOW_OK) {
-            GST_DEBUG_OBJECT (self, "Component signalled EOS");
-            flow_ret = GST_FLOW_EOS;
+    /* The timestamp identifies the frame across codecs */
+    timestamp = GST_CLOCK_TIME_IS_VALID (frame->pts) ? frame->pts :
+        frame->system_frame_number * GST_USECOND;
+    input = gst_amc_video_decoder_strip_input (self, input);
+    input = gst_buffer_make_writable (input);
+    GST_BUFFER_PTS (input) = timestamp;
+    if (split)
+        GST_BUFFER_FLAG_UNSET (input, GST_BUFFER_FLAG_DELTA_UNIT);
+    else
+        GST_BUFFER_FLAG_SET (input, GST_BUFFER_FLAG_DELTA_UNIT);
+    g_ptr_array_add (priv->gop->input, input);
+
+    gst_video_codec_frame_set_user_data (frame, buffer_identification_new (timestamp),
+                (GDestroyNotify) buffer_identification_free);
+    gst_video_codec_frame_unref (frame);
+
+    return priv->downstream_flow_ret;
+}
+
+/* Decodes keyframes on the session shared by all time-sharing decoders
+ * of the MIME type instead of a codec of our own */
+static gboolean
+gst_amc_video_decoder_start_time_share (GstAmcVideoDecoder * self, GError ** err)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gchar *checksum = NULL;
+
+    priv->shared_format = gst_amc_video_decoder_create_format (self, err);
+    if (!priv->shared_format)
+        return FALSE;
+
+    priv->shared_codec = gst_amc_shared_codec_get (priv->mime, err);
+    if (!priv->shared_codec) {
+        gst_amc_format_free (priv->shared_format);
+        priv->shared_format = NULL;
+        return FALSE;
+    }
+
+    /* Streams configured alike follow each other without reconfiguring */
+    if (priv->codec_data)
+        checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1, priv->codec_data,
+                    priv->codec_data_size);
+    priv->shared_config = g_strdup_printf ("%s %dx%d %s", priv->mime,
+                priv->width, priv->height, checksum ? checksum : "-");
+    g_free (checksum);
+
+    GST_INFO_OBJECT (self, "Time-sharing codec as %s", priv->shared_config);
+
+    return TRUE;
+}
+
+/* Accounts a keyframe refresh that took a codec switch of @switch_time
+ * if valid, and posts the refresh rate every TIME_SHARE_REPORT_INTERVAL */
+static void
+gst_amc_video_decoder_update_time_share (GstAmcVideoDecoder * self,
+            GstClockTime switch_time)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gdouble refresh_rate;
+    guint n_switches;
+    gint64 now, window;
+
+    GST_OBJECT_LOCK (self);
+    if (GST_CLOCK_TIME_IS_VALID (switch_time)) {
+        priv->n_time_share_switches++;
+        priv->time_share_switch_time = switch_time;
+    }
+    n_switches = priv->n_time_share_switches;
+    switch_time = priv->time_share_switch_time;
+    GST_OBJECT_UNLOCK (self);
+
+    now = g_get_monotonic_time ();
+    if (!priv->refresh_window_start) {
+        priv->refresh_window_start = now;
+        priv->n_window_refreshes = 0;
+        return;
+    }
+
+    priv->n_window_refreshes++;
+    window = now - priv->refresh_window_start;
+    if (window < TIME_SHARE_REPORT_INTERVAL)
+        return;
+
+    refresh_rate = (gdouble) priv->n_window_refreshes * G_TIME_SPAN_SECOND / window;
+    priv->refresh_window_start = now;
+    priv->n_window_refreshes = 0;
+
+    GST_OBJECT_LOCK (self);
+    priv->refresh_rate = refresh_rate;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_LOG_OBJECT (self, "Refreshing at %.2f fps, %u codec switches",
+                refresh_rate, n_switches);
+
+    gst_element_post_message (GST_ELEMENT (self),
+                gst_message_new_element (GST_OBJECT (self),
+                    gst_structure_new ("amc-time-share",
+                        "refresh-rate", G_TYPE_DOUBLE, refresh_rate,
+                        "switches", G_TYPE_UINT, n_switches,
+                        "switch-time", G_TYPE_UINT64, switch_time,
+                        NULL)));
+}
+
+/* Closes the open GOP of a focused stream and ends its turn on the
+ * shared codec once the rest of the GOP is decoded, finishing its frames
+ * unless @discard. Must be called with the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_end_shared_gop (GstAmcVideoDecoder * self, gboolean discard)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstFlowReturn flow_ret = GST_FLOW_OK, ret;
+    GError *err = NULL;
+    GstBuffer *outbuf;
+
+    if (!priv->shared_gop)
+        return GST_FLOW_OK;
+
+    /* A GOP that failed is gone already, it is the only one in the pool */
+    if (gst_amc_gop_pool_get_n_pending (priv->shared_pool))
+        gst_amc_gop_pool_close (priv->shared_pool, priv->shared_gop);
+    priv->shared_gop = NULL;
+
+    if (!discard)
+        flow_ret = gst_amc_video_decoder_finish_gop (self, priv->shared_pool, TRUE);
+
+    /* Whatever downstream returned, the next stream gets an empty pool */
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    do {
+        ret = gst_amc_gop_pool_pop_frame (priv->shared_pool, TRUE, &outbuf,
+                    NULL, &err);
+        if (outbuf)
+            gst_buffer_unref (outbuf);
+    } while (ret == GST_FLOW_OK && outbuf);
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+    if (ret == GST_FLOW_ERROR && discard)
+        GST_DEBUG_OBJECT (self, "Discarded GOP failed: %s", err->message);
+    g_clear_error (&err);
+
+    gst_amc_shared_codec_release (priv->shared_codec,
+                flow_ret == GST_FLOW_ERROR || ret == GST_FLOW_ERROR);
+    priv->shared_pool = NULL;
+
+    return flow_ret;
+}
+
+/* Decodes all frames of a focused stream on the shared codec. Its turn
+ * lasts from a keyframe to the next one that starts a closed GOP, in
+ * between the streams waiting for a keyframe refresh get the codec in
+ * the order they asked for it. Must be called with the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_handle_focused_frame (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, GstBuffer * input, gboolean split)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstClockTime timestamp, switch_time;
+    GstFlowReturn flow_ret;
+    GError *err = NULL;
+    gboolean ret;
+
+    if (split) {
+        flow_ret = gst_amc_video_decoder_end_shared_gop (self, FALSE);
+        if (flow_ret != GST_FLOW_OK) {
+            gst_buffer_unref (input);
+            gst_video_codec_frame_unref (frame);
+            return flow_ret;
         }
-        g_mutex_unlock (&priv->drain_lock);
-        GST_VIDEO_DECODER_STREAM_LOCK (self);
+    } else if (!priv->shared_gop) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_TIME_SHARE);
+    }
+
+    /* The timestamp identifies the frame on the shared codec */
+    timestamp = GST_CLOCK_TIME_IS_VALID (frame->pts) ? frame->pts :
+        frame->system_frame_number * GST_USECOND;
+    input = gst_amc_video_decoder_strip_input (self, input);
+    input = gst_buffer_make_writable (input);
+    GST_BUFFER_PTS (input) = timestamp;
+    if (split)
+        GST_BUFFER_FLAG_UNSET (input, GST_BUFFER_FLAG_DELTA_UNIT);
+    else
+        GST_BUFFER_FLAG_SET (input, GST_BUFFER_FLAG_DELTA_UNIT);
+    gst_video_codec_frame_set_user_data (frame, buffer_identification_new (timestamp),
+                (GDestroyNotify) buffer_identification_free);
+    gst_video_codec_frame_unref (frame);
+
+    if (!split) {
+        gst_amc_gop_pool_append (priv->shared_pool, priv->shared_gop, input);
     } else {
-        GST_DEBUG_OBJECT (self, "Finished frame: %s", gst_flow_get_name (flow_ret));
+        /* Waits for the decoders ahead of us on the session */
+        GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+        ret = gst_amc_shared_codec_acquire (priv->shared_codec, &priv->shared_flushing);
+        GST_VIDEO_DECODER_STREAM_LOCK (self);
+        if (!ret) {
+            gst_buffer_unref (input);
+            return GST_FLOW_FLUSHING;
+        }
+
+        priv->shared_pool = gst_amc_shared_codec_configure (priv->shared_codec,
+                    priv->shared_config, priv->shared_format, &switch_time, &err);
+        if (!priv->shared_pool) {
+            GST_ERROR_OBJECT (self, "Failed to configure shared codec");
+            gst_amc_shared_codec_release (priv->shared_codec, FALSE);
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            gst_buffer_unref (input);
+            return GST_FLOW_ERROR;
+        }
+        gst_amc_video_decoder_update_time_share (self, switch_time);
+
+        priv->shared_gop = gst_amc_gop_new ();
+        priv->shared_gop->open = TRUE;
+        g_ptr_array_add (priv->shared_gop->input, input);
+        gst_amc_gop_pool_push (priv->shared_pool, priv->shared_gop);
     }
 
+    /* Whatever the codec output meanwhile */
+    flow_ret = gst_amc_video_decoder_finish_gop (self, priv->shared_pool, FALSE);
+    if (flow_ret != GST_FLOW_OK)
+        gst_amc_video_decoder_end_shared_gop (self, TRUE);
     priv->downstream_flow_ret = flow_ret;
 
-    if (flow_ret != GST_FLOW_OK)
-      goto flow_error;
+    return flow_ret;
+}
+
+/* Refreshes the picture from keyframes only, each decoded on its own
+ * on the shared codec, or from all frames while in focus. Must be called
+ * with the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_handle_shared_frame (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame, GstBuffer * input)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gboolean sync = GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame);
+    GstClockTime timestamp, switch_time;
+    GstFlowReturn flow_ret;
+    GError *err = NULL;
+    gboolean focus, split = sync;
+    GstAmcGop *gop;
+    gboolean ret;
+
+    GST_OBJECT_LOCK (self);
+    focus = priv->focus;
+    GST_OBJECT_UNLOCK (self);
+
+    /* Open GOPs go on with the turn until a closed one starts */
+    if (sync && priv->shared_gop && mime_has_closed_gops (priv->mime)) {
+        GstMapInfo minfo;
+
+        gst_buffer_map (input, &minfo, GST_MAP_READ);
+        split = gst_amc_video_decoder_is_closed_gop_start (self, minfo.data,
+                    minfo.size);
+        gst_buffer_unmap (input, &minfo);
+    }
+
+    /* Focus is given or taken at GOP boundaries */
+    if (priv->shared_gop && !split)
+        return gst_amc_video_decoder_handle_focused_frame (self, frame, input, FALSE);
+    if (focus)
+        return gst_amc_video_decoder_handle_focused_frame (self, frame, input, split);
+
+    flow_ret = gst_amc_video_decoder_end_shared_gop (self, FALSE);
+    if (flow_ret != GST_FLOW_OK) {
+        gst_buffer_unref (input);
+        gst_video_codec_frame_unref (frame);
+        return flow_ret;
+    }
+
+    if (!sync) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_TIME_SHARE);
+    }
+
+    timestamp = GST_CLOCK_TIME_IS_VALID (frame->pts) ? frame->pts :
+        frame->system_frame_number * GST_USECOND;
+    input = gst_amc_video_decoder_strip_input (self, input);
+    input = gst_buffer_make_writable (input);
+    GST_BUFFER_PTS (input) = timestamp;
+    GST_BUFFER_FLAG_UNSET (input, GST_BUFFER_FLAG_DELTA_UNIT);
+    gop = gst_amc_gop_new ();
+    g_ptr_array_add (gop->input, input);
+
+    /* Waits for the decoders ahead of us on the session */
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    ret = gst_amc_shared_codec_decode (priv->shared_codec, &priv->shared_flushing,
+                priv->shared_config, priv->shared_format, gop, &switch_time, &err);
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+
+    if (!ret && !err) {
+        gst_amc_gop_free (gop);
+        gst_video_codec_frame_unref (frame);
+        return GST_FLOW_FLUSHING;
+    }
 
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    if (!ret || gop->error) {
+        GST_ERROR_OBJECT (self, "Failed to decode on shared codec");
+        if (ret)
+            err = g_error_copy (gop->error);
+        GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+        gst_amc_gop_free (gop);
+        gst_video_codec_frame_unref (frame);
+        return GST_FLOW_ERROR;
+    }
 
-    return;
+    gst_amc_video_decoder_update_time_share (self, switch_time);
 
-dequeue_error:
-    GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
-    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    priv->downstream_flow_ret = GST_FLOW_ERROR;
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    return;
+    if (gop->output->len == 0) {
+        gst_amc_gop_free (gop);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_TIME_SHARE);
+    }
 
-format_error:
-    if (err)
-      GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-    else
-      GST_ELEMENT_ERROR (self, LIBRARY, FAILED, (NULL), ("Failed to handle format"));
-    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
-    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    priv->downstream_flow_ret = GST_FLOW_ERROR;
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    return;
-failed_release:
-    GST_VIDEO_DECODER_ERROR_FROM_ERROR (self, err);
-    gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self), gst_event_new_eos ());
-    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    priv->downstream_flow_ret = GST_FLOW_ERROR;
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    return;
-flushing:
-    GST_DEBUG_OBJECT (self, "Flushing -- stopping task");
-    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    priv->downstream_flow_ret = GST_FLOW_FLUSHING;
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    return;
-flow_error:
-    if (flow_ret == GST_FLOW_EOS) {
-        GST_DEBUG_OBJECT (self, "EOS");
-        gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self),
-        gst_event_new_eos ());
-        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    } else if (flow_ret < GST_FLOW_EOS) {
-        GST_ELEMENT_ERROR (self, STREAM, FAILED,
-        ("Internal data stream error."), ("stream stopped, reason %s",
-        gst_flow_get_name (flow_ret)));
-        gst_pad_push_event (GST_VIDEO_DECODER_SRC_PAD (self),
-        gst_event_new_eos ());
-        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
-    } else if (flow_ret == GST_FLOW_FLUSHING) {
-        GST_DEBUG_OBJECT (self, "Flushing -- stopping task");
-        gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    if (!gst_video_info_is_equal (&gop->layout.info, &priv->layout.info)) {
+        priv->layout = gop->layout;
+        if (!gst_amc_video_decoder_set_src_caps (self)) {
+            gst_amc_gop_free (gop);
+            gst_video_codec_frame_unref (frame);
+            return GST_FLOW_NOT_NEGOTIATED;
+        }
     }
-    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
-    return;
+
+    frame->output_buffer = gst_buffer_ref (g_ptr_array_index (gop->output, 0));
+    gst_amc_gop_free (gop);
+    flow_ret = gst_video_decoder_finish_frame (GST_VIDEO_DECODER (self), frame);
+    priv->downstream_flow_ret = flow_ret;
+
+    return flow_ret;
 }
 
+/* Stops and reconfigures the codec after a recoverable error. Pending
+ * frames other than @current are released, decoding resumes at the next
+ * sync frame. Must be called with the stream lock held */
 static gboolean
-gst_amc_video_decoder_start (GstVideoDecoder * decoder)
+gst_amc_video_decoder_reset_codec (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * current, GError ** err)
 {
-    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    gboolean flush_only = priv->reset_flush_only;
+    gboolean recreate = FALSE;
+    GError *local_err = NULL;
+    GList *frames, *l;
 
-    priv->last_upstream_ts = 0;
-    priv->drained = TRUE;
-    priv->downstream_flow_ret = GST_FLOW_OK;
-    priv->started = FALSE;
+    GST_DEBUG_OBJECT (self, "%s codec", flush_only ? "Flushing" : "Resetting");
+
+    priv->pending_reset = FALSE;
+    priv->reset_flush_only = FALSE;
     priv->flushing = TRUE;
+    /* Wait until the srcpad loop is finished, see flush() */
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
 
-    return TRUE;
-}
+    /* Output held downstream must not be released to the new codec */
+    gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+    if (flush_only && !gst_amc_video_decoder_flush_codec (self, &local_err)) {
+        GST_WARNING_OBJECT (self, "Failed to flush codec, resetting it: %s",
+                    local_err->message);
+        g_clear_error (&local_err);
+        flush_only = FALSE;
+    }
 
-static gboolean
-gst_amc_video_decoder_stop (GstVideoDecoder * decoder)
-{
-    GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
-    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GError *err = NULL;
+    if (!flush_only)
+        gst_amc_video_decoder_detach_window (self);
+
+    if (!flush_only && g_atomic_int_get (&priv->preempted)) {
+        /* Hands the session over, the new codec is a software one unless
+         * the session was freed up meanwhile */
+        GST_INFO_OBJECT (self, "Codec preempted, recreating it");
+        gst_amc_codec_stop (priv->codec, &local_err);
+        g_clear_error (&local_err);
+        recreate = TRUE;
+        GST_OBJECT_LOCK (self);
+        priv->n_preemptions++;
+        GST_OBJECT_UNLOCK (self);
+    } else if (!flush_only && !g_atomic_int_get (&priv->codec_stopped) &&
+                !gst_amc_codec_stop (priv->codec, &local_err)) {
+        /* A codec that can't even be stopped is replaced */
+        GST_WARNING_OBJECT (self, "Failed to stop codec, recreating it: %s",
+                    local_err->message);
+        g_clear_error (&local_err);
+        recreate = TRUE;
+    }
 
-    GST_DEBUG_OBJECT (self, "Stopping decoder");
-    priv->flushing = TRUE;
-    if (priv->started) {
-        gst_amc_codec_flush (priv->codec, &err);
-        if (err)
-          GST_ELEMENT_WARNING_FROM_ERROR (self, err);
-        gst_amc_codec_stop (priv->codec, &err);
-        if (err)
-          GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+    if (recreate) {
+        gst_amc_video_decoder_free_dec (self);
+        gst_amc_codec_release (priv->codec, &local_err);
+        g_clear_error (&local_err);
+        gst_amc_video_decoder_clear_preempted (self);
+        gst_amc_codec_free (priv->codec);
+        priv->codec = gst_amc_video_decoder_create_codec (self, err);
+        if (!priv->codec) {
+            priv->started = FALSE;
+            return FALSE;
+        }
+    }
+
+    /* Frames queued to the old codec will never be output */
+    frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (self));
+    for (l = frames; l; l = l->next) {
+        GstVideoCodecFrame *frame = l->data;
+
+        if (frame != current)
+            gst_video_decoder_release_frame (GST_VIDEO_DECODER (self), frame);
+        else
+            gst_video_codec_frame_unref (frame);
+    }
+    g_list_free (frames);
+
+    if (!flush_only && !gst_amc_video_decoder_configure_codec (self, err)) {
         priv->started = FALSE;
-        if (priv->input_buffers)
-          gst_amc_codec_free_buffers (priv->input_buffers, priv->n_input_buffers);
-        priv->input_buffers = NULL;
+        return FALSE;
     }
-    gst_pad_stop_task (GST_VIDEO_DECODER_SRC_PAD (decoder));
 
-    priv->downstream_flow_ret = GST_FLOW_FLUSHING;
+    gst_amc_video_decoder_reset_watchdog (self);
+    priv->flushing = FALSE;
     priv->drained = TRUE;
-    g_mutex_lock (&priv->drain_lock);
-    priv->draining = FALSE;
-    g_cond_broadcast (&priv->drain_cond);
-    g_mutex_unlock (&priv->drain_lock);
-    g_free (priv->codec_data);
-    priv->codec_data_size = 0;
-    if (priv->input_state)
-      gst_video_codec_state_unref (priv->input_state);
-    priv->input_state = NULL;
-    GST_DEBUG_OBJECT (self, "Stopped decoder");
+    priv->downstream_flow_ret = GST_FLOW_OK;
+    priv->needs_keyframe = TRUE;
+    priv->keyframe_wait_reason = DROP_REASON_RESET;
+
+    gst_pad_start_task (GST_VIDEO_DECODER_SRC_PAD (self),
+                (GstTaskFunction) gst_amc_video_decoder_loop, self, NULL);
+
+    GST_DEBUG_OBJECT (self, "Reset codec");
 
     return TRUE;
 }
@@ -1086,18 +5319,27 @@ gst_amc_video_decoder_set_format (GstVideoDecoder * decoder,
 {
     GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    GstAmcFormat *format;
     gboolean is_format_change = FALSE;
     gboolean needs_disable = FALSE;
-    gchar *format_string;
     guint8 *codec_data = NULL;
     gsize codec_data_size = 0;
     GError *err = NULL;
-    const gchar *mime;
+    const gchar *mime, *alignment;
+    gboolean subframe_mode;
 
     GST_DEBUG_OBJECT (self, "Setting new caps %" GST_PTR_FORMAT, state->caps);
     mime = caps_to_mime (state->caps);
 
+    /* Queue slices as they arrive, as partial frames from API 26 on */
+    alignment = gst_structure_get_string (gst_caps_get_structure (state->caps, 0),
+                "alignment");
+    subframe_mode = g_strcmp0 (alignment, "nal") == 0;
+    gst_video_decoder_set_subframe_mode (decoder, subframe_mode);
+    priv->partial_frames = subframe_mode && gst_amc_get_sdk_int () >= 26;
+    gst_adapter_clear (priv->au_adapter);
+    GST_DEBUG_OBJECT (self, "Subframe mode %d, partial frames %d",
+                subframe_mode, priv->partial_frames);
+
     needs_disable |= priv->mime != mime;
     needs_disable |= priv->started;
 
@@ -1107,9 +5349,15 @@ gst_amc_video_decoder_set_format (GstVideoDecoder * decoder,
     is_format_change |= priv->mime != mime;
     is_format_change |= priv->width != state->info.width;
     is_format_change |= priv->height != state->info.height;
+    if (priv->mime != mime && priv->nal_filter) {
+        gst_amc_nal_filter_free (priv->nal_filter);
+        priv->nal_filter = NULL;
+    }
     priv->mime = mime;
     priv->width = state->info.width;
     priv->height = state->info.height;
+    priv->fps_n = state->info.fps_n;
+    priv->fps_d = state->info.fps_d;
     if (state->codec_data) {
         GstMapInfo cminfo;
 
@@ -1139,6 +5387,7 @@ gst_amc_video_decoder_set_format (GstVideoDecoder * decoder,
         if (priv->input_state)
           gst_video_codec_state_unref (priv->input_state);
         priv->input_state = gst_video_codec_state_ref (state);
+        gst_amc_video_decoder_update_operating_rate (self);
         GST_DEBUG_OBJECT (self,
             "Already running and caps did not change the format");
         return TRUE;
@@ -1164,67 +5413,87 @@ gst_amc_video_decoder_set_format (GstVideoDecoder * decoder,
       gst_video_codec_state_unref (priv->input_state);
     priv->input_state = NULL;
 
+    /* The codec is configured from scratch and reports its output format
+     * again, until then caps use the new input size. Otherwise an output
+     * format equal to the one of the previous stream would not renegotiate */
+    priv->has_output_format = FALSE;
+
+    /* Until the first SPS tells us better */
+    priv->reorder_depth = mime_to_default_reorder_depth (priv->mime);
+
     g_free (priv->codec_data);
     priv->codec_data = codec_data;
     priv->codec_data_size = codec_data_size;
 
-    format = gst_amc_format_new_video (priv->mime, state->info.width,
-                state->info.height, &err);
-    if (!format) {
-        GST_ERROR_OBJECT (self, "Failed to create video format");
-        GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-        return FALSE;
+    /* Time-sharing decoders don't hold a session of their own */
+    if (!priv->time_share && !priv->codec) {
+        priv->codec = gst_amc_video_decoder_create_codec (self, &err);
+        if (!priv->codec) {
+            GST_ERROR_OBJECT (self, "Failed to create codec");
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return FALSE;
+        }
     }
 
-    /* FIXME: This buffer needs to be valid until the codec is stopped again */
-    if (priv->codec_data) {
-        gst_amc_format_set_buffer (format, "csd-0", priv->codec_data,
-            priv->codec_data_size, &err);
-        if (err)
-          GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+    /* Thumbnails and time-shared keyframes are always copied out */
+    priv->gl_output = !priv->thumbnail_interval && !priv->time_share &&
+        gst_amc_video_decoder_wants_gl_output (self);
+    priv->raw_output = !priv->gl_output && (priv->thumbnail_interval ||
+                priv->time_share || gst_amc_video_decoder_wants_raw_output (self));
+    if (priv->gl_output) {
+        if (!gst_amc_video_decoder_ensure_gl (self, &err)) {
+            GST_ERROR_OBJECT (self, "Failed to set up GL output");
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return FALSE;
+        }
+    } else if (!priv->raw_output) {
+        gboolean has_surface;
+
+        GST_OBJECT_LOCK (self);
+        has_surface = priv->surface != NULL;
+        GST_OBJECT_UNLOCK (self);
+        if (!has_surface)
+            gst_video_overlay_prepare_window_handle (GST_VIDEO_OVERLAY (decoder));
     }
 
-    format_string = gst_amc_format_to_string (format, &err);
-    if (err)
-      GST_ELEMENT_WARNING_FROM_ERROR (self, err);
-    GST_DEBUG_OBJECT (self, "Configuring codec with format: %s", GST_STR_NULL (format_string));
-    g_free (format_string);
-
-    if (!priv->surface)
-        gst_video_overlay_prepare_window_handle (GST_VIDEO_OVERLAY (decoder));
+    /* Thumbnails are drained one access unit at a time */
+    if (priv->thumbnail_interval)
+        priv->partial_frames = FALSE;
 
-    if (!gst_amc_codec_configure (priv->codec, format, priv->surface, 0, &err)) {
+    if (priv->time_share) {
+        /* Keyframes are decoded one access unit at a time */
+        priv->partial_frames = FALSE;
+        if (!gst_amc_video_decoder_start_time_share (self, &err)) {
+            GST_ERROR_OBJECT (self, "Failed to join shared codec");
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return FALSE;
+        }
+    } else if (priv->raw_output && priv->parallel_gops > 1 && !priv->thumbnail_interval &&
+                mime_has_closed_gops (priv->mime)) {
+        /* GOPs are queued per access unit */
+        priv->partial_frames = FALSE;
+        if (!gst_amc_video_decoder_start_gop_pool (self, &err)) {
+            GST_ERROR_OBJECT (self, "Failed to start parallel decoding");
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return FALSE;
+        }
+    } else if (!gst_amc_video_decoder_configure_codec (self, &err)) {
         GST_ERROR_OBJECT (self, "Failed to configure codec");
         GST_ELEMENT_ERROR_FROM_ERROR (self, err);
         return FALSE;
     }
 
-    gst_amc_format_free (format);
-
-    if (!gst_amc_codec_start (priv->codec, &err)) {
-        GST_ERROR_OBJECT (self, "Failed to start codec");
-        GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-        return FALSE;
-    }
-
-    if (priv->input_buffers)
-      gst_amc_codec_free_buffers (priv->input_buffers, priv->n_input_buffers);
-    priv->input_buffers = gst_amc_codec_get_input_buffers (priv->codec, &priv->n_input_buffers, &err);
-    if (!priv->input_buffers) {
-        GST_ERROR_OBJECT (self, "Failed to get input buffers");
-        GST_ELEMENT_ERROR_FROM_ERROR (self, err);
-        return FALSE;
-    }
-
     priv->started = TRUE;
     priv->input_state = gst_video_codec_state_ref (state);
     priv->input_state_changed = TRUE;
 
-    /* Start the srcpad loop again */
+    /* Start the srcpad loop again, the GOP pool and the shared codec
+     * have their own threads */
     priv->flushing = FALSE;
     priv->downstream_flow_ret = GST_FLOW_OK;
-    gst_pad_start_task (GST_VIDEO_DECODER_SRC_PAD (self),
-                (GstTaskFunction) gst_amc_video_decoder_loop, decoder, NULL);
+    if (!priv->gop_pool && !priv->shared_codec)
+        gst_pad_start_task (GST_VIDEO_DECODER_SRC_PAD (self),
+                    (GstTaskFunction) gst_amc_video_decoder_loop, decoder, NULL);
 
     return TRUE;
 }
@@ -1243,6 +5512,28 @@ gst_amc_video_decoder_flush (GstVideoDecoder * decoder)
         return TRUE;
     }
 
+    if (priv->gop_pool) {
+        gst_amc_gop_pool_set_flushing (priv->gop_pool, TRUE);
+        gst_amc_gop_pool_set_flushing (priv->gop_pool, FALSE);
+        if (priv->gop)
+            gst_amc_gop_free (priv->gop);
+        priv->gop = NULL;
+        gst_adapter_clear (priv->au_adapter);
+        priv->downstream_flow_ret = GST_FLOW_OK;
+        GST_DEBUG_OBJECT (self, "Flushed GOP pool");
+        return TRUE;
+    }
+
+    /* Nothing is left on the shared codec between keyframes, a focused
+     * stream gives up its turn */
+    if (priv->shared_codec) {
+        gst_amc_video_decoder_end_shared_gop (self, TRUE);
+        g_atomic_int_set (&priv->shared_flushing, FALSE);
+        gst_adapter_clear (priv->au_adapter);
+        priv->downstream_flow_ret = GST_FLOW_OK;
+        return TRUE;
+    }
+
     priv->flushing = TRUE;
     /* Wait until the srcpad loop is finished,
     * unlock GST_VIDEO_DECODER_STREAM_LOCK to prevent deadlocks
@@ -1251,9 +5542,13 @@ gst_amc_video_decoder_flush (GstVideoDecoder * decoder)
     GST_PAD_STREAM_LOCK (GST_VIDEO_DECODER_SRC_PAD (self));
     GST_PAD_STREAM_UNLOCK (GST_VIDEO_DECODER_SRC_PAD (self));
     GST_VIDEO_DECODER_STREAM_LOCK (self);
-    gst_amc_codec_flush (priv->codec, &err);
+    gst_amc_output_pool_invalidate (GST_AMC_OUTPUT_POOL (priv->output_pool));
+    gst_amc_video_decoder_flush_codec (self, &err);
     if (err)
       GST_ELEMENT_WARNING_FROM_ERROR (self, err);
+    gst_amc_video_decoder_reset_watchdog (self);
+    gst_adapter_clear (priv->au_adapter);
+    priv->next_thumbnail = GST_CLOCK_TIME_NONE;
     priv->flushing = FALSE;
 
     /* Start the srcpad loop again */
@@ -1268,19 +5563,90 @@ gst_amc_video_decoder_flush (GstVideoDecoder * decoder)
     return TRUE;
 }
 
+/* Picks the first keyframe at least thumbnail-interval after the
+ * previous thumbnail. Must be called with the stream lock held */
+static gboolean
+gst_amc_video_decoder_is_thumbnail (GstAmcVideoDecoder * self,
+            GstVideoCodecFrame * frame)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+
+    if (!GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame))
+        return FALSE;
+
+    if (GST_CLOCK_TIME_IS_VALID (frame->pts)) {
+        if (GST_CLOCK_TIME_IS_VALID (priv->next_thumbnail) &&
+                    frame->pts < priv->next_thumbnail)
+            return FALSE;
+        priv->next_thumbnail = frame->pts + priv->thumbnail_interval;
+    }
+
+    return TRUE;
+}
+
+/* Drains the thumbnail just queued out of the codec, then flushes it
+ * so that nothing is buffered until the next one. Must be called with
+ * the stream lock held */
+static GstFlowReturn
+gst_amc_video_decoder_finish_thumbnail (GstAmcVideoDecoder * self)
+{
+    GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
+    GstFlowReturn ret;
+    GError *err = NULL;
+
+    ret = gst_amc_video_decoder_drain (self);
+    if (ret != GST_FLOW_OK)
+        return ret;
+    if (priv->downstream_flow_ret != GST_FLOW_OK || priv->pending_reset)
+        return priv->downstream_flow_ret;
+
+    /* The codec accepts no input after EOS until flushed */
+    priv->flushing = TRUE;
+    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+    gst_pad_pause_task (GST_VIDEO_DECODER_SRC_PAD (self));
+    GST_VIDEO_DECODER_STREAM_LOCK (self);
+
+    if (!gst_amc_video_decoder_flush_codec (self, &err)) {
+        if (!gst_amc_video_decoder_schedule_reset (self, err)) {
+            GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+            return GST_FLOW_ERROR;
+        }
+        /* The reset with the next frame restarts the srcpad loop */
+        g_clear_error (&err);
+        priv->flushing = FALSE;
+        return GST_FLOW_OK;
+    }
+
+    gst_amc_video_decoder_reset_watchdog (self);
+    priv->flushing = FALSE;
+    priv->drained = TRUE;
+    gst_pad_start_task (GST_VIDEO_DECODER_SRC_PAD (self),
+                (GstTaskFunction) gst_amc_video_decoder_loop, self, NULL);
+
+    return GST_FLOW_OK;
+}
+
 static GstFlowReturn
 gst_amc_video_decoder_handle_frame (GstVideoDecoder * decoder,
     GstVideoCodecFrame * frame)
 {
     GstAmcVideoDecoder *self = GST_AMC_VIDEO_DECODER (decoder);
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
-    gint idx;
-    GstAmcBuffer *buf;
-    GstAmcBufferInfo buffer_info;
+    AmcDecResult res;
+    AmcDecInput slot;
+    gsize chunk;
+    gint64 pts_us;
+    gint flags;
     guint offset = 0;
     GstClockTime timestamp, duration, timestamp_offset = 0;
     GstMapInfo minfo;
     GError *err = NULL;
+    GstBuffer *input = NULL;
+    gboolean partial = FALSE, first = TRUE, last = TRUE;
+    /* Bytes passed on to the codec, less than mapped if NAL units are stripped */
+    gsize size;
+    gboolean stripped;
+    gint64 wait_start, transient_start = 0;
 
     memset (&minfo, 0, sizeof (minfo));
 
@@ -1292,39 +5658,178 @@ gst_amc_video_decoder_handle_frame (GstVideoDecoder * decoder,
         return GST_FLOW_NOT_NEGOTIATED;
     }
 
+    /* With alignment=nal every slice is handled as a subframe */
+    if (gst_video_decoder_get_subframe_mode (decoder)) {
+        gboolean marker = GST_BUFFER_FLAG_IS_SET (frame->input_buffer,
+                    GST_VIDEO_BUFFER_FLAG_MARKER);
+
+        if (!priv->partial_frames) {
+            /* No BUFFER_FLAG_PARTIAL_FRAME, assemble the access unit */
+            gst_adapter_push (priv->au_adapter, gst_buffer_ref (frame->input_buffer));
+            if (!marker) {
+                gst_video_codec_frame_unref (frame);
+                return priv->downstream_flow_ret;
+            }
+            input = gst_adapter_take_buffer (priv->au_adapter,
+                        gst_adapter_available (priv->au_adapter));
+        } else {
+            GstVideoCodecFrame *pending;
+
+            partial = TRUE;
+            first = gst_video_decoder_get_input_subframe_index (decoder, frame) == 1;
+            last = marker;
+
+            /* Nothing to do if the access unit was dropped with its first slice */
+            pending = gst_video_decoder_get_frame (decoder, frame->system_frame_number);
+            if (!pending) {
+                gst_video_codec_frame_unref (frame);
+                return GST_FLOW_OK;
+            }
+            gst_video_codec_frame_unref (pending);
+        }
+    }
+    if (!input)
+        input = gst_buffer_ref (frame->input_buffer);
+
+    if (priv->gop_pool)
+        return gst_amc_video_decoder_handle_gop_frame (self, frame, input);
+    if (priv->shared_codec)
+        return gst_amc_video_decoder_handle_shared_frame (self, frame, input);
+
+again:
     if (priv->flushing)
       goto flushing;
 
+    gst_amc_video_decoder_apply_surface_change (self);
+
+    /* A stopped codec waits for the next window, see release_window() */
+    if (priv->parked && g_atomic_int_get (&priv->codec_stopped)) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_BACKGROUND);
+    }
+
+    /* Hand the hardware session over to a decoder of higher priority */
+    if (g_atomic_int_get (&priv->preempted) && !priv->pending_reset) {
+        priv->pending_reset = TRUE;
+        priv->reset_flush_only = FALSE;
+    }
+
+    if (priv->pending_reset) {
+        if (!gst_amc_video_decoder_reset_codec (self, frame, &err))
+            goto reset_error;
+        /* The start of this access unit went to the old codec */
+        if (!first) {
+            gst_buffer_unref (input);
+            return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_RESET);
+        }
+    }
+
+    if (priv->parked) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_BACKGROUND);
+    }
+
+    if (first && gst_amc_video_decoder_skip_to_keyframe (self, frame)) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame,
+                    priv->keyframe_wait_reason);
+    }
+
+    if (first && priv->thumbnail_interval &&
+                !gst_amc_video_decoder_is_thumbnail (self, frame)) {
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_THUMBNAIL);
+    }
+
     if (priv->downstream_flow_ret != GST_FLOW_OK)
       goto downstream_error;
 
     timestamp = frame->pts;
     duration = frame->duration;
 
-    gst_buffer_map (frame->input_buffer, &minfo, GST_MAP_READ);
+    gst_buffer_map (input, &minfo, GST_MAP_READ);
+
+    /* Parameter sets come with sync frames */
+    if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame))
+        gst_amc_video_decoder_parse_reorder_depth (self, minfo.data, minfo.size);
+
+    if (first && gst_amc_video_decoder_get_frames_in_flight (self)) {
+        if (priv->leaky == GST_AMC_VIDEO_DECODER_LEAKY_NONE) {
+            if (!gst_amc_video_decoder_wait_in_flight (self))
+                goto reset;
+        } else if (!GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame)) {
+            /* Disposable frames go first, a reference frame takes the
+             * rest of its GOP with it */
+            DropReason reason = DROP_REASON_NON_REFERENCE;
+
+            if (!gst_amc_video_decoder_is_non_reference (self, minfo.data, minfo.size)) {
+                GST_INFO_OBJECT (self, "Too many frames in flight, dropping GOP tail");
+                priv->needs_keyframe = TRUE;
+                priv->keyframe_wait_reason = DROP_REASON_GOP_TAIL;
+                reason = DROP_REASON_GOP_TAIL;
+            }
+            gst_buffer_unmap (input, &minfo);
+            gst_buffer_unref (input);
+            return gst_amc_video_decoder_drop_frame (self, frame, reason);
+        }
+    }
+
+    if (first && priv->target_latency &&
+                gst_amc_video_decoder_catch_up (self, frame, minfo.data, minfo.size)) {
+        gst_buffer_unmap (input, &minfo);
+        gst_buffer_unref (input);
+        return gst_amc_video_decoder_drop_frame (self, frame, DROP_REASON_CATCH_UP);
+    }
+
+    stripped = gst_amc_video_decoder_strip_nal (self, minfo.data, minfo.size, &size);
 
-    while (offset < minfo.size) {
+    while (offset < size) {
         /* Make sure to release the base class stream lock, otherwise
         * _loop() can't call _finish_frame() and we might block forever
         * because no input buffers are released */
+        wait_start = g_get_monotonic_time ();
         GST_VIDEO_DECODER_STREAM_UNLOCK (self);
         /* Wait at most 100ms here, some codecs don't fail dequeueing if
         * the codec is flushing, causing deadlocks during shutdown */
-        idx = gst_amc_codec_dequeue_input_buffer (priv->codec, 100000, &err);
+        res = amc_dec_dequeue_input (priv->dec, &slot, 100000, &err);
         GST_VIDEO_DECODER_STREAM_LOCK (self);
 
-        if (idx < 0 || priv->downstream_flow_ret == GST_FLOW_FLUSHING) {
+        /* Input slots taken by output held downstream, or not dequeued
+         * yet by a loop blocked pushing downstream, don't count */
+        if (priv->output_wait_start)
+            priv->load_starved += g_get_monotonic_time () -
+                MAX (wait_start, priv->output_wait_start);
+
+        /* The srcpad loop hit a recoverable error meanwhile */
+        if (priv->pending_reset && !priv->flushing)
+            goto reset;
+
+        if (res != AMC_DEC_OK || priv->downstream_flow_ret == GST_FLOW_FLUSHING) {
             if (priv->flushing) {
                 g_clear_error (&err);
                 goto flushing;
             }
 
-            switch (idx) {
-            case INFO_TRY_AGAIN_LATER:
+            switch (res) {
+            case AMC_DEC_TRY_AGAIN:
                 GST_DEBUG_OBJECT (self, "Dequeueing input buffer timed out");
                 continue;             /* next try */
                 break;
-            case G_MININT:
+            case AMC_DEC_ERROR:
+                if (g_error_matches (err, GST_AMC_CODEC_ERROR,
+                                GST_AMC_CODEC_ERROR_TRANSIENT) &&
+                            gst_amc_video_decoder_retry_transient (self, err,
+                                &transient_start)) {
+                    GST_DEBUG_OBJECT (self, "Transient failure dequeueing input buffer: %s",
+                                err->message);
+                    g_clear_error (&err);
+                    GST_VIDEO_DECODER_STREAM_UNLOCK (self);
+                    g_usleep (TRANSIENT_ERROR_RETRY_DELAY);
+                    GST_VIDEO_DECODER_STREAM_LOCK (self);
+                    continue;
+                }
+                if (gst_amc_video_decoder_schedule_reset (self, err))
+                    goto reset;
                 GST_ERROR_OBJECT (self, "Failed to dequeue input buffer");
                 goto dequeue_error;
             default:
@@ -1334,19 +5839,15 @@ gst_amc_video_decoder_handle_frame (GstVideoDecoder * decoder,
 
             continue;
         }
-
-        if (idx >= priv->n_input_buffers)
-          goto invalid_buffer_index;
+        transient_start = 0;
 
         if (priv->flushing) {
-            memset (&buffer_info, 0, sizeof (buffer_info));
-            gst_amc_codec_queue_input_buffer (priv->codec, idx, &buffer_info, NULL);
+            amc_dec_queue_input (priv->dec, &slot, 0, 0, 0, NULL);
             goto flushing;
         }
 
         if (priv->downstream_flow_ret != GST_FLOW_OK) {
-            memset (&buffer_info, 0, sizeof (buffer_info));
-            gst_amc_codec_queue_input_buffer (priv->codec, idx, &buffer_info, &err);
+            amc_dec_queue_input (priv->dec, &slot, 0, 0, 0, &err);
             if (err)
               GST_ELEMENT_WARNING_FROM_ERROR (self, err);
             goto downstream_error;
@@ -1354,83 +5855,119 @@ gst_amc_video_decoder_handle_frame (GstVideoDecoder * decoder,
 
         /* Now handle the frame */
 
+        /* Picks the copy kernel for this kind of memory, once per process */
+        gst_amc_copy_calibrate (slot.data, slot.size);
+
         /* Copy the buffer content in chunks of size as requested
         * by the port */
-        buf = &priv->input_buffers[idx];
-
-        memset (&buffer_info, 0, sizeof (buffer_info));
-        buffer_info.offset = 0;
-        buffer_info.size = MIN (minfo.size - offset, buf->size);
+        chunk = MIN (size - offset, slot.size);
+        pts_us = 0;
+        flags = 0;
 
-        orc_memcpy (buf->data, minfo.data + offset, buffer_info.size);
-
-        /* Interpolate timestamps if we're passing the buffer
-        * in multiple chunks */
-        if (offset != 0 && duration != GST_CLOCK_TIME_NONE) {
-            timestamp_offset = gst_util_uint64_scale (offset, duration, minfo.size);
+        if (stripped)
+            gst_amc_nal_filter_copy (priv->nal_filter, minfo.data, offset,
+                        slot.data, chunk);
+        else
+            gst_amc_copy (slot.data, minfo.data + offset, chunk);
+
+        if (partial) {
+            /* All but the last chunk of the access unit are partial */
+            if (!last || offset + chunk < size)
+                flags |= BUFFER_FLAG_PARTIAL_FRAME;
+        } else if (offset != 0 && duration != GST_CLOCK_TIME_NONE) {
+            /* Interpolate timestamps if we're passing the buffer
+            * in multiple chunks */
+            timestamp_offset = gst_util_uint64_scale (offset, duration, size);
         }
 
         if (timestamp != GST_CLOCK_TIME_NONE) {
-            buffer_info.presentation_time_us =
-            gst_util_uint64_scale (timestamp + timestamp_offset, 1, GST_USECOND);
+            pts_us = gst_util_uint64_scale (timestamp + timestamp_offset, 1, GST_USECOND);
             priv->last_upstream_ts = timestamp + timestamp_offset;
         }
         if (duration != GST_CLOCK_TIME_NONE)
           priv->last_upstream_ts += duration;
 
-        if (offset == 0) {
+        if (offset == 0 && first) {
             BufferIdentification *id = buffer_identification_new (timestamp + timestamp_offset);
             if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame))
-                buffer_info.flags |= BUFFER_FLAG_SYNC_FRAME;
+                flags |= BUFFER_FLAG_SYNC_FRAME;
             gst_video_codec_frame_set_user_data (frame, id,
                 (GDestroyNotify) buffer_identification_free);
         }
 
-        offset += buffer_info.size;
+        offset += chunk;
         GST_DEBUG_OBJECT (self,
-                    "Queueing buffer %d: size %d time %" G_GINT64_FORMAT " flags 0x%08x",
-                    idx, buffer_info.size, buffer_info.presentation_time_us,
-                    buffer_info.flags);
-        if (!gst_amc_codec_queue_input_buffer (priv->codec, idx, &buffer_info, &err))
-          goto queue_error;
+                    "Queueing buffer %d: size %" G_GSIZE_FORMAT " time %" G_GINT64_FORMAT
+                    " flags 0x%08x", slot.index, chunk, pts_us, flags);
+        if (amc_dec_queue_input (priv->dec, &slot, chunk, pts_us, flags,
+                        &err) != AMC_DEC_OK) {
+            if (gst_amc_video_decoder_schedule_reset (self, err))
+                goto reset;
+            goto queue_error;
+        }
         priv->drained = FALSE;
     }
 
-    gst_buffer_unmap (frame->input_buffer, &minfo);
+    gst_amc_video_decoder_update_strip_rate (self, minfo.size - size);
+
+    if (last) {
+        /* An idle codec starts the stall timer with its first pending
+         * frame, the one just queued */
+        if (gst_amc_video_decoder_get_pending_frames (self, 0, NULL) <= 1)
+            priv->last_progress_time = g_get_monotonic_time ();
+    }
+
+    gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
     gst_video_codec_frame_unref (frame);
 
+    if (priv->thumbnail_interval && last)
+        return gst_amc_video_decoder_finish_thumbnail (self);
+
     return priv->downstream_flow_ret;
 
+reset:
+    /* Start over with this frame, on the reset codec if needed */
+    g_clear_error (&err);
+    if (minfo.data)
+      gst_buffer_unmap (input, &minfo);
+    memset (&minfo, 0, sizeof (minfo));
+    offset = 0;
+    timestamp_offset = 0;
+    goto again;
+reset_error:
+    GST_ERROR_OBJECT (self, "Failed to reset codec");
+    GST_ELEMENT_ERROR_FROM_ERROR (self, err);
+    gst_buffer_unref (input);
+    gst_video_codec_frame_unref (frame);
+    return GST_FLOW_ERROR;
 downstream_error:
     GST_ERROR_OBJECT (self, "Downstream returned %s",
     gst_flow_get_name (priv->downstream_flow_ret));
     if (minfo.data)
-      gst_buffer_unmap (frame->input_buffer, &minfo);
+      gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
     gst_video_codec_frame_unref (frame);
     return priv->downstream_flow_ret;
-invalid_buffer_index:
-    GST_ELEMENT_ERROR (self, LIBRARY, FAILED, (NULL),
-                ("Invalid input buffer index %d of %zu", idx, priv->n_input_buffers));
-    if (minfo.data)
-      gst_buffer_unmap (frame->input_buffer, &minfo);
-    gst_video_codec_frame_unref (frame);
-    return GST_FLOW_ERROR;
 dequeue_error:
     GST_VIDEO_DECODER_ERROR_FROM_ERROR (self, err);
     if (minfo.data)
-      gst_buffer_unmap (frame->input_buffer, &minfo);
+      gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
     gst_video_codec_frame_unref (frame);
     return GST_FLOW_ERROR;
 queue_error:
     GST_ELEMENT_ERROR_FROM_ERROR (self, err);
     if (minfo.data)
-      gst_buffer_unmap (frame->input_buffer, &minfo);
+      gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
     gst_video_codec_frame_unref (frame);
     return GST_FLOW_ERROR;
 flushing:
     GST_DEBUG_OBJECT (self, "Flushing -- returning FLUSHING");
     if (minfo.data)
-      gst_buffer_unmap (frame->input_buffer, &minfo);
+      gst_buffer_unmap (input, &minfo);
+    gst_buffer_unref (input);
     gst_video_codec_frame_unref (frame);
     return GST_FLOW_FLUSHING;
 }
@@ -1450,7 +5987,8 @@ gst_amc_video_decoder_drain (GstAmcVideoDecoder * self)
 {
     GstAmcVideoDecoderPrivate *priv = GST_AMC_VIDEO_DECODER_GET_PRIVATE (self);
     GstFlowReturn ret;
-    gint idx;
+    AmcDecInput slot;
+    AmcDecResult res;
     GError *err = NULL;
 
     GST_DEBUG_OBJECT (self, "Draining codec");
@@ -1459,6 +5997,23 @@ gst_amc_video_decoder_drain (GstAmcVideoDecoder * self)
         return GST_FLOW_OK;
     }
 
+    if (priv->gop_pool) {
+        ret = gst_amc_video_decoder_dispatch_gop (self);
+        while (ret == GST_FLOW_OK && gst_amc_gop_pool_get_n_pending (priv->gop_pool))
+            ret = gst_amc_video_decoder_finish_gop (self, priv->gop_pool, TRUE);
+        return ret;
+    }
+
+    /* Keyframes are decoded on the shared codec as they come, a focused
+     * stream decodes the rest of its GOP */
+    if (priv->shared_codec)
+        return gst_amc_video_decoder_end_shared_gop (self, FALSE);
+
+    if (priv->pending_reset || g_atomic_int_get (&priv->codec_stopped)) {
+        GST_DEBUG_OBJECT (self, "Codec is waiting for reset, nothing to drain");
+        return GST_FLOW_OK;
+    }
+
     /* Don't send drain buffer twice, this doesn't work */
     if (priv->drained) {
         GST_DEBUG_OBJECT (self, "Codec is drained already");
@@ -1473,23 +6028,17 @@ gst_amc_video_decoder_drain (GstAmcVideoDecoder * self)
     * class drop the EOS event. We will send it later when
     * the EOS buffer arrives on the output port.
     * Wait at most 0.5s here. */
-    idx = gst_amc_codec_dequeue_input_buffer (priv->codec, 500000, &err);
+    res = amc_dec_dequeue_input (priv->dec, &slot, 500000, &err);
     GST_VIDEO_DECODER_STREAM_LOCK (self);
 
-    if (idx >= 0 && idx < priv->n_input_buffers) {
-        GstAmcBufferInfo buffer_info;
-
+    if (res == AMC_DEC_OK) {
         GST_VIDEO_DECODER_STREAM_UNLOCK (self);
         g_mutex_lock (&priv->drain_lock);
         priv->draining = TRUE;
 
-        memset (&buffer_info, 0, sizeof (buffer_info));
-        buffer_info.size = 0;
-        buffer_info.presentation_time_us =
-            gst_util_uint64_scale (priv->last_upstream_ts, 1, GST_USECOND);
-        buffer_info.flags |= BUFFER_FLAG_END_OF_STREAM;
-
-        if (gst_amc_codec_queue_input_buffer (priv->codec, idx, &buffer_info, &err)) {
+        if (amc_dec_queue_input (priv->dec, &slot, 0,
+                        gst_util_uint64_scale (priv->last_upstream_ts, 1, GST_USECOND),
+                        BUFFER_FLAG_END_OF_STREAM, &err) == AMC_DEC_OK) {
             GST_DEBUG_OBJECT (self, "Waiting until codec is drained");
             g_cond_wait (&priv->drain_cond, &priv->drain_lock);
             GST_DEBUG_OBJECT (self, "Drained codec");
@@ -1504,12 +6053,8 @@ gst_amc_video_decoder_drain (GstAmcVideoDecoder * self)
         priv->draining = FALSE;
         g_mutex_unlock (&priv->drain_lock);
         GST_VIDEO_DECODER_STREAM_LOCK (self);
-    } else if (idx >= priv->n_input_buffers) {
-        GST_ERROR_OBJECT (self, "Invalid input buffer index %d of %zu",
-                    idx, priv->n_input_buffers);
-        ret = GST_FLOW_ERROR;
     } else {
-        GST_ERROR_OBJECT (self, "Failed to acquire buffer for EOS: %d", idx);
+        GST_ERROR_OBJECT (self, "Failed to acquire buffer for EOS");
         if (err)
           GST_ELEMENT_WARNING_FROM_ERROR (self, err);
         ret = GST_FLOW_ERROR;
@@ -31,9 +31,57 @@ G_BEGIN_DECLS
 #define GST_IS_AMC_VIDEO_DECODER_CLASS(obj) \
     (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_AMC_VIDEO_DECODER))
 
+#define GST_TYPE_AMC_VIDEO_DECODER_OUTPUT_MODE \
+    (gst_amc_video_decoder_output_mode_get_type())
+#define GST_TYPE_AMC_VIDEO_DECODER_LEAKY \
+    (gst_amc_video_decoder_leaky_get_type())
+#define GST_TYPE_AMC_VIDEO_DECODER_CATCH_UP_STATE \
+    (gst_amc_video_decoder_catch_up_state_get_type())
+#define GST_TYPE_AMC_VIDEO_DECODER_SCALING_MODE \
+    (gst_amc_video_decoder_scaling_mode_get_type())
+#define GST_TYPE_AMC_VIDEO_DECODER_PRIORITY \
+    (gst_amc_video_decoder_priority_get_type())
+
 typedef struct _GstAmcVideoDecoder GstAmcVideoDecoder;
 typedef struct _GstAmcVideoDecoderClass GstAmcVideoDecoderClass;
 
+typedef enum
+{
+    GST_AMC_VIDEO_DECODER_OUTPUT_MODE_AUTO,
+    GST_AMC_VIDEO_DECODER_OUTPUT_MODE_DIRECT,
+    GST_AMC_VIDEO_DECODER_OUTPUT_MODE_GL,
+    GST_AMC_VIDEO_DECODER_OUTPUT_MODE_RAW
+} GstAmcVideoDecoderOutputMode;
+
+typedef enum
+{
+    GST_AMC_VIDEO_DECODER_LEAKY_NONE,
+    GST_AMC_VIDEO_DECODER_LEAKY_GOP
+} GstAmcVideoDecoderLeaky;
+
+typedef enum
+{
+    GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_IDLE,
+    GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_RENDER_AHEAD,
+    GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_SKIP,
+    GST_AMC_VIDEO_DECODER_CATCH_UP_STATE_JUMP
+} GstAmcVideoDecoderCatchUpState;
+
+/* Values match MediaCodec.VIDEO_SCALING_MODE_* */
+typedef enum
+{
+    GST_AMC_VIDEO_DECODER_SCALING_MODE_FIT = 1,
+    GST_AMC_VIDEO_DECODER_SCALING_MODE_CROP = 2
+} GstAmcVideoDecoderScalingMode;
+
+/* Values match MediaFormat.KEY_PRIORITY, DEFAULT leaves it unset */
+typedef enum
+{
+    GST_AMC_VIDEO_DECODER_PRIORITY_DEFAULT = -1,
+    GST_AMC_VIDEO_DECODER_PRIORITY_REALTIME = 0,
+    GST_AMC_VIDEO_DECODER_PRIORITY_BEST_EFFORT = 1
+} GstAmcVideoDecoderPriority;
+
 struct _GstAmcVideoDecoder
 {
     GstVideoDecoder parent;
@@ -45,6 +93,11 @@ struct _GstAmcVideoDecoderClass
 };
 
 GType gst_amc_video_decoder_get_type (void);
+GType gst_amc_video_decoder_output_mode_get_type (void);
+GType gst_amc_video_decoder_leaky_get_type (void);
+GType gst_amc_video_decoder_catch_up_state_get_type (void);
+GType gst_amc_video_decoder_scaling_mode_get_type (void);
+GType gst_amc_video_decoder_priority_get_type (void);
 
 G_END_DECLS
 
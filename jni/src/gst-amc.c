@@ -22,11 +22,66 @@
 #include <string.h>
 
 #include "gst-amc.h"
+#include "gst-amc-codec-cache.h"
+#include "gst-amc-surface-texture.h"
 #include "gst-jni-utils.h"
 
 GST_DEBUG_CATEGORY (gst_amc_debug);
 #define GST_CAT_DEFAULT gst_amc_debug
 
+/* android.os.Build.VERSION.SDK_INT of the device we run on */
+static gint sdk_int;
+/* android.os.Build.FINGERPRINT, NULL if unknown */
+static gchar *build_fingerprint;
+
+/* Overrides the codec cache path, see gst_amc_codeclist_to_caps() */
+#define CODEC_CACHE_ENV "GST_AMC_CODEC_CACHE"
+/* Part of the codec cache key. Bump it whenever
+ * gst_amc_codeclist_enumerate_codec() changes which codecs, types or
+ * profiles it keeps, so caches written by older builds are dropped */
+#define CODECLIST_FILTER_VERSION 1
+
+/* Threads enumerating the codec list, and the fewest codecs worth one */
+#define CODECLIST_MAX_THREADS 4
+#define CODECLIST_MIN_CODECS_PER_THREAD 8
+/* Local references held while looking at one codec */
+#define CODECLIST_LOCAL_FRAME_CAPACITY 32
+
+/* Codec indices [start, end) enumerated by one thread */
+typedef struct
+{
+  gint start;
+  gint end;
+  GstAmcCodecCache *cache;
+  GThread *thread;
+} GstAmcCodeclistRange;
+
+/* Overrides the codec budget, see gst_amc_set_codec_budget() */
+#define CODEC_BUDGET_ENV "GST_AMC_CODEC_BUDGET"
+/* How long a preempting session waits for preempted ones to go */
+#define PREEMPT_TIMEOUT (500 * G_TIME_SPAN_MILLISECOND)
+
+/* A hardware codec instance counted against the budget */
+struct _GstAmcSession
+{
+  /* Codec name, the MIME type until the first instance told us */
+  gchar *name;
+  guint units;
+  GstAmcSessionPriority priority;
+  GstAmcSessionPreemptFunc preempt;
+  gpointer user_data;
+  gboolean preempted;
+};
+
+static GMutex budget_lock;
+static GCond budget_cond;
+/* Units per codec name, 0 for no limit other than the device's */
+static guint budget_units;
+static GList *sessions;
+/* MIME types to hardware and software decoder names */
+static GHashTable *hardware_names;
+static GHashTable *software_names;
+
 struct _GstAmcCodecInfoHandle
 {
   jobject object;
@@ -38,6 +93,14 @@ struct _GstAmcCodecCapabilitiesHandle
 };
 
 /* Global cached references */
+static struct
+{
+  jclass klass;
+  jmethodID constructor;
+  jmethodID put_float;
+  jmethodID put_int;
+} bundle;
+
 static struct
 {
   jclass klass;
@@ -55,12 +118,17 @@ static struct
   jmethodID dequeue_output_buffer;
   jmethodID flush;
   jmethodID get_input_buffers;
+  jmethodID get_name;
   jmethodID get_output_buffers;
   jmethodID get_output_format;
+  jmethodID get_output_image;
   jmethodID queue_input_buffer;
   jmethodID release;
   jmethodID release_output_buffer;
   jmethodID release_output_buffer_time;
+  jmethodID set_output_surface;
+  jmethodID set_parameters;
+  jmethodID set_video_scaling_mode;
   jmethodID start;
   jmethodID stop;
 } media_codec;
@@ -92,6 +160,22 @@ static struct
   jmethodID set_byte_buffer;
 } media_format;
 
+/* Decoded frames in vendor formats, API level 21 */
+static struct
+{
+  jclass klass;
+  jmethodID get_planes;
+  jmethodID close;
+} image;
+
+static struct
+{
+  jclass klass;
+  jmethodID get_buffer;
+  jmethodID get_row_stride;
+  jmethodID get_pixel_stride;
+} image_plane;
+
 static struct
 {
   jclass klass;
@@ -231,6 +315,392 @@ gst_amc_encoder_new_from_type (const gchar * type, GError ** err)
     return gst_amc_codec_new_from_type (media_codec.create_encoder_by_type, type, err);
 }
 
+/* Resolution classes weighted by pixel count, SD being one unit */
+static guint
+gst_amc_session_get_units (gint width, gint height)
+{
+  gint64 pixels = (gint64) width * height;
+
+  if (pixels <= 720 * 576)
+    return 1;
+  if (pixels <= 1280 * 720)
+    return 2;
+  if (pixels <= 1920 * 1088)
+    return 4;
+
+  return 4 * ((pixels + 1920 * 1088 - 1) / (1920 * 1088));
+}
+
+static gboolean
+gst_amc_is_software_codec_name (const gchar * name)
+{
+  return g_str_has_prefix (name, "OMX.google.") ||
+      g_str_has_prefix (name, "c2.android.");
+}
+
+/* Called with the budget lock held */
+static guint
+gst_amc_session_get_used_units (const gchar * name, gboolean with_preempted)
+{
+  guint units = 0;
+  GList *l;
+
+  for (l = sessions; l; l = l->next) {
+    GstAmcSession *session = l->data;
+
+    if (strcmp (session->name, name) == 0 &&
+        (with_preempted || !session->preempted))
+      units += session->units;
+  }
+
+  return units;
+}
+
+/* Preempts sessions of lower priority than @session until it fits in
+ * the budget, then waits for them to go. Called with the budget lock
+ * held, @session being counted already */
+static gboolean
+gst_amc_session_make_room (GstAmcSession * session)
+{
+  gint64 deadline = g_get_monotonic_time () + PREEMPT_TIMEOUT;
+
+  if (!budget_units)
+    return TRUE;
+
+  while (gst_amc_session_get_used_units (session->name, FALSE) > budget_units) {
+    GstAmcSession *victim = NULL;
+    GList *l;
+
+    /* The lowest priority, the most recent one among equals */
+    for (l = sessions; l; l = l->next) {
+      GstAmcSession *other = l->data;
+
+      if (other->preempted || !other->preempt ||
+          other->priority >= session->priority ||
+          strcmp (other->name, session->name) != 0)
+        continue;
+      if (!victim || other->priority <= victim->priority)
+        victim = other;
+    }
+
+    if (!victim)
+      return FALSE;
+
+    GST_INFO ("Preempting %s session of priority %d for one of priority %d",
+        victim->name, victim->priority, session->priority);
+    victim->preempted = TRUE;
+    victim->preempt (victim->user_data);
+  }
+
+  while (gst_amc_session_get_used_units (session->name, TRUE) > budget_units) {
+    if (!g_cond_wait_until (&budget_cond, &budget_lock, deadline)) {
+      GST_INFO ("Preempted %s sessions didn't go in time", session->name);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+gst_amc_session_free (GstAmcSession * session)
+{
+  g_mutex_lock (&budget_lock);
+  sessions = g_list_remove (sessions, session);
+  g_cond_broadcast (&budget_cond);
+  g_mutex_unlock (&budget_lock);
+
+  g_free (session->name);
+  g_slice_free (GstAmcSession, session);
+}
+
+/* First software decoder for @type in the codec list, NULL if none */
+static gchar *
+gst_amc_codeclist_find_software_decoder (const gchar * type)
+{
+  GError *error = NULL;
+  gchar *found = NULL;
+  gint codec_count, i;
+
+  if (!gst_amc_codeclist_get_count (&codec_count, &error)) {
+    GST_ERROR ("Failed to get number of available codecs: %s", error->message);
+    g_clear_error (&error);
+    return NULL;
+  }
+
+  for (i = 0; i < codec_count && !found; i++) {
+    GstAmcCodecInfoHandle *codec_info;
+    gchar *name_str = NULL;
+    gchar **supported_types = NULL;
+    gboolean is_encoder;
+    gsize n_supported_types, j;
+
+    codec_info = gst_amc_codeclist_get_codec_info_at (i, &error);
+    if (!codec_info)
+      goto next_codec;
+
+    name_str = gst_amc_codec_info_handle_get_name (codec_info, &error);
+    if (!name_str || !gst_amc_is_software_codec_name (name_str))
+      goto next_codec;
+
+    if (!gst_amc_codec_info_handle_is_encoder (codec_info, &is_encoder, &error)
+        || is_encoder)
+      goto next_codec;
+
+    supported_types = gst_amc_codec_info_handle_get_supported_types (codec_info,
+        &n_supported_types, &error);
+    for (j = 0; supported_types && j < n_supported_types; j++) {
+      if (g_ascii_strcasecmp (supported_types[j], type) == 0) {
+        found = name_str;
+        name_str = NULL;
+        break;
+      }
+    }
+
+  next_codec:
+    g_free (name_str);
+    g_strfreev (supported_types);
+    if (codec_info)
+      gst_amc_codec_info_handle_free (codec_info);
+    g_clear_error (&error);
+  }
+
+  return found;
+}
+
+/* Cached, NULL if there is no software decoder for @type */
+static gchar *
+gst_amc_get_software_decoder_name (const gchar * type)
+{
+  gchar *name;
+
+  g_mutex_lock (&budget_lock);
+  if (g_hash_table_contains (software_names, type)) {
+    name = g_strdup (g_hash_table_lookup (software_names, type));
+    g_mutex_unlock (&budget_lock);
+    return name;
+  }
+  g_mutex_unlock (&budget_lock);
+
+  name = gst_amc_codeclist_find_software_decoder (type);
+
+  g_mutex_lock (&budget_lock);
+  g_hash_table_insert (software_names, g_strdup (type), g_strdup (name));
+  g_mutex_unlock (&budget_lock);
+
+  return name;
+}
+
+/* Creates a decoder for @type, counted against the codec budget of its
+ * codec name with the units of the resolution class of @width x @height
+ * (0 if unknown). If the budget is exhausted, sessions of lower priority
+ * are preempted through their @preempt function. Failing that, or if
+ * the device has no hardware session left, the software decoder for
+ * @type is used if @allow_software */
+GstAmcCodec *
+gst_amc_decoder_new_with_budget (const gchar * type, gint width, gint height,
+    GstAmcSessionPriority priority, gboolean allow_software,
+    GstAmcSessionPreemptFunc preempt, gpointer user_data, GError ** err)
+{
+  GstAmcSession *session;
+  GstAmcCodec *codec;
+  GError *local_err = NULL;
+  gchar *name;
+
+  g_return_val_if_fail (type != NULL, NULL);
+
+  session = g_slice_new0 (GstAmcSession);
+  session->units = gst_amc_session_get_units (width, height);
+  session->priority = priority;
+  session->preempt = preempt;
+  session->user_data = user_data;
+
+  g_mutex_lock (&budget_lock);
+  name = g_hash_table_lookup (hardware_names, type);
+  session->name = g_strdup (name ? name : type);
+  sessions = g_list_append (sessions, session);
+  if (!gst_amc_session_make_room (session)) {
+    g_mutex_unlock (&budget_lock);
+    g_set_error (&local_err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_BUSY,
+        "Codec budget of %u units for %s exhausted", budget_units,
+        session->name);
+    gst_amc_session_free (session);
+    goto software;
+  }
+  g_mutex_unlock (&budget_lock);
+
+  codec = gst_amc_decoder_new_from_type (type, &local_err);
+  if (!codec) {
+    gst_amc_session_free (session);
+    goto software;
+  }
+
+  /* Sessions are counted per codec, not per MIME type */
+  name = gst_amc_codec_get_name (codec, NULL);
+  if (name && gst_amc_is_software_codec_name (name)) {
+    /* No hardware decoder for this type at all */
+    gst_amc_session_free (session);
+    codec->software = TRUE;
+  } else {
+    g_mutex_lock (&budget_lock);
+    if (name && strcmp (session->name, name) != 0) {
+      g_free (session->name);
+      session->name = g_strdup (name);
+      g_hash_table_insert (hardware_names, g_strdup (type), g_strdup (name));
+    }
+    g_mutex_unlock (&budget_lock);
+    codec->session = session;
+  }
+  g_free (name);
+
+  return codec;
+
+software:
+  if (!allow_software) {
+    g_propagate_error (err, local_err);
+    return NULL;
+  }
+
+  GST_INFO ("Falling back to software decoder for %s: %s", type,
+      local_err->message);
+  codec = gst_amc_decoder_new_software (type, NULL);
+  if (codec)
+    g_clear_error (&local_err);
+  else
+    g_propagate_error (err, local_err);
+
+  return codec;
+}
+
+/* Creates the software decoder for @type, not counted against the codec
+ * budget. For hardware codecs that fail to configure or start for lack
+ * of resources */
+GstAmcCodec *
+gst_amc_decoder_new_software (const gchar * type, GError ** err)
+{
+  GstAmcCodec *codec;
+  gchar *name;
+
+  g_return_val_if_fail (type != NULL, NULL);
+
+  name = gst_amc_get_software_decoder_name (type);
+  if (!name) {
+    g_set_error (err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NOT_FOUND,
+        "No software decoder for %s", type);
+    return NULL;
+  }
+
+  codec = gst_amc_codec_new (name, err);
+  if (codec)
+    codec->software = TRUE;
+  g_free (name);
+
+  return codec;
+}
+
+gboolean
+gst_amc_codec_is_software (GstAmcCodec * codec)
+{
+  g_return_val_if_fail (codec != NULL, FALSE);
+
+  return codec->software;
+}
+
+/* Sessions only preempt those of lower priority than theirs */
+void
+gst_amc_codec_set_session_priority (GstAmcCodec * codec,
+    GstAmcSessionPriority priority)
+{
+  g_return_if_fail (codec != NULL);
+
+  g_mutex_lock (&budget_lock);
+  if (codec->session)
+    codec->session->priority = priority;
+  g_mutex_unlock (&budget_lock);
+}
+
+/* Counts the session of @codec with the units of @width x @height, for
+ * a codec configured again at another resolution. Sessions of lower
+ * priority are preempted if it grew past the budget. Fails, leaving the
+ * units as they were, if there is still no room */
+gboolean
+gst_amc_codec_update_session (GstAmcCodec * codec, gint width, gint height,
+    GError ** err)
+{
+  GstAmcSession *session;
+  guint units, old_units;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+
+  units = gst_amc_session_get_units (width, height);
+
+  g_mutex_lock (&budget_lock);
+  session = codec->session;
+  if (!session || session->units == units) {
+    g_mutex_unlock (&budget_lock);
+    return TRUE;
+  }
+
+  GST_INFO ("%s session now counts %u units instead of %u", session->name,
+      units, session->units);
+  old_units = session->units;
+  session->units = units;
+  if (units < old_units) {
+    g_cond_broadcast (&budget_cond);
+  } else if (!gst_amc_session_make_room (session)) {
+    session->units = old_units;
+    g_set_error (err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_BUSY,
+        "Codec budget of %u units for %s exhausted", budget_units,
+        session->name);
+    g_mutex_unlock (&budget_lock);
+    return FALSE;
+  }
+  g_mutex_unlock (&budget_lock);
+
+  return TRUE;
+}
+
+/* Hands the session of @codec back to the budget once the codec is
+ * released, before it is freed. Safe to call from any thread */
+void
+gst_amc_codec_release_session (GstAmcCodec * codec)
+{
+  GstAmcSession *session;
+
+  g_return_if_fail (codec != NULL);
+
+  g_mutex_lock (&budget_lock);
+  session = codec->session;
+  codec->session = NULL;
+  g_mutex_unlock (&budget_lock);
+
+  if (session)
+    gst_amc_session_free (session);
+}
+
+/* Limits the sessions of each hardware codec to @units, SD sessions
+ * counting as one unit, 720p as two, 1080p as four and larger ones as
+ * four per 1080p. 0 leaves the limit to the device */
+void
+gst_amc_set_codec_budget (guint units)
+{
+  g_mutex_lock (&budget_lock);
+  budget_units = units;
+  g_mutex_unlock (&budget_lock);
+}
+
+guint
+gst_amc_get_codec_budget (void)
+{
+  guint units;
+
+  g_mutex_lock (&budget_lock);
+  units = budget_units;
+  g_mutex_unlock (&budget_lock);
+
+  return units;
+}
+
 void
 gst_amc_codec_free (GstAmcCodec * codec)
 {
@@ -238,11 +708,36 @@ gst_amc_codec_free (GstAmcCodec * codec)
 
   g_return_if_fail (codec != NULL);
 
+  gst_amc_codec_release_session (codec);
+
   env = gst_amc_jni_get_env ();
   gst_amc_jni_object_unref (env, codec->object);
   g_slice_free (GstAmcCodec, codec);
 }
 
+gchar *
+gst_amc_codec_get_name (GstAmcCodec * codec, GError ** err)
+{
+  JNIEnv *env;
+  jstring v_str = NULL;
+
+  g_return_val_if_fail (codec != NULL, NULL);
+
+  if (!media_codec.get_name) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "MediaCodec.getName() requires API level 18");
+    return NULL;
+  }
+
+  env = gst_amc_jni_get_env ();
+
+  if (!gst_amc_jni_call_object_method (env, err, codec->object,
+          media_codec.get_name, &v_str))
+    return NULL;
+
+  return gst_amc_jni_string_to_gchar (env, v_str, TRUE);
+}
+
 jmethodID
 gst_amc_codec_get_release_method_id (GstAmcCodec * codec)
 {
@@ -335,6 +830,109 @@ gst_amc_codec_flush (GstAmcCodec * codec, GError ** err)
       media_codec.flush);
 }
 
+gboolean
+gst_amc_codec_set_output_surface (GstAmcCodec * codec, jobject surface,
+    GError ** err)
+{
+  JNIEnv *env;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+  g_return_val_if_fail (surface != NULL, FALSE);
+
+  if (!media_codec.set_output_surface) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "MediaCodec.setOutputSurface() requires API level 23");
+    return FALSE;
+  }
+
+  env = gst_amc_jni_get_env ();
+
+  return gst_amc_jni_call_void_method (env, err, codec->object,
+      media_codec.set_output_surface, surface);
+}
+
+static gboolean
+gst_amc_codec_set_parameter (GstAmcCodec * codec, const gchar * key,
+    gboolean is_float, gint int_value, gfloat float_value, GError ** err)
+{
+  JNIEnv *env;
+  jstring key_str = NULL;
+  jobject params = NULL;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  if (!media_codec.set_parameters || !bundle.klass) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "MediaCodec.setParameters() requires API level 19");
+    return FALSE;
+  }
+
+  env = gst_amc_jni_get_env ();
+
+  key_str = gst_amc_jni_string_from_gchar (env, err, FALSE, key);
+  if (!key_str)
+    goto done;
+
+  params = gst_amc_jni_new_object (env, err, FALSE, bundle.klass,
+      bundle.constructor);
+  if (!params)
+    goto done;
+
+  if (is_float) {
+    if (!gst_amc_jni_call_void_method (env, err, params, bundle.put_float,
+            key_str, (jdouble) float_value))
+      goto done;
+  } else {
+    if (!gst_amc_jni_call_void_method (env, err, params, bundle.put_int,
+            key_str, int_value))
+      goto done;
+  }
+
+  if (!gst_amc_jni_call_void_method (env, err, codec->object,
+          media_codec.set_parameters, params))
+    goto done;
+
+  ret = TRUE;
+
+done:
+  if (params)
+    gst_amc_jni_object_local_unref (env, params);
+  if (key_str)
+    gst_amc_jni_object_local_unref (env, key_str);
+
+  return ret;
+}
+
+gboolean
+gst_amc_codec_set_parameter_int (GstAmcCodec * codec, const gchar * key,
+    gint value, GError ** err)
+{
+  return gst_amc_codec_set_parameter (codec, key, FALSE, value, 0, err);
+}
+
+gboolean
+gst_amc_codec_set_parameter_float (GstAmcCodec * codec, const gchar * key,
+    gfloat value, GError ** err)
+{
+  return gst_amc_codec_set_parameter (codec, key, TRUE, 0, value, err);
+}
+
+gboolean
+gst_amc_codec_set_video_scaling_mode (GstAmcCodec * codec, gint mode,
+    GError ** err)
+{
+  JNIEnv *env;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+
+  env = gst_amc_jni_get_env ();
+
+  return gst_amc_jni_call_void_method (env, err, codec->object,
+      media_codec.set_video_scaling_mode, mode);
+}
+
 gboolean
 gst_amc_codec_release (GstAmcCodec * codec, GError ** err)
 {
@@ -531,6 +1129,157 @@ gst_amc_codec_release_output_buffer (GstAmcCodec * codec, gint index,
       media_codec.release_output_buffer, index, JNI_FALSE);
 }
 
+/* Renders output buffer @index at @timestamp, in nanoseconds of the
+ * System.nanoTime() clock, i.e. CLOCK_MONOTONIC */
+gboolean
+gst_amc_codec_render_output_buffer_at (GstAmcCodec * codec, gint index,
+    gint64 timestamp, GError ** err)
+{
+  JNIEnv *env;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+
+  env = gst_amc_jni_get_env ();
+
+  return gst_amc_jni_call_void_method (env, err, codec->object,
+      media_codec.release_output_buffer_time, index, timestamp);
+}
+
+static gboolean
+gst_amc_image_plane_copy (JNIEnv * env, jobject plane, gint crop_left,
+    gint crop_top, GstVideoFrame * frame, guint i, GError ** err)
+{
+  jobject buffer = NULL;
+  gint row_stride, pixel_stride, width, height, x, y;
+  const guint8 *data;
+  guint8 *dest;
+  jlong size;
+  gboolean ret = FALSE;
+
+  if (!gst_amc_jni_call_int_method (env, err, plane,
+          image_plane.get_row_stride, &row_stride)
+      || !gst_amc_jni_call_int_method (env, err, plane,
+          image_plane.get_pixel_stride, &pixel_stride)
+      || !gst_amc_jni_call_object_method (env, err, plane,
+          image_plane.get_buffer, &buffer))
+    goto done;
+
+  data = (*env)->GetDirectBufferAddress (env, buffer);
+  size = (*env)->GetDirectBufferCapacity (env, buffer);
+  if (!data || size < 0) {
+    gst_amc_jni_set_error (env, err, GST_LIBRARY_ERROR,
+        GST_LIBRARY_ERROR_FAILED, "Image plane %u is not a direct buffer", i);
+    goto done;
+  }
+
+  width = GST_VIDEO_FRAME_COMP_WIDTH (frame, i);
+  height = GST_VIDEO_FRAME_COMP_HEIGHT (frame, i);
+  if (i > 0) {
+    crop_left /= 2;
+    crop_top /= 2;
+  }
+  data += crop_top * row_stride + crop_left * pixel_stride;
+
+  /* The last row may end right after its visible part */
+  if ((crop_top + height - 1) * (jlong) row_stride
+      + (crop_left + width - 1) * (jlong) pixel_stride + 1 > size) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "Image plane %u of %" G_GINT64_FORMAT " bytes too small", i,
+        (gint64) size);
+    goto done;
+  }
+
+  dest = GST_VIDEO_FRAME_COMP_DATA (frame, i);
+  for (y = 0; y < height; y++) {
+    if (pixel_stride == 1) {
+      memcpy (dest, data, width);
+    } else {
+      for (x = 0; x < width; x++)
+        dest[x] = data[x * pixel_stride];
+    }
+    data += row_stride;
+    dest += GST_VIDEO_FRAME_COMP_STRIDE (frame, i);
+  }
+
+  ret = TRUE;
+
+done:
+  if (buffer)
+    gst_amc_jni_object_local_unref (env, buffer);
+
+  return ret;
+}
+
+/* Copies output buffer @index through MediaCodec.getOutputImage(), for
+ * layouts with use_image set. @frame is I420 as in the layout */
+gboolean
+gst_amc_codec_copy_output_image (GstAmcCodec * codec, gint index,
+    const GstAmcVideoLayout * layout, GstVideoFrame * frame, GError ** err)
+{
+  JNIEnv *env;
+  jobject object = NULL, planes = NULL;
+  gboolean ret = FALSE;
+  guint i;
+
+  g_return_val_if_fail (codec != NULL, FALSE);
+  g_return_val_if_fail (layout != NULL && layout->use_image, FALSE);
+  g_return_val_if_fail (GST_VIDEO_FRAME_FORMAT (frame) ==
+      GST_VIDEO_FORMAT_I420, FALSE);
+
+  env = gst_amc_jni_get_env ();
+
+  if (!gst_amc_jni_call_object_method (env, err, codec->object,
+          media_codec.get_output_image, &object, index))
+    goto done;
+  if (!object) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "No image for output buffer %d", index);
+    goto done;
+  }
+
+  if (!gst_amc_jni_call_object_method (env, err, object, image.get_planes,
+          &planes))
+    goto done;
+  if (!planes || (*env)->GetArrayLength (env, planes) < 3) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_FAILED,
+        "Image of output buffer %d is not YUV", index);
+    goto done;
+  }
+
+  for (i = 0; i < 3; i++) {
+    jobject plane = (*env)->GetObjectArrayElement (env, planes, i);
+    gboolean copied;
+
+    if (!plane) {
+      gst_amc_jni_set_error (env, err, GST_LIBRARY_ERROR,
+          GST_LIBRARY_ERROR_FAILED, "Failed to get image plane %u", i);
+      goto done;
+    }
+    copied = gst_amc_image_plane_copy (env, plane, layout->crop_left,
+        layout->crop_top, frame, i, err);
+    gst_amc_jni_object_local_unref (env, plane);
+    if (!copied)
+      goto done;
+  }
+
+  ret = TRUE;
+
+done:
+  if (planes)
+    gst_amc_jni_object_local_unref (env, planes);
+  if (object) {
+    GError *close_err = NULL;
+
+    if (!gst_amc_jni_call_void_method (env, &close_err, object, image.close)) {
+      GST_WARNING ("Failed to close image: %s", close_err->message);
+      g_clear_error (&close_err);
+    }
+    gst_amc_jni_object_local_unref (env, object);
+  }
+
+  return ret;
+}
+
 GstAmcFormat *
 gst_amc_format_new_audio (const gchar * mime, gint sample_rate, gint channels,
     GError ** err)
@@ -937,19 +1686,194 @@ gst_amc_format_set_buffer (GstAmcFormat * format, const gchar * key,
     goto done;
   }
 
-  if (!gst_amc_jni_call_void_method (env, err, format->object,
-          media_format.set_byte_buffer, key_str, v))
-    goto done;
+  if (!gst_amc_jni_call_void_method (env, err, format->object,
+          media_format.set_byte_buffer, key_str, v))
+    goto done;
+
+  ret = TRUE;
+
+done:
+  if (key_str)
+    gst_amc_jni_object_local_unref (env, key_str);
+  if (v)
+    gst_amc_jni_object_local_unref (env, v);
+
+  return ret;
+}
+
+static gint
+gst_amc_format_get_int_default (GstAmcFormat * format, const gchar * key,
+    gint def)
+{
+  gint value;
+
+  if (!gst_amc_format_contains_key (format, key, NULL)
+      || !gst_amc_format_get_int (format, key, &value, NULL))
+    return def;
+
+  return value;
+}
+
+gboolean
+gst_amc_video_output_format_parse (GstAmcVideoOutputFormat * output,
+    GstAmcFormat * format, GError ** err)
+{
+  g_return_val_if_fail (output != NULL, FALSE);
+  g_return_val_if_fail (format != NULL, FALSE);
+
+  if (!gst_amc_format_get_int (format, "width", &output->width, err)
+      || !gst_amc_format_get_int (format, "height", &output->height, err))
+    return FALSE;
+
+  output->color_format =
+      gst_amc_format_get_int_default (format, "color-format", 0);
+
+  /* Some codecs report 0 or less than the width and height */
+  output->stride = MAX (gst_amc_format_get_int_default (format, "stride",
+          output->width), output->width);
+  output->slice_height = MAX (gst_amc_format_get_int_default (format,
+          "slice-height", output->height), output->height);
+
+  output->crop_left = gst_amc_format_get_int_default (format, "crop-left", 0);
+  output->crop_top = gst_amc_format_get_int_default (format, "crop-top", 0);
+  output->crop_right = gst_amc_format_get_int_default (format, "crop-right",
+      output->width - 1);
+  output->crop_bottom = gst_amc_format_get_int_default (format, "crop-bottom",
+      output->height - 1);
+
+  if (output->crop_left < 0 || output->crop_left >= output->width
+      || output->crop_right >= output->width
+      || output->crop_right < output->crop_left
+      || output->crop_top < 0 || output->crop_top >= output->height
+      || output->crop_bottom >= output->height
+      || output->crop_bottom < output->crop_top) {
+    g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_SETTINGS,
+        "Invalid crop rectangle %d,%d-%d,%d for %dx%d", output->crop_left,
+        output->crop_top, output->crop_right, output->crop_bottom,
+        output->width, output->height);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean
+gst_amc_video_output_format_is_equal (const GstAmcVideoOutputFormat * a,
+    const GstAmcVideoOutputFormat * b)
+{
+  return a->width == b->width && a->height == b->height
+      && a->crop_left == b->crop_left && a->crop_top == b->crop_top
+      && a->crop_right == b->crop_right && a->crop_bottom == b->crop_bottom
+      && a->stride == b->stride && a->slice_height == b->slice_height
+      && a->color_format == b->color_format;
+}
+
+gboolean
+gst_amc_video_layout_from_output_format (GstAmcVideoLayout * layout,
+    const GstAmcVideoOutputFormat * output, GError ** err)
+{
+  GstVideoFormat video_format;
+
+  g_return_val_if_fail (layout != NULL, FALSE);
+  g_return_val_if_fail (output != NULL, FALSE);
+
+  switch (output->color_format) {
+    case COLOR_FormatYUV420Planar:
+      video_format = GST_VIDEO_FORMAT_I420;
+      break;
+    case COLOR_FormatYUV420SemiPlanar:
+    case COLOR_TI_FormatYUV420PackedSemiPlanar:
+    case COLOR_QCOM_FormatYUV420SemiPlanar:
+      video_format = GST_VIDEO_FORMAT_NV12;
+      break;
+    default:
+      /* Vendor formats like tiled ones are converted by the codec */
+      if (image.klass) {
+        video_format = GST_VIDEO_FORMAT_I420;
+        break;
+      }
+      g_set_error (err, GST_LIBRARY_ERROR, GST_LIBRARY_ERROR_SETTINGS,
+          "Unsupported color format 0x%08x", output->color_format);
+      return FALSE;
+  }
+
+  layout->use_image = video_format == GST_VIDEO_FORMAT_I420
+      && output->color_format != COLOR_FormatYUV420Planar;
+  layout->color_format = output->color_format;
+  layout->stride = output->stride;
+  layout->slice_height = output->slice_height;
+
+  /* Chroma is subsampled, crop at even positions only */
+  layout->crop_left = output->crop_left & ~1;
+  layout->crop_top = output->crop_top & ~1;
+
+  gst_video_info_set_format (&layout->info, video_format,
+      output->crop_right - layout->crop_left + 1,
+      output->crop_bottom - layout->crop_top + 1);
+
+  return TRUE;
+}
+
+gboolean
+gst_amc_video_layout_from_format (GstAmcVideoLayout * layout,
+    GstAmcFormat * format, GError ** err)
+{
+  GstAmcVideoOutputFormat output;
+
+  return gst_amc_video_output_format_parse (&output, format, err)
+      && gst_amc_video_layout_from_output_format (layout, &output, err);
+}
 
-  ret = TRUE;
+gboolean
+gst_amc_video_layout_copy (const GstAmcVideoLayout * layout,
+    const guint8 * data, gsize size, GstVideoFrame * frame)
+{
+  gint chroma_stride, plane_offset[GST_VIDEO_MAX_PLANES];
+  guint i;
+
+  g_return_val_if_fail (layout != NULL, FALSE);
+  g_return_val_if_fail (!layout->use_image, FALSE);
+  g_return_val_if_fail (frame != NULL, FALSE);
+
+  /* Y plane, then either interleaved UV or U followed by V */
+  plane_offset[0] = layout->crop_top * layout->stride + layout->crop_left;
+  if (GST_VIDEO_FRAME_FORMAT (frame) == GST_VIDEO_FORMAT_NV12) {
+    chroma_stride = layout->stride;
+    plane_offset[1] = layout->stride * layout->slice_height
+        + (layout->crop_top / 2) * chroma_stride + layout->crop_left;
+  } else {
+    chroma_stride = layout->stride / 2;
+    plane_offset[1] = layout->stride * layout->slice_height
+        + (layout->crop_top / 2) * chroma_stride + layout->crop_left / 2;
+    plane_offset[2] = plane_offset[1]
+        + chroma_stride * (layout->slice_height / 2);
+  }
 
-done:
-  if (key_str)
-    gst_amc_jni_object_local_unref (env, key_str);
-  if (v)
-    gst_amc_jni_object_local_unref (env, v);
+  for (i = 0; i < GST_VIDEO_FRAME_N_PLANES (frame); i++) {
+    gint src_stride = i == 0 ? layout->stride : chroma_stride;
+    gint dest_stride = GST_VIDEO_FRAME_PLANE_STRIDE (frame, i);
+    gint row_size = GST_VIDEO_FRAME_COMP_WIDTH (frame, i)
+        * GST_VIDEO_FRAME_COMP_PSTRIDE (frame, i);
+    gint rows = GST_VIDEO_FRAME_COMP_HEIGHT (frame, i);
+    const guint8 *src = data + plane_offset[i];
+    guint8 *dest = GST_VIDEO_FRAME_PLANE_DATA (frame, i);
+    gint j;
+
+    /* The last row may end right after its visible part */
+    if (plane_offset[i] + (gsize) (rows - 1) * src_stride + row_size > size) {
+      GST_ERROR ("Output buffer of %" G_GSIZE_FORMAT " bytes too small for "
+          "plane %u", size, i);
+      return FALSE;
+    }
 
-  return ret;
+    for (j = 0; j < rows; j++) {
+      memcpy (dest, src, row_size);
+      src += src_stride;
+      dest += dest_stride;
+    }
+  }
+
+  return TRUE;
 }
 
 gboolean
@@ -984,142 +1908,303 @@ gst_amc_codeclist_get_codec_info_at (gint index, GError ** err)
   return ret;
 }
 
-GstCaps *
-gst_amc_codeclist_to_caps (GstAmcCodecForeachFunc func)
+/* Adds the supported types of codec @i to @cache if it is a usable
+ * decoder. Changes to what is kept must bump CODECLIST_FILTER_VERSION */
+static void
+gst_amc_codeclist_enumerate_codec (gint i, GstAmcCodecCache * cache)
 {
-  GstCaps *caps = gst_caps_new_empty ();
+  GstAmcCodecInfoHandle *codec_info = NULL;
   GError *error = NULL;
-  gint codec_count, i;
+  gchar *name_str = NULL;
+  gboolean is_encoder;
+  gchar **supported_types = NULL;
+  gsize n_supported_types;
+  gsize j;
+
+  codec_info = gst_amc_codeclist_get_codec_info_at (i, &error);
+  if (!codec_info) {
+    GST_ERROR ("Failed to get codec info %d", i);
+    goto next_codec;
+  }
 
-  if (!gst_amc_codeclist_get_count (&codec_count, &error)) {
-    GST_ERROR ("Failed to get number of available codecs");
-    goto done;
+  name_str = gst_amc_codec_info_handle_get_name (codec_info, &error);
+  if (!name_str) {
+    GST_ERROR ("Failed to get codec name");
+    goto next_codec;
   }
 
-  for (i = 0; i < codec_count; i++) {
-    GstAmcCodecInfoHandle *codec_info = NULL;
-    gchar *name_str = NULL;
-    gboolean is_encoder;
-    gchar **supported_types = NULL;
-    gsize n_supported_types;
-    gsize j;
+  GST_INFO ("Checking codec '%s'", name_str);
 
-    codec_info = gst_amc_codeclist_get_codec_info_at (i, &error);
-    if (!codec_info) {
-      GST_ERROR ("Failed to get codec info %d", i);
-      goto next_codec;
-    }
+  /* Compatibility codec names */
+  if (strcmp (name_str, "AACEncoder") == 0 ||
+    strcmp (name_str, "OMX.google.raw.decoder") == 0) {
+    GST_INFO ("Skipping compatibility codec '%s'", name_str);
+    goto next_codec;
+  }
 
-    name_str = gst_amc_codec_info_handle_get_name (codec_info, &error);
-    if (!name_str) {
-      GST_ERROR ("Failed to get codec name");
-      goto next_codec;
-    }
+  if (g_str_has_suffix (name_str, ".secure")) {
+    GST_INFO ("Skipping DRM codec '%s'", name_str);
+    goto next_codec;
+  }
 
-    GST_INFO ("Checking codec '%s'", name_str);
+  /* FIXME: Non-Google codecs usually just don't work and hang forever
+   * or crash when not used from a process that started the Java
+   * VM via the non-public AndroidRuntime class. Can we somehow
+   * initialize all this?
+   */
+  if (gst_amc_jni_is_vm_started () &&
+    !g_str_has_prefix (name_str, "OMX.google.")) {
+    GST_INFO ("Skipping non-Google codec '%s' in standalone mode", name_str);
+    goto next_codec;
+  }
 
-    /* Compatibility codec names */
-    if (strcmp (name_str, "AACEncoder") == 0 ||
-      strcmp (name_str, "OMX.google.raw.decoder") == 0) {
-      GST_INFO ("Skipping compatibility codec '%s'", name_str);
-      goto next_codec;
-    }
+  if (g_str_has_prefix (name_str, "OMX.ARICENT.")) {
+    GST_INFO ("Skipping possible broken codec '%s'", name_str);
+    goto next_codec;
+  }
 
-    if (g_str_has_suffix (name_str, ".secure")) {
-      GST_INFO ("Skipping DRM codec '%s'", name_str);
-      goto next_codec;
-    }
+  if (!gst_amc_codec_info_handle_is_encoder (codec_info, &is_encoder, &error)) {
+    GST_ERROR ("Failed to detect if codec is an encoder");
+    goto next_codec;
+  }
 
-    /* FIXME: Non-Google codecs usually just don't work and hang forever
-     * or crash when not used from a process that started the Java
-     * VM via the non-public AndroidRuntime class. Can we somehow
-     * initialize all this?
-     */
-    if (gst_amc_jni_is_vm_started () &&
-      !g_str_has_prefix (name_str, "OMX.google.")) {
-      GST_INFO ("Skipping non-Google codec '%s' in standalone mode", name_str);
-      goto next_codec;
-    }
+  if (is_encoder) {
+    /* Skip encoder */
+    goto next_codec;
+  }
 
-    if (g_str_has_prefix (name_str, "OMX.ARICENT.")) {
-      GST_INFO ("Skipping possible broken codec '%s'", name_str);
-      goto next_codec;
-    }
+  supported_types = gst_amc_codec_info_handle_get_supported_types (codec_info,
+              &n_supported_types, &error);
+  if (!supported_types) {
+    GST_ERROR ("Failed to get supported types");
+    goto next_codec;
+  }
 
-    if (!gst_amc_codec_info_handle_is_encoder (codec_info, &is_encoder, &error)) {
-      GST_ERROR ("Failed to detect if codec is an encoder");
-      goto next_codec;
-    }
+  GST_INFO ("Codec '%s' has %" G_GSIZE_FORMAT " supported types", name_str,
+              n_supported_types);
 
-    if (is_encoder) {
-      /* Skip encoder */
-      goto next_codec;
+  if (n_supported_types == 0) {
+    GST_ERROR ("Codec has no supported types");
+    goto next_codec;
+  }
+
+  for (j = 0; j < n_supported_types; j++) {
+    const gchar *mime;
+    GstAmcCodecCapabilitiesHandle *capabilities = NULL;
+    GstAmcCodecProfileLevel *profile_levels;
+    gsize n_profile_levels;
+    gint k;
+
+    mime = supported_types[j];
+    GST_INFO ("Supported type '%s'", mime);
+
+    capabilities =
+        gst_amc_codec_info_handle_get_capabilities_for_type (codec_info, mime, &error);
+    if (!capabilities) {
+        GST_ERROR ("Failed to get capabilities for supported type");
+        goto next_supported_type;
     }
 
-    supported_types = gst_amc_codec_info_handle_get_supported_types (codec_info,
-                &n_supported_types, &error);
-    if (!supported_types) {
-      GST_ERROR ("Failed to get supported types");
-      goto next_codec;
+    profile_levels =
+        gst_amc_codec_capabilities_handle_get_profile_levels (capabilities,
+                    &n_profile_levels, &error);
+    if (error) {
+        GST_ERROR ("Failed to get profile/levels: %s", error->message);
+        goto next_supported_type;
     }
 
-    GST_INFO ("Codec '%s' has %" G_GSIZE_FORMAT " supported types", name_str,
-                n_supported_types);
+    gst_amc_codec_cache_add_type (cache, mime, profile_levels,
+        n_profile_levels);
+    g_free (profile_levels);
 
-    if (n_supported_types == 0) {
-      GST_ERROR ("Codec has no supported types");
-      goto next_codec;
-    }
+next_supported_type:
+    if (capabilities)
+        gst_amc_codec_capabilities_handle_free (capabilities);
+    capabilities = NULL;
+    g_clear_error (&error);
+  }
 
-    for (j = 0; j < n_supported_types; j++) {
-      const gchar *mime;
-      GstAmcCodecCapabilitiesHandle *capabilities = NULL;
-      GstAmcCodecProfileLevel *profile_levels;
-      gsize n_profile_levels;
-      gint k;
-
-      mime = supported_types[j];
-      GST_INFO ("Supported type '%s'", mime);
-
-      capabilities =
-          gst_amc_codec_info_handle_get_capabilities_for_type (codec_info, mime, &error);
-      if (!capabilities) {
-          GST_ERROR ("Failed to get capabilities for supported type");
-          goto next_supported_type;
-      }
+  /* Clean up of all local references we got */
+next_codec:
+  if (name_str)
+    g_free (name_str);
+  name_str = NULL;
+  if (supported_types)
+    g_strfreev (supported_types);
+  supported_types = NULL;
+  if (codec_info)
+    gst_amc_codec_info_handle_free (codec_info);
+  codec_info = NULL;
+  g_clear_error (&error);
+}
 
-      profile_levels =
-          gst_amc_codec_capabilities_handle_get_profile_levels (capabilities,
-                      &n_profile_levels, &error);
-      if (error) {
-          GST_ERROR ("Failed to get profile/levels: %s", error->message);
-          goto next_supported_type;
-      }
+/* Enumerates the codecs of @range on its own thread, unless run on the
+ * calling one. Each codec gets a local reference frame, so whatever the
+ * calls leave behind is released right away */
+static gpointer
+gst_amc_codeclist_enumerate_range (gpointer data)
+{
+  GstAmcCodeclistRange *range = data;
+  JNIEnv *env;
+  gint i;
 
-      func (caps, mime, profile_levels, n_profile_levels);
+  env = gst_amc_jni_get_env ();
 
-next_supported_type:
-      if (capabilities)
-          gst_amc_codec_capabilities_handle_free (capabilities);
-      capabilities = NULL;
-      g_clear_error (&error);
+  for (i = range->start; i < range->end; i++) {
+    if ((*env)->PushLocalFrame (env, CODECLIST_LOCAL_FRAME_CAPACITY) < 0) {
+      (*env)->ExceptionClear (env);
+      GST_ERROR ("Failed to push local frame for codec %d", i);
+      break;
     }
+    gst_amc_codeclist_enumerate_codec (i, range->cache);
+    (*env)->PopLocalFrame (env, NULL);
+  }
 
-    /* Clean up of all local references we got */
-next_codec:
-    if (name_str)
-      g_free (name_str);
-    name_str = NULL;
-    if (supported_types)
-      g_strfreev (supported_types);
-    supported_types = NULL;
-    if (codec_info)
-      gst_amc_codec_info_handle_free (codec_info);
-    codec_info = NULL;
+  return NULL;
+}
+
+/* Adds the supported types of all usable decoders to @cache, returns
+ * FALSE if the codec list couldn't be read. The codec indices are split
+ * among up to CODECLIST_MAX_THREADS threads, each attached to the VM */
+static gboolean
+gst_amc_codeclist_enumerate (GstAmcCodecCache * cache)
+{
+  GstAmcCodeclistRange *ranges;
+  GError *error = NULL;
+  gint codec_count, n_threads, i;
+
+  if (!gst_amc_codeclist_get_count (&codec_count, &error)) {
+    GST_ERROR ("Failed to get number of available codecs");
     g_clear_error (&error);
+    return FALSE;
   }
 
-done:
+  n_threads = MIN (g_get_num_processors (), CODECLIST_MAX_THREADS);
+  n_threads = CLAMP (codec_count / CODECLIST_MIN_CODECS_PER_THREAD, 1,
+      n_threads);
+  GST_DEBUG ("Enumerating %d codecs on %d threads", codec_count, n_threads);
+
+  ranges = g_new0 (GstAmcCodeclistRange, n_threads);
+  for (i = 0; i < n_threads; i++) {
+    ranges[i].start = codec_count * i / n_threads;
+    ranges[i].end = codec_count * (i + 1) / n_threads;
+    ranges[i].cache = gst_amc_codec_cache_new (NULL);
+    if (i > 0)
+      ranges[i].thread = g_thread_try_new ("amccodeclist",
+          gst_amc_codeclist_enumerate_range, &ranges[i], NULL);
+  }
+
+  /* The first range, and any that didn't get a thread, run here */
+  gst_amc_codeclist_enumerate_range (&ranges[0]);
+
+  /* Merged in index order, so the caps come out the same every time */
+  for (i = 0; i < n_threads; i++) {
+    if (ranges[i].thread)
+      g_thread_join (ranges[i].thread);
+    else if (i > 0)
+      gst_amc_codeclist_enumerate_range (&ranges[i]);
+    gst_amc_codec_cache_append (cache, ranges[i].cache);
+    gst_amc_codec_cache_free (ranges[i].cache);
+  }
+  g_free (ranges);
+
+  return TRUE;
+}
+
+static gchar *
+gst_amc_codec_cache_get_path (void)
+{
+  const gchar *path;
+
+  path = g_getenv (CODEC_CACHE_ENV);
+  if (path)
+    return g_strdup (path);
+
+  /* Next to the GStreamer registry, in the app's cache directory */
+  return g_build_filename (g_get_user_cache_dir (), "gstreamer-1.0",
+      "amc-codecs.bin", NULL);
+}
+
+/* NULL if there is no build fingerprint to key the cache on */
+static gchar *
+gst_amc_codec_cache_get_key (void)
+{
+  if (!build_fingerprint)
+    return NULL;
+
+  /* Which codecs are usable also depends on how the VM was started */
+  return g_strdup_printf ("%s filter-%d%s", build_fingerprint,
+      CODECLIST_FILTER_VERSION,
+      gst_amc_jni_is_vm_started () ? " standalone" : "");
+}
+
+/* Like gst_amc_codeclist_to_caps(), but only reads a valid codec cache,
+ * NULL if the codec list would have to be enumerated */
+GstCaps *
+gst_amc_codeclist_to_caps_from_cache (GstAmcCodecForeachFunc func)
+{
+  GstAmcCodecCache *cache;
+  GstCaps *caps;
+  gchar *key, *path;
+
+  key = gst_amc_codec_cache_get_key ();
+  if (!key)
+    return NULL;
+
+  path = gst_amc_codec_cache_get_path ();
+  cache = gst_amc_codec_cache_load (path, key);
+  g_free (path);
+  g_free (key);
+  if (!cache)
+    return NULL;
+
+  caps = gst_caps_new_empty ();
+  gst_amc_codec_cache_foreach (cache, caps, func);
+  gst_amc_codec_cache_free (cache);
+
+  return caps;
+}
+
+/* Calls @func for the supported types of all usable decoders. They are
+ * enumerated through JNI only once per firmware and codec filter
+ * version, and later read from the codec cache */
+GstCaps *
+gst_amc_codeclist_to_caps (GstAmcCodecForeachFunc func)
+{
+  GstCaps *caps = gst_caps_new_empty ();
+  GstAmcCodecCache *cache = NULL;
+  gchar *key, *path = NULL;
+  GError *error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  key = gst_amc_codec_cache_get_key ();
+  if (key) {
+    path = gst_amc_codec_cache_get_path ();
+    cache = gst_amc_codec_cache_load (path, key);
+  }
+
+  if (cache) {
+    gst_amc_codec_cache_foreach (cache, caps, func);
+    GST_INFO ("Read codec list from %s in %" G_GINT64_FORMAT " us", path,
+        g_get_monotonic_time () - start);
+  } else {
+    cache = gst_amc_codec_cache_new (key);
+    if (gst_amc_codeclist_enumerate (cache) && path &&
+        !gst_amc_codec_cache_save (cache, path, &error)) {
+      GST_WARNING ("Failed to write codec cache: %s", error->message);
+      g_clear_error (&error);
+    }
+    gst_amc_codec_cache_foreach (cache, caps, func);
+    GST_INFO ("Enumerated codec list in %" G_GINT64_FORMAT " us",
+        g_get_monotonic_time () - start);
+  }
+
+  gst_amc_codec_cache_free (cache);
+  g_free (path);
+  g_free (key);
+
   return caps;
 }
 
@@ -1438,6 +2523,9 @@ gst_amc_codec_static_init (void)
   media_codec.release_output_buffer_time =
       (*env)->GetMethodID (env, media_codec.klass, "releaseOutputBuffer",
       "(IJ)V");
+  media_codec.set_video_scaling_mode =
+      (*env)->GetMethodID (env, media_codec.klass, "setVideoScalingMode",
+      "(I)V");
   media_codec.start =
       (*env)->GetMethodID (env, media_codec.klass, "start", "()V");
   media_codec.stop =
@@ -1457,6 +2545,7 @@ gst_amc_codec_static_init (void)
       !media_codec.release ||
       !media_codec.release_output_buffer ||
       !media_codec.release_output_buffer_time ||
+      !media_codec.set_video_scaling_mode ||
       !media_codec.start || !media_codec.stop) {
     ret = FALSE;
     GST_ERROR ("Failed to get codec methods");
@@ -1467,6 +2556,39 @@ gst_amc_codec_static_init (void)
     goto done;
   }
 
+  /* Optional, API level 18 */
+  if (sdk_int >= 18) {
+    media_codec.get_name =
+        (*env)->GetMethodID (env, media_codec.klass, "getName",
+        "()Ljava/lang/String;");
+    if (!media_codec.get_name) {
+      GST_WARNING ("Failed to get getName method");
+      (*env)->ExceptionClear (env);
+    }
+  }
+
+  /* Optional, API level 19 */
+  if (sdk_int >= 19) {
+    media_codec.set_parameters =
+        (*env)->GetMethodID (env, media_codec.klass, "setParameters",
+        "(Landroid/os/Bundle;)V");
+    if (!media_codec.set_parameters) {
+      GST_WARNING ("Failed to get setParameters method");
+      (*env)->ExceptionClear (env);
+    }
+  }
+
+  /* Optional, API level 23 */
+  if (sdk_int >= 23) {
+    media_codec.set_output_surface =
+        (*env)->GetMethodID (env, media_codec.klass, "setOutputSurface",
+        "(Landroid/view/Surface;)V");
+    if (!media_codec.set_output_surface) {
+      GST_WARNING ("Failed to get setOutputSurface method");
+      (*env)->ExceptionClear (env);
+    }
+  }
+
   tmp = (*env)->FindClass (env, "android/media/MediaCodec$BufferInfo");
   if (!tmp) {
     ret = FALSE;
@@ -1758,21 +2880,240 @@ gst_amc_codeclist_static_init (void)
   return TRUE;
 }
 
+static gboolean
+gst_amc_build_static_init (void)
+{
+  JNIEnv *env;
+  GError *err = NULL;
+  jclass klass;
+  jfieldID sdk_int_id;
+
+  env = gst_amc_jni_get_env ();
+
+  klass = gst_amc_jni_get_class (env, &err, "android/os/Build$VERSION");
+  if (!klass) {
+    GST_ERROR ("Failed to get android.os.Build.VERSION class: %s",
+        err->message);
+    g_clear_error (&err);
+    return FALSE;
+  }
+
+  sdk_int_id =
+      gst_amc_jni_get_static_field_id (env, &err, klass, "SDK_INT", "I");
+  if (!sdk_int_id
+      || !gst_amc_jni_get_static_int_field (env, &err, klass, sdk_int_id,
+          &sdk_int)) {
+    GST_ERROR ("Failed to get android.os.Build.VERSION.SDK_INT: %s",
+        err->message);
+    g_clear_error (&err);
+    gst_amc_jni_object_unref (env, klass);
+    return FALSE;
+  }
+
+  gst_amc_jni_object_unref (env, klass);
+
+  GST_INFO ("Running on API level %d", sdk_int);
+
+  /* Only keys the codec cache, not fatal */
+  klass = gst_amc_jni_get_class (env, &err, "android/os/Build");
+  if (klass) {
+    jfieldID fingerprint_id;
+    jobject fingerprint = NULL;
+
+    fingerprint_id = gst_amc_jni_get_static_field_id (env, &err, klass,
+        "FINGERPRINT", "Ljava/lang/String;");
+    if (fingerprint_id && gst_amc_jni_get_static_object_field (env, &err,
+            klass, fingerprint_id, &fingerprint) && fingerprint)
+      build_fingerprint = gst_amc_jni_string_to_gchar (env, fingerprint, TRUE);
+    gst_amc_jni_object_unref (env, klass);
+  }
+  if (!build_fingerprint) {
+    GST_WARNING ("Failed to get android.os.Build.FINGERPRINT: %s",
+        err ? err->message : "null");
+    g_clear_error (&err);
+  }
+
+  return TRUE;
+}
+
+/* Only needed for MediaCodec.setParameters(), failures are not fatal */
+static gboolean
+gst_amc_bundle_static_init (void)
+{
+  JNIEnv *env;
+  GError *err = NULL;
+  jclass klass;
+
+  if (sdk_int < 19)
+    return TRUE;
+
+  env = gst_amc_jni_get_env ();
+
+  klass = gst_amc_jni_get_class (env, &err, "android/os/Bundle");
+  if (!klass)
+    goto error;
+
+  bundle.constructor =
+      gst_amc_jni_get_method_id (env, &err, klass, "<init>", "()V");
+  if (!bundle.constructor)
+    goto error;
+
+  bundle.put_float =
+      gst_amc_jni_get_method_id (env, &err, klass, "putFloat",
+      "(Ljava/lang/String;F)V");
+  if (!bundle.put_float)
+    goto error;
+
+  bundle.put_int =
+      gst_amc_jni_get_method_id (env, &err, klass, "putInt",
+      "(Ljava/lang/String;I)V");
+  if (!bundle.put_int)
+    goto error;
+
+  bundle.klass = klass;
+
+  return TRUE;
+
+error:
+  GST_WARNING ("Failed to get android.os.Bundle: %s",
+      err ? err->message : "no global reference");
+  g_clear_error (&err);
+  if (klass)
+    gst_amc_jni_object_unref (env, klass);
+
+  return TRUE;
+}
+
+static gboolean
+gst_amc_image_static_init (void)
+{
+  JNIEnv *env;
+  GError *err = NULL;
+  jclass image_klass = NULL, plane_klass = NULL;
+
+  if (sdk_int < 21)
+    return TRUE;
+
+  env = gst_amc_jni_get_env ();
+
+  media_codec.get_output_image =
+      gst_amc_jni_get_method_id (env, &err, media_codec.klass,
+      "getOutputImage", "(I)Landroid/media/Image;");
+  if (!media_codec.get_output_image)
+    goto error;
+
+  image_klass = gst_amc_jni_get_class (env, &err, "android/media/Image");
+  if (!image_klass)
+    goto error;
+
+  image.get_planes =
+      gst_amc_jni_get_method_id (env, &err, image_klass, "getPlanes",
+      "()[Landroid/media/Image$Plane;");
+  if (!image.get_planes)
+    goto error;
+
+  image.close = gst_amc_jni_get_method_id (env, &err, image_klass, "close",
+      "()V");
+  if (!image.close)
+    goto error;
+
+  plane_klass = gst_amc_jni_get_class (env, &err, "android/media/Image$Plane");
+  if (!plane_klass)
+    goto error;
+
+  image_plane.get_buffer =
+      gst_amc_jni_get_method_id (env, &err, plane_klass, "getBuffer",
+      "()Ljava/nio/ByteBuffer;");
+  if (!image_plane.get_buffer)
+    goto error;
+
+  image_plane.get_row_stride =
+      gst_amc_jni_get_method_id (env, &err, plane_klass, "getRowStride",
+      "()I");
+  if (!image_plane.get_row_stride)
+    goto error;
+
+  image_plane.get_pixel_stride =
+      gst_amc_jni_get_method_id (env, &err, plane_klass, "getPixelStride",
+      "()I");
+  if (!image_plane.get_pixel_stride)
+    goto error;
+
+  image_plane.klass = plane_klass;
+  image.klass = image_klass;
+
+  return TRUE;
+
+error:
+  GST_WARNING ("Failed to get android.media.Image: %s",
+      err ? err->message : "no global reference");
+  g_clear_error (&err);
+  media_codec.get_output_image = NULL;
+  if (image_klass)
+    gst_amc_jni_object_unref (env, image_klass);
+  if (plane_klass)
+    gst_amc_jni_object_unref (env, plane_klass);
+
+  return TRUE;
+}
+
+static gboolean
+gst_amc_budget_static_init (void)
+{
+  const gchar *budget;
+
+  hardware_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      g_free);
+  software_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      g_free);
+
+  budget = g_getenv (CODEC_BUDGET_ENV);
+  if (budget) {
+    budget_units = g_ascii_strtoull (budget, NULL, 10);
+    GST_INFO ("Codec budget of %u units", budget_units);
+  }
+
+  return TRUE;
+}
+
+gint
+gst_amc_get_sdk_int (void)
+{
+  return sdk_int;
+}
+
 gboolean
 gst_amc_init (void)
 {
+  GST_DEBUG_CATEGORY_INIT (gst_amc_debug, "amc", 0, "Android MediaCodec");
+
   if (!gst_amc_jni_initialize ())
     return FALSE;
 
+  if (!gst_amc_build_static_init ())
+    return FALSE;
+
   if (!gst_amc_codec_static_init ())
     return FALSE;
 
+  if (!gst_amc_bundle_static_init ())
+    return FALSE;
+
+  if (!gst_amc_image_static_init ())
+    return FALSE;
+
+  if (!gst_amc_budget_static_init ())
+    return FALSE;
+
   if (!gst_amc_format_static_init ())
     return FALSE;
 
   if (!gst_amc_codeclist_static_init ())
     return FALSE;
 
+  if (!gst_amc_surface_texture_static_init ())
+    return FALSE;
+
   return TRUE;
 }
 
@@ -23,11 +23,15 @@
 
 #include <jni.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 
 #include "gst-jni-utils.h"
 
 G_BEGIN_DECLS
 
+/* Plugin version, also invalidates the codec cache */
+#define GST_AMC_VERSION "0.0.1"
+
 enum
 {
     INFO_TRY_AGAIN_LATER = -1,
@@ -39,7 +43,25 @@ enum
 {
     BUFFER_FLAG_SYNC_FRAME = 1,
     BUFFER_FLAG_CODEC_CONFIG = 2,
-    BUFFER_FLAG_END_OF_STREAM = 4
+    BUFFER_FLAG_END_OF_STREAM = 4,
+    /* API 26+ */
+    BUFFER_FLAG_PARTIAL_FRAME = 8
+};
+
+enum
+{
+    VIDEO_SCALING_MODE_SCALE_TO_FIT = 1,
+    VIDEO_SCALING_MODE_SCALE_TO_FIT_WITH_CROPPING = 2
+};
+
+enum
+{
+    COLOR_FormatYUV420Planar = 0x13,
+    COLOR_FormatYUV420SemiPlanar = 0x15,
+    COLOR_TI_FormatYUV420PackedSemiPlanar = 0x7f000100,
+    /* API 21+ */
+    COLOR_FormatYUV420Flexible = 0x7f420888,
+    COLOR_QCOM_FormatYUV420SemiPlanar = 0x7fa30c00
 };
 
 enum
@@ -98,11 +120,32 @@ typedef struct _GstAmcBufferInfo GstAmcBufferInfo;
 typedef struct _GstAmcCodecInfoHandle GstAmcCodecInfoHandle;
 typedef struct _GstAmcCodecCapabilitiesHandle GstAmcCodecCapabilitiesHandle;
 typedef struct _GstAmcCodecProfileLevel GstAmcCodecProfileLevel;
+typedef struct _GstAmcVideoLayout GstAmcVideoLayout;
+typedef struct _GstAmcVideoOutputFormat GstAmcVideoOutputFormat;
+typedef struct _GstAmcSession GstAmcSession;
 typedef void (*GstAmcCodecForeachFunc) (GstCaps *, const gchar *, GstAmcCodecProfileLevel*, gsize);
 
+/* Sessions of higher priority preempt those of lower priority once the
+ * codec budget is exhausted */
+typedef enum
+{
+    GST_AMC_SESSION_PRIORITY_LOW,
+    GST_AMC_SESSION_PRIORITY_NORMAL,
+    GST_AMC_SESSION_PRIORITY_HIGH
+} GstAmcSessionPriority;
+
+/* Asks the owner to release the codec of a preempted session. Called
+ * with the budget lock held, must not block. The owner may release the
+ * codec from any thread and hand the session back with
+ * gst_amc_codec_release_session() without waiting for its data flow */
+typedef void (*GstAmcSessionPreemptFunc) (gpointer user_data);
+
 struct _GstAmcCodec {
   /* < private > */
   jobject object; /* global reference */
+  /* NULL if not counted against the budget */
+  GstAmcSession *session;
+  gboolean software;
 };
 
 struct _GstAmcFormat {
@@ -123,10 +166,50 @@ struct _GstAmcCodecProfileLevel
   gint level;
 };
 
+/* Output format of a video decoder, missing keys defaulted */
+struct _GstAmcVideoOutputFormat
+{
+  gint width;
+  gint height;
+  /* Inclusive visible rectangle */
+  gint crop_left;
+  gint crop_top;
+  gint crop_right;
+  gint crop_bottom;
+  gint stride;
+  gint slice_height;
+  /* 0 if not reported */
+  gint color_format;
+};
+
+/* Layout of decoded frames in codec output buffers */
+struct _GstAmcVideoLayout
+{
+  gint color_format;
+  gint stride;
+  gint slice_height;
+  gint crop_left;
+  gint crop_top;
+  /* Vendor format, copied with gst_amc_codec_copy_output_image() */
+  gboolean use_image;
+  /* Cropped frames as output downstream */
+  GstVideoInfo info;
+};
+
 GstAmcCodec * gst_amc_codec_new (const gchar *name, GError **err);
 GstAmcCodec * gst_amc_decoder_new_from_type (const gchar *type, GError **err);
 GstAmcCodec * gst_amc_encoder_new_from_type (const gchar *type, GError **err);
+GstAmcCodec * gst_amc_decoder_new_with_budget (const gchar *type, gint width, gint height, GstAmcSessionPriority priority, gboolean allow_software, GstAmcSessionPreemptFunc preempt, gpointer user_data, GError **err);
+GstAmcCodec * gst_amc_decoder_new_software (const gchar *type, GError **err);
 void gst_amc_codec_free (GstAmcCodec * codec);
+gboolean gst_amc_codec_is_software (GstAmcCodec * codec);
+void gst_amc_codec_set_session_priority (GstAmcCodec * codec, GstAmcSessionPriority priority);
+gboolean gst_amc_codec_update_session (GstAmcCodec * codec, gint width, gint height, GError **err);
+void gst_amc_codec_release_session (GstAmcCodec * codec);
+
+void gst_amc_set_codec_budget (guint units);
+guint gst_amc_get_codec_budget (void);
+gchar * gst_amc_codec_get_name (GstAmcCodec * codec, GError **err);
 
 gboolean gst_amc_codec_configure (GstAmcCodec * codec, GstAmcFormat * format, jobject surface, gint flags, GError **err);
 GstAmcFormat * gst_amc_codec_get_output_format (GstAmcCodec * codec, GError **err);
@@ -134,6 +217,10 @@ GstAmcFormat * gst_amc_codec_get_output_format (GstAmcCodec * codec, GError **er
 gboolean gst_amc_codec_start (GstAmcCodec * codec, GError **err);
 gboolean gst_amc_codec_stop (GstAmcCodec * codec, GError **err);
 gboolean gst_amc_codec_flush (GstAmcCodec * codec, GError **err);
+gboolean gst_amc_codec_set_output_surface (GstAmcCodec * codec, jobject surface, GError **err);
+gboolean gst_amc_codec_set_video_scaling_mode (GstAmcCodec * codec, gint mode, GError **err);
+gboolean gst_amc_codec_set_parameter_int (GstAmcCodec * codec, const gchar *key, gint value, GError **err);
+gboolean gst_amc_codec_set_parameter_float (GstAmcCodec * codec, const gchar *key, gfloat value, GError **err);
 gboolean gst_amc_codec_release (GstAmcCodec * codec, GError **err);
 
 GstAmcBuffer * gst_amc_codec_get_output_buffers (GstAmcCodec * codec, gsize * n_buffers, GError **err);
@@ -145,6 +232,8 @@ gint gst_amc_codec_dequeue_output_buffer (GstAmcCodec * codec, GstAmcBufferInfo
 
 gboolean gst_amc_codec_queue_input_buffer (GstAmcCodec * codec, gint index, const GstAmcBufferInfo *info, GError **err);
 gboolean gst_amc_codec_release_output_buffer (GstAmcCodec * codec, gint index, gboolean render, gint64 delay, GError **err);
+gboolean gst_amc_codec_render_output_buffer_at (GstAmcCodec * codec, gint index, gint64 timestamp, GError **err);
+gboolean gst_amc_codec_copy_output_image (GstAmcCodec * codec, gint index, const GstAmcVideoLayout *layout, GstVideoFrame *frame, GError **err);
 
 
 GstAmcFormat * gst_amc_format_new_audio (const gchar *mime, gint sample_rate, gint channels, GError **err);
@@ -164,12 +253,19 @@ gboolean gst_amc_format_set_string (GstAmcFormat *format, const gchar *key, cons
 gboolean gst_amc_format_get_buffer (GstAmcFormat *format, const gchar *key, guint8 **data, gsize *size, GError **err);
 gboolean gst_amc_format_set_buffer (GstAmcFormat *format, const gchar *key, guint8 *data, gsize size, GError **err);
 
+gboolean gst_amc_video_output_format_parse (GstAmcVideoOutputFormat *output, GstAmcFormat *format, GError **err);
+gboolean gst_amc_video_output_format_is_equal (const GstAmcVideoOutputFormat *a, const GstAmcVideoOutputFormat *b);
+gboolean gst_amc_video_layout_from_output_format (GstAmcVideoLayout *layout, const GstAmcVideoOutputFormat *output, GError **err);
+gboolean gst_amc_video_layout_from_format (GstAmcVideoLayout *layout, GstAmcFormat *format, GError **err);
+gboolean gst_amc_video_layout_copy (const GstAmcVideoLayout *layout, const guint8 *data, gsize size, GstVideoFrame *frame);
+
 
 gboolean gst_amc_codeclist_get_count (gint * count, GError **err);
 GstAmcCodecInfoHandle * gst_amc_codeclist_get_codec_info_at (gint index,
     GError **err);
 
 GstCaps * gst_amc_codeclist_to_caps (GstAmcCodecForeachFunc func);
+GstCaps * gst_amc_codeclist_to_caps_from_cache (GstAmcCodecForeachFunc func);
 
 void gst_amc_codec_info_handle_free (GstAmcCodecInfoHandle * handle);
 gchar * gst_amc_codec_info_handle_get_name (GstAmcCodecInfoHandle * handle,
@@ -208,6 +304,7 @@ GstAmcCodecProfileLevel * gst_amc_codec_capabilities_handle_get_profile_levels (
 jmethodID gst_amc_codec_get_release_method_id (GstAmcCodec *codec);
 
 gboolean gst_amc_init (void);
+gint gst_amc_get_sdk_int (void);
 
 G_END_DECLS
 
@@ -31,6 +31,20 @@ static JavaVM *java_vm;
 static gboolean started_java_vm = FALSE;
 static pthread_key_t current_jni_env;
 
+static struct
+{
+  jclass klass;
+  jmethodID is_transient;
+  jmethodID is_recoverable;
+  /* Since API 23 */
+  jmethodID get_error_code;
+} codec_exception;
+
+/* MediaCodec.CodecException.ERROR_INSUFFICIENT_RESOURCE */
+#define CODEC_EXCEPTION_ERROR_INSUFFICIENT_RESOURCE 1100
+
+G_DEFINE_QUARK (gst-amc-codec-error-quark, gst_amc_codec_error);
+
 jclass
 gst_amc_jni_get_class (JNIEnv * env, GError ** err, const gchar * name)
 {
@@ -58,6 +72,66 @@ done:
   return ret;
 }
 
+/* Classes shipped with the application aren't visible to FindClass on
+ * threads attached from native code, load them through the class loader
+ * the GStreamer Android glue keeps from the application context */
+jclass
+gst_amc_jni_get_application_class (JNIEnv * env, GError ** err,
+    const gchar * name)
+{
+  jobject (*get_class_loader) (void) = NULL;
+  jclass loader_class = NULL, tmp = NULL, ret = NULL;
+  jobject class_loader;
+  jmethodID load_class;
+  jstring name_str = NULL;
+  GModule *module;
+  gchar *dotted;
+
+  module = g_module_open (NULL, G_MODULE_BIND_LOCAL);
+  if (module) {
+    g_module_symbol (module, "gst_android_get_application_class_loader",
+        (gpointer *) & get_class_loader);
+    g_module_close (module);
+  }
+
+  class_loader = get_class_loader ? get_class_loader () : NULL;
+  if (!class_loader)
+    return gst_amc_jni_get_class (env, err, name);
+
+  GST_DEBUG ("Retrieving application Java class %s", name);
+
+  loader_class = (*env)->GetObjectClass (env, class_loader);
+  load_class = gst_amc_jni_get_method_id (env, err, loader_class, "loadClass",
+      "(Ljava/lang/String;)Ljava/lang/Class;");
+  if (!load_class)
+    goto done;
+
+  dotted = g_strdelimit (g_strdup (name), "/", '.');
+  name_str = gst_amc_jni_string_from_gchar (env, err, FALSE, dotted);
+  g_free (dotted);
+  if (!name_str)
+    goto done;
+
+  if (!gst_amc_jni_call_object_method (env, err, class_loader, load_class,
+          (jobject *) & tmp, name_str))
+    goto done;
+
+  ret = (*env)->NewGlobalRef (env, tmp);
+  if (!ret) {
+    GST_ERROR ("Failed to get %s class global reference", name);
+  }
+
+done:
+  if (tmp)
+    (*env)->DeleteLocalRef (env, tmp);
+  if (name_str)
+    (*env)->DeleteLocalRef (env, name_str);
+  if (loader_class)
+    (*env)->DeleteLocalRef (env, loader_class);
+
+  return ret;
+}
+
 jmethodID
 gst_amc_jni_get_method_id (JNIEnv * env, GError ** err, jclass klass, const gchar * name,
     const gchar * signature)
@@ -618,6 +692,97 @@ create_failed:
   }
 }
 
+static gpointer
+gst_amc_jni_codec_exception_init (gpointer data)
+{
+  JNIEnv *env = data;
+  jclass tmp;
+
+  /* MediaCodec.CodecException only exists since API 21 */
+  tmp = (*env)->FindClass (env, "android/media/MediaCodec$CodecException");
+  if ((*env)->ExceptionCheck (env) || !tmp) {
+    (*env)->ExceptionClear (env);
+    GST_DEBUG ("No MediaCodec.CodecException class");
+    return NULL;
+  }
+
+  codec_exception.is_transient =
+      (*env)->GetMethodID (env, tmp, "isTransient", "()Z");
+  codec_exception.is_recoverable =
+      (*env)->GetMethodID (env, tmp, "isRecoverable", "()Z");
+  if ((*env)->ExceptionCheck (env) || !codec_exception.is_transient
+      || !codec_exception.is_recoverable) {
+    (*env)->ExceptionClear (env);
+    (*env)->DeleteLocalRef (env, tmp);
+    GST_ERROR ("Failed to get MediaCodec.CodecException methods");
+    return NULL;
+  }
+
+  codec_exception.get_error_code =
+      (*env)->GetMethodID (env, tmp, "getErrorCode", "()I");
+  if ((*env)->ExceptionCheck (env) || !codec_exception.get_error_code) {
+    (*env)->ExceptionClear (env);
+    codec_exception.get_error_code = NULL;
+    GST_DEBUG ("No MediaCodec.CodecException.getErrorCode()");
+  }
+
+  codec_exception.klass = (*env)->NewGlobalRef (env, tmp);
+  (*env)->DeleteLocalRef (env, tmp);
+
+  return NULL;
+}
+
+/* Maps a MediaCodec.CodecException to a GstAmcCodecError code, returns
+ * FALSE for any other kind of exception */
+static gboolean
+gst_amc_jni_classify_exception (JNIEnv * env, jthrowable exception,
+    gint * code)
+{
+  static GOnce once = G_ONCE_INIT;
+  jboolean transient, recoverable;
+  jint error_code;
+
+  g_once (&once, gst_amc_jni_codec_exception_init, env);
+
+  if (!codec_exception.klass ||
+      !(*env)->IsInstanceOf (env, exception, codec_exception.klass))
+    return FALSE;
+
+  if (codec_exception.get_error_code) {
+    error_code = (*env)->CallIntMethod (env, exception,
+        codec_exception.get_error_code);
+    if ((*env)->ExceptionCheck (env))
+      (*env)->ExceptionClear (env);
+    else if (error_code == CODEC_EXCEPTION_ERROR_INSUFFICIENT_RESOURCE) {
+      *code = GST_AMC_CODEC_ERROR_INSUFFICIENT_RESOURCE;
+      return TRUE;
+    }
+  }
+
+  transient = (*env)->CallBooleanMethod (env, exception,
+      codec_exception.is_transient);
+  if ((*env)->ExceptionCheck (env)) {
+    (*env)->ExceptionClear (env);
+    return FALSE;
+  }
+
+  recoverable = (*env)->CallBooleanMethod (env, exception,
+      codec_exception.is_recoverable);
+  if ((*env)->ExceptionCheck (env)) {
+    (*env)->ExceptionClear (env);
+    return FALSE;
+  }
+
+  if (transient)
+    *code = GST_AMC_CODEC_ERROR_TRANSIENT;
+  else if (recoverable)
+    *code = GST_AMC_CODEC_ERROR_RECOVERABLE;
+  else
+    *code = GST_AMC_CODEC_ERROR_FATAL;
+
+  return TRUE;
+}
+
 static void
 gst_amc_jni_set_error_string (JNIEnv * env, GError ** err, GQuark domain,
     gint code, const gchar * message)
@@ -634,6 +799,9 @@ gst_amc_jni_set_error_string (JNIEnv * env, GError ** err, GQuark domain,
       /* Clear exception so that we can call Java methods again */
       (*env)->ExceptionClear (env);
 
+      if (gst_amc_jni_classify_exception (env, exception, &code))
+        domain = GST_AMC_CODEC_ERROR;
+
       exception_description = getExceptionSummary (env, exception);
       exception_stacktrace = getStackTrace (env, exception);
       g_set_error (err, domain, code, "%s: %s\n%s", message,
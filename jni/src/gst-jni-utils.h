@@ -24,10 +24,28 @@
 #include <glib.h>
 #include <gst/gst.h>
 
+#define GST_AMC_CODEC_ERROR (gst_amc_codec_error_quark ())
+
+/* Classification of android.media.MediaCodec.CodecException */
+typedef enum
+{
+  GST_AMC_CODEC_ERROR_TRANSIENT,
+  GST_AMC_CODEC_ERROR_RECOVERABLE,
+  GST_AMC_CODEC_ERROR_FATAL,
+  /* No hardware resources left to configure or start the codec */
+  GST_AMC_CODEC_ERROR_INSUFFICIENT_RESOURCE
+} GstAmcCodecError;
+
+GQuark    gst_amc_codec_error_quark          (void);
+
 jclass    gst_amc_jni_get_class              (JNIEnv * env,
                                              GError ** err,
                                              const gchar * name);
 
+jclass    gst_amc_jni_get_application_class  (JNIEnv * env,
+                                             GError ** err,
+                                             const gchar * name);
+
 jmethodID gst_amc_jni_get_method_id          (JNIEnv * env,
                                              GError ** err,
                                              jclass klass,
@@ -0,0 +1,41 @@
+/*
+ ============================================================================
+ Name        : GstAmcOnFrameAvailableListener.java
+ Author      : Heiher <r@hev.cc>
+ Version     : 0.0.1
+ Copyright   : Copyright (C) 2014 everyone.
+ Description : 
+ ============================================================================
+ */
+
+package cc.hev.gst.amc;
+
+import android.graphics.SurfaceTexture;
+
+/* Forwards SurfaceTexture frame notifications to gst-amc-surface-texture.c,
+ * the context is the native texture or 0 once it was freed */
+public class GstAmcOnFrameAvailableListener
+        implements SurfaceTexture.OnFrameAvailableListener
+{
+    private long context = 0;
+
+    public synchronized void onFrameAvailable (SurfaceTexture surfaceTexture)
+    {
+        native_onFrameAvailable (context, surfaceTexture);
+    }
+
+    public synchronized long getContext ()
+    {
+        return context;
+    }
+
+    public synchronized void setContext (long c)
+    {
+        context = c;
+    }
+
+    private native void native_onFrameAvailable (long context,
+            SurfaceTexture surfaceTexture);
+}
+
+/* vim:set tabstop=4 softtabstop=4 shiftwidth=4 expandtab: */